@@ -7,7 +7,14 @@
 //
 
 #import "AppDelegate.h"
+#import <AudioToolbox/AudioToolbox.h>
 #import "Chip8.h"
+#import "Chip8Audio.h"
+#import "Chip8Frames.h"
+#import "Chip8Input.h"
+#import "Chip8Pacer.h"
+#import "Chip8Recording.h"
+#import "Chip8Rewind.h"
 #import "Chip8View.h"
 
 @interface AppDelegate () <NSWindowDelegate>
@@ -15,13 +22,69 @@
 @property (weak) IBOutlet NSWindow *window;
 @property (weak) IBOutlet Chip8View *chip8view;
 @property (weak) IBOutlet NSMenuItem *pauseResumeMenuItem;
+@property (weak) IBOutlet NSMenuItem *turboMenuItem;
 
 @property (assign) BOOL paused;
-@property (strong) NSTimer *cpuTimer, *displayTimer;
+@property (strong) NSTimer *displayTimer;
+
+// The machine runs on the pacer's thread (see Chip8Pacer.h), so a slow redraw never holds up the game and a busy frame never
+// holds up the window. That thread owns the machine, the rewind buffer and the recording, and everything else only asks it to
+// do things (see -emulate:wait:), so none of them need a lock. Key presses go to it through `input`, and finished frames come
+// back through `frames`.
+@property (assign) chip8_pacer *pacer;
+@property (assign) chip8_input *input;
+@property (assign) chip8_frames *frames;
+@property (assign) chip8_audio *audio;			// the pacer's thread makes the samples, and the sound card's thread plays them
+@property (assign) AudioComponentInstance audioUnit;
+
+// these belong to the pacer's thread
+@property (assign) chip8_rewind *rewind;
+@property (assign) chip8_recording *recording;
+@property (copy) NSString *romName;
+
+- (void)runFrame;
 
 @end
 
 
+// Pacer callbacks
+// The pacer's thread is a plain pthread, so nothing drains autorelease pools there unless we do.
+
+static void chip8_app_runFrame(void *context, chip8_machine *machine) {
+	
+	@autoreleasepool {
+		[(__bridge AppDelegate *)context runFrame];
+	}
+}
+
+static void chip8_app_frameDone(void *context, chip8_machine *machine, bool present) {
+	
+	AppDelegate *app = (__bridge AppDelegate *)context;
+	chip8_audio_update(app.audio, machine);
+	
+	// in turbo mode only the frames the pacer presents are worth handing over
+	if (present) {
+		chip8_frames_publish(app.frames, machine);
+	}
+}
+
+// Called on the sound card's thread whenever it wants more samples.
+static OSStatus chip8_app_renderAudio(void *context, AudioUnitRenderActionFlags *flags, const AudioTimeStamp *timeStamp,
+									  UInt32 bus, UInt32 frames, AudioBufferList *data) {
+	
+	chip8_audio_read(context, data->mBuffers[0].mData, frames);
+	return noErr;
+}
+
+static void chip8_app_perform(void *context, chip8_machine *machine) {
+	
+	@autoreleasepool {
+		void (^work)(void) = (__bridge_transfer void (^)(void))context;
+		work();
+	}
+}
+
+
 @implementation AppDelegate
 
 - (NSSize)windowWillResize:(NSWindow *)sender toSize:(NSSize)frameSize {
@@ -32,10 +95,86 @@
 
 - (void)applicationDidFinishLaunching:(NSNotification *)aNotification {
 	
+	self.rewind = chip8_rewind_create(CHIP8_REWIND_DEFAULT_BUDGET, 0);
+	self.recording = chip8_recording_create();
+	self.frames = chip8_frames_create();
+	self.input = chip8_input_create();
+	self.audio = chip8_audio_create(0, 0);
+	chip8_audio_attach(self.audio, chip8_sharedMachine());
+	[self startAudio];
+	
+	// the view hands us the keys, and we queue them up for the emulation thread, stamped with when they were pressed (NSEvent's
+	// timestamps come from the same clock as chip8_now(), in seconds)
+	chip8_input *input = self.input;
+	self.chip8view.frames = self.frames;
+	self.chip8view.keyHandler = ^(unsigned char key, BOOL down, NSTimeInterval timestamp) {
+		chip8_input_push(input, key, down, (uint64_t)(timestamp * 1e9));
+	};
+	
+	chip8_pacer_callbacks callbacks = { chip8_app_runFrame, chip8_app_frameDone };
+	self.pacer = chip8_pacer_create(chip8_sharedMachine(), &callbacks, (__bridge void *)self);
+	
+	// defaults write leemorgan.Chip8 ClockRate 1000 (for example) for games that want a faster (or slower) machine
+	NSInteger clockRate = [[NSUserDefaults standardUserDefaults] integerForKey:@"ClockRate"];
+	if (clockRate > 0) {
+		chip8_pacer_setClockRate(self.pacer, (unsigned int)clockRate);
+	}
+	
+	// defaults write leemorgan.Chip8 PhosphorPersistence 0.5 (for example) to let pixels fade out, which hides the flicker
+	self.chip8view.persistence = [[NSUserDefaults standardUserDefaults] doubleForKey:@"PhosphorPersistence"];
+	
+	// show whatever the emulation thread has finished, as often as the screen can
+	self.displayTimer = [NSTimer scheduledTimerWithTimeInterval:1.0/60.0 target:self selector:@selector(updateDisplay:) userInfo:nil repeats:YES];
+	
 	[self openROM:self];
 	[self.chip8view becomeFirstResponder];
 }
 
+- (void)applicationWillTerminate:(NSNotification *)aNotification {
+	
+	chip8_pacer_pause(self.pacer);
+	[self emulate:^{ [self saveRecording]; } wait:YES];
+	[self logStats];
+	
+	if (self.audioUnit != NULL) {
+		AudioOutputUnitStop(self.audioUnit);
+		AudioComponentInstanceDispose(self.audioUnit);
+		self.audioUnit = NULL;
+	}
+}
+
+- (void)startAudio {
+	
+	AudioComponentDescription description = { kAudioUnitType_Output, kAudioUnitSubType_DefaultOutput, kAudioUnitManufacturer_Apple, 0, 0 };
+	AudioComponent component = AudioComponentFindNext(NULL, &description);
+	AudioComponentInstance unit;
+	if (component == NULL || AudioComponentInstanceNew(component, &unit) != noErr) {
+		return;
+	}
+	
+	// mono, signed 16 bit, just the way chip8_audio makes them
+	AudioStreamBasicDescription format = { 0 };
+	format.mSampleRate = chip8_audio_sampleRate(self.audio);
+	format.mFormatID = kAudioFormatLinearPCM;
+	format.mFormatFlags = kAudioFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked;
+	format.mFramesPerPacket = 1;
+	format.mChannelsPerFrame = 1;
+	format.mBitsPerChannel = 16;
+	format.mBytesPerFrame = 2;
+	format.mBytesPerPacket = 2;
+	
+	AURenderCallbackStruct callback = { chip8_app_renderAudio, self.audio };
+	if (AudioUnitSetProperty(unit, kAudioUnitProperty_StreamFormat, kAudioUnitScope_Input, 0, &format, sizeof(format)) != noErr ||
+		AudioUnitSetProperty(unit, kAudioUnitProperty_SetRenderCallback, kAudioUnitScope_Input, 0, &callback, sizeof(callback)) != noErr ||
+		AudioUnitInitialize(unit) != noErr ||
+		AudioOutputUnitStart(unit) != noErr) {
+		NSLog(@"Can't start the sound");
+		AudioComponentInstanceDispose(unit);
+		return;
+	}
+	self.audioUnit = unit;
+}
+
 - (IBAction)pauseResume:(id)sender {
 	
 	if (self.paused) {
@@ -50,28 +189,125 @@
 	
 	self.paused = YES;
 	self.pauseResumeMenuItem.title = @"Resume";
-	[self.cpuTimer invalidate];
-	[self.displayTimer invalidate];
+	
+	chip8_pacer_pause(self.pacer);
 }
 
 - (void)resume {
 	
 	self.paused = NO;
 	self.pauseResumeMenuItem.title = @"Pause";
-	self.cpuTimer = [NSTimer scheduledTimerWithTimeInterval:1.0/800.0 target:self selector:@selector(updateChip8:) userInfo:nil repeats:YES];
-	self.displayTimer = [NSTimer scheduledTimerWithTimeInterval:1.0/60.0 target:self selector:@selector(updateDisplay) userInfo:nil repeats:YES];
+	chip8_pacer_resume(self.pacer);
+}
+
+- (IBAction)toggleTurbo:(id)sender {
+	
+	BOOL turbo = (self.turboMenuItem.state != NSOnState);
+	self.turboMenuItem.state = turbo ? NSOnState : NSOffState;
+	chip8_pacer_setTurbo(self.pacer, turbo);
 }
 
-- (void)updateChip8:(NSTimer*)timer {
+- (void)updateDisplay:(NSTimer*)timer {
 	
-	chip8_step();
+	[self.chip8view showLatestFrame];
 }
 
-- (void)updateDisplay {
+- (void)logStats {
+	
+	chip8_pacer_stats pacing = chip8_pacer_getStats(self.pacer);
+	if (pacing.frames > 0) {
+		NSLog(@"Pacing: %.0f instructions/s for %u, %.2f frames/s, %llu dropped. Frames started %.1fus late on average (%.1fus standard deviation, %.1fus worst)",
+			  pacing.measuredRate, pacing.targetRate, pacing.measuredFPS, pacing.dropped,
+			  pacing.jitterMean / 1e3, pacing.jitterStdDev / 1e3, pacing.jitterMax / 1e3);
+	}
+	chip8_pacer_resetStats(self.pacer);
+	
+	chip8_audio_stats sound = chip8_audio_getStats(self.audio);
+	if (sound.read > 0) {
+		NSLog(@"Sound: %llu samples played, %llu dropped, %llu of silence because there was nothing to play", sound.read, sound.dropped, sound.underruns);
+	}
+	
+	// the pacer has stopped by now, so the input's statistics are safe to read from here
+	chip8_input_stats input = chip8_input_getStats(self.input);
+	if (input.applied > 0) {
+		NSLog(@"Input: %llu key presses and releases, %llu held over a frame, %llu dropped. Latency to the machine: %.2fms min, %.2fms mean, %.2fms max",
+			  input.applied, input.deferred, input.dropped,
+			  input.latency.min / 1e6, chip8_latency_mean(&input.latency) / 1e6, input.latency.max / 1e6);
+	}
+	chip8_input_resetStats(self.input);
 	
-	if (chip8_needsDisplay() == true) {
-		[self.chip8view setNeedsDisplay:YES];
+	chip8_frames_stats stats = chip8_frames_getStats(self.frames);
+	if (stats.presented > 0) {
+		NSLog(@"Frames: %llu published, %llu presented, %llu skipped. Latency to present: %.2fms min, %.2fms mean, %.2fms max",
+			  stats.published, stats.presented, stats.skipped,
+			  stats.latency.min / 1e6, chip8_latency_mean(&stats.latency) / 1e6, stats.latency.max / 1e6);
 	}
+	chip8_frames_resetStats(self.frames);
+}
+
+
+
+// Pacer thread
+
+- (void)emulate:(void (^)(void))work wait:(BOOL)wait {
+	
+	chip8_pacer_perform(self.pacer, chip8_app_perform, (__bridge_retained void *)[work copy], wait);
+}
+
+- (void)loadROM:(NSString *)path {
+	
+	[self saveRecording];
+	chip8_loadROM([path cStringUsingEncoding:NSUTF8StringEncoding]);
+	chip8_rewind_clear(self.rewind);
+	chip8_recording_begin(self.recording, chip8_sharedMachine());
+	self.romName = [path lastPathComponent];
+	
+	// show the cleared screen straight away
+	chip8_frames_publish(self.frames, chip8_sharedMachine());
+}
+
+- (void)runFrame {
+	
+	// the pacer keeps the game at real speed (see Chip8Pacer.c), so all we do here is run a frame, or go back one
+	if (self.chip8view.rewinding) {
+		[self rewindFrame];
+	}
+	else {
+		// the keys change between frames, so they land on the same cycles when the recording is played back
+		chip8_input_apply(self.input, chip8_sharedMachine());
+		chip8_runFrame();
+		chip8_rewind_push(self.rewind, chip8_sharedMachine());
+	}
+}
+
+- (void)rewindFrame {
+	
+	// go back a frame, but keep the keys the player is holding down right now rather than the ones they were holding back then
+	chip8_machine *machine = chip8_sharedMachine();
+	uint16_t keys = machine->keys;
+	
+	chip8_rewind_stepBack(self.rewind, machine);
+	
+	// the recording has to forget everything that happened after this frame too, and then see the keys change back
+	chip8_recording_truncate(self.recording, machine->cycles);
+	chip8_machine_setKeys(machine, keys);
+}
+
+- (void)saveRecording {
+	
+	// every session is recorded, and the last one for each ROM is kept in ~/Library/Application Support/Chip8/Recordings
+	if (self.romName == nil) {
+		return;
+	}
+	
+	NSURL *supportURL = [[[NSFileManager defaultManager] URLsForDirectory:NSApplicationSupportDirectory inDomains:NSUserDomainMask] firstObject];
+	NSURL *recordingsURL = [supportURL URLByAppendingPathComponent:@"Chip8/Recordings" isDirectory:YES];
+	if (![[NSFileManager defaultManager] createDirectoryAtURL:recordingsURL withIntermediateDirectories:YES attributes:nil error:NULL]) {
+		return;
+	}
+	
+	NSURL *recordingURL = [recordingsURL URLByAppendingPathComponent:[self.romName stringByAppendingPathExtension:@"c8r"]];
+	chip8_recording_save(self.recording, [[recordingURL path] fileSystemRepresentation]);
 }
 
 - (IBAction)openROM:(id)sender {
@@ -86,7 +322,8 @@
 			NSURL *fileURL = [openPanel URL];
 			
 			NSString *path = [fileURL path];
-			chip8_loadROM([path cStringUsingEncoding:NSUTF8StringEncoding]);
+			[self emulate:^{ [self loadROM:path]; } wait:YES];
+			[self logStats];
 			
 			[self resume];
 		}
@@ -7,6 +7,18 @@
 //
 
 #include "Chip8.h"
+#include "Chip8AOT.h"
+#include "Chip8JIT.h"
+#include "Chip8Profile.h"
+#include <limits.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__APPLE__)
+	#include <mach/mach_time.h>
+#endif
 
 /* 
  Chip8 Architecture:
@@ -94,46 +106,22 @@
 #define GetN(opcode)	( opcode & 0x000F)			// N is a 4-bit (nibble) constant stored in the last nibble of the opcode.
 #define GetNN(opcode)	( opcode & 0x00FF)			// NN is a 8-bit (byte) constant stored in the lower byte of the opcode.
 #define GetNNN(opcode)	( opcode & 0x0FFF)			// NNN is an address stored in the lower 12 bits of the opcode.
+#define MemAddr(addr)	((addr) & 0x0FFF)			// Wraps an address into the 4KB address space, so a stray I or pc can never read or write outside of the machine's memory.
 
+#define VF(m)			(m)->V[0xF]					// VF (register 16) is a special register reserved for carry operations. So we define a convience accessor here.
 
 
-// Used to store the current opcode (2 bytes)
-unsigned short opcode;
-
-// Sytem Memory (4 KB)
-unsigned char memory[4096];
-
-// Registers
-unsigned char	V[16];	// 8-bit registers
-#define VF		V[0xF]	// VF (register 16) is a special register reserved for carry operations. So we define a convience accessor here.
-
-// Delay Timer register
-unsigned char delay_timer;
-
-// Sound Timer register
-unsigned char sound_timer;
-
-// Index Register (sometimes called Address register) is 2 bytes wide and is used with several opcodes that involve memory operations.
-unsigned short I;
-
-// Program Coutner (PC) - 2 bytes wide, so we can point at any valid memory location (0-4095) in the 4KB of memory. Technically we only need 12-bits for this.
-unsigned short pc;
-
-// VRAM (the screen memory)
-unsigned char gfx[64][32];
 
-// The Stack, and Stack Pointer (sp)
-unsigned short stack[16];
-unsigned short sp;
+// All of the machine state (memory, registers, timers, gfx, etc...) lives in the chip8_machine struct declared in Chip8.h.
+// The single machine API (chip8_step(), chip8_loadROM(), ...) operates on this shared machine.
+static chip8_machine chip8_shared;
 
-// Keypad - used as input from a HEX keypad
-unsigned char key[16];
 
 // Font
 // The Chip8 font is an array of bytes, each one representing one row of pixels
 // I've put the first few characters in binary form to show this.
 // If you look closely at the 1's you'll see the character they represent.
-unsigned char chip8_fontset[80] = {
+static const unsigned char chip8_fontset[80] = {
 	
 	0b11110000, // 0
 	0b10010000,
@@ -174,566 +162,1783 @@ unsigned char chip8_fontset[80] = {
 };
 
 
-// Flag used to let the renderer (Chip8View) know when we have updated the graphics memory.
-bool _needsDisplay = false;
+// Function Prototypes
+static void chip8_unknownOpcode(chip8_machine *m);
+static void chip8_flushDecodeCache(chip8_machine *m);
+static void chip8_scheduleTimerTick(chip8_machine *m);
+static inline void chip8_setSoundTimer(chip8_machine *m, unsigned char value, unsigned long long cycle);
+static void chip8_decodeEntry(chip8_machine *m, chip8_insn *insn);
 
 
-// Function Prototypes
-void chip8_init();
-void chip8_unknownOpcode();
 
-// We use NSBeep() to play a tone when the soundTimer ends.
-// Instead of importing all of AppKit we just declare it's prototype here to keep the compiler from complaining.
-void NSBeep(void);
 
+// Machine API
 
+chip8_machine *chip8_machine_create() {
+	
+	chip8_machine *m = calloc(1, sizeof(chip8_machine));
+	if (m != NULL) {
+		chip8_machine_reset(m);
+	}
+	return m;
+}
 
-void chip8_loadROM(const char *romPath) {
+void chip8_machine_destroy(chip8_machine *m) {
+	
+	if (m != NULL) {
+		chip8_jit_destroy(m->jit);
+		chip8_aot_destroy(m->aot);
+	}
+	free(m);
+}
+
+bool chip8_machine_loadROM(chip8_machine *m, const char *romPath) {
 	
 	// Init the Chip8 system
-	chip8_init();
+	chip8_machine_reset(m);
 	
 	
 	// Load the game into memory
 	// The first 512 bytes of memory are reserved, so we can't load more than 3584 bytes (3.5KB of our total 4KB memory)
-	FILE *rom = fopen(romPath, "r");
-	if (rom != NULL) {
-		
-		size_t result = fread(&memory[512], sizeof(unsigned char), 3584, rom);
-		
-		if (result == -1) {
-			printf("Failed to read rom into memory with error %zu\n", result);
-		}
+	FILE *rom = fopen(romPath, "rb");
+	if (rom == NULL) {
+		printf("Failed to open rom %s\n", romPath);
+		return false;
 	}
+	
+	size_t result = fread(&m->memory[512], sizeof(unsigned char), 3584, rom);
+	bool failed = ferror(rom);
 	fclose(rom);
+	
+	if (failed) {
+		printf("Failed to read rom into memory after %zu bytes\n", result);
+		return false;
+	}
+	
+	// the ROM was written straight into memory, so make sure none of it is stuck in the decode cache
+	chip8_flushDecodeCache(m);
+	chip8_machine_setQuirks(m, chip8_machine_quirksForROM(&m->memory[512], result));
+	if (m->jit != NULL) {
+		chip8_jit_invalidate(m->jit);
+	}
+	chip8_aot_invalidate(m->aot);
+	return true;
 }
 
+// A seed for a machine nobody has seeded. time() alone would give every machine reset in the same second the same
+// numbers, so it's mixed with a count of the seeds handed out so far (splitmix64's finaliser spreads the difference
+// over all the bits).
+static unsigned int chip8_clockSeed() {
+	
+	static atomic_uint seedsHandedOut;
+	uint64_t z = (uint64_t)time(NULL) + 0x9E3779B97F4A7C15ULL * (atomic_fetch_add_explicit(&seedsHandedOut, 1, memory_order_relaxed) + 1);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+	return (unsigned int)(z >> 32);
+}
 
-void chip8_init() {
+void chip8_machine_reset(chip8_machine *m) {
 	
 	// init the registers and memory
-	pc		= 0x200;	// program counter starts at 0x200
-	opcode	= 0;		// zeroize the opcode
-	I		= 0;		// zeroize the index register
-	sp		= 0;		// zeroize the stack pointer
+	m->pc		= 0x200;	// program counter starts at 0x200
+	m->I		= 0;		// zeroize the index register
+	m->sp		= 0;		// zeroize the stack pointer
 	
 	// clear the display
-	for (int row = 0; row < 32; row++) {
-		for (int col = 0; col < 64; col++) {
-			gfx[col][row] = 0;
-		}
-	}
+	memset(m->gfx, 0, sizeof(m->gfx));
+	
+	// we don't know what the renderer is showing (the last game, maybe) so treat the whole screen as dirty
+	memset(m->presentedGfx, 0xFF, sizeof(m->presentedGfx));
 	
 	// clear the stack
 	for (int i = 0; i < 16; ++i) {
-		stack[i] = 0;
+		m->stack[i] = 0;
 	}
 	
 	// clear the keys
-	for (int i = 0; i < 16; i++) {
-		key[i] = V[i] = 0;
-	}
+	m->keys = 0;
 	
 	// clear registers V0-VF
 	for (int i = 0; i < 16; i++) {
-		V[i] = 0;
+		m->V[i] = 0;
 	}
 	
 	// clear memory
 	for (int i = 0; i < 4096; i++) {
-		memory[i] = 0;
+		m->memory[i] = 0;
 	}
 	
 	// Load fontset
 	for (int i = 0; i < 80; i++) {
-		memory[i] = chip8_fontset[i];
+		m->memory[i] = chip8_fontset[i];
 	}
 	
 	// reset timers
-	delay_timer = 0;
-	sound_timer = 0;
+	m->delay_timer = 0;
+	m->sound_timer = 0;
+	
+	// restart the cycle count (the clock rate is a setting, so it survives a reset)
+	if (m->clockRate == 0) {
+		m->clockRate = CHIP8_DEFAULT_CLOCK_RATE;
+	}
+	m->cycles = 0;
+	m->timerBase = 0;
+	m->timerTicks = 0;
+	chip8_scheduleTimerTick(m);
+	m->idleCycles = 0;
+	m->fusedCycles = 0;
+	memset(m->fusedRuns, 0, sizeof(m->fusedRuns));
+	
+	m->needsDisplay = false;
+	
+	// nothing has been decoded (or compiled) yet
+	chip8_flushDecodeCache(m);
+	if (m->jit != NULL) {
+		chip8_jit_invalidate(m->jit);
+	}
+	chip8_aot_invalidate(m->aot);
 	
 	// seed random
-	srandom((unsigned int)time(NULL));
+	chip8_machine_seed(m, chip8_clockSeed());
 }
 
 
-void chip8_step() {
+// Opcode Decoding
+//
+// Rather than walking a long if / else if chain for every instruction, each opcode is decoded into a small number (a chip8_op)
+// with two table lookups. The first nibble of the opcode picks a decode level, which says which bits of the opcode select the
+// actual instruction within that group. Groups with only one instruction (1NNN, 2NNN, ...) use a mask of 0 and a one entry table.
+// Any entry we don't fill in is 0, which is CHIP8_OP_UNKNOWN.
+//
+// Every chip8_op has a handler function (chip8_op_00E0(), chip8_op_1NNN(), ...) which does the work for that instruction.
+
+#define CHIP8_OPCODES(OP) \
+	OP(UNKNOWN) \
+	OP(00E0) OP(00EE) OP(1NNN) OP(2NNN) OP(3XNN) OP(4XNN) OP(5XY0) OP(6XNN) OP(7XNN) \
+	OP(8XY0) OP(8XY1) OP(8XY2) OP(8XY3) OP(8XY4) OP(8XY5) OP(8XY6) OP(8XY7) OP(8XYE) \
+	OP(9XY0) OP(ANNN) OP(BNNN) OP(CXNN) OP(DXYN) OP(EX9E) OP(EXA1) \
+	OP(FX07) OP(FX0A) OP(FX15) OP(FX18) OP(FX1E) OP(FX29) OP(FX33) OP(FX55) OP(FX65)
+
+// The superinstructions (see Superinstructions below): each one's length, and the ops it runs in order (unused slots are UNKNOWN).
+// Where one is the start of another, the longer one has to come first.
+#define CHIP8_FUSIONS(FUSE) \
+	FUSE(7XNN_3XNN_1NNN,		3, 7XNN, 3XNN, 1NNN, UNKNOWN) \
+	FUSE(7XNN_4XNN_1NNN,		3, 7XNN, 4XNN, 1NNN, UNKNOWN) \
+	FUSE(7XNN_6XNN,				2, 7XNN, 6XNN, UNKNOWN, UNKNOWN) \
+	FUSE(3XNN_1NNN,				2, 3XNN, 1NNN, UNKNOWN, UNKNOWN) \
+	FUSE(4XNN_1NNN,				2, 4XNN, 1NNN, UNKNOWN, UNKNOWN) \
+	FUSE(EX9E_1NNN,				2, EX9E, 1NNN, UNKNOWN, UNKNOWN) \
+	FUSE(EXA1_1NNN,				2, EXA1, 1NNN, UNKNOWN, UNKNOWN) \
+	FUSE(6XNN_6XNN_ANNN_DXYN,	4, 6XNN, 6XNN, ANNN, DXYN) \
+	FUSE(6XNN_8XY2,				2, 6XNN, 8XY2, UNKNOWN, UNKNOWN) \
+	FUSE(6XNN_EXA1,				2, 6XNN, EXA1, UNKNOWN, UNKNOWN) \
+	FUSE(ANNN_FX1E_FX65,		3, ANNN, FX1E, FX65, UNKNOWN) \
+	FUSE(ANNN_DXYN,				2, ANNN, DXYN, UNKNOWN, UNKNOWN) \
+	FUSE(FX1E_FX65,				2, FX1E, FX65, UNKNOWN, UNKNOWN) \
+	FUSE(FX29_DXYN,				2, FX29, DXYN, UNKNOWN, UNKNOWN)
+
+#define CHIP8_FUSED_LONGEST		4	// instructions in the longest superinstruction
+
+#define CHIP8_OP_ENUM(name)		CHIP8_OP_##name,
+#define CHIP8_FUSED_ENUM(name, length, a, b, c, d)		CHIP8_OP_##name,
+
+typedef enum chip8_op {
+	CHIP8_OPCODES(CHIP8_OP_ENUM)
+	CHIP8_OP_COUNT,
+	CHIP8_OP_DECODE = CHIP8_OP_COUNT,	// a decode cache entry that needs to be (re)decoded before it can run
+	CHIP8_FUSIONS(CHIP8_FUSED_ENUM)		// then the superinstructions
+	CHIP8_OP_LIMIT
+} chip8_op;
+
+#define CHIP8_OP_FUSED_FIRST	(CHIP8_OP_DECODE + 1)
+#define CHIP8_FUSION_COUNT		(CHIP8_OP_LIMIT - CHIP8_OP_FUSED_FIRST)
+
+typedef struct chip8_decodeLevel {
+	const unsigned char	*ops;	// table of chip8_op values for this group
+	unsigned short		mask;	// bits of the opcode used to index into ops
+} chip8_decodeLevel;
+
+static const unsigned char chip8_ops0[4096] = {	// 0NNN: only 00E0 and 00EE are real instructions
+	[0x0E0] = CHIP8_OP_00E0,
+	[0x0EE] = CHIP8_OP_00EE,
+};
+
+static const unsigned char chip8_ops8[16] = {		// 8XYN: the last nibble picks the math operation
+	[0x0] = CHIP8_OP_8XY0, [0x1] = CHIP8_OP_8XY1, [0x2] = CHIP8_OP_8XY2, [0x3] = CHIP8_OP_8XY3,
+	[0x4] = CHIP8_OP_8XY4, [0x5] = CHIP8_OP_8XY5, [0x6] = CHIP8_OP_8XY6, [0x7] = CHIP8_OP_8XY7,
+	[0xE] = CHIP8_OP_8XYE,
+};
+
+static const unsigned char chip8_opsE[256] = {		// EXNN: the last byte picks the key test
+	[0x9E] = CHIP8_OP_EX9E,
+	[0xA1] = CHIP8_OP_EXA1,
+};
+
+static const unsigned char chip8_opsF[256] = {		// FXNN: the last byte picks the operation
+	[0x07] = CHIP8_OP_FX07, [0x0A] = CHIP8_OP_FX0A, [0x15] = CHIP8_OP_FX15, [0x18] = CHIP8_OP_FX18,
+	[0x1E] = CHIP8_OP_FX1E, [0x29] = CHIP8_OP_FX29, [0x33] = CHIP8_OP_FX33, [0x55] = CHIP8_OP_FX55,
+	[0x65] = CHIP8_OP_FX65,
+};
+
+static const unsigned char chip8_op1[1] = { CHIP8_OP_1NNN };
+static const unsigned char chip8_op2[1] = { CHIP8_OP_2NNN };
+static const unsigned char chip8_op3[1] = { CHIP8_OP_3XNN };
+static const unsigned char chip8_op4[1] = { CHIP8_OP_4XNN };
+static const unsigned char chip8_ops5[16] = { [0x0] = CHIP8_OP_5XY0 };
+static const unsigned char chip8_op6[1] = { CHIP8_OP_6XNN };
+static const unsigned char chip8_op7[1] = { CHIP8_OP_7XNN };
+static const unsigned char chip8_ops9[16] = { [0x0] = CHIP8_OP_9XY0 };
+static const unsigned char chip8_opA[1] = { CHIP8_OP_ANNN };
+static const unsigned char chip8_opB[1] = { CHIP8_OP_BNNN };
+static const unsigned char chip8_opC[1] = { CHIP8_OP_CXNN };
+static const unsigned char chip8_opD[1] = { CHIP8_OP_DXYN };
+
+static const chip8_decodeLevel chip8_decodeTable[16] = {
+	[0x0] = { chip8_ops0, 0x0FFF },
+	[0x1] = { chip8_op1, 0x0000 },
+	[0x2] = { chip8_op2, 0x0000 },
+	[0x3] = { chip8_op3, 0x0000 },
+	[0x4] = { chip8_op4, 0x0000 },
+	[0x5] = { chip8_ops5, 0x000F },
+	[0x6] = { chip8_op6, 0x0000 },
+	[0x7] = { chip8_op7, 0x0000 },
+	[0x8] = { chip8_ops8, 0x000F },
+	[0x9] = { chip8_ops9, 0x000F },
+	[0xA] = { chip8_opA, 0x0000 },
+	[0xB] = { chip8_opB, 0x0000 },
+	[0xC] = { chip8_opC, 0x0000 },
+	[0xD] = { chip8_opD, 0x0000 },
+	[0xE] = { chip8_opsE, 0x00FF },
+	[0xF] = { chip8_opsF, 0x00FF },
+};
+
+// Decodes an opcode into its chip8_op and pulls out all of its operands up front, so the handlers never have to pick the opcode apart.
+static inline void chip8_decode(unsigned short opcode, chip8_insn *insn) {
 	
-	// fetch opcode
-	// fetch one opcode from the memory at the location specified by the program counter (pc).
-	// In our emulator, data is stored in an array in which each address contains one byte.
-	// As one opcode is 2 bytes long, we need to fetch two successive bytes and merge them to get the actual opcode.
-	opcode = memory[pc];		// get the first byte
-	opcode <<= 8;				// shift the first byte to the left 1 byte (to make room for the 2nd byte)
-	opcode |= memory[pc + 1];	// get the 2nd byte
-	
-	// decode & execute opcode
-	// decode the opcode and check the opcode table to see what it means.
-	// because every instruction is 2 bytes long, we need to increment the program counter by two after every executed opcode.
-	// This is true unless you jump to a certain address in the memory or if you call a subroutine (in which case you need to store the program counter in the stack).
-	// If the next opcode should be skipped, increase the program counter by four.
-	
-	// Get the first nibble of the opcode using a mask like `0xF000. This allows us to "categorize" the opcode
-	// Then based on the category, apply more masks to either get the register values from the opcode, or whatever other variables might be encoded with the opcode that will narrow down the actual function that would need to be called, as well as it's arguments.
-	
-	unsigned short maskedOpcode = opcode & 0xF000;
-//	printf("opcode			= 0x%X\n", opcode);			// uncomment to print the current opcode
-//	printf("masked opcode	= 0x%X\n", maskedOpcode);	// uncomment to print the current masked opcode
-	
-	if (opcode == 0x00E0) {
-		for (int row = 0; row < 32; row++) {
-			for (int col = 0; col < 64; col++) {
-				gfx[col][row] = 0;
-			}
-		}
-		pc += 2;
-	}
-	else if (opcode == 0x00EE) {
-		if (sp <= 0) {
-			printf("WARNING: Stack Underflow\n");
-			return;
-		}
-		sp--;
-		pc = stack[sp];
+	const chip8_decodeLevel *level = &chip8_decodeTable[opcode >> 12];
+	
+	insn->op	= level->ops[opcode & level->mask];
+	insn->base	= insn->op;
+	insn->x		= GetX(opcode);		// mask to X, then shift 8 (256 bits) to drop the 2nd byte (e.g. 0x3100 = [0011 0001][0000 0000] becomes [0000 0001][0000 0000] then [0000 0000][0000 0001])
+	insn->y		= GetY(opcode);
+	insn->n		= GetN(opcode);
+	insn->nn	= GetNN(opcode);
+	insn->nnn	= GetNNN(opcode);
+}
+
+
+
+// Opcode Handlers
+//
+// because every instruction is 2 bytes long, we need to increment the program counter by two after every executed opcode.
+// This is true unless you jump to a certain address in the memory or if you call a subroutine (in which case you need to store the program counter in the stack).
+// If the next opcode should be skipped, increase the program counter by four.
+
+// Throws away the decode cache entry for an address that has been written to. A superinstruction that starts a few
+// instructions earlier may have this one baked into it as well, so those entries go too.
+static inline void chip8_forgetDecoded(chip8_machine *m, unsigned short address) {
+	
+	int entry = MemAddr(address) >> 1;
+	for (int i = 0; i < CHIP8_FUSED_LONGEST && i <= entry; i++) {
+		m->decoded[entry - i].op = CHIP8_OP_DECODE;
 	}
-	else if (maskedOpcode == 0x1000) {
-		pc = GetNNN(opcode);
+}
+
+// Every store into memory goes through here so that if a program writes over its own code, the stale decode cache entry is thrown away.
+static inline void chip8_store(chip8_machine *m, unsigned short address, unsigned char value) {
+	
+	address = MemAddr(address);
+	m->memory[address] = value;
+	chip8_forgetDecoded(m, address);
+	
+	// the JIT keeps its own translation of the code, so it needs to know too (but only if this byte was part of a translated block)
+	if (m->jitCodeMap != NULL && m->jitCodeMap[address]) {
+		chip8_jit_invalidate(m->jit);
 	}
-	else if (maskedOpcode == 0x2000) {
-		if (sp+1 > 15) {
-			printf("WARNING: Stack Overflow\n");
-			return;
-		}
-		stack[sp] = pc + 2;
-		sp++;
-		pc = GetNNN(opcode);
-	}
-	else if (maskedOpcode == 0x3000) {
-		unsigned char X = GetX(opcode); // mask to X, then shift 8 (256 bits) to drop the 2nd byte (e.g. 0x3100 = [0011 0001][0000 0000] becomes [0000 0001][0000 0000] then [0000 0000][0000 0001])
-		unsigned char NN = GetNN(opcode);
-		if (V[X] == NN) {
-			pc += 4;
-		}
-		else {
-			pc += 2;
-		}
+	
+	// and so does a program translated ahead of time
+	if (m->aotCodeMap != NULL && m->aotCodeMap[address]) {
+		chip8_aot_codeWritten(m->aot, address);
 	}
-	else if (maskedOpcode == 0x4000) {
-		unsigned char X = GetX(opcode);
-		unsigned char NN = GetNN(opcode);
-		if (V[X] != NN) {
-			pc += 4;
-		}
-		else {
-			pc += 2;
-		}
+	
+	// and whoever else is keeping track (chip8_lockstep, which runs lanes on machines of their own)
+	if (m->storeMap != NULL) {
+		m->storeMap[address >> 1] = 1;
 	}
-	else if (maskedOpcode == 0x5000) {
-		unsigned char X = GetX(opcode);
-		unsigned char Y = GetY(opcode);
-		if (V[X] == V[Y]) {
-			pc += 4;
-		}
-		else {
-			pc += 2;
-		}
+}
+
+// Quirks
+//
+// Every profile in CHIP8_QUIRK_PROFILES gets its own copy of the interpreter and of the handler table, which pass the
+// profile's CHIP8_QUIRK_ flags to every handler as a constant. The compiler folds the quirk tests away, so each copy only
+// contains its own behaviour and the handlers never test for quirks while they run.
+// `arg` is handed on to PROFILE untouched, which is how one list can be expanded once per entry of another (see chip8_handlers).
+#define CHIP8_QUIRK_PROFILES(PROFILE, arg) \
+	PROFILE(CLASSIC,	0, arg) \
+	PROFILE(VIP,		CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_MEMORY_I | CHIP8_QUIRK_CLIP | CHIP8_QUIRK_VF_RESET, arg) \
+	PROFILE(CHIP48,		CHIP8_QUIRK_MEMORY_I_SHORT | CHIP8_QUIRK_JUMP_VX | CHIP8_QUIRK_CLIP, arg) \
+	PROFILE(SCHIP,		CHIP8_QUIRK_JUMP_VX | CHIP8_QUIRK_CLIP, arg)
+
+#define CHIP8_HANDLER(name)		static inline __attribute__((always_inline)) void chip8_op_##name(chip8_machine *m, __attribute__((unused)) const chip8_insn *insn, __attribute__((unused)) const unsigned int quirks)
+
+CHIP8_HANDLER(UNKNOWN) {
+	chip8_unknownOpcode(m);
+}
+
+CHIP8_HANDLER(00E0) {
+	memset(m->gfx, 0, sizeof(m->gfx));
+	m->needsDisplay = true;
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(00EE) {
+	if (m->sp <= 0) {
+		printf("WARNING: Stack Underflow\n");
+		return;
 	}
-	else if (maskedOpcode == 0x6000) {
-		unsigned char X = GetX(opcode);
-		unsigned char NN = GetNN(opcode);
-		V[X] = NN;
-		pc += 2;
+	m->sp--;
+	m->pc = m->stack[m->sp];
+}
+
+CHIP8_HANDLER(1NNN) {
+	m->pc = insn->nnn;
+}
+
+CHIP8_HANDLER(2NNN) {
+	if (m->sp+1 > 15) {
+		printf("WARNING: Stack Overflow\n");
+		return;
 	}
-	else if (maskedOpcode == 0x7000) {
-		unsigned char X = GetX(opcode);
-		unsigned char NN = GetNN(opcode);
-		V[X] += NN;
-		pc += 2;
+	m->stack[m->sp] = m->pc + 2;
+	m->sp++;
+	m->pc = insn->nnn;
+}
+
+CHIP8_HANDLER(3XNN) {
+	unsigned char X = insn->x;
+	unsigned char NN = insn->nn;
+	m->pc += (m->V[X] == NN) ? 4 : 2;
+}
+
+CHIP8_HANDLER(4XNN) {
+	unsigned char X = insn->x;
+	unsigned char NN = insn->nn;
+	m->pc += (m->V[X] != NN) ? 4 : 2;
+}
+
+CHIP8_HANDLER(5XY0) {
+	unsigned char X = insn->x;
+	unsigned char Y = insn->y;
+	m->pc += (m->V[X] == m->V[Y]) ? 4 : 2;
+}
+
+CHIP8_HANDLER(6XNN) {
+	unsigned char X = insn->x;
+	unsigned char NN = insn->nn;
+	m->V[X] = NN;
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(7XNN) {
+	unsigned char X = insn->x;
+	unsigned char NN = insn->nn;
+	m->V[X] += NN;
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(8XY0) {
+	unsigned char X = insn->x;
+	unsigned char Y = insn->y;
+	m->V[X] = m->V[Y];
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(8XY1) {
+	unsigned char X = insn->x;
+	unsigned char Y = insn->y;
+	m->V[X] = m->V[X] | m->V[Y];
+	if (quirks & CHIP8_QUIRK_VF_RESET) {
+		VF(m) = 0;
 	}
-	else if (maskedOpcode == 0x8000) {
-		
-		unsigned short submaskedOpcode = opcode & 0x000F;
-		
-		if (submaskedOpcode == 0x0000) {
-			unsigned char X = GetX(opcode);
-			unsigned char Y = GetY(opcode);
-			V[X] = V[Y];
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x0001) {
-			unsigned char X = GetX(opcode);
-			unsigned char Y = GetY(opcode);
-			V[X] = V[X] | V[Y];
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x0002) {
-			unsigned char X = GetX(opcode);
-			unsigned char Y = GetY(opcode);
-			V[X] = V[X] & V[Y];
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x0003) {
-			unsigned char X = GetX(opcode);
-			unsigned char Y = GetY(opcode);
-			V[X] = V[X] ^ V[Y];
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x0004) {
-			unsigned char X = GetX(opcode);
-			unsigned char Y = GetY(opcode);
-			if (V[Y] > (255 - V[X])) { // since a byte can only store up to 255, we can check for a carry by seeing if the number we are adding is greather than 255 minus somenumber.
-				VF = 1;
-			}
-			else {
-				VF = 0;
-			}
-			V[X] += V[Y];
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x0005) {
-			unsigned char X = GetX(opcode);
-			unsigned char Y = GetY(opcode);
-			if (V[Y] > V[X]) { // we will only need to borrow if the number we are subtracting from is smaller than the number we are subtracting with
-				VF = 0; // borrow
-			}
-			else {
-				VF = 1;
-			}
-			V[X] -= V[Y];
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x0006) {
-			unsigned char X = GetX(opcode);
-			VF = V[X] & 0x1;
-			V[X] = V[X] >> 1;
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x0007) {
-			unsigned char X = GetX(opcode);
-			unsigned char Y = GetY(opcode);
-			if (V[X] > V[Y]) {
-				VF = 0; // borrow
-			}
-			else {
-				VF = 1;
-			}
-			V[X] = V[Y] - V[X];
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x000E) {
-			unsigned char X = GetX(opcode);
-			VF = V[X] >> 7;
-			V[X] = V[X] << 1;
-			pc += 2;
-		}
-		else {
-			chip8_unknownOpcode();
-		}
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(8XY2) {
+	unsigned char X = insn->x;
+	unsigned char Y = insn->y;
+	m->V[X] = m->V[X] & m->V[Y];
+	if (quirks & CHIP8_QUIRK_VF_RESET) {
+		VF(m) = 0;
 	}
-	else if (maskedOpcode == 0x9000) {
-		unsigned char X = GetX(opcode);
-		unsigned char Y = GetY(opcode);
-		if (V[X] != V[Y]) {
-			pc += 4;
-		}
-		else {
-			pc += 2;
-		}
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(8XY3) {
+	unsigned char X = insn->x;
+	unsigned char Y = insn->y;
+	m->V[X] = m->V[X] ^ m->V[Y];
+	if (quirks & CHIP8_QUIRK_VF_RESET) {
+		VF(m) = 0;
 	}
-	else if (maskedOpcode == 0xA000) {
-		unsigned short NNN = GetNNN(opcode);
-		I = NNN;
-		pc += 2;
-	}
-	else if (maskedOpcode == 0xB000) {
-		unsigned short NNN = GetNNN(opcode);
-		pc = NNN + V[0];
-	}
-	else if (maskedOpcode == 0xC000) {
-		unsigned char X = GetX(opcode);
-		unsigned char NN = GetNN(opcode);
-		unsigned char randomByte = random();
-		V[X] = randomByte & NN;
-		pc += 2;
-	}
-	else if (maskedOpcode == 0xD000) {
-		unsigned char X = GetX(opcode);
-		unsigned char Y = GetY(opcode);
-		unsigned char height = GetN(opcode);
-		unsigned char pixel;
-		
-		VF = 0;
-		
-		for (unsigned char yLine = 0; yLine < height; yLine++) {
-			unsigned char row = yLine + V[Y];
-			
-			for (unsigned char xLine = 0; xLine < 8; xLine++) {
-				// each 'pixel' is one bit. each sprite is 8 pixels wide (1 byte). So we step through each bit checking if it is set.
-				pixel = memory[I + yLine] & (0x80 >> xLine);
-				
-				if (pixel != 0) {
-					unsigned char col = xLine + V[X];
-					if (gfx[col][row] == 1) {
-						VF = 1;
-					}
-					gfx[col][row] = gfx[col][row] ^ 1;
-				}
-			}
-		}
-		
-		_needsDisplay = true;
-		
-		pc += 2;
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(8XY4) {
+	unsigned char X = insn->x;
+	unsigned char Y = insn->y;
+	// since a byte can only store up to 255, we can check for a carry by seeing if the number we are adding is greather than 255 minus somenumber.
+	VF(m) = (m->V[Y] > (255 - m->V[X])) ? 1 : 0;
+	m->V[X] += m->V[Y];
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(8XY5) {
+	unsigned char X = insn->x;
+	unsigned char Y = insn->y;
+	// we will only need to borrow if the number we are subtracting from is smaller than the number we are subtracting with
+	VF(m) = (m->V[Y] > m->V[X]) ? 0 : 1;
+	m->V[X] -= m->V[Y];
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(8XY6) {
+	unsigned char X = insn->x;
+	unsigned char S = (quirks & CHIP8_QUIRK_SHIFT_VY) ? insn->y : X;	// the register being shifted
+	VF(m) = m->V[S] & 0x1;
+	m->V[X] = m->V[S] >> 1;
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(8XY7) {
+	unsigned char X = insn->x;
+	unsigned char Y = insn->y;
+	VF(m) = (m->V[X] > m->V[Y]) ? 0 : 1; // 0 means we had to borrow
+	m->V[X] = m->V[Y] - m->V[X];
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(8XYE) {
+	unsigned char X = insn->x;
+	unsigned char S = (quirks & CHIP8_QUIRK_SHIFT_VY) ? insn->y : X;
+	VF(m) = m->V[S] >> 7;
+	m->V[X] = m->V[S] << 1;
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(9XY0) {
+	unsigned char X = insn->x;
+	unsigned char Y = insn->y;
+	m->pc += (m->V[X] != m->V[Y]) ? 4 : 2;
+}
+
+CHIP8_HANDLER(ANNN) {
+	m->I = insn->nnn;
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(BNNN) {
+	// CHIP-48 read this as BXNN, and added VX rather than V0 (X is the top nibble of NNN, so the address is the same)
+	m->pc = insn->nnn + m->V[(quirks & CHIP8_QUIRK_JUMP_VX) ? insn->x : 0];
+}
+
+// Each machine has its own generator rather than sharing libc's random(), so runs can be repeated (and machines on
+// different threads don't fight over it). It's Marsaglia's 32-bit xorshift, which is a handful of instructions and only
+// needs its 4 bytes of state. The state is never 0 (see chip8_machine_seed()), which is the one value xorshift can't leave.
+// Its low bits are its weakest, and CXNN masks off the low bits, so we hand out the top byte of the state scrambled by a
+// multiply instead.
+static inline unsigned char chip8_random(chip8_machine *m) {
+	unsigned int s = m->rngState;
+	s ^= s << 13;
+	s ^= s >> 17;
+	s ^= s << 5;
+	m->rngState = s;
+	return (unsigned char)((s * 0x9E3779BBu) >> 24);
+}
+
+CHIP8_HANDLER(CXNN) {
+	unsigned char X = insn->x;
+	unsigned char NN = insn->nn;
+	unsigned char randomByte = chip8_random(m);
+	m->V[X] = randomByte & NN;
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(DXYN) {
+	unsigned char height = insn->n;
+	unsigned char x = m->V[insn->x] % 64;
+	unsigned char y = m->V[insn->y] % 32;
+	uint64_t sprite[16];
+	uint64_t collision = 0;
+	
+	// with CHIP8_QUIRK_CLIP the rows that run off the bottom of the screen just aren't drawn
+	if ((quirks & CHIP8_QUIRK_CLIP) && y + height > 32) {
+		height = 32 - y;
 	}
-	else if (maskedOpcode == 0xE000) {
-		
-		unsigned short submaskedOpcode = opcode & 0x00FF;
-		
-		if (submaskedOpcode == 0x009E) {
-			unsigned char X = GetX(opcode);
-			if (key[V[X]] != 0) {
-				pc += 4;
-			}
-			else {
-				pc += 2;
-			}
-		}
-		else if (submaskedOpcode == 0x00A1) {
-			unsigned char X = GetX(opcode);
-			if (key[V[X]] == 0) {
-				pc += 4;
-			}
-			else {
-				pc += 2;
-			}
-		}
-		else {
-			chip8_unknownOpcode();
-		}
+	
+	// Each row of the screen is a uint64_t with the leftmost pixel in the top bit, and each row of a sprite is one byte (8 pixels).
+	// So a sprite row lines up with the screen by putting it in the top byte and rotating it right by x. Rotating (rather than
+	// shifting) means pixels that run off the right hand edge wrap around to the left, unless they're clipped.
+	for (unsigned char yLine = 0; yLine < height; yLine++) {
+		uint64_t bits = (uint64_t)m->memory[MemAddr(m->I + yLine)] << 56;
+		sprite[yLine] = (bits >> x) | ((quirks & CHIP8_QUIRK_CLIP) ? 0 : bits << ((64 - x) & 63));
 	}
-	else if (maskedOpcode == 0xF000) {
-		
-		unsigned short submaskedOpcode = opcode & 0x00FF;
-		
-		if (submaskedOpcode == 0x0007) {
-			unsigned char X = GetX(opcode);
-			V[X] = delay_timer;
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x000A) {
-			unsigned char X = GetX(opcode);
-			bool keyPress = false;
-			
-			for (unsigned char i = 0; i < 16; i++) {
-				if (key[i] != 0) {
-					V[X] = i;
-					keyPress = true;
-				}
-			}
-			if (!keyPress) {
-				// we didn't receive a key press, skip this cycle and try again (that is, don't advance the pc, just loop back to this opcode again)
-				return;
-			}
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x0015) {
-			unsigned char X = GetX(opcode);
-			delay_timer = V[X];
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x0018) {
-			unsigned char X = GetX(opcode);
-			sound_timer = V[X];
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x001E) {
-			unsigned char X = GetX(opcode);
-			I += V[X];
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x0029) {
-			unsigned char X = GetX(opcode);
-			I = V[X] * 5; // font's are 5 bytes, so we can multiple by 5 to move to the start of the font
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x0033) {
-			unsigned char X = GetX(opcode);
-			memory[I]	= V[X] / 100;
-			memory[I+1]	= (V[X] / 10) % 10;
-			memory[I+2]	= V[X] % 10;
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x0055) {
-			unsigned char X = GetX(opcode);
-			for (unsigned char r = 0; r <= X; r++) {
-				memory[I+r] = V[r];
-			}
-			pc += 2;
-		}
-		else if (submaskedOpcode == 0x0065) {
-			unsigned char X = GetX(opcode);
-			for (unsigned char r = 0; r <= X; r++) {
-				V[r] = memory[I+r];
-			}
-			pc += 2;
-		}
-		else {
-			chip8_unknownOpcode();
+	
+	// Drawing XORs the sprite onto the screen, and any pixel that was already on (screen AND sprite) is a collision.
+	// That's one AND and one XOR per row instead of a branch per pixel.
+	if (y + height <= 32) {
+		// the usual case: the rows are all next to each other, so compilers can do this a few rows at a time with SIMD
+		uint64_t *rows = &m->gfx[y];
+		for (unsigned char yLine = 0; yLine < height; yLine++) {
+			collision |= rows[yLine] & sprite[yLine];
+			rows[yLine] ^= sprite[yLine];
 		}
 	}
 	else {
-		chip8_unknownOpcode();
+		// sprites that run off the bottom of the screen wrap around to the top
+		for (unsigned char yLine = 0; yLine < height; yLine++) {
+			uint64_t *row = &m->gfx[(y + yLine) % 32];
+			collision |= *row & sprite[yLine];
+			*row ^= sprite[yLine];
+		}
 	}
 	
+	VF(m) = (collision != 0);
+	m->needsDisplay = true;
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(EX9E) {
+	unsigned char X = insn->x;
+	m->pc += ((m->keys >> (m->V[X] & 0xF)) & 1) ? 4 : 2;
+}
+
+CHIP8_HANDLER(EXA1) {
+	unsigned char X = insn->x;
+	m->pc += ((m->keys >> (m->V[X] & 0xF)) & 1) ? 2 : 4;
+}
+
+CHIP8_HANDLER(FX07) {
+	unsigned char X = insn->x;
+	m->V[X] = m->delay_timer;
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(FX0A) {
+	unsigned char X = insn->x;
 	
-	// Update Timers
-	static struct timeval lastFireTime = {.tv_sec = 0, .tv_usec = 0};
-	struct timeval currentTime;
-	struct timeval timeDiff;
-	
-	gettimeofday(&currentTime, NULL);
-	timersub(&currentTime, &lastFireTime, &timeDiff);
-	double totalTime = (timeDiff.tv_sec * 1000000.0 + timeDiff.tv_usec) / 1000000.0;
-	
-	if (totalTime >= 1.0/60.0f) {
-		
-		lastFireTime = currentTime;
-		
-		if (delay_timer > 0) {
-			delay_timer--;
-		}
-		
-		if (sound_timer > 0) {
-			NSBeep();
-			sound_timer--;
-		}
+	// the highest key that's down, as the original search from key 0 up to F (which kept the last one it found) left it
+	if (m->keys != 0) {
+		m->V[X] = (unsigned char)(31 - __builtin_clz(m->keys));
+		m->pc += 2;
+		return;
 	}
+	// we didn't receive a key press, skip this cycle and try again (that is, don't advance the pc, just loop back to this opcode again)
 }
 
-void chip8_unknownOpcode() {
-	
-	printf("Unknown opcode: 0x%X at PC: %d\n", opcode, pc);
+CHIP8_HANDLER(FX15) {
+	unsigned char X = insn->x;
+	m->delay_timer = m->V[X];
+	m->pc += 2;
 }
 
-void chip8_keydown(unsigned char k) {
-	
-	switch (k) {
-		case '1':
-			key[0x1] = 1;
-			break;
-		case '2':
-			key[0x2] = 1;
-			break;
-		case '3':
-			key[0x3] = 1;
-			break;
-		case '4':
-			key[0x4] = 1;
-			break;
-		case '5':
-			key[0x5] = 1;
-			break;
-		case '6':
-			key[0x6] = 1;
-			break;
-		case '7':
-			key[0x7] = 1;
-			break;
-		case '8':
-			key[0x8] = 1;
-			break;
-		case '9':
-			key[0x9] = 1;
-			break;
-		case '0':
-			key[0x0] = 1;
-			break;
-		case 'A':
-			key[0xA] = 1;
-			break;
-		case 'B':
-			key[0xB] = 1;
-			break;
-		case 'C':
-			key[0xC] = 1;
-			break;
-		case 'D':
-			key[0xD] = 1;
-			break;
-		case 'E':
-			key[0xE] = 1;
-			break;
-		case 'F':
-			key[0xF] = 1;
-			break;
-		default:
-			printf("Chip8: Unrecognized key");
-			break;
+CHIP8_HANDLER(FX18) {
+	unsigned char X = insn->x;
+	chip8_setSoundTimer(m, m->V[X], m->cycles);
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(FX1E) {
+	unsigned char X = insn->x;
+	m->I += m->V[X];
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(FX29) {
+	unsigned char X = insn->x;
+	m->I = m->V[X] * 5; // font's are 5 bytes, so we can multiple by 5 to move to the start of the font
+	m->pc += 2;
+}
+
+CHIP8_HANDLER(FX33) {
+	unsigned char X = insn->x;
+	unsigned char value = m->V[X];
+	chip8_store(m, m->I,	value / 100);
+	chip8_store(m, m->I+1,	(value / 10) % 10);
+	chip8_store(m, m->I+2,	value % 10);
+	m->pc += 2;
+}
+
+// The VIP moved I along as FX55 and FX65 went, so it ended up just past the last register. CHIP-48 got that one short.
+static inline __attribute__((always_inline)) void chip8_memoryQuirk(chip8_machine *m, unsigned char X, const unsigned int quirks) {
+	if (quirks & CHIP8_QUIRK_MEMORY_I) {
+		m->I += X + 1;
+	}
+	else if (quirks & CHIP8_QUIRK_MEMORY_I_SHORT) {
+		m->I += X;
 	}
 }
 
-void chip8_keyup(unsigned char k) {
-	
-	switch (k) {
-		case '1':
-			key[0x1] = 0;
-			break;
-		case '2':
-			key[0x2] = 0;
-			break;
-		case '3':
-			key[0x3] = 0;
-			break;
-		case '4':
-			key[0x4] = 0;
-			break;
-		case '5':
-			key[0x5] = 0;
-			break;
-		case '6':
-			key[0x6] = 0;
-			break;
-		case '7':
-			key[0x7] = 0;
-			break;
-		case '8':
-			key[0x8] = 0;
-			break;
-		case '9':
-			key[0x9] = 0;
-			break;
-		case '0':
-			key[0x0] = 0;
-			break;
-		case 'A':
-			key[0xA] = 0;
-			break;
-		case 'B':
-			key[0xB] = 0;
-			break;
-		case 'C':
-			key[0xC] = 0;
-			break;
-		case 'D':
-			key[0xD] = 0;
-			break;
-		case 'E':
-			key[0xE] = 0;
-			break;
-		case 'F':
-			key[0xF] = 0;
-			break;
-		default:
-			printf("Chip8: Unrecognized key");
-			break;
+CHIP8_HANDLER(FX55) {
+	unsigned char X = insn->x;
+	for (unsigned char r = 0; r <= X; r++) {
+		chip8_store(m, m->I+r, m->V[r]);
 	}
+	chip8_memoryQuirk(m, X, quirks);
+	m->pc += 2;
 }
 
-bool chip8_needsDisplay() {
-	return _needsDisplay;
+CHIP8_HANDLER(FX65) {
+	unsigned char X = insn->x;
+	for (unsigned char r = 0; r <= X; r++) {
+		m->V[r] = m->memory[MemAddr(m->I+r)];
+	}
+	chip8_memoryQuirk(m, X, quirks);
+	m->pc += 2;
 }
 
-void chip8_setNeedsDisplay(bool needsDisplay) {
-	_needsDisplay = needsDisplay;
+
+
+// Execution
+//
+// The core loop fetches an instruction, then hands it to its op's handler.
+// How we get from the chip8_op to the handler is picked at build time with CHIP8_DISPATCH:
+//
+//	CHIP8_DISPATCH_TABLE	an array of handler function pointers, indexed by chip8_op. Works with any C compiler.
+//	CHIP8_DISPATCH_GOTO		"computed goto" (a GCC/Clang extension). Each handler is inlined under its own label, and every
+//							label ends with its own copy of the fetch/jump. The CPU's branch predictor then learns
+//							what usually follows each instruction, instead of funneling every instruction through one jump.
+//
+// If CHIP8_DISPATCH isn't defined we use computed goto when the compiler supports it.
+// The table is kept for compilers that don't have computed goto. It costs an indirect call per instruction, but most of the
+// time goes into the handlers themselves, and it runs within about 10% of goto (`make bench-dispatch` compares the two).
+//
+// The Decode Cache
+//
+// Programs spend nearly all of their time running the same few loops, so rather than decoding the same opcodes over and over
+// each machine keeps a pre-decoded chip8_insn for every even address in memory (m->decoded). Entries start out as CHIP8_OP_DECODE.
+// The first time one runs it is decoded in place, and from then on the instruction runs straight out of the cache.
+// chip8_store() knocks an entry back to CHIP8_OP_DECODE whenever the memory under it is written, so self-modifying code still works.
+// Instructions at odd addresses are legal but rare, so those are simply decoded every time they run.
+
+#define CHIP8_DISPATCH_TABLE	1
+#define CHIP8_DISPATCH_GOTO		2
+
+#ifndef CHIP8_DISPATCH
+	#if defined(__GNUC__)
+		#define CHIP8_DISPATCH	CHIP8_DISPATCH_GOTO
+	#else
+		#define CHIP8_DISPATCH	CHIP8_DISPATCH_TABLE
+	#endif
+#endif
+
+
+// fetch one opcode from the memory at the given address.
+// In our emulator, data is stored in an array in which each address contains one byte.
+// As one opcode is 2 bytes long, we need to fetch two successive bytes and merge them to get the actual opcode.
+static inline unsigned short chip8_opcodeAt(chip8_machine *m, unsigned short address) {
+	
+	unsigned short opcode;
+	opcode = m->memory[MemAddr(address)];		// get the first byte
+	opcode <<= 8;								// shift the first byte to the left 1 byte (to make room for the 2nd byte)
+	opcode |= m->memory[MemAddr(address + 1)];	// get the 2nd byte
+	
+	return opcode;
+}
+
+// fetch the instruction at the program counter (pc) from the decode cache.
+static inline chip8_insn *chip8_fetch(chip8_machine *m, chip8_insn *scratch) {
+	
+	unsigned short pc = MemAddr(m->pc);
+	
+	if (pc & 1) {
+		chip8_decode(chip8_opcodeAt(m, pc), scratch);
+		return scratch;
+	}
+	return &m->decoded[pc >> 1];
+}
+
+static void chip8_flushDecodeCache(chip8_machine *m) {
+	
+	for (int i = 0; i < 2048; i++) {
+		m->decoded[i].op = CHIP8_OP_DECODE;
+	}
+}
+
+// Timers
+//
+// The timers count down at 60Hz of emulated time rather than wall clock time: tick n happens n/60ths of a second worth of
+// instructions after timerBase. Working each tick out from timerBase (rather than adding clockRate / 60 every time) means
+// clock rates that aren't a multiple of 60 don't drift. All the interpreter has to do per instruction is one compare.
+
+static void chip8_scheduleTimerTick(chip8_machine *m) {
+	
+	m->nextTimerTick = m->timerBase + ((m->timerTicks + 1) * m->clockRate + 59) / 60;
+}
+
+static void chip8_timerTick(chip8_machine *m) {
+	
+	// below 60 instructions per second more than one tick can fall due on the same instruction
+	while (m->cycles >= m->nextTimerTick) {
+		
+		if (m->delay_timer > 0) {
+			m->delay_timer--;
+		}
+		
+		if (m->sound_timer > 0) {
+			chip8_setSoundTimer(m, m->sound_timer - 1, m->nextTimerTick);
+		}
+		
+		m->timerTicks++;
+		chip8_scheduleTimerTick(m);
+	}
+}
+
+// Sets the sound timer, and tells the sound observer if that turns the buzzer on or off (on instruction `cycle`).
+static inline void chip8_setSoundTimer(chip8_machine *m, unsigned char value, unsigned long long cycle) {
+	
+	bool wasOn = (m->sound_timer != 0);
+	m->sound_timer = value;
+	if (m->soundObserver != NULL && wasOn != (value != 0)) {
+		m->soundObserver(m->soundObserverContext, m, cycle, value != 0);
+	}
+}
+
+static inline void chip8_updateTimers(chip8_machine *m) {
+	
+	if (++m->cycles >= m->nextTimerTick) {
+		chip8_timerTick(m);
+	}
+}
+
+typedef void (*chip8_handler)(chip8_machine *m, const chip8_insn *insn);
+
+// chip8_handler_8XY6_VIP() and so on: every handler, once for each quirks profile
+#define CHIP8_HANDLER_FUNC_FOR(profile, flags, name) \
+	static void chip8_handler_##name##_##profile(chip8_machine *m, const chip8_insn *insn) { chip8_op_##name(m, insn, (flags)); }
+#define CHIP8_HANDLER_FUNC(name)				CHIP8_QUIRK_PROFILES(CHIP8_HANDLER_FUNC_FOR, name)
+#define CHIP8_HANDLER_ENTRY_FOR(profile, flags, name)	[CHIP8_QUIRKS_##profile] = chip8_handler_##name##_##profile,
+#define CHIP8_HANDLER_ENTRY(name)				{ CHIP8_QUIRK_PROFILES(CHIP8_HANDLER_ENTRY_FOR, name) },
+
+CHIP8_OPCODES(CHIP8_HANDLER_FUNC)
+
+// indexed by chip8_op, then chip8_quirks
+static const chip8_handler chip8_handlers[CHIP8_OP_COUNT][CHIP8_QUIRKS_COUNT] = {
+	CHIP8_OPCODES(CHIP8_HANDLER_ENTRY)
+};
+
+// Idle Loops
+//
+// Lots of games wait for the delay timer with a loop like this, which does nothing but burn cycles until the timer runs out:
+//
+//		L:	FX07		VX = delay timer
+//			3X00		skip the next instruction if VX == 0
+//			1L			jump back to L
+//
+// and FX0A waits for a key by running itself over and over. Until the timers next count down, the only thing the delay loop
+// changes is the cycle count. FX0A can't stop waiting until a key is pressed, which can't happen in the middle of a run.
+// So rather than emulate every pass around these loops we skip straight ahead: the delay loop to the last pass before the timers
+// tick, FX0A to the end of the run. Either way the machine ends up in exactly the state it would have, only much sooner.
+
+static inline chip8_insn *chip8_insnAt(chip8_machine *m, unsigned short address) {
+	
+	chip8_insn *insn = &m->decoded[address >> 1];
+	if (insn->op == CHIP8_OP_DECODE) {
+		chip8_decodeEntry(m, insn);
+	}
+	return insn;
+}
+
+// the instructions that can start an idle loop
+static inline bool chip8_opMayIdle(unsigned char op) {
+	
+	return op == CHIP8_OP_FX07 || op == CHIP8_OP_FX0A;
+}
+
+// Is the FX07 `insn` at `pc` the start of a delay loop? If it is, *test is the 3XNN or 4XNN that decides whether it goes round again.
+static bool chip8_isDelayLoop(chip8_machine *m, unsigned short pc, const chip8_insn *insn, chip8_insn **test) {
+	
+	if ((pc & 1) || pc > 0xFFA) {
+		return false;
+	}
+	
+	*test = chip8_insnAt(m, pc + 2);
+	chip8_insn *jump = chip8_insnAt(m, pc + 4);
+	if (jump->base != CHIP8_OP_1NNN || jump->nnn != pc || (*test)->x != insn->x) {
+		return false;
+	}
+	return (*test)->base == CHIP8_OP_3XNN || (*test)->base == CHIP8_OP_4XNN;
+}
+
+// insn is the instruction at pc, which hasn't run yet. Returns the number of cycles skipped, which is always less than `cycles`
+// so the caller still gets to run insn itself.
+static unsigned long chip8_skipIdle(chip8_machine *m, const chip8_insn *insn, unsigned long cycles) {
+	
+	unsigned long skip = 0;
+	
+	if (cycles < 2) {
+		return 0;
+	}
+	
+	if (insn->op == CHIP8_OP_FX0A) {
+		
+		if (m->keys != 0) {
+			return 0;
+		}
+		skip = cycles - 1;
+	}
+	else if (insn->op == CHIP8_OP_FX07) {
+		
+		chip8_insn *test;
+		if (!chip8_isDelayLoop(m, m->pc, insn, &test)) {
+			return 0;
+		}
+		
+		// would the loop go around again with the delay timer as it is?
+		bool loops = (test->base == CHIP8_OP_3XNN) ? (m->delay_timer != test->nn) : (m->delay_timer == test->nn);
+		if (!loops) {
+			return 0;
+		}
+		
+		// every pass around the loop that ends before the timers tick is the same, so skip them all
+		unsigned long long passes = (m->nextTimerTick - m->cycles - 1) / 3;
+		if (passes > (cycles - 1) / 3) {
+			passes = (cycles - 1) / 3;
+		}
+		if (passes == 0) {
+			return 0;
+		}
+		skip = (unsigned long)passes * 3;
+		m->V[insn->x] = m->delay_timer;
+	}
+	
+	m->cycles += skip;
+	if (m->cycles >= m->nextTimerTick) {
+		chip8_timerTick(m);
+	}
+	m->idleCycles += skip;
+	
+#if CHIP8_PROFILE
+	// these cycles were spent waiting just as much as if we'd run them, so the profile should still see them
+	if (m->profile != NULL) {
+		chip8_profile_skipped(m, insn->op, skip);
+	}
+#endif
+	return skip;
+}
+
+// the instructions chip8_machine_runUntil() can stop after with CHIP8_RUN_UNTIL_DRAW
+static inline bool chip8_opDraws(unsigned char op) {
+	
+	return op == CHIP8_OP_00E0 || op == CHIP8_OP_DXYN;
+}
+
+// Profiling
+// With CHIP8_PROFILE every instruction counts down to the next sample, which costs one decrement and a branch that's
+// almost never taken. Without a profile attached the countdown starts so high it never gets there. Without CHIP8_PROFILE
+// the samples are taken between runs instead (see chip8_runSampled()).
+#if CHIP8_PROFILE
+	#define CHIP8_PROFILE_INSN(m, insn) \
+		if (--(m)->profileCountdown == 0) { \
+			chip8_profile_sample((m), (insn)->op); \
+		}
+#else
+	#define CHIP8_PROFILE_INSN(m, insn)
+#endif
+
+// Superinstructions
+//
+// ROMs are full of the same short sequences: a skip and a jump back to the top of a loop, a key test and a jump, loading I
+// and drawing. When the decode cache decodes an instruction that starts one of the sequences in CHIP8_FUSIONS, it gives the
+// entry a superinstruction op instead, which runs the whole sequence in one go. That saves a dispatch per instruction,
+// and lets the compiler optimise the handlers together.
+//
+// Every instruction in the sequence still runs through its own handler, with its own operands out of the decode cache
+// entries that follow, so VF and everything else behaves exactly as before. To keep the rest of the machine unable to tell:
+//
+//	- the timers don't change during a superinstruction, so none of them use the timers (FX07, FX15, FX18) or wait (FX0A),
+//	  and the cycle count and timer ticks are brought up to date at the end, just as if they'd happened one at a time
+//	- a superinstruction only runs if the run has enough cycles left for all of it, otherwise just its first instruction runs
+//	- if an instruction doesn't carry on to the next one (a skip, say), the superinstruction stops there
+//	- only the last instruction may draw (so stopping after a draw still works) or store to memory (so nothing in the
+//	  sequence can be written over while it runs)
+//
+// Build with CHIP8_FUSE=0 to turn them off. They're off in profiling builds, so profiles count every instruction.
+
+#ifndef CHIP8_FUSE
+	#define CHIP8_FUSE	!CHIP8_PROFILE
+#endif
+
+// the instructions that don't always carry on to the next one
+static inline bool chip8_opBranches(unsigned char op) {
+	
+	switch (op) {
+		case CHIP8_OP_UNKNOWN:
+		case CHIP8_OP_00EE:
+		case CHIP8_OP_1NNN:
+		case CHIP8_OP_2NNN:
+		case CHIP8_OP_3XNN:
+		case CHIP8_OP_4XNN:
+		case CHIP8_OP_5XY0:
+		case CHIP8_OP_9XY0:
+		case CHIP8_OP_BNNN:
+		case CHIP8_OP_EX9E:
+		case CHIP8_OP_EXA1:
+		case CHIP8_OP_FX0A:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Runs instruction i of a superinstruction, and returns early (with the number run) if it went anywhere but the next one.
+// All of the tests are constants, so only the handler calls and the checks after branches are left.
+#define CHIP8_FUSED_STEP(name, i, length) \
+	if ((i) < (length)) { \
+		chip8_op_##name(m, &insn[i], quirks); \
+		if ((i) + 1 < (length) && chip8_opBranches(CHIP8_OP_##name) && m->pc != start + 2 * ((i) + 1)) { \
+			return (i) + 1; \
+		} \
+	}
+
+// chip8_fused_7XNN_3XNN_1NNN() and so on run a superinstruction starting at insn (which is in the decode cache, so the
+// instructions after it are at insn[1], insn[2] ...) and return the number of instructions run.
+#define CHIP8_FUSED_FUNC(name, length, a, b, c, d) \
+	static inline __attribute__((always_inline)) unsigned int chip8_fused_##name(chip8_machine *m, const chip8_insn *insn, const unsigned int quirks) { \
+		unsigned short start = m->pc; \
+		CHIP8_FUSED_STEP(a, 0, length) \
+		CHIP8_FUSED_STEP(b, 1, length) \
+		CHIP8_FUSED_STEP(c, 2, length) \
+		CHIP8_FUSED_STEP(d, 3, length) \
+		return (length); \
+	}
+
+CHIP8_FUSIONS(CHIP8_FUSED_FUNC)
+
+typedef struct chip8_fusion {
+	unsigned char	length;
+	unsigned char	ops[CHIP8_FUSED_LONGEST];
+	bool			draws;		// the last instruction draws
+	const char		*name;
+} chip8_fusion;
+
+#define CHIP8_FUSED_LAST(length, a, b, c, d)	((length) == 2 ? CHIP8_OP_##b : (length) == 3 ? CHIP8_OP_##c : CHIP8_OP_##d)
+
+#define CHIP8_FUSION_ENTRY(name, length, a, b, c, d) \
+	{ length, { CHIP8_OP_##a, CHIP8_OP_##b, CHIP8_OP_##c, CHIP8_OP_##d }, \
+	  CHIP8_FUSED_LAST(length, a, b, c, d) == CHIP8_OP_00E0 || CHIP8_FUSED_LAST(length, a, b, c, d) == CHIP8_OP_DXYN, #name },
+
+static const chip8_fusion chip8_fusions[] = {
+	CHIP8_FUSIONS(CHIP8_FUSION_ENTRY)
+};
+
+_Static_assert(CHIP8_FUSION_COUNT <= CHIP8_FUSIONS_MAX, "CHIP8_FUSIONS_MAX is too small");
+_Static_assert(CHIP8_OP_LIMIT <= 256, "chip8_insn.op is a byte");
+
+#if CHIP8_FUSE
+// The decode cache entry for an instruction that a superinstruction starting before it would run. A superinstruction runs
+// these straight out of the cache, so their operands are decoded, but op stays CHIP8_OP_DECODE until the entry is decoded
+// for itself. That way every entry gets its own chance to start a superinstruction, whichever one was decoded first.
+static inline const chip8_insn *chip8_peekEntry(chip8_machine *m, unsigned short address) {
+	
+	chip8_insn *insn = &m->decoded[address >> 1];
+	if (insn->op == CHIP8_OP_DECODE) {
+		chip8_decode(chip8_opcodeAt(m, address), insn);
+		insn->op = CHIP8_OP_DECODE;
+	}
+	return insn;
+}
+#endif
+
+// Decodes a decode cache entry, turning it into a superinstruction if it starts one. Every path that fills in the cache
+// (running, single stepping, looking for idle loops) comes through here, so they all fuse the same way.
+static void chip8_decodeEntry(chip8_machine *m, chip8_insn *insn) {
+	
+	unsigned short address = (unsigned short)((insn - m->decoded) * 2);
+	chip8_decode(chip8_opcodeAt(m, address), insn);
+	
+#if CHIP8_FUSE
+	for (int f = 0; f < CHIP8_FUSION_COUNT; f++) {
+		const chip8_fusion *fusion = &chip8_fusions[f];
+		if (fusion->ops[0] != insn->base || address + 2 * fusion->length > 4096) {
+			continue;
+		}
+		
+		bool matches = true;
+		for (int i = 1; i < fusion->length && matches; i++) {
+			matches = chip8_peekEntry(m, address + 2 * i)->base == fusion->ops[i];
+		}
+		if (matches) {
+			insn->op = CHIP8_OP_FUSED_FIRST + f;
+			return;
+		}
+	}
+#endif
+}
+
+// chip8_interpret_CLASSIC() and so on: the interpreter, once for each quirks profile (see Quirks above).
+// Each one is written out by CHIP8_INTERPRETER(profile, flags), which has `quirks` in scope as a constant.
+
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_TABLE
+
+#define CHIP8_FUSED_CASE(name, length, a, b, c, d) \
+	case CHIP8_OP_##name: \
+		ran = chip8_fused_##name(m, insn, quirks); \
+		break;
+
+static inline __attribute__((always_inline)) unsigned int chip8_runFused(chip8_machine *m, const chip8_insn *insn, unsigned char op, const unsigned int quirks) {
+	
+	unsigned int ran = 1;
+	switch (op) {
+		CHIP8_FUSIONS(CHIP8_FUSED_CASE)
+	}
+	m->fusedRuns[op - CHIP8_OP_FUSED_FIRST]++;
+	m->fusedCycles += ran;
+	return ran;
+}
+
+#define CHIP8_INTERPRETER(profile, flags, unused) \
+static unsigned long chip8_interpret_##profile(chip8_machine *m, unsigned long cycles, bool *drew) { \
+	\
+	const unsigned int quirks = (flags); \
+	chip8_insn scratch; \
+	\
+	for (unsigned long executed = 0; executed < cycles; executed++) { \
+		chip8_insn *insn = chip8_fetch(m, &scratch); \
+		if (insn->op == CHIP8_OP_DECODE) { \
+			chip8_decodeEntry(m, insn); \
+		} \
+		unsigned char op = insn->op; \
+		\
+		if (op >= CHIP8_OP_FUSED_FIRST) { \
+			const chip8_fusion *fusion = &chip8_fusions[op - CHIP8_OP_FUSED_FIRST]; \
+			if (cycles - executed >= fusion->length) { \
+				unsigned int ran = chip8_runFused(m, insn, op, quirks); \
+				m->cycles += ran - 1; \
+				executed += ran - 1; \
+				chip8_updateTimers(m); \
+				\
+				if (drew != NULL && fusion->draws && ran == fusion->length) { \
+					*drew = true; \
+					return executed + 1; \
+				} \
+				continue; \
+			} \
+			op = insn->base; \
+		} \
+		\
+		if (chip8_opMayIdle(op)) { \
+			executed += chip8_skipIdle(m, insn, cycles - executed); \
+		} \
+		CHIP8_PROFILE_INSN(m, insn); \
+		chip8_handlers[op][CHIP8_QUIRKS_##profile](m, insn); \
+		chip8_updateTimers(m); \
+		\
+		if (drew != NULL && chip8_opDraws(op)) { \
+			*drew = true; \
+			return executed + 1; \
+		} \
+	} \
+	return cycles; \
+}
+
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_GOTO
+
+#define CHIP8_LABEL_ENTRY(name)		&&op_##name,
+#define CHIP8_LABEL_BODY(name)		op_##name: CHIP8_SKIP_IDLE(name); CHIP8_PROFILE_INSN(m, insn); chip8_op_##name(m, insn, quirks); chip8_updateTimers(m); CHIP8_STOP_ON_DRAW(name); CHIP8_NEXT();
+
+// chip8_opDraws() is a constant for every label, so this disappears from all the handlers except 00E0 and DXYN
+#define CHIP8_STOP_ON_DRAW(name) \
+	if (chip8_opDraws(CHIP8_OP_##name) && drew != NULL) { \
+		*drew = true; \
+		return executed + 1; \
+	}
+
+// likewise this is only there for FX07 and FX0A
+#define CHIP8_SKIP_IDLE(name) \
+	if (chip8_opMayIdle(CHIP8_OP_##name)) { \
+		executed += chip8_skipIdle(m, insn, cycles - executed); \
+	}
+
+// a superinstruction runs its whole sequence if there's room, or falls back to the handler for its first instruction
+#define CHIP8_FUSED_LABEL_ENTRY(name, length, a, b, c, d)		&&op_##name,
+#define CHIP8_FUSED_LABEL_BODY(name, length, a, b, c, d) \
+	op_##name: \
+		if (cycles - executed < (length)) { \
+			goto *labels[insn->base]; \
+		} \
+		{ \
+			unsigned int ran = chip8_fused_##name(m, insn, quirks); \
+			m->fusedRuns[CHIP8_OP_##name - CHIP8_OP_FUSED_FIRST]++; \
+			m->fusedCycles += ran; \
+			m->cycles += ran - 1; \
+			executed += ran - 1; \
+			chip8_updateTimers(m); \
+			if (chip8_fusions[CHIP8_OP_##name - CHIP8_OP_FUSED_FIRST].draws && ran == (length) && drew != NULL) { \
+				*drew = true; \
+				return executed + 1; \
+			} \
+		} \
+		CHIP8_NEXT();
+
+// fetch the next instruction and jump straight to its handler (or stop if we've run enough cycles)
+#define CHIP8_NEXT() \
+	if (++executed == cycles) { \
+		return cycles; \
+	} \
+	insn = chip8_fetch(m, &scratch); \
+	goto *labels[insn->op];
+
+#define CHIP8_INTERPRETER(profile, flags, unused) \
+static unsigned long chip8_interpret_##profile(chip8_machine *m, unsigned long cycles, bool *drew) { \
+	\
+	static const void *labels[CHIP8_OP_LIMIT] = { \
+		CHIP8_OPCODES(CHIP8_LABEL_ENTRY) \
+		&&op_DECODE, \
+		CHIP8_FUSIONS(CHIP8_FUSED_LABEL_ENTRY) \
+	}; \
+	\
+	if (cycles == 0) { \
+		return 0; \
+	} \
+	\
+	const unsigned int quirks = (flags); \
+	unsigned long executed = 0; \
+	chip8_insn scratch; \
+	chip8_insn *insn = chip8_fetch(m, &scratch); \
+	goto *labels[insn->op]; \
+	\
+	/* this cache entry is empty (or was written over), so decode it and then run it. This doesn't count as a cycle. */ \
+	/* (an odd pc never gets here, its instruction is decoded into scratch by chip8_fetch()) */ \
+op_DECODE: \
+	chip8_decodeEntry(m, insn); \
+	goto *labels[insn->op]; \
+	\
+	CHIP8_OPCODES(CHIP8_LABEL_BODY) \
+	CHIP8_FUSIONS(CHIP8_FUSED_LABEL_BODY) \
+}
+
+#else
+	#error "Unknown CHIP8_DISPATCH"
+#endif
+
+typedef unsigned long (*chip8_interpreter)(chip8_machine *m, unsigned long cycles, bool *drew);
+
+#define CHIP8_INTERPRETER_ENTRY(profile, flags, unused)	[CHIP8_QUIRKS_##profile] = chip8_interpret_##profile,
+
+CHIP8_QUIRK_PROFILES(CHIP8_INTERPRETER, _)
+
+static const chip8_interpreter chip8_interpreters[CHIP8_QUIRKS_COUNT] = {
+	CHIP8_QUIRK_PROFILES(CHIP8_INTERPRETER_ENTRY, _)
+};
+
+// Runs the machine on the copy of the interpreter for its quirks. That's the only time the quirks are looked at.
+static inline unsigned long chip8_interpret(chip8_machine *m, unsigned long cycles, bool *drew) {
+	
+	return chip8_interpreters[m->quirks](m, cycles, drew);
+}
+
+// Runs the machine on its engine.
+static inline unsigned long chip8_runEngine(chip8_machine *m, unsigned long cycles, bool *drew) {
+	
+	if (m->jit != NULL) {
+		return chip8_jit_run(m, cycles, drew);
+	}
+	if (m->aot != NULL) {
+		return chip8_aot_run(m, cycles, drew);
+	}
+	return chip8_interpret(m, cycles, drew);
+}
+
+// ... and takes the profile's samples, when the interpreter doesn't (see Profiling above). The run is split where each
+// sample is due and the instruction at pc is sampled in between, so every engine runs at full speed (superinstructions,
+// translated code, idle loops and all) up to the sample. With no profile attached it costs one test a run.
+static unsigned long chip8_runSampled(chip8_machine *m, unsigned long cycles, bool *drew) {
+	
+#if !CHIP8_PROFILE
+	if (m->profile != NULL) {
+		unsigned long ran = 0;
+		while (ran < cycles) {
+			unsigned long batch = (cycles - ran < m->profileCountdown) ? cycles - ran : (unsigned long)m->profileCountdown;
+			unsigned long batchRan = chip8_runEngine(m, batch, drew);
+			ran += batchRan;
+			m->profileCountdown -= batchRan;
+			if (m->profileCountdown == 0) {
+				chip8_insn scratch;
+				chip8_insn *insn = chip8_fetch(m, &scratch);
+				if (insn->op == CHIP8_OP_DECODE) {
+					chip8_decodeEntry(m, insn);
+				}
+				chip8_profile_sample(m, insn->base);
+			}
+			if (batchRan < batch || (drew != NULL && *drew)) {
+				break;
+			}
+		}
+		return ran;
+	}
+#endif
+	return chip8_runEngine(m, cycles, drew);
+}
+
+unsigned long chip8_machine_run(chip8_machine *m, unsigned long cycles) {
+	
+	return chip8_runSampled(m, cycles, NULL);
+}
+
+chip8_stop chip8_machine_runUntil(chip8_machine *m, unsigned long cycles, unsigned int until, unsigned long *executed) {
+	
+	// A frame ends when the timers count down, and we know exactly how many instructions away that is,
+	// so stopping there is just a matter of asking for fewer cycles. Stopping after a draw needs help from the engine.
+	bool toFrameEnd = false;
+	if (until & CHIP8_RUN_UNTIL_FRAME) {
+		unsigned long long untilTick = m->nextTimerTick - m->cycles;
+		if (untilTick <= cycles) {
+			cycles = (unsigned long)untilTick;
+			toFrameEnd = true;
+		}
+	}
+	
+	bool drew = false;
+	bool *stopOnDraw = (until & CHIP8_RUN_UNTIL_DRAW) ? &drew : NULL;
+	unsigned long ran = chip8_runSampled(m, cycles, stopOnDraw);
+	
+	if (executed != NULL) {
+		*executed = ran;
+	}
+	
+	// if the last instruction of the frame drew, report the end of the frame so callers looping on frames don't run past it
+	if (toFrameEnd && ran == cycles) {
+		return CHIP8_STOP_FRAME;
+	}
+	return drew ? CHIP8_STOP_DRAW : CHIP8_STOP_CYCLES;
+}
+
+unsigned long chip8_machine_runFrame(chip8_machine *m) {
+	
+	unsigned long executed;
+	chip8_machine_runUntil(m, ULONG_MAX, CHIP8_RUN_UNTIL_FRAME, &executed);
+	return executed;
+}
+
+void chip8_machine_step(chip8_machine *m) {
+	
+	chip8_machine_run(m, 1);
+}
+
+void chip8_machine_execute(chip8_machine *m) {
+	
+	chip8_insn scratch;
+	chip8_insn *insn = chip8_fetch(m, &scratch);
+	if (insn->op == CHIP8_OP_DECODE) {
+		chip8_decodeEntry(m, insn);
+	}
+	chip8_handlers[insn->base][m->quirks](m, insn);	// just this one instruction, even if it starts a superinstruction
+}
+
+void chip8_machine_setSoundTimer(chip8_machine *m, unsigned char value, unsigned long ahead) {
+	
+	chip8_setSoundTimer(m, value, m->cycles + ahead);
+}
+
+void chip8_machine_advance(chip8_machine *m, unsigned long cycles) {
+	
+	m->cycles += cycles;
+	if (m->cycles >= m->nextTimerTick) {
+		chip8_timerTick(m);
+	}
+	
+#if CHIP8_PROFILE
+	// other engines can only tell us how far they got, so the sample lands on wherever they stopped
+	if (cycles >= m->profileCountdown) {
+		chip8_insn scratch;
+		chip8_insn *insn = chip8_fetch(m, &scratch);
+		if (insn->op == CHIP8_OP_DECODE) {
+			chip8_decodeEntry(m, insn);
+		}
+		m->profileCountdown = 1;
+		CHIP8_PROFILE_INSN(m, insn);
+	}
+	else {
+		m->profileCountdown -= cycles;
+	}
+#endif
+}
+
+unsigned long chip8_machine_skipIdle(chip8_machine *m, unsigned long cycles) {
+	
+	chip8_insn scratch;
+	chip8_insn *insn = chip8_fetch(m, &scratch);
+	if (insn->op == CHIP8_OP_DECODE) {
+		chip8_decodeEntry(m, insn);
+	}
+	
+	if (!chip8_opMayIdle(insn->op)) {
+		return 0;
+	}
+	return chip8_skipIdle(m, insn, cycles);
+}
+
+bool chip8_machine_idleLoopAt(chip8_machine *m, unsigned short address) {
+	
+	if ((address & 1) || address > 0xFFE) {
+		return false;
+	}
+	chip8_insn *insn = chip8_insnAt(m, address);
+	chip8_insn *test;
+	return insn->op == CHIP8_OP_FX0A || (insn->op == CHIP8_OP_FX07 && chip8_isDelayLoop(m, address, insn, &test));
+}
+
+#define CHIP8_OP_NAME(name)		#name,
+
+const char *chip8_machine_opName(unsigned char op) {
+	
+	static const char *names[CHIP8_OP_COUNT] = {
+		CHIP8_OPCODES(CHIP8_OP_NAME)
+	};
+	if (op >= CHIP8_OP_FUSED_FIRST && op < CHIP8_OP_LIMIT) {
+		return chip8_fusions[op - CHIP8_OP_FUSED_FIRST].name;
+	}
+	return (op < CHIP8_OP_COUNT) ? names[op] : NULL;
+}
+
+unsigned int chip8_machine_fusionCount() {
+	
+	return CHIP8_FUSION_COUNT;
+}
+
+const char *chip8_machine_fusionName(unsigned int fusion) {
+	
+	return (fusion < CHIP8_FUSION_COUNT) ? chip8_fusions[fusion].name : NULL;
+}
+
+const char *chip8_machine_dispatchName() {
+	
+	return (CHIP8_DISPATCH == CHIP8_DISPATCH_GOTO) ? "goto" : "table";
+}
+
+void chip8_machine_setClockRate(chip8_machine *m, unsigned int instructionsPerSecond) {
+	
+	if (instructionsPerSecond == 0) {
+		instructionsPerSecond = 1;
+	}
+	
+	// start counting ticks again from here at the new rate
+	m->clockRate = instructionsPerSecond;
+	m->timerBase = m->cycles;
+	m->timerTicks = 0;
+	chip8_scheduleTimerTick(m);
+}
+
+void chip8_machine_setQuirks(chip8_machine *m, chip8_quirks quirks) {
+	
+	if ((unsigned int)quirks >= CHIP8_QUIRKS_COUNT || quirks == m->quirks) {
+		return;
+	}
+	m->quirks = (unsigned char)quirks;
+	
+	// the decode cache doesn't care (it's the same for every profile) but translated code does
+	if (m->jit != NULL) {
+		chip8_jit_invalidate(m->jit);
+	}
+	chip8_aot_invalidate(m->aot);
+}
+
+// ROMs whose profile we know, by the FNV-1a hash of the whole ROM. The heuristic in chip8_machine_quirksForROM() is only for the rest.
+// The ROMs that come with the emulator are VIP programs, but they have always run (and been recorded) on CLASSIC, and they
+// run properly on it, so they stay there.
+static const struct {
+	
+	unsigned long long	hash;
+	chip8_quirks		quirks;
+	
+} chip8_knownROMs[] = {
+	{ 0xC86E8FF63FCE668CULL, CHIP8_QUIRKS_CLASSIC },	// BRIX
+	{ 0xADF99268DB3C3BC9ULL, CHIP8_QUIRKS_CLASSIC },	// CONNECT4
+	{ 0x25E96E1086CE43CBULL, CHIP8_QUIRKS_CLASSIC },	// MAZE
+	{ 0x624B3EED64313F42ULL, CHIP8_QUIRKS_CLASSIC },	// PONG
+	{ 0xE59FD57FA44ECB40ULL, CHIP8_QUIRKS_CLASSIC },	// PUZZLE
+	{ 0x56049E83866B207DULL, CHIP8_QUIRKS_CLASSIC },	// TICTACTOE
+};
+
+static unsigned long long chip8_hashROM(const unsigned char *rom, size_t size) {
+	
+	unsigned long long hash = 0xCBF29CE484222325ULL;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ rom[i]) * 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+chip8_quirks chip8_machine_quirksForROM(const unsigned char *rom, size_t size) {
+	
+	unsigned long long hash = chip8_hashROM(rom, size);
+	for (size_t i = 0; i < sizeof(chip8_knownROMs) / sizeof(chip8_knownROMs[0]); i++) {
+		if (chip8_knownROMs[i].hash == hash) {
+			return chip8_knownROMs[i].quirks;
+		}
+	}
+	
+	// SUPER-CHIP programs nearly always switch modes or scroll with one of its 00FX instructions somewhere.
+	// Only look at even addresses, where instructions usually are, so sprite data is less likely to fool us.
+	for (size_t i = 0; i + 1 < size; i += 2) {
+		if (rom[i] == 0x00 && (rom[i + 1] == 0xFE || rom[i + 1] == 0xFF || rom[i + 1] == 0xFB || rom[i + 1] == 0xFC)) {
+			return CHIP8_QUIRKS_SCHIP;
+		}
+	}
+	return CHIP8_QUIRKS_CLASSIC;
+}
+
+#define CHIP8_QUIRKS_FLAGS(profile, flags, unused)	[CHIP8_QUIRKS_##profile] = (flags),
+
+unsigned int chip8_machine_quirkFlags(chip8_quirks quirks) {
+	
+	static const unsigned int flags[CHIP8_QUIRKS_COUNT] = {
+		CHIP8_QUIRK_PROFILES(CHIP8_QUIRKS_FLAGS, _)
+	};
+	return ((unsigned int)quirks < CHIP8_QUIRKS_COUNT) ? flags[quirks] : 0;
+}
+
+const char *chip8_machine_quirksName(chip8_quirks quirks) {
+	
+	static const char *names[CHIP8_QUIRKS_COUNT] = {
+		[CHIP8_QUIRKS_CLASSIC]	= "classic",
+		[CHIP8_QUIRKS_VIP]		= "vip",
+		[CHIP8_QUIRKS_CHIP48]	= "chip48",
+		[CHIP8_QUIRKS_SCHIP]	= "schip",
+	};
+	return ((unsigned int)quirks < CHIP8_QUIRKS_COUNT) ? names[quirks] : NULL;
+}
+
+// Forking
+//
+// The emulated state is one contiguous block at the top of chip8_machine, so copying it is one memcpy. The clone's
+// decode cache (and JIT) only has to forget the addresses whose memory actually changes, which when forking the same
+// machine over and over is usually none of the code.
+
+#define CHIP8_STATE_BEGIN	offsetof(chip8_machine, memory)
+#define CHIP8_STATE_END		offsetof(chip8_machine, needsDisplay)
+
+void chip8_machine_fork(const chip8_machine *m, chip8_machine *clone) {
+	
+	if (clone == m) {
+		return;
+	}
+	
+	// compare a page at a time (memcmp is about as fast as it gets), and only go looking for the changes in pages that differ
+	bool codeChanged = false;
+	for (int page = 0; page < 4096; page += 256) {
+		
+		if (memcmp(&m->memory[page], &clone->memory[page], 256) == 0) {
+			continue;
+		}
+		
+		for (int address = page; address < page + 256; address += 2) {
+			if (m->memory[address] != clone->memory[address] || m->memory[address + 1] != clone->memory[address + 1]) {
+				chip8_forgetDecoded(clone, address);
+				if (clone->jitCodeMap != NULL) {
+					codeChanged |= (clone->jitCodeMap[address] | clone->jitCodeMap[address + 1]) != 0;
+				}
+				if (clone->aotCodeMap != NULL) {
+					codeChanged |= (clone->aotCodeMap[address] | clone->aotCodeMap[address + 1]) != 0;
+				}
+			}
+		}
+	}
+	
+	// translated code is only right for the quirks it was translated with
+	codeChanged |= (clone->quirks != m->quirks);
+	
+	memcpy((unsigned char *)clone + CHIP8_STATE_BEGIN, (const unsigned char *)m + CHIP8_STATE_BEGIN, CHIP8_STATE_END - CHIP8_STATE_BEGIN);
+	
+	if (codeChanged) {
+		if (clone->jit != NULL) {
+			chip8_jit_invalidate(clone->jit);
+		}
+		chip8_aot_invalidate(clone->aot);
+	}
+	clone->needsDisplay = true;
+}
+
+chip8_machine *chip8_machine_clone(const chip8_machine *m) {
+	
+	chip8_machine *clone = chip8_machine_create();
+	if (clone != NULL) {
+		chip8_machine_fork(m, clone);
+	}
+	return clone;
+}
+
+bool chip8_machine_setEngine(chip8_machine *m, chip8_engine engine) {
+	
+	chip8_jit_destroy(m->jit);
+	m->jit = NULL;
+	chip8_aot_destroy(m->aot);
+	m->aot = NULL;
+	
+	if (engine == CHIP8_ENGINE_INTERPRETER) {
+		return true;
+	}
+	if (engine == CHIP8_ENGINE_AOT) {
+		return false;	// see chip8_machine_setProgram()
+	}
+	
+	m->jit = chip8_jit_create(m, engine == CHIP8_ENGINE_JIT_VALIDATE);
+	return m->jit != NULL;
+}
+
+bool chip8_machine_setProgram(chip8_machine *m, const chip8_aot_program *program) {
+	
+	chip8_machine_setEngine(m, CHIP8_ENGINE_INTERPRETER);
+	if (program == NULL) {
+		return true;
+	}
+	if (program->quirks != m->quirks) {
+		return false;	// it was translated for another profile
+	}
+	
+	m->aot = chip8_aot_create(m, program);
+	return m->aot != NULL;
+}
+
+void chip8_machine_invalidate(chip8_machine *m, unsigned short address, unsigned short length) {
+	
+	for (unsigned int i = 0; i < length; i++) {
+		chip8_forgetDecoded(m, address + i);
+	}
+	if (m->jit != NULL) {
+		chip8_jit_invalidate(m->jit);
+	}
+	chip8_aot_invalidate(m->aot);
+}
+
+
+static void chip8_unknownOpcode(chip8_machine *m) {
+	
+	printf("Unknown opcode: 0x%X at PC: %d\n", chip8_opcodeAt(m, m->pc), m->pc);
+}
+
+// Maps a keypad character ('0'-'9', 'A'-'F') to its bit in the key mask, or -1 if it isn't a keypad key.
+int chip8_keyIndex(unsigned char k) {
+	
+	if (k >= '0' && k <= '9') {
+		return k - '0';
+	}
+	if (k >= 'A' && k <= 'F') {
+		return k - 'A' + 0xA;
+	}
+	return -1;
+}
+
+void chip8_machine_keydown(chip8_machine *m, unsigned char k) {
+	
+	int index = chip8_keyIndex(k);
+	if (index < 0) {
+		printf("Chip8: Unrecognized key");
+		return;
+	}
+	if (m->keyObserver != NULL) {
+		m->keyObserver(m->keyObserverContext, m, k, true);
+	}
+	m->keys |= (uint16_t)(1 << index);
+}
+
+void chip8_machine_keyup(chip8_machine *m, unsigned char k) {
+	
+	int index = chip8_keyIndex(k);
+	if (index < 0) {
+		printf("Chip8: Unrecognized key");
+		return;
+	}
+	if (m->keyObserver != NULL) {
+		m->keyObserver(m->keyObserverContext, m, k, false);
+	}
+	m->keys &= (uint16_t)~(1 << index);
+}
+
+void chip8_machine_setKeys(chip8_machine *m, uint16_t keys) {
+	
+	uint16_t changed = m->keys ^ keys;
+	while (changed != 0) {
+		int index = __builtin_ctz(changed);
+		changed &= changed - 1;
+		
+		unsigned char k = "0123456789ABCDEF"[index];
+		if ((keys >> index) & 1) {
+			chip8_machine_keydown(m, k);
+		}
+		else {
+			chip8_machine_keyup(m, k);
+		}
+	}
+}
+
+void chip8_machine_setKeyObserver(chip8_machine *m, chip8_keyObserver observer, void *context) {
+	
+	m->keyObserver = observer;
+	m->keyObserverContext = context;
+}
+
+void chip8_machine_setSoundObserver(chip8_machine *m, chip8_soundObserver observer, void *context) {
+	
+	m->soundObserver = observer;
+	m->soundObserverContext = context;
+}
+
+void chip8_machine_seed(chip8_machine *m, unsigned int seed) {
+	
+	// xorshift would return 0 forever from 0, so that seed gets swapped for another one (any non-zero seed is its own state,
+	// which is how a recording can restart the generator from wherever it had got to)
+	m->rngState = (seed != 0) ? seed : 0x6D2B79F5u;
+}
+
+
+
+// Display
+
+uint32_t chip8_machine_dirtyRows(const chip8_machine *m) {
+	
+	uint32_t rows = 0;
+	for (int row = 0; row < 32; row++) {
+		if (m->gfx[row] != m->presentedGfx[row]) {
+			rows |= (uint32_t)1 << row;
+		}
+	}
+	return rows;
+}
+
+uint32_t chip8_machine_dirtyTiles(const chip8_machine *m) {
+	
+	return chip8_dirtyTilesBetween(m->gfx, m->presentedGfx);
+}
+
+uint32_t chip8_dirtyTilesBetween(const uint64_t screen[32], const uint64_t shown[32]) {
+	
+	uint32_t tiles = 0;
+	for (int tileRow = 0; tileRow < 4; tileRow++) {
+		
+		// every pixel that changed anywhere in this band of 8 rows
+		uint64_t changed = 0;
+		for (int row = tileRow * 8; row < tileRow * 8 + 8; row++) {
+			changed |= screen[row] ^ shown[row];
+		}
+		
+		// the leftmost tile is the top byte
+		for (int tileCol = 0; tileCol < 8; tileCol++) {
+			if ((changed >> (56 - tileCol * 8)) & 0xFF) {
+				tiles |= (uint32_t)1 << (tileRow * 8 + tileCol);
+			}
+		}
+	}
+	return tiles;
+}
+
+void chip8_machine_clearDirty(chip8_machine *m) {
+	
+	memcpy(m->presentedGfx, m->gfx, sizeof(m->gfx));
+}
+
+bool chip8_machine_pixel(const chip8_machine *m, unsigned char col, unsigned char row) {
+	
+	return (m->gfx[row % 32] >> (63 - col % 64)) & 1;
+}
+
+void chip8_machine_expandDisplay(const chip8_machine *m, unsigned char pixels[32][64]) {
+	
+	for (int row = 0; row < 32; row++) {
+		uint64_t bits = m->gfx[row];
+		for (int col = 0; col < 64; col++) {
+			pixels[row][col] = (bits >> (63 - col)) & 1;
+		}
+	}
+}
+
+
+// Clock
+
+uint64_t chip8_now() {
+	
+#if defined(__APPLE__)
+	// the clock NSEvent uses, which stops while the Mac is asleep. clock_gettime_nsec_np() reads the same clock, but only
+	// from 10.12 on, and the app still runs on 10.10
+	static mach_timebase_info_data_t timebase;
+	if (timebase.denom == 0) {
+		mach_timebase_info(&timebase);
+	}
+	return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+void chip8_latency_count(chip8_latency *l, uint64_t nanoseconds) {
+	
+	if (l->count == 0 || nanoseconds < l->min) {
+		l->min = nanoseconds;
+	}
+	if (nanoseconds > l->max) {
+		l->max = nanoseconds;
+	}
+	l->last = nanoseconds;
+	l->total += nanoseconds;
+	l->count++;
+}
+
+double chip8_latency_mean(const chip8_latency *l) {
+	
+	return (l->count != 0) ? (double)l->total / l->count : 0;
+}
+
+
+// Single Machine API
+
+chip8_machine *chip8_sharedMachine() {
+	
+	// a machine that's never been reset has no clock rate (and a decode cache of zeros), so it's reset on first use, before a ROM is loaded
+	if (chip8_shared.clockRate == 0) {
+		chip8_machine_reset(&chip8_shared);
+	}
+	return &chip8_shared;
+}
+
+void chip8_loadROM(const char *romPath) {
+	chip8_machine_loadROM(chip8_sharedMachine(), romPath);
+}
+
+void chip8_step() {
+	chip8_machine_step(chip8_sharedMachine());
+}
+
+unsigned long chip8_run(unsigned long cycles) {
+	return chip8_machine_run(chip8_sharedMachine(), cycles);
+}
+
+unsigned long chip8_runFrame() {
+	return chip8_machine_runFrame(chip8_sharedMachine());
+}
+
+void chip8_keydown(unsigned char k) {
+	chip8_machine_keydown(chip8_sharedMachine(), k);
+}
+
+void chip8_keyup(unsigned char k) {
+	chip8_machine_keyup(chip8_sharedMachine(), k);
+}
+
+bool chip8_needsDisplay() {
+	return chip8_sharedMachine()->needsDisplay;
+}
+
+void chip8_setNeedsDisplay(bool needsDisplay) {
+	chip8_sharedMachine()->needsDisplay = needsDisplay;
+}
+
+uint32_t chip8_dirtyTiles() {
+	return chip8_machine_dirtyTiles(chip8_sharedMachine());
+}
+
+void chip8_clearDirty() {
+	chip8_machine_clearDirty(chip8_sharedMachine());
 }
@@ -12,13 +12,282 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include <sys/time.h>
 
 
+#define CHIP8_DEFAULT_CLOCK_RATE	800		// instructions per second, unless chip8_machine_setClockRate() says otherwise
+
+// Build with CHIP8_PROFILE=1 to have the interpreter check for a profile sample on every instruction (see Chip8Profile.h), which
+// makes exact profiles cheap but turns superinstructions off. Without it, profiles are sampled between runs.
+#ifndef CHIP8_PROFILE
+	#define CHIP8_PROFILE	0
+#endif
+
+#define CHIP8_FUSIONS_MAX	32		// room for this many different superinstructions (see Chip8.c)
+
+
+// A pre-decoded instruction. Each machine caches one of these for every even address in memory so the core doesn't have to decode the same opcode every time it runs.
+typedef struct chip8_insn {
+	
+	unsigned char	op;			// which handler runs this instruction (a chip8_op, see Chip8.c). This may be a superinstruction that runs the next few as well
+	unsigned char	x;			// register identifier X
+	unsigned char	y;			// register identifier Y
+	unsigned char	n;			// 4-bit constant
+	unsigned char	nn;			// 8-bit constant
+	unsigned char	base;		// the chip8_op for just this instruction, even when op is a superinstruction
+	unsigned short	nnn;		// 12-bit address
+	
+} chip8_insn;
+
+
+// The execution engines a machine can run on.
+typedef enum chip8_engine {
+	
+	CHIP8_ENGINE_INTERPRETER,		// the portable interpreter in Chip8.c
+	CHIP8_ENGINE_JIT,				// translate blocks of Chip8 code to native x86-64 code (see Chip8JIT.c)
+	CHIP8_ENGINE_JIT_VALIDATE,		// the JIT, checked against the interpreter after every native run
+	CHIP8_ENGINE_AOT,				// a ROM translated to C ahead of time (see Chip8AOT.h). Needs chip8_machine_setProgram()
+	
+} chip8_engine;
+
+// Quirks
+// The interpreters Chip8 ROMs were written for never quite agreed on what a few instructions do, and a ROM only works
+// properly with the behaviour its author had. A profile is a named set of those behaviours. Each one gets its own copy of
+// the interpreter, built with the quirks as constants, so the instruction handlers don't test for them as they run.
+typedef enum chip8_quirks {
+	
+	CHIP8_QUIRKS_CLASSIC,			// how this emulator has always worked: 8XY6/8XYE shift VX, FX55/FX65 leave I alone, BNNN adds V0 and sprites wrap
+	CHIP8_QUIRKS_VIP,				// the original COSMAC VIP interpreter
+	CHIP8_QUIRKS_CHIP48,			// CHIP-48 on the HP-48
+	CHIP8_QUIRKS_SCHIP,				// SUPER-CHIP 1.1 (only its low resolution instructions, the rest aren't emulated)
+	
+	CHIP8_QUIRKS_COUNT
+	
+} chip8_quirks;
+
+// The individual behaviours, for chip8_machine_quirkFlags(). None of them set is CHIP8_QUIRKS_CLASSIC.
+enum {
+	CHIP8_QUIRK_SHIFT_VY		= 1 << 0,		// 8XY6 and 8XYE shift VY into VX, rather than shifting VX (VIP)
+	CHIP8_QUIRK_MEMORY_I		= 1 << 1,		// FX55 and FX65 leave I pointing past the last register (VIP)
+	CHIP8_QUIRK_MEMORY_I_SHORT	= 1 << 2,		// ... or at it (CHIP-48)
+	CHIP8_QUIRK_JUMP_VX			= 1 << 3,		// BXNN jumps to XNN plus VX, rather than NNN plus V0 (CHIP-48, SUPER-CHIP)
+	CHIP8_QUIRK_CLIP			= 1 << 4,		// DXYN clips sprites at the edges of the screen, rather than wrapping them round (all but CLASSIC)
+	CHIP8_QUIRK_VF_RESET		= 1 << 5,		// 8XY1, 8XY2 and 8XY3 clear VF (VIP)
+};
+
+struct chip8_jit;
+struct chip8_aot;
+struct chip8_aot_program;
+struct chip8_machine;
+struct chip8_profile;
+
+// Called for every key press and release on a machine (k is '0'-'9' or 'A'-'F'), before the machine sees it.
+typedef void (*chip8_keyObserver)(void *context, struct chip8_machine *machine, unsigned char k, bool down);
+
+// Called when the buzzer goes on (the sound timer is set to something other than 0) or off (it runs out, or is set to 0).
+// `cycle` is the instruction it happened on, which can be ahead of machine->cycles while an engine is running a block.
+typedef void (*chip8_soundObserver)(void *context, struct chip8_machine *machine, unsigned long long cycle, bool on);
+
+
+// Why chip8_machine_runUntil() stopped.
+typedef enum chip8_stop {
+	
+	CHIP8_STOP_CYCLES,				// it ran every cycle it was asked to
+	CHIP8_STOP_FRAME,				// it reached the end of a 60Hz frame (the timers just counted down)
+	CHIP8_STOP_DRAW,				// it just ran an instruction that draws to the screen (00E0 or DXYN)
+	
+} chip8_stop;
+
+// What chip8_machine_runUntil() should stop for, besides running out of cycles. These can be or'd together.
+enum {
+	CHIP8_RUN_UNTIL_FRAME	= 1 << 0,
+	CHIP8_RUN_UNTIL_DRAW	= 1 << 1,
+};
+
+
+// All of the state for one Chip8 system lives in a chip8_machine.
+// Nothing in the emulator core touches global state, so any number of machines can be created and stepped at the same time on different threads.
+// The only rule is that a single machine must not be stepped from two threads at once.
+//
+// Everything from memory down to rngState is the state of the emulated machine. It has to stay in one piece
+// (and free of pointers), because chip8_machine_fork() copies it with a single memcpy.
+typedef struct chip8_machine {
+
+	unsigned char	memory[4096];		// system memory (4 KB)
+	unsigned char	V[16];				// 8-bit registers V0-VF
+	unsigned short	I;					// index register
+	unsigned short	pc;					// program counter
+	unsigned short	stack[16];			// the stack
+	unsigned short	sp;					// stack pointer
+	unsigned char	delay_timer;		// delay timer register (counts down at 60Hz)
+	unsigned char	sound_timer;		// sound timer register (counts down at 60Hz)
+	uint64_t		gfx[32];			// VRAM (the screen memory), one bit per pixel and one uint64_t per row. Bit 63 is the leftmost column
+	uint16_t		keys;				// keypad state, bit n set while HEX key n is held down
+	
+	unsigned int		clockRate;		// emulated instructions per second, which is what the 60Hz timers are measured against
+	unsigned char		quirks;			// the chip8_quirks the machine runs with (see chip8_machine_setQuirks())
+	unsigned long long	cycles;			// instructions executed since the last reset
+	unsigned long long	nextTimerTick;	// the value of cycles at which the timers next count down
+	unsigned long long	timerBase;		// the value of cycles when the clock rate was last set
+	unsigned long long	timerTicks;		// times the timers have counted down since timerBase
+	unsigned long long	idleCycles;		// cycles since the last reset that were fast-forwarded through idle loops rather than emulated
+	unsigned int		rngState;		// where CXNN gets its random numbers from (see chip8_machine_seed())
+	
+	bool			needsDisplay;		// set when gfx has changed and the renderer should redraw
+	uint64_t		presentedGfx[32];	// gfx as it was at the last chip8_machine_clearDirty(), i.e. what the renderer is showing
+	
+	chip8_insn		decoded[2048];		// decode cache, one entry per even address
+	
+	struct chip8_jit	*jit;			// the JIT, when the machine is running on it
+	unsigned char		*jitCodeMap;	// non-zero for every byte of memory the JIT has translated (NULL without the JIT)
+	
+	struct chip8_aot	*aot;			// the ahead of time translated program, when the machine is running one
+	unsigned char		*aotCodeMap;	// non-zero for every byte of memory the program was translated from (NULL without one)
+	
+	unsigned char		*storeMap;		// when it isn't NULL, entry n is set whenever the program stores to word n (bytes 2n and 2n + 1) of memory
+	
+	unsigned long long	fusedCycles;					// instructions since the last reset that ran as part of a superinstruction
+	unsigned long long	fusedRuns[CHIP8_FUSIONS_MAX];	// times each superinstruction has run since the last reset
+	
+	chip8_keyObserver	keyObserver;	// told about every key press and release (see chip8_machine_setKeyObserver())
+	void				*keyObserverContext;
+	
+	chip8_soundObserver	soundObserver;	// told when the buzzer goes on and off (see chip8_machine_setSoundObserver())
+	void				*soundObserverContext;
+	
+	struct chip8_profile	*profile;			// the profile collecting samples from this machine, if any
+	unsigned long long		profileCountdown;	// instructions until the next sample
+
+} chip8_machine;
+
+
+// Machine API
+chip8_machine *chip8_machine_create();
+void chip8_machine_destroy(chip8_machine *machine);
+
+void chip8_machine_reset(chip8_machine *machine);
+bool chip8_machine_loadROM(chip8_machine *machine, const char *romPath);
+
+void chip8_machine_step(chip8_machine *machine);
+unsigned long chip8_machine_run(chip8_machine *machine, unsigned long cycles);	// executes `cycles` instructions, returns the number executed
+
+// Executes up to `cycles` instructions, stopping early for anything in `until`, and returns why it stopped.
+// The number of instructions executed goes in *executed (if it isn't NULL). If the last instruction of a frame draws, you get CHIP8_STOP_FRAME.
+chip8_stop chip8_machine_runUntil(chip8_machine *machine, unsigned long cycles, unsigned int until, unsigned long *executed);
+
+// Executes instructions up to the end of the current 60Hz frame, and returns the number executed (clockRate / 60, give or take one).
+unsigned long chip8_machine_runFrame(chip8_machine *machine);
+
+// Makes `clone` an exact copy of the machine, so it carries on from the same point (the clone keeps its own execution engine).
+// This is cheap enough to do thousands of times a second, especially when you keep forking the same machine into the same clones.
+void chip8_machine_fork(const chip8_machine *machine, chip8_machine *clone);
+chip8_machine *chip8_machine_clone(const chip8_machine *machine);	// creates a new machine and forks into it
+
+// Picks the execution engine used by chip8_machine_run() and chip8_machine_step().
+// Returns false if the engine isn't available on this platform, in which case the machine carries on with the interpreter.
+// CHIP8_ENGINE_AOT needs to know which program to run, so pick it with chip8_machine_setProgram() instead.
+bool chip8_machine_setEngine(chip8_machine *machine, chip8_engine engine);
+
+// Runs the machine on a ROM translated ahead of time by chip8-aotc (see Chip8AOT.h), which has to be the ROM it has loaded (and
+// translated for the quirks it runs with, see chip8_machine_setQuirks()).
+// Code that wasn't translated, or has since been written over, runs on the interpreter. Pass NULL to go back to the interpreter.
+bool chip8_machine_setProgram(chip8_machine *machine, const struct chip8_aot_program *program);
+
+// If you write to machine->memory directly, call this so the core doesn't keep running the old instructions out of its decode cache.
+void chip8_machine_invalidate(chip8_machine *machine, unsigned short address, unsigned short length);
+
+// The core never looks at the clock. The 60Hz timers count down once every clockRate / 60 instructions, so a machine runs
+// exactly the same way no matter how fast (or how unevenly) the frontend steps it. Keeping it at real time is up to the frontend.
+void chip8_machine_setClockRate(chip8_machine *machine, unsigned int instructionsPerSecond);
+
+// Picks the quirks profile. chip8_machine_loadROM() picks one for the ROM (see chip8_machine_quirksForROM()), so call this
+// afterwards to override it. The profile survives a reset, like the clock rate.
+void chip8_machine_setQuirks(chip8_machine *machine, chip8_quirks quirks);
+
+// The profile a ROM needs: from a list of ROMs we know, or failing that from the instructions it uses. Anything we can't tell is CLASSIC.
+chip8_quirks chip8_machine_quirksForROM(const unsigned char *rom, size_t size);
+unsigned int chip8_machine_quirkFlags(chip8_quirks quirks);		// the CHIP8_QUIRK_ flags in a profile
+const char *chip8_machine_quirksName(chip8_quirks quirks);		// "classic", "vip", "chip48" or "schip" (NULL if there's no such profile)
+
+void chip8_machine_keydown(chip8_machine *machine, unsigned char k);
+void chip8_machine_keyup(chip8_machine *machine, unsigned char k);
+void chip8_machine_setKeys(chip8_machine *machine, uint16_t keys);	// all of them at once (bit n for key n), telling the observer about each one that changes
+void chip8_machine_setKeyObserver(chip8_machine *machine, chip8_keyObserver observer, void *context);	// pass NULL to stop observing
+int chip8_keyIndex(unsigned char k);	// the bit of keypad character k ('0'-'9', 'A'-'F') in the key mask, or -1 if it isn't a keypad key
+
+// The core doesn't make any sound itself. It tells the observer when the buzzer goes on and off, which is everything there is to
+// know about Chip8 sound (see Chip8Audio.h for turning that into samples). Only the program counts: resets, snapshots and
+// forks change sound_timer without telling anyone. Pass NULL to stop observing.
+void chip8_machine_setSoundObserver(chip8_machine *machine, chip8_soundObserver observer, void *context);
+
+// Every machine has its own random number generator for CXNN (a xorshift, so machines on different threads never share or
+// lock anything), seeded from the clock when it's reset. Seed it yourself (after loading the ROM) to make a run repeatable.
+// Its state is machine->rngState, which snapshots save and forking copies.
+void chip8_machine_seed(chip8_machine *machine, unsigned int seed);
+
+// Dirty regions
+// The core remembers what the screen looked like when the renderer last presented it, and works out what has changed since by
+// comparing. So a sprite that is erased and drawn again in the same place (which Chip8 games do all the time) doesn't count.
+uint32_t chip8_machine_dirtyRows(const chip8_machine *machine);		// bit n is set if row n has changed
+uint32_t chip8_machine_dirtyTiles(const chip8_machine *machine);	// the screen as 8x4 tiles of 8x8 pixels. Bit (tileRow * 8 + tileCol) is set if that tile has changed
+void chip8_machine_clearDirty(chip8_machine *machine);				// call this once you've presented the screen
+uint32_t chip8_dirtyTilesBetween(const uint64_t screen[32], const uint64_t shown[32]);	// the same for any two screens, like frames from Chip8Frames.h
+
+// For renderers that would rather not deal with the packed gfx rows.
+bool chip8_machine_pixel(const chip8_machine *machine, unsigned char col, unsigned char row);			// is the pixel at (col, row) on?
+void chip8_machine_expandDisplay(const chip8_machine *machine, unsigned char pixels[32][64]);		// one byte per pixel (0 or 1), row by row
+
+
+// Execution engine hooks
+// These let other execution engines (like the JIT) share the interpreter's instruction handlers and timers.
+void chip8_machine_execute(chip8_machine *machine);			// runs the one instruction at pc, without touching the timers
+void chip8_machine_advance(chip8_machine *machine, unsigned long cycles);	// counts instructions run by another engine, ticking the 60Hz timers as they fall due
+unsigned long chip8_machine_skipIdle(chip8_machine *machine, unsigned long cycles);	// fast-forwards through an idle loop at pc (leaving at least one of `cycles` to run), returns the cycles skipped
+bool chip8_machine_idleLoopAt(chip8_machine *machine, unsigned short address);	// could chip8_machine_skipIdle() skip anything with pc at `address`? Engines should come back to it there, rather than run straight in
+const char *chip8_machine_opName(unsigned char op);		// the name of a chip8_op ("8XY4" and so on), or NULL if there's no such op
+
+// FX18 for engines that don't run it on the interpreter. `ahead` is the number of instructions run since machine->cycles was last
+// brought up to date, so the sound observer hears about it on the right one.
+void chip8_machine_setSoundTimer(chip8_machine *machine, unsigned char value, unsigned long ahead);
+
+// Superinstructions
+// The interpreter runs some common sequences of instructions as one (see Chip8.c). machine->fusedRuns[n] counts superinstruction n.
+unsigned int chip8_machine_fusionCount();						// the number of different superinstructions
+const char *chip8_machine_fusionName(unsigned int fusion);		// "7XNN_3XNN_1NNN" and so on
+const char *chip8_machine_dispatchName();						// how the interpreter was built to dispatch, "table" or "goto" (see Chip8.c)
+
+
+// Clock
+// Nanoseconds on a monotonic clock. Everything that measures real time (the pacer's deadlines, frame and key latencies) uses
+// this one, so their times can be compared. On the Mac it's the clock of mach_absolute_time() and of NSEvent's timestamps
+// (which are in seconds), so an event's timestamp can be compared with it directly.
+uint64_t chip8_now();
+
+// Latencies measured with chip8_now(), in nanoseconds, for the statistics of anything that hands things from one thread to another.
+// All zeros is empty.
+typedef struct chip8_latency {
+
+	unsigned long long	count;
+	uint64_t			last;
+	uint64_t			min;
+	uint64_t			max;
+	uint64_t			total;
+
+} chip8_latency;
+
+void chip8_latency_count(chip8_latency *latency, uint64_t nanoseconds);
+double chip8_latency_mean(const chip8_latency *latency);		// 0 if nothing's been counted
+
+
+// Single machine API
+// These operate on one shared machine, which is all the Cocoa frontend needs.
 void chip8_loadROM(const char *romPath);
 
 void chip8_step();
+unsigned long chip8_run(unsigned long cycles);
+unsigned long chip8_runFrame();
 
 void chip8_keydown(unsigned char k);
 void chip8_keyup(unsigned char k);
@@ -26,7 +295,10 @@ void chip8_keyup(unsigned char k);
 bool chip8_needsDisplay();
 void chip8_setNeedsDisplay(bool needsDisplay);
 
-extern unsigned char gfx[64][32]; // we expose the graphics buffer so the Chip8View can read from it to render to the screen.
+uint32_t chip8_dirtyTiles();
+void chip8_clearDirty();
+
+chip8_machine *chip8_sharedMachine();
 
 
 #endif /* defined(__Chip8__Chip8__) */
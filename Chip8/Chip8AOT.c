@@ -0,0 +1,227 @@
+//
+//  Chip8AOT.c
+//  Chip8
+//
+//  Runs ROMs that were translated to C ahead of time by chip8-aotc (see Chip8AOT/main.c).
+//
+
+#include "Chip8AOT.h"
+
+#include <string.h>
+
+/*
+ How ahead of time translation works
+
+ chip8-aotc traces a ROM from 0x200, following every jump, call and skip it can work out without running it, and writes
+ each straight run of instructions it finds out as a labelled block of C. Jumps between blocks are gotos, so a hot loop is
+ just a loop in native code. Where the code goes next depends on the machine (00EE and BNNN) the translated code switches
+ on pc, and anything it never saw is handed back to us.
+
+ So the translated code only ever runs blocks it knows about, and everything else goes to the interpreter one instruction at
+ a time until pc lands on a block again. That covers the ROM jumping somewhere tracing couldn't find, an instruction
+ split from its block by a timer tick, and code that has been written over.
+
+ Self-modifying code
+ A block is only right for as long as the memory under it holds what was translated. We mark every translated byte in
+ codeMap, and chip8_store() tells us when one is written. Every block the byte is part of is marked stale, and stale blocks go
+ to the interpreter until the bytes match again (when the machine is reset, loads a snapshot and so on).
+
+ Quirks
+ The quirks profile is built into the translated code as well. If the machine's quirks are changed to something else, every
+ block counts as stale and the whole program runs on the interpreter.
+
+ Timers
+ Just like the JIT, the budget handed to translated code never runs past the next 60Hz tick, so the timers count down
+ between exactly the same two instructions they would on the interpreter.
+*/
+
+struct chip8_aot {
+
+	chip8_aot_context			context;	// first, so translated code and the engine can share it
+
+	const chip8_aot_program		*program;
+	unsigned char				codeMap[4096];		// set for every byte of memory that is part of a block
+	bool						verifyPending;		// memory may have changed wholesale, check every block before running anything
+
+	chip8_aot_stats				stats;
+};
+
+
+
+// Blocks
+
+// Does the memory under the block still hold the ROM bytes it was translated from?
+static bool chip8_aot_matches(const chip8_aot *aot, const chip8_aot_block *block) {
+
+	const chip8_aot_program *p = aot->program;
+	const unsigned char *memory = aot->context.machine->memory;
+	unsigned int start = block->address;
+	unsigned int end = start + block->length * 2u;
+
+	if (start < 0x200 || end > 0x200u + p->romSize) {
+		return false;
+	}
+	return memcmp(&memory[start], &p->rom[start - 0x200], end - start) == 0;
+}
+
+static void chip8_aot_verify(chip8_aot *aot) {
+
+	const chip8_aot_program *p = aot->program;
+
+	// the quirks were built into the translated code, so with any others none of it is any good
+	bool quirksMatch = (p->quirks == aot->context.machine->quirks);
+
+	aot->stats.staleBlocks = 0;
+	for (unsigned int i = 0; i < p->blockCount; i++) {
+		aot->context.stale[i] = !quirksMatch || !chip8_aot_matches(aot, &p->blocks[i]);
+		aot->stats.staleBlocks += aot->context.stale[i];
+	}
+	aot->verifyPending = false;
+}
+
+const chip8_aot_program *chip8_aot_find(const chip8_aot_program * const *programs, const chip8_machine *m) {
+
+	for (; *programs != NULL; programs++) {
+		const chip8_aot_program *p = *programs;
+		if (p->quirks == m->quirks && p->romSize <= 4096 - 0x200 && memcmp(&m->memory[0x200], p->rom, p->romSize) == 0) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+
+
+// AOT API
+
+chip8_aot *chip8_aot_create(chip8_machine *m, const chip8_aot_program *program) {
+
+	chip8_aot *aot = calloc(1, sizeof(chip8_aot));
+	if (aot == NULL) {
+		return NULL;
+	}
+
+	aot->context.stale = calloc(program->blockCount + 1, 1);
+	if (aot->context.stale == NULL) {
+		free(aot);
+		return NULL;
+	}
+
+	aot->context.machine = m;
+	aot->program = program;
+	for (unsigned int i = 0; i < program->blockCount; i++) {
+		const chip8_aot_block *block = &program->blocks[i];
+		for (unsigned int a = block->address; a < block->address + block->length * 2u && a < 4096; a++) {
+			aot->codeMap[a] = 1;
+		}
+	}
+	aot->verifyPending = true;
+
+	m->aotCodeMap = aot->codeMap;
+
+	return aot;
+}
+
+void chip8_aot_destroy(chip8_aot *aot) {
+
+	if (aot == NULL) {
+		return;
+	}
+
+	if (aot->context.machine->aot == aot) {
+		aot->context.machine->aotCodeMap = NULL;
+	}
+	free(aot->context.stale);
+	free(aot);
+}
+
+void chip8_aot_invalidate(chip8_aot *aot) {
+
+	if (aot != NULL) {
+		aot->verifyPending = true;
+	}
+}
+
+void chip8_aot_codeWritten(chip8_aot *aot, unsigned short address) {
+
+	const chip8_aot_program *p = aot->program;
+
+	// programs often write back what was already there, which doesn't change anything
+	if (address >= 0x200 && address - 0x200 < p->romSize && aot->context.machine->memory[address] == p->rom[address - 0x200]) {
+		return;
+	}
+
+	// only happens when a program writes over its own code, so a walk over the blocks is fine
+	for (unsigned int i = 0; i < p->blockCount; i++) {
+		const chip8_aot_block *block = &p->blocks[i];
+		if (address >= block->address && address < block->address + block->length * 2u && !aot->context.stale[i]) {
+			aot->context.stale[i] = 1;
+			aot->stats.staleBlocks++;
+		}
+	}
+	aot->context.interrupted = true;
+}
+
+static void chip8_aot_interpretOne(chip8_aot *aot) {
+
+	chip8_machine *m = aot->context.machine;
+	unsigned short pc = m->pc & 0xFFF;
+	unsigned char first = m->memory[pc];
+	unsigned char second = m->memory[(pc + 1) & 0xFFF];
+
+	if (aot->context.stopOnDraw && ((first == 0x00 && second == 0xE0) || (first & 0xF0) == 0xD0)) {
+		aot->context.drew = true;
+	}
+	chip8_machine_execute(m);
+	chip8_machine_advance(m, 1);
+	aot->stats.interpretedCycles++;
+}
+
+unsigned long chip8_aot_run(chip8_machine *m, unsigned long cycles, bool *drew) {
+
+	chip8_aot *aot = m->aot;
+	unsigned long executed = 0;
+
+	aot->context.stopOnDraw = (drew != NULL);
+	aot->context.drew = false;
+
+	while (executed < cycles && !aot->context.drew) {
+
+		if (aot->verifyPending) {
+			chip8_aot_verify(aot);
+		}
+
+		// don't bother running idle loops (see chip8_machine_skipIdle())
+		executed += chip8_machine_skipIdle(m, cycles - executed);
+
+		// stop at the next timer tick
+		unsigned long slice = cycles - executed;
+		unsigned long long untilTick = m->nextTimerTick - m->cycles;
+		if (slice > untilTick) {
+			slice = (unsigned long)untilTick;
+		}
+
+		aot->context.interrupted = false;
+		unsigned long ran = aot->program->run(&aot->context, slice);
+
+		if (ran == 0) {
+			chip8_aot_interpretOne(aot);
+			executed++;
+			continue;
+		}
+
+		executed += ran;
+		aot->stats.nativeCycles += ran;
+		chip8_machine_advance(m, ran);
+	}
+
+	if (drew != NULL) {
+		*drew = aot->context.drew;
+	}
+	return executed;
+}
+
+chip8_aot_stats chip8_aot_getStats(chip8_aot *aot) {
+
+	return aot->stats;
+}
@@ -0,0 +1,118 @@
+//
+//  Chip8AOT.h
+//  Chip8
+//
+//  Runs ROMs that were translated to C ahead of time by chip8-aotc (see Chip8AOT/main.c).
+//  Pick a translated program with chip8_machine_setProgram().
+//
+
+#ifndef __Chip8__Chip8AOT__
+#define __Chip8__Chip8AOT__
+
+#include "Chip8.h"
+
+
+typedef struct chip8_aot chip8_aot;
+typedef struct chip8_aot_context chip8_aot_context;
+
+
+// A straight run of translated instructions. Control only ever enters one at the top.
+typedef struct chip8_aot_block {
+
+	unsigned short	address;
+	unsigned short	length;			// in instructions
+
+} chip8_aot_block;
+
+// One ROM, translated. chip8-aotc writes these out as C, one per ROM it was given.
+typedef struct chip8_aot_program {
+
+	const char				*name;
+	const unsigned char		*rom;			// the ROM it was translated from (loaded at 0x200)
+	unsigned short			romSize;
+	const chip8_aot_block	*blocks;
+	unsigned short			blockCount;
+	chip8_quirks			quirks;			// the profile it was translated for (it only runs on a machine with the same one)
+
+	// Runs translated blocks from machine->pc for at most `budget` instructions and returns the number it ran, leaving pc at
+	// the next instruction. It returns 0 when the instruction at pc has to go to the interpreter instead.
+	unsigned long (*run)(chip8_aot_context *context, unsigned long budget);
+
+} chip8_aot_program;
+
+// The part of the AOT engine that translated code gets to see.
+struct chip8_aot_context {
+
+	chip8_machine	*machine;
+	unsigned char	*stale;			// one per block, set while the memory under a block doesn't match what was translated
+	bool			stopOnDraw;		// leave straight after an instruction that draws ...
+	bool			drew;			// ... and this says that's why we left
+	bool			interrupted;	// a store just hit translated code, so the rest of the block may be out of date
+
+};
+
+
+// Finds the program in a NULL terminated list that was translated from the ROM loaded into the machine, for the machine's
+// quirks (NULL if there isn't one).
+const chip8_aot_program *chip8_aot_find(const chip8_aot_program * const *programs, const chip8_machine *machine);
+
+// You don't normally call these directly, chip8_machine_setProgram() does.
+chip8_aot *chip8_aot_create(chip8_machine *machine, const chip8_aot_program *program);
+void chip8_aot_destroy(chip8_aot *aot);
+
+// Executes up to `cycles` instructions and returns the number executed.
+// If drew isn't NULL it returns early, straight after the first instruction that draws to the screen, and sets *drew.
+unsigned long chip8_aot_run(chip8_machine *machine, unsigned long cycles, bool *drew);
+
+// Checks every block against memory again before running any more. Called when memory may have changed wholesale.
+void chip8_aot_invalidate(chip8_aot *aot);
+
+// Called by chip8_store() when a byte of translated code is written.
+void chip8_aot_codeWritten(chip8_aot *aot, unsigned short address);
+
+
+// Statistics
+typedef struct chip8_aot_stats {
+
+	unsigned long	nativeCycles;			// instructions executed as translated code
+	unsigned long	interpretedCycles;		// instructions handed to the interpreter (untranslated, stale, or split by a timer tick)
+	unsigned long	staleBlocks;			// blocks that don't match memory right now
+
+} chip8_aot_stats;
+
+chip8_aot_stats chip8_aot_getStats(chip8_aot *aot);
+
+
+// Translated code
+// The C that chip8-aotc writes is built out of these. Each one expects `m` (the machine), `c` (the context), `budget` and
+// `left` (what is left of the budget) in scope.
+
+// Enters a block, or leaves if there isn't enough budget left to run all of it or it has been written over.
+#define CHIP8_AOT_ENTER(block, address, length) \
+	if (left < (length) || c->stale[block]) { m->pc = (address); return budget - left; } \
+	left -= (length);
+
+// Leaves translated code with pc at `address`, giving back the budget for the `unrun` instructions of the block that didn't run.
+#define CHIP8_AOT_EXIT(address, unrun) \
+	{ m->pc = (address); left += (unrun); return budget - left; }
+
+// Runs the instruction at `address` on the interpreter's handler, then leaves if it stored over translated code.
+// `after` is the number of instructions left in the block after this one.
+#define CHIP8_AOT_HELPER(address, after) \
+	m->pc = (address); \
+	chip8_machine_execute(m); \
+	if (c->interrupted) { left += (after); return budget - left; }
+
+// The same, for 00E0 and DXYN, which also leave when the caller wants to stop after drawing.
+#define CHIP8_AOT_DRAW(address, after) \
+	m->pc = (address); \
+	chip8_machine_execute(m); \
+	if (c->stopOnDraw) { c->drew = true; left += (after); return budget - left; }
+
+
+// FX18, which tells the sound observer which instruction it ran on. `after` is the number of instructions left in the block after this one.
+#define CHIP8_AOT_SOUND(x, after) \
+	chip8_machine_setSoundTimer(m, m->V[x], budget - left - (after) - 1);
+
+
+#endif /* defined(__Chip8__Chip8AOT__) */
@@ -0,0 +1,363 @@
+//
+//  Chip8Audio.c
+//  Chip8
+//
+//  Turns the buzzer going on and off into a stream of samples for the sound card (or a WAV file).
+//
+
+#include "Chip8Audio.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ How the sound works
+
+ A Chip8 has a buzzer, and that's all: it sounds for as long as the sound timer isn't 0. So the machine just tells us (as its
+ sound observer) which instruction the buzzer went on or off on, and we work out which sample that is from the clock rate.
+ When the frontend calls chip8_audio_update() after running a frame, we make a square wave (or silence) for every sample from
+ the last one we made up to wherever the machine has got to.
+
+ The samples go into a ring buffer that the audio thread reads from, which only needs one atomic index for each side: the
+ emulation thread only ever moves writeIndex on, and the audio thread only ever moves readIndex on. Neither of them ever waits
+ for the other, so the sound can't slow the emulator down, and a slow frame can't make the sound card wait (it just gets
+ silence until the samples turn up).
+
+ The emulation thread never lets more than `limit` samples wait in the ring, and drops whatever doesn't fit. That keeps the
+ delay between the buzzer going on and hearing it short, no matter how far the emulator gets ahead (in turbo mode, say),
+ and it means making samples nobody is reading costs next to nothing.
+*/
+
+#define CHIP8_AUDIO_RING	16384		// samples, a power of two (longer than any latency anybody would want)
+#define CHIP8_AUDIO_MASK	(CHIP8_AUDIO_RING - 1)
+
+
+struct chip8_audio {
+
+	int16_t					ring[CHIP8_AUDIO_RING];
+	unsigned int			sampleRate;
+	size_t					limit;			// the most samples that can be waiting to be read
+
+	// the emulation thread's
+	_Alignas(64) atomic_size_t	writeIndex;		// samples ever written (so the next one goes in ring[writeIndex & CHIP8_AUDIO_MASK])
+	atomic_ullong				edges;
+	atomic_ullong				written;
+	atomic_ullong				dropped;
+
+	bool					on;				// the buzzer, as of lastCycle
+	unsigned long long		lastCycle;		// the instruction we've made samples up to
+	unsigned long long		fraction;		// the part of a sample left over from that, in 1 / clockRate samples
+	unsigned int			tone;
+	unsigned int			phase;			// how far through the square wave's cycle we are, from 0 up to sampleRate
+	int16_t					amplitude;
+
+	// the audio thread's
+	_Alignas(64) atomic_size_t	readIndex;
+	atomic_ullong				read;
+	atomic_ullong				underruns;
+};
+
+
+chip8_audio *chip8_audio_create(unsigned int sampleRate, unsigned int latency) {
+
+	chip8_audio *a = calloc(1, sizeof(chip8_audio));
+	if (a == NULL) {
+		return NULL;
+	}
+
+	a->sampleRate = (sampleRate != 0) ? sampleRate : CHIP8_AUDIO_DEFAULT_RATE;
+	if (latency == 0) {
+		latency = CHIP8_AUDIO_DEFAULT_LATENCY;
+	}
+	a->limit = (size_t)((unsigned long long)a->sampleRate * latency / 1000);
+	if (a->limit > CHIP8_AUDIO_RING) {
+		a->limit = CHIP8_AUDIO_RING;
+	}
+
+	atomic_init(&a->writeIndex, 0);
+	atomic_init(&a->readIndex, 0);
+	chip8_audio_setTone(a, CHIP8_AUDIO_DEFAULT_TONE, CHIP8_AUDIO_DEFAULT_VOLUME);
+	return a;
+}
+
+void chip8_audio_destroy(chip8_audio *a) {
+
+	free(a);
+}
+
+unsigned int chip8_audio_sampleRate(const chip8_audio *a) {
+
+	return a->sampleRate;
+}
+
+
+
+// Emulation thread
+
+static void chip8_audio_count(atomic_ullong *counter, unsigned long long n) {
+
+	// only one thread ever changes each counter, so there's no need for an atomic add
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Makes `count` more samples.
+static void chip8_audio_write(chip8_audio *a, unsigned long long count) {
+
+	size_t w = atomic_load_explicit(&a->writeIndex, memory_order_relaxed);
+	size_t r = atomic_load_explicit(&a->readIndex, memory_order_acquire);
+	size_t waiting = w - r;
+	size_t room = (waiting < a->limit) ? a->limit - waiting : 0;
+	size_t n = (count < room) ? (size_t)count : room;
+
+	for (size_t i = 0; i < n; i++) {
+		int16_t sample = 0;
+		if (a->on) {
+			sample = (a->phase < a->sampleRate / 2) ? a->amplitude : -a->amplitude;
+		}
+		a->ring[(w + i) & CHIP8_AUDIO_MASK] = sample;
+
+		a->phase += a->tone;
+		if (a->phase >= a->sampleRate) {
+			a->phase -= a->sampleRate;
+		}
+	}
+
+	// skip the wave on past the samples we're dropping, so it carries on as if they'd been played
+	a->phase = (unsigned int)((a->phase + (count - n) % a->sampleRate * a->tone) % a->sampleRate);
+
+	// release, so the audio thread sees the samples before the index that says they're there
+	atomic_store_explicit(&a->writeIndex, w + n, memory_order_release);
+	chip8_audio_count(&a->written, n);
+	chip8_audio_count(&a->dropped, count - n);
+}
+
+// Makes the samples from lastCycle up to `cycle`.
+static void chip8_audio_writeTo(chip8_audio *a, const chip8_machine *m, unsigned long long cycle) {
+
+	// a machine that's never been reset has no clock to turn cycles into samples with
+	if (m->clockRate == 0) {
+		return;
+	}
+
+	// if the machine has gone back in time (it was reset, or rewound, or loaded a snapshot), start again from here
+	if (cycle < a->lastCycle) {
+		a->lastCycle = cycle;
+		a->fraction = 0;
+		return;
+	}
+
+	unsigned long long cycles = cycle - a->lastCycle;
+	a->lastCycle = cycle;
+
+	// after a minute or so there's nothing to be gained from making every sample, and the sums below could overflow
+	if (cycles > (unsigned long long)m->clockRate * 60) {
+		cycles = (unsigned long long)m->clockRate * 60;
+		a->fraction = 0;
+	}
+
+	unsigned long long total = a->fraction + cycles * a->sampleRate;
+	a->fraction = total % m->clockRate;
+	chip8_audio_write(a, total / m->clockRate);
+}
+
+static void chip8_audio_buzzer(void *context, chip8_machine *m, unsigned long long cycle, bool on) {
+
+	chip8_audio *a = context;
+	chip8_audio_writeTo(a, m, cycle);
+	a->on = on;
+	chip8_audio_count(&a->edges, 1);
+}
+
+void chip8_audio_attach(chip8_audio *a, chip8_machine *m) {
+
+	if (a == NULL) {
+		chip8_machine_setSoundObserver(m, NULL, NULL);
+		return;
+	}
+
+	chip8_machine_setSoundObserver(m, chip8_audio_buzzer, a);
+	a->lastCycle = m->cycles;
+	a->fraction = 0;
+	a->on = (m->sound_timer != 0);
+}
+
+void chip8_audio_update(chip8_audio *a, const chip8_machine *m) {
+
+	chip8_audio_writeTo(a, m, m->cycles);
+
+	// resets, snapshots and rewinding change the sound timer without telling us
+	bool on = (m->sound_timer != 0);
+	if (on != a->on) {
+		a->on = on;
+		chip8_audio_count(&a->edges, 1);
+	}
+}
+
+void chip8_audio_setTone(chip8_audio *a, unsigned int frequency, double volume) {
+
+	// anything at half the sample rate or above would just alias
+	if (frequency == 0 || frequency >= a->sampleRate / 2) {
+		frequency = CHIP8_AUDIO_DEFAULT_TONE;
+	}
+	if (volume < 0) {
+		volume = 0;
+	}
+	else if (volume > 1) {
+		volume = 1;
+	}
+
+	a->tone = frequency;
+	a->amplitude = (int16_t)(volume * INT16_MAX);
+}
+
+
+
+// Audio thread
+
+size_t chip8_audio_read(chip8_audio *a, int16_t *samples, size_t count) {
+
+	size_t r = atomic_load_explicit(&a->readIndex, memory_order_relaxed);
+	size_t w = atomic_load_explicit(&a->writeIndex, memory_order_acquire);
+	size_t n = (count < w - r) ? count : w - r;
+
+	// the samples can wrap round the end of the ring
+	size_t start = r & CHIP8_AUDIO_MASK;
+	size_t first = (n < CHIP8_AUDIO_RING - start) ? n : CHIP8_AUDIO_RING - start;
+	memcpy(samples, &a->ring[start], first * sizeof(int16_t));
+	memcpy(samples + first, &a->ring[0], (n - first) * sizeof(int16_t));
+	memset(samples + n, 0, (count - n) * sizeof(int16_t));
+
+	// release, so the emulation thread doesn't write over the samples until we've copied them
+	atomic_store_explicit(&a->readIndex, r + n, memory_order_release);
+	chip8_audio_count(&a->read, n);
+	chip8_audio_count(&a->underruns, count - n);
+	return n;
+}
+
+size_t chip8_audio_available(chip8_audio *a) {
+
+	size_t r = atomic_load_explicit(&a->readIndex, memory_order_relaxed);
+	size_t w = atomic_load_explicit(&a->writeIndex, memory_order_acquire);
+	return w - r;
+}
+
+
+
+// Statistics
+
+chip8_audio_stats chip8_audio_getStats(chip8_audio *a) {
+
+	chip8_audio_stats stats;
+	stats.edges = atomic_load_explicit(&a->edges, memory_order_relaxed);
+	stats.written = atomic_load_explicit(&a->written, memory_order_relaxed);
+	stats.dropped = atomic_load_explicit(&a->dropped, memory_order_relaxed);
+	stats.read = atomic_load_explicit(&a->read, memory_order_relaxed);
+	stats.underruns = atomic_load_explicit(&a->underruns, memory_order_relaxed);
+	return stats;
+}
+
+
+
+// WAV files
+// A 44 byte header and then the samples, everything little endian.
+
+struct chip8_wav {
+
+	FILE				*file;
+	unsigned int		sampleRate;
+	unsigned long long	samples;
+	bool				failed;
+};
+
+static void chip8_wav_put(unsigned char **p, uint32_t value, int bytes) {
+
+	for (int i = 0; i < bytes; i++) {
+		*(*p)++ = (unsigned char)(value >> (8 * i));
+	}
+}
+
+static bool chip8_wav_writeHeader(chip8_wav *wav) {
+
+	// WAV sizes are 32 bits, so a file longer than that (about 13 hours at 44.1kHz) gets the largest size that fits
+	uint32_t dataSize = (wav->samples * 2 > UINT32_MAX - 36) ? (UINT32_MAX - 36) & ~1u : (uint32_t)(wav->samples * 2);
+
+	unsigned char header[44];
+	unsigned char *p = header;
+	memcpy(p, "RIFF", 4); p += 4;
+	chip8_wav_put(&p, 36 + dataSize, 4);
+	memcpy(p, "WAVEfmt ", 8); p += 8;
+	chip8_wav_put(&p, 16, 4);						// the size of the rest of the fmt chunk
+	chip8_wav_put(&p, 1, 2);						// PCM
+	chip8_wav_put(&p, 1, 2);						// mono
+	chip8_wav_put(&p, wav->sampleRate, 4);
+	chip8_wav_put(&p, wav->sampleRate * 2, 4);		// bytes per second
+	chip8_wav_put(&p, 2, 2);						// bytes per sample
+	chip8_wav_put(&p, 16, 2);						// bits per sample
+	memcpy(p, "data", 4); p += 4;
+	chip8_wav_put(&p, dataSize, 4);
+
+	return fwrite(header, sizeof(header), 1, wav->file) == 1;
+}
+
+chip8_wav *chip8_wav_open(const char *path, unsigned int sampleRate) {
+
+	chip8_wav *wav = calloc(1, sizeof(chip8_wav));
+	if (wav == NULL) {
+		return NULL;
+	}
+
+	wav->file = fopen(path, "wb");
+	wav->sampleRate = sampleRate;
+	if (wav->file == NULL || !chip8_wav_writeHeader(wav)) {
+		if (wav->file != NULL) {
+			fclose(wav->file);
+		}
+		free(wav);
+		return NULL;
+	}
+	return wav;
+}
+
+bool chip8_wav_write(chip8_wav *wav, const int16_t *samples, size_t count) {
+
+	unsigned char bytes[1024];
+	while (count > 0 && !wav->failed) {
+		size_t n = (count < sizeof(bytes) / 2) ? count : sizeof(bytes) / 2;
+		unsigned char *p = bytes;
+		for (size_t i = 0; i < n; i++) {
+			chip8_wav_put(&p, (uint16_t)samples[i], 2);
+		}
+		wav->failed = (fwrite(bytes, 2, n, wav->file) != n);
+		wav->samples += n;
+		samples += n;
+		count -= n;
+	}
+	return !wav->failed;
+}
+
+bool chip8_wav_close(chip8_wav *wav) {
+
+	if (wav == NULL) {
+		return false;
+	}
+
+	bool ok = !wav->failed && fseek(wav->file, 0, SEEK_SET) == 0 && chip8_wav_writeHeader(wav);
+	ok &= (fclose(wav->file) == 0);
+	free(wav);
+	return ok;
+}
+
+bool chip8_audio_readToWAV(chip8_audio *a, chip8_wav *wav) {
+
+	int16_t samples[1024];
+	size_t available = chip8_audio_available(a);
+	while (available > 0) {
+		size_t n = chip8_audio_read(a, samples, (available < 1024) ? available : 1024);
+		if (!chip8_wav_write(wav, samples, n)) {
+			return false;
+		}
+		available -= n;
+	}
+	return true;
+}
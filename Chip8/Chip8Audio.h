@@ -0,0 +1,77 @@
+//
+//  Chip8Audio.h
+//  Chip8
+//
+//  Turns the buzzer going on and off into a stream of samples for the sound card (or a WAV file).
+//
+
+#ifndef __Chip8__Chip8Audio__
+#define __Chip8__Chip8Audio__
+
+#include "Chip8.h"
+
+
+#define CHIP8_AUDIO_DEFAULT_RATE		44100	// samples per second
+#define CHIP8_AUDIO_DEFAULT_LATENCY		50		// milliseconds of sound that can be waiting to be played before we start dropping it
+#define CHIP8_AUDIO_DEFAULT_TONE		440		// Hz
+#define CHIP8_AUDIO_DEFAULT_VOLUME		0.25
+
+
+typedef struct chip8_audio chip8_audio;
+
+// Pass 0 for sampleRate or latency (in milliseconds) to get the defaults. Samples are signed 16 bit mono.
+chip8_audio *chip8_audio_create(unsigned int sampleRate, unsigned int latency);
+void chip8_audio_destroy(chip8_audio *audio);
+
+unsigned int chip8_audio_sampleRate(const chip8_audio *audio);
+
+
+// Emulation thread
+// Call these on the thread running the machine.
+
+// Makes the audio the machine's sound observer (see chip8_machine_setSoundObserver()). Pass NULL for audio to stop.
+void chip8_audio_attach(chip8_audio *audio, chip8_machine *machine);
+
+// Makes the samples for everything the machine has run since last time. Call it after running the machine (after every frame, say).
+// It never waits: if nobody is reading the samples, or the machine is running faster than real time, they're dropped.
+void chip8_audio_update(chip8_audio *audio, const chip8_machine *machine);
+
+void chip8_audio_setTone(chip8_audio *audio, unsigned int frequency, double volume);	// volume from 0 to 1
+
+
+// Audio thread
+// Only one thread may call these. They never wait, so they're fine in a real time audio callback.
+
+// Fills `samples` with the next `count` samples, and returns how many of them there were. The rest are silence.
+size_t chip8_audio_read(chip8_audio *audio, int16_t *samples, size_t count);
+
+size_t chip8_audio_available(chip8_audio *audio);		// samples waiting to be read
+
+
+// Statistics
+typedef struct chip8_audio_stats {
+
+	unsigned long long	edges;			// times the buzzer has gone on or off
+	unsigned long long	written;		// samples made
+	unsigned long long	dropped;		// samples made when there wasn't room for them (nobody was reading, or in turbo mode)
+	unsigned long long	read;			// samples read
+	unsigned long long	underruns;		// samples of silence read because there wasn't anything to read
+
+} chip8_audio_stats;
+
+chip8_audio_stats chip8_audio_getStats(chip8_audio *audio);		// from any thread
+
+
+// WAV files
+// For writing the samples to disk rather than to the sound card.
+typedef struct chip8_wav chip8_wav;
+
+chip8_wav *chip8_wav_open(const char *path, unsigned int sampleRate);	// returns NULL if the file can't be created
+bool chip8_wav_write(chip8_wav *wav, const int16_t *samples, size_t count);
+bool chip8_wav_close(chip8_wav *wav);		// fills in the header, and returns false if anything went wrong along the way
+
+// Reads everything that's waiting into the file. Returns false if it can't be written.
+bool chip8_audio_readToWAV(chip8_audio *audio, chip8_wav *wav);
+
+
+#endif /* defined(__Chip8__Chip8Audio__) */
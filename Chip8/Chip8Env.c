@@ -0,0 +1,288 @@
+//
+//  Chip8Env.c
+//  Chip8
+//
+//  Runs a batch of machines as environments for an agent to play: reset, step with actions, observe, reward.
+//
+
+#include "Chip8Env.h"
+#include "Chip8Pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ How stepping works
+
+ Every environment is a machine of its own, so a step is just every machine running a few frames, which is exactly the sort
+ of work Chip8Pool spreads over its threads. chip8_env_step() stashes its arguments in the env and hands out environments with
+ chip8_pool_each(). Whichever thread gets an environment sets its keys, runs its frames, asks the hooks how it went, starts
+ a new episode if that one is over, and writes its reward, done flag and observation straight into the caller's buffers. No
+ environment's results go through anything shared, so there are no locks and nothing to gather up at the end. The one copy
+ left is the observation itself, out of the machine's gfx once a step, which is cheap next to the frames the step ran.
+
+ New episodes fork the prototype. That copies the machine's whole state with one memcpy. Only the pages of memory that differ
+ are searched for changed instructions, whose decoded (and translated) code is thrown away, so the code that didn't change
+ stays ready to run, and it's cheap enough to do every step.
+ Each episode reseeds CXNN from the config's seed, the environment and the episode number, so a batch plays out exactly the
+ same way every time, no matter how many threads it runs on or which thread gets which environment.
+*/
+
+
+// Each slot is on a cache line of its own, since it's written every frame by whichever thread is stepping its environment.
+typedef struct chip8_env_slot {
+
+	_Alignas(64) chip8_machine	*machine;
+	unsigned long long	episode;		// episodes this environment has started before this one, which picks the seed
+	unsigned long long	finished;		// episodes it has played to the end (a reset abandons one without finishing it)
+	unsigned long long	episodeFrames;
+	unsigned long long	frames;
+
+} chip8_env_slot;
+
+struct chip8_env {
+
+	chip8_env_config	config;
+	chip8_env_hooks		hooks;
+	void				*context;
+
+	chip8_machine		*prototype;		// our own copy, so the caller can do what they like with theirs
+	chip8_env_slot		*slots;
+	chip8_pool			*pool;
+
+	// the step being run
+	const uint16_t		*actions;
+	unsigned char		*observations;
+	float				*rewards;
+	bool				*dones;
+
+	unsigned long long	steps;
+
+};
+
+
+
+// Episodes
+
+// Mixes the seed, environment and episode together (with splitmix64's finalizer), so that nearby environments and episodes
+// don't get nearby seeds.
+static unsigned int chip8_env_seedFor(unsigned int seed, size_t index, unsigned long long episode) {
+
+	uint64_t x = seed ^ ((uint64_t)index * 0x9E3779B97F4A7C15ull) ^ (episode * 0xD1B54A32D192ED03ull);
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	x ^= x >> 31;
+	return (unsigned int)(x >> 32);
+}
+
+static void chip8_env_begin(chip8_env *env, size_t index) {
+
+	chip8_env_slot *slot = &env->slots[index];
+	chip8_machine_fork(env->prototype, slot->machine);
+	chip8_machine_seed(slot->machine, chip8_env_seedFor(env->config.seed, index, slot->episode));
+	slot->episodeFrames = 0;
+}
+
+static void chip8_env_observe(chip8_env *env, size_t index) {
+
+	if (env->observations == NULL) {
+		return;
+	}
+
+	const chip8_machine *m = env->slots[index].machine;
+	unsigned char *observation = env->observations + index * chip8_env_observationSize(env);
+	if (env->config.observation == CHIP8_ENV_OBSERVE_PIXELS) {
+		chip8_machine_expandDisplay(m, (unsigned char (*)[64])observation);
+	}
+	else {
+		memcpy(observation, m->gfx, sizeof(m->gfx));
+	}
+}
+
+
+
+// Create / Destroy
+
+chip8_env *chip8_env_create(const chip8_machine *prototype, const chip8_env_config *config, const chip8_env_hooks *hooks, void *context) {
+
+	if (config->count == 0) {
+		return NULL;
+	}
+
+	chip8_env *env = calloc(1, sizeof(chip8_env));
+	if (env == NULL) {
+		return NULL;
+	}
+
+	env->config = *config;
+	if (env->config.frameSkip == 0) {
+		env->config.frameSkip = CHIP8_ENV_DEFAULT_FRAME_SKIP;
+	}
+	if (hooks != NULL) {
+		env->hooks = *hooks;
+	}
+	env->context = context;
+
+	env->prototype = chip8_machine_clone(prototype);
+	// aligned to the cache lines, which is more than calloc() promises (posix_memalign(), as the Mac only has aligned_alloc() from 10.15 on)
+	void *slots = NULL;
+	if (posix_memalign(&slots, _Alignof(chip8_env_slot), config->count * sizeof(chip8_env_slot)) == 0) {
+		memset(slots, 0, config->count * sizeof(chip8_env_slot));
+		env->slots = slots;
+	}
+	env->pool = chip8_pool_create(config->threads);
+	if (env->prototype == NULL || env->slots == NULL || env->pool == NULL) {
+		chip8_env_destroy(env);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < config->count; i++) {
+
+		chip8_machine *m = chip8_machine_create();
+		env->slots[i].machine = m;
+		if (m == NULL) {
+			chip8_env_destroy(env);
+			return NULL;
+		}
+
+		// a program translated ahead of time only goes with the quirks it was translated for, so the machine needs the prototype's
+		// before it gets an engine. After that, forking each episode keeps the engine, and whatever code it has translated
+		chip8_machine_fork(env->prototype, m);
+		bool available = (config->program != NULL) ? chip8_machine_setProgram(m, config->program) : chip8_machine_setEngine(m, config->engine);
+		if (!available) {
+			chip8_env_destroy(env);
+			return NULL;
+		}
+		chip8_env_begin(env, i);
+	}
+
+	return env;
+}
+
+void chip8_env_destroy(chip8_env *env) {
+
+	if (env == NULL) {
+		return;
+	}
+
+	chip8_pool_destroy(env->pool);
+	if (env->slots != NULL) {
+		for (size_t i = 0; i < env->config.count; i++) {
+			chip8_machine_destroy(env->slots[i].machine);
+		}
+		free(env->slots);
+	}
+	chip8_machine_destroy(env->prototype);
+	free(env);
+}
+
+size_t chip8_env_count(const chip8_env *env) {
+
+	return env->config.count;
+}
+
+size_t chip8_env_observationSize(const chip8_env *env) {
+
+	return (env->config.observation == CHIP8_ENV_OBSERVE_PIXELS) ? 64 * 32 : sizeof(((chip8_machine *)NULL)->gfx);
+}
+
+
+
+// Reset / Step
+
+static void chip8_env_resetOne(void *context, size_t index) {
+
+	// an episode that had started counts as over, so the next one gets random numbers of its own
+	chip8_env *env = context;
+	if (env->slots[index].episodeFrames != 0) {
+		env->slots[index].episode++;
+	}
+	chip8_env_begin(env, index);
+	chip8_env_observe(env, index);
+}
+
+void chip8_env_reset(chip8_env *env, void *observations) {
+
+	env->observations = observations;
+	chip8_pool_each(env->pool, env->config.count, chip8_env_resetOne, env);
+}
+
+static void chip8_env_stepOne(void *context, size_t index) {
+
+	chip8_env *env = context;
+	chip8_env_slot *slot = &env->slots[index];
+	chip8_machine *m = slot->machine;
+
+	// hold the action's keys down. Nobody observes these machines' keys, so there's no need to go through chip8_machine_setKeys()
+	m->keys = (env->actions != NULL) ? env->actions[index] : 0;
+
+	float reward = 0;
+	bool done = false;
+	for (unsigned int frame = 0; frame < env->config.frameSkip && !done; frame++) {
+
+		chip8_machine_runFrame(m);
+		slot->episodeFrames++;
+		slot->frames++;
+
+		if (env->hooks.reward != NULL) {
+			reward += env->hooks.reward(env->context, index, m);
+		}
+		if (env->hooks.done != NULL) {
+			done = env->hooks.done(env->context, index, m);
+		}
+		if (env->config.maxFrames != 0 && slot->episodeFrames >= env->config.maxFrames) {
+			done = true;
+		}
+	}
+
+	if (done) {
+		slot->episode++;
+		slot->finished++;
+		chip8_env_begin(env, index);
+	}
+
+	if (env->rewards != NULL) {
+		env->rewards[index] = reward;
+	}
+	if (env->dones != NULL) {
+		env->dones[index] = done;
+	}
+	chip8_env_observe(env, index);
+}
+
+void chip8_env_step(chip8_env *env, const uint16_t *actions, void *observations, float *rewards, bool *dones) {
+
+	env->actions		= actions;
+	env->observations	= observations;
+	env->rewards		= rewards;
+	env->dones			= dones;
+	chip8_pool_each(env->pool, env->config.count, chip8_env_stepOne, env);
+	env->steps++;
+}
+
+const chip8_machine *chip8_env_machine(const chip8_env *env, size_t index) {
+
+	return (index < env->config.count) ? env->slots[index].machine : NULL;
+}
+
+unsigned long long chip8_env_episodeFrames(const chip8_env *env, size_t index) {
+
+	return (index < env->config.count) ? env->slots[index].episodeFrames : 0;
+}
+
+
+
+// Statistics
+
+chip8_env_stats chip8_env_getStats(const chip8_env *env) {
+
+	chip8_env_stats stats = {
+		.steps		= env->steps,
+		.threads	= chip8_pool_threadCount(env->pool),
+	};
+	for (size_t i = 0; i < env->config.count; i++) {
+		stats.frames	+= env->slots[i].frames;
+		stats.episodes	+= env->slots[i].finished;
+	}
+	return stats;
+}
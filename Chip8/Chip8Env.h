@@ -0,0 +1,91 @@
+//
+//  Chip8Env.h
+//  Chip8
+//
+//  Runs a batch of machines as environments for an agent to play: reset, step with actions, observe, reward.
+//
+
+#ifndef __Chip8__Chip8Env__
+#define __Chip8__Chip8Env__
+
+#include "Chip8.h"
+
+
+#define CHIP8_ENV_DEFAULT_FRAME_SKIP	4		// frames each step runs for, when the config says 0
+
+
+typedef struct chip8_env chip8_env;
+
+// What an observation looks like. Either way, observation i starts i * chip8_env_observationSize() bytes into the buffer.
+typedef enum chip8_env_observation {
+
+	CHIP8_ENV_OBSERVE_ROWS,			// the screen as 32 uint64_t rows, exactly like chip8_machine.gfx (256 bytes)
+	CHIP8_ENV_OBSERVE_PIXELS,		// one byte per pixel (0 or 1), row by row, like chip8_machine_expandDisplay() (2048 bytes)
+
+} chip8_env_observation;
+
+typedef struct chip8_env_config {
+
+	size_t					count;			// environments
+	unsigned int			frameSkip;		// 60Hz frames each step runs for, with the action's keys held down
+	unsigned long long		maxFrames;		// an episode ends after this many frames, if done() hasn't ended it first (0 for no limit)
+	chip8_env_observation	observation;
+	chip8_engine			engine;			// CHIP8_ENGINE_INTERPRETER or CHIP8_ENGINE_JIT
+	const struct chip8_aot_program	*program;	// or run a program translated ahead of time (see chip8_machine_setProgram()). NULL for none
+	unsigned int			threads;		// threads to step on. 0 for one per online core
+	unsigned int			seed;			// CXNN's random numbers in each episode come from this, the environment and the episode number
+
+} chip8_env_config;
+
+// Tell the environments how the game is going. Both are optional, and both are called after every frame (so a step's reward is
+// the sum over its frames, and a step stops as soon as its episode is done). They're called on the stepping threads, several at
+// once for different environments, but never twice at once for the same one.
+typedef struct chip8_env_hooks {
+
+	float (*reward)(void *context, size_t index, const chip8_machine *machine);		// NULL for no rewards
+	bool (*done)(void *context, size_t index, const chip8_machine *machine);		// NULL if episodes only end at maxFrames
+
+} chip8_env_hooks;
+
+
+// Makes config->count copies of the machine (the way chip8_machine_fork() would), and starts the threads. Each episode starts
+// from the machine exactly as it is now, so load the ROM and run it to wherever the agent should take over first.
+// `hooks` is copied, and may be NULL. Returns NULL if there isn't the memory, the threads can't be started, or the engine isn't available.
+chip8_env *chip8_env_create(const chip8_machine *prototype, const chip8_env_config *config, const chip8_env_hooks *hooks, void *context);
+void chip8_env_destroy(chip8_env *env);
+
+size_t chip8_env_count(const chip8_env *env);
+size_t chip8_env_observationSize(const chip8_env *env);		// bytes in one environment's observation
+
+// The observations go straight from the machines into `observations`, which needs room for chip8_env_count() of them. Nothing
+// is allocated along the way, and there's no buffer in between: each environment's screen is copied out once a step (256
+// bytes as rows, or expanded to 2048 as pixels), by the thread that stepped it. Any of the buffers may be NULL, if you don't
+// need them.
+
+// Starts a new episode in every environment.
+void chip8_env_reset(chip8_env *env, void *observations);
+
+// Every environment runs frameSkip frames with the keys in its action held down (bit n for key n), and gets its reward, and
+// whether its episode is over. An environment whose episode is over starts its next one straight away, so its observation is
+// the first of the new episode (the way vectorised gym environments do it).
+void chip8_env_step(chip8_env *env, const uint16_t *actions, void *observations, float *rewards, bool *dones);
+
+// The machine behind an environment, for hooks or for looking at between steps (don't change it).
+const chip8_machine *chip8_env_machine(const chip8_env *env, size_t index);
+unsigned long long chip8_env_episodeFrames(const chip8_env *env, size_t index);	// frames since its episode started
+
+
+// Statistics
+typedef struct chip8_env_stats {
+
+	unsigned long long	steps;			// calls to chip8_env_step()
+	unsigned long long	frames;			// frames run, counting every environment
+	unsigned long long	episodes;		// episodes finished, counting every environment (not the ones chip8_env_reset() abandons)
+	unsigned int		threads;
+
+} chip8_env_stats;
+
+chip8_env_stats chip8_env_getStats(const chip8_env *env);
+
+
+#endif /* defined(__Chip8__Chip8Env__) */
@@ -0,0 +1,134 @@
+//
+//  Chip8Frames.c
+//  Chip8
+//
+//  Hands finished frames from the thread running a machine to the thread drawing it, without either of them waiting.
+//
+
+#include "Chip8Frames.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+/*
+ A triple buffer
+
+ There are three frames. The emulation thread owns one (the back frame) and writes the next frame into it. The render thread
+ owns another (the front frame) and draws from it. The third sits in the middle. Publishing swaps the back frame with the
+ middle one, and acquiring swaps the middle one with the front, each with a single atomic exchange. So neither thread ever
+ waits for the other, and neither ever sees a frame the other is still touching: the renderer always gets a whole frame,
+ never half of one frame and half of the next.
+
+ The middle index carries a FRESH bit, set when the emulation thread puts a frame there that the renderer hasn't taken yet.
+ Without it the renderer couldn't tell a new frame from the one it handed back last time. If the emulation thread publishes
+ twice before the renderer looks, the first of the two is simply written over, which is what a renderer wants (only the
+ latest frame is worth drawing) and is counted as skipped.
+
+ Each thread's own fields are on a cache line of their own, so the two threads only share the line holding the middle index.
+*/
+
+#define CHIP8_FRAMES_FRESH		4	// set in middle when the frame there hasn't been acquired yet
+#define CHIP8_FRAMES_INDEX		3
+
+
+struct chip8_frames {
+
+	chip8_frame			frames[3];
+
+	_Alignas(64) atomic_uint	middle;			// the frame in the middle, plus CHIP8_FRAMES_FRESH
+	atomic_ullong				published;
+
+	// the emulation thread's
+	_Alignas(64) unsigned int	back;
+	unsigned long long			sequence;
+
+	// the render thread's
+	_Alignas(64) unsigned int	front;
+	unsigned long long			acquired;		// the sequence number of the last frame acquired
+	unsigned long long			presented;		// ... and presented
+	chip8_frames_stats			stats;
+};
+
+
+chip8_frames *chip8_frames_create() {
+
+	chip8_frames *f = calloc(1, sizeof(chip8_frames));
+	if (f == NULL) {
+		return NULL;
+	}
+
+	f->front = 0;
+	atomic_init(&f->middle, 1);
+	atomic_init(&f->published, 0);
+	f->back = 2;
+	chip8_frames_resetStats(f);
+	return f;
+}
+
+void chip8_frames_destroy(chip8_frames *f) {
+
+	free(f);
+}
+
+
+
+// Emulation thread
+
+void chip8_frames_publish(chip8_frames *f, const chip8_machine *m) {
+
+	chip8_frame *frame = &f->frames[f->back];
+	memcpy(frame->gfx, m->gfx, sizeof(frame->gfx));
+	frame->sequence = ++f->sequence;
+	frame->cycles = m->cycles;
+	frame->publishedAt = chip8_now();
+
+	// release, so the renderer sees everything written above once it sees the index; acquire, because we're about to
+	// write into the frame the renderer just handed back
+	unsigned int old = atomic_exchange_explicit(&f->middle, f->back | CHIP8_FRAMES_FRESH, memory_order_acq_rel);
+	f->back = old & CHIP8_FRAMES_INDEX;
+	atomic_fetch_add_explicit(&f->published, 1, memory_order_relaxed);
+}
+
+
+
+// Render thread
+
+const chip8_frame *chip8_frames_acquire(chip8_frames *f) {
+
+	if (atomic_load_explicit(&f->middle, memory_order_relaxed) & CHIP8_FRAMES_FRESH) {
+		unsigned int old = atomic_exchange_explicit(&f->middle, f->front, memory_order_acq_rel);
+		f->front = old & CHIP8_FRAMES_INDEX;
+
+		const chip8_frame *frame = &f->frames[f->front];
+		if (frame->sequence > f->acquired + 1) {
+			f->stats.skipped += frame->sequence - f->acquired - 1;
+		}
+		f->acquired = frame->sequence;
+	}
+
+	return (f->acquired != 0) ? &f->frames[f->front] : NULL;
+}
+
+void chip8_frames_presented(chip8_frames *f, const chip8_frame *frame) {
+
+	// presenting the same frame again (a redraw after the window was uncovered, say) doesn't count
+	if (frame == NULL || frame->sequence == f->presented) {
+		return;
+	}
+	f->presented = frame->sequence;
+
+	f->stats.presented++;
+	chip8_latency_count(&f->stats.latency, chip8_now() - frame->publishedAt);
+}
+
+chip8_frames_stats chip8_frames_getStats(chip8_frames *f) {
+
+	chip8_frames_stats stats = f->stats;
+	stats.published = atomic_load_explicit(&f->published, memory_order_relaxed);
+	return stats;
+}
+
+void chip8_frames_resetStats(chip8_frames *f) {
+
+	memset(&f->stats, 0, sizeof(f->stats));
+}
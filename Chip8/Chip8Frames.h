@@ -0,0 +1,59 @@
+//
+//  Chip8Frames.h
+//  Chip8
+//
+//  Hands finished frames from the thread running a machine to the thread drawing it, without either of them waiting.
+//
+
+#ifndef __Chip8__Chip8Frames__
+#define __Chip8__Chip8Frames__
+
+#include "Chip8.h"
+
+
+typedef struct chip8_frames chip8_frames;
+
+// One finished frame: a copy of the screen, and where it came from.
+typedef struct chip8_frame {
+
+	uint64_t			gfx[32];		// the machine's gfx when the frame was published
+	unsigned long long	sequence;		// 1 for the first frame published, 2 for the next and so on
+	unsigned long long	cycles;			// the machine's cycle count when the frame was published
+	uint64_t			publishedAt;	// chip8_now() when the frame was published
+
+} chip8_frame;
+
+chip8_frames *chip8_frames_create();
+void chip8_frames_destroy(chip8_frames *frames);
+
+
+// Emulation thread
+// Copies the machine's screen into a new frame and makes it the latest. Never blocks. Only one thread may publish.
+void chip8_frames_publish(chip8_frames *frames, const chip8_machine *machine);
+
+
+// Render thread
+// Only one thread may call these.
+
+// Returns the latest frame published, which stays put until the next call (NULL if nothing has been published yet).
+// If nothing new has been published since the last call it's the same frame again, which the sequence number will tell you.
+const chip8_frame *chip8_frames_acquire(chip8_frames *frames);
+
+// Call this once the frame is on the screen, to count how long it took to get there.
+void chip8_frames_presented(chip8_frames *frames, const chip8_frame *frame);
+
+// Statistics
+// Latencies are from chip8_frames_publish() to chip8_frames_presented(), in nanoseconds.
+typedef struct chip8_frames_stats {
+
+	unsigned long long	published;		// frames published
+	unsigned long long	presented;		// frames presented
+	unsigned long long	skipped;		// frames replaced by a newer one before the render thread got to them
+	chip8_latency		latency;		// of every frame presented
+
+} chip8_frames_stats;
+
+chip8_frames_stats chip8_frames_getStats(chip8_frames *frames);	// call it from the render thread
+void chip8_frames_resetStats(chip8_frames *frames);				// likewise (published carries on counting)
+
+#endif /* defined(__Chip8__Chip8Frames__) */
@@ -0,0 +1,176 @@
+//
+//  Chip8Input.c
+//  Chip8
+//
+//  Hands key presses from the thread that sees them to the thread running the machine, without either of them waiting.
+//
+
+#include "Chip8Input.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ How key presses get to the machine
+
+ The keypad is the only thing that comes into the machine from outside, and it comes from another thread: the UI thread
+ sees the key go down, but the emulation thread owns the machine. So the UI thread pushes each press or release (with the
+ time it happened) onto a ring, and the emulation thread takes them off between frames. Like the audio ring, there's one
+ atomic index for each side, and only that side ever moves it on, so neither ever waits for the other.
+
+ Applying events only between frames means every key change lands on a frame boundary, which is a cycle count the core
+ works out for itself, whatever the host is doing. The recording stamps each change with that cycle, so a session plays
+ back exactly the way it was played.
+
+ A key that goes down and comes back up within one frame would never be seen by the game if both events were applied
+ together, because the game only looks at the keys while it runs. So each key changes at most once per boundary: a second
+ change to the same key stays in the queue (along with everything after it, to keep them in order) for the next frame.
+
+ The keys the machine ended up with are also kept in an atomic 16-bit mask, for any other thread that wants to know.
+*/
+
+#define CHIP8_INPUT_MASK	(CHIP8_INPUT_CAPACITY - 1)
+
+
+typedef struct chip8_input_event {
+
+	uint64_t		timestamp;
+	unsigned char	key;			// 0x0-0xF
+	bool			down;
+
+} chip8_input_event;
+
+struct chip8_input {
+
+	chip8_input_event		ring[CHIP8_INPUT_CAPACITY];
+
+	// the input thread's
+	_Alignas(64) atomic_size_t	writeIndex;		// events ever pushed (so the next one goes in ring[writeIndex & CHIP8_INPUT_MASK])
+	atomic_ullong				pushed;
+	atomic_ullong				dropped;
+
+	// the emulation thread's
+	_Alignas(64) atomic_size_t	readIndex;
+	atomic_uint_least16_t		keys;
+	chip8_input_stats			stats;
+};
+
+
+chip8_input *chip8_input_create() {
+
+	chip8_input *input = calloc(1, sizeof(chip8_input));
+	if (input == NULL) {
+		return NULL;
+	}
+
+	atomic_init(&input->writeIndex, 0);
+	atomic_init(&input->readIndex, 0);
+	atomic_init(&input->keys, 0);
+	chip8_input_resetStats(input);
+	return input;
+}
+
+void chip8_input_destroy(chip8_input *input) {
+
+	free(input);
+}
+
+
+
+// Input thread
+
+bool chip8_input_push(chip8_input *input, unsigned char k, bool down, uint64_t timestamp) {
+
+	int index = chip8_keyIndex(k);
+	if (index < 0) {
+		return false;
+	}
+
+	// only this thread changes the counters, so there's no need for an atomic add
+	size_t w = atomic_load_explicit(&input->writeIndex, memory_order_relaxed);
+	size_t r = atomic_load_explicit(&input->readIndex, memory_order_acquire);
+	if (w - r == CHIP8_INPUT_CAPACITY) {
+		atomic_store_explicit(&input->dropped, atomic_load_explicit(&input->dropped, memory_order_relaxed) + 1, memory_order_relaxed);
+		return false;
+	}
+
+	input->ring[w & CHIP8_INPUT_MASK] = (chip8_input_event){ timestamp, (unsigned char)index, down };
+
+	// release, so the emulation thread sees the event before the index that says it's there
+	atomic_store_explicit(&input->writeIndex, w + 1, memory_order_release);
+	atomic_store_explicit(&input->pushed, atomic_load_explicit(&input->pushed, memory_order_relaxed) + 1, memory_order_relaxed);
+	return true;
+}
+
+
+
+// Emulation thread
+
+unsigned int chip8_input_apply(chip8_input *input, chip8_machine *m) {
+
+	size_t r = atomic_load_explicit(&input->readIndex, memory_order_relaxed);
+	size_t w = atomic_load_explicit(&input->writeIndex, memory_order_acquire);
+	if (r == w) {
+		atomic_store_explicit(&input->keys, m->keys, memory_order_relaxed);
+		return 0;
+	}
+
+	uint64_t now = chip8_now();
+	uint16_t keys = m->keys;
+	uint16_t changed = 0;
+	unsigned int applied = 0;
+
+	for (; r != w; r++) {
+		const chip8_input_event *event = &input->ring[r & CHIP8_INPUT_MASK];
+		uint16_t bit = (uint16_t)(1 << event->key);
+
+		if (((keys & bit) != 0) == event->down) {
+			input->stats.repeats++;
+			continue;
+		}
+		if (changed & bit) {
+			input->stats.deferred++;
+			break;
+		}
+		keys ^= bit;
+		changed |= bit;
+		applied++;
+
+		chip8_latency_count(&input->stats.latency, (now > event->timestamp) ? now - event->timestamp : 0);
+	}
+
+	// release, so the input thread doesn't write over the events until we're done with them
+	atomic_store_explicit(&input->readIndex, r, memory_order_release);
+
+	chip8_machine_setKeys(m, keys);
+	atomic_store_explicit(&input->keys, keys, memory_order_relaxed);
+	input->stats.applied += applied;
+	return applied;
+}
+
+
+
+// Any thread
+
+uint16_t chip8_input_keys(chip8_input *input) {
+
+	return atomic_load_explicit(&input->keys, memory_order_relaxed);
+}
+
+
+
+// Statistics
+
+chip8_input_stats chip8_input_getStats(chip8_input *input) {
+
+	chip8_input_stats stats = input->stats;
+	stats.pushed = atomic_load_explicit(&input->pushed, memory_order_relaxed);
+	stats.dropped = atomic_load_explicit(&input->dropped, memory_order_relaxed);
+	return stats;
+}
+
+void chip8_input_resetStats(chip8_input *input) {
+
+	memset(&input->stats, 0, sizeof(input->stats));
+}
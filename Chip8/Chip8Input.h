@@ -0,0 +1,63 @@
+//
+//  Chip8Input.h
+//  Chip8
+//
+//  Hands key presses from the thread that sees them to the thread running the machine, without either of them waiting.
+//
+
+#ifndef __Chip8__Chip8Input__
+#define __Chip8__Chip8Input__
+
+#include "Chip8.h"
+
+
+#define CHIP8_INPUT_CAPACITY	256		// key events that can be waiting to be applied (a power of two)
+
+
+typedef struct chip8_input chip8_input;
+
+chip8_input *chip8_input_create();
+void chip8_input_destroy(chip8_input *input);
+
+
+// Input thread
+// Only one thread may push. It never waits.
+
+// Queues a keypad key ('0'-'9', 'A'-'F') going down or up at `timestamp` (from chip8_now(), or the time the event happened,
+// if you know it: on the Mac an NSEvent's timestamp is on the same clock). Returns false if the queue is full, in which case the event is dropped.
+bool chip8_input_push(chip8_input *input, unsigned char k, bool down, uint64_t timestamp);
+
+
+// Emulation thread
+// Only one thread may call these.
+
+// Presses and releases the machine's keys for the events waiting, and returns how many of them changed anything. Call it
+// between frames (before running each one), so key changes always land on a frame boundary, and the recording (the key
+// observer) sees them on that cycle. Each key changes at most once per call, so a press and release that both arrive
+// within a frame still hold the key down for a whole frame: the release waits in the queue for the next call.
+unsigned int chip8_input_apply(chip8_input *input, chip8_machine *machine);
+
+
+// Any thread
+
+// The keys held down as of the last chip8_input_apply() (bit n for key n).
+uint16_t chip8_input_keys(chip8_input *input);
+
+
+// Statistics
+// Latencies are from an event's timestamp to the chip8_input_apply() that applied it, in nanoseconds.
+typedef struct chip8_input_stats {
+
+	unsigned long long	pushed;			// events queued
+	unsigned long long	dropped;		// events pushed while the queue was full
+	unsigned long long	applied;		// events that pressed or released a key
+	unsigned long long	repeats;		// events that didn't change anything (key repeat, or a release for a key that was never down)
+	unsigned long long	deferred;		// times a second change to the same key had to wait for the next chip8_input_apply()
+	chip8_latency		latency;		// of every event applied
+
+} chip8_input_stats;
+
+chip8_input_stats chip8_input_getStats(chip8_input *input);		// call it from the emulation thread
+void chip8_input_resetStats(chip8_input *input);				// likewise (pushed and dropped carry on counting)
+
+#endif /* defined(__Chip8__Chip8Input__) */
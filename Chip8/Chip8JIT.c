@@ -0,0 +1,944 @@
+//
+//  Chip8JIT.c
+//  Chip8
+//
+//  Translates Chip8 code into native x86-64 code.
+//
+
+#include "Chip8JIT.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ How the JIT works
+
+ Chip8 code is translated one basic block at a time. A block is a straight run of instructions that ends at the first
+ instruction that can change the flow of control (1NNN, 2NNN, 00EE, BNNN and the skips 3XNN, 4XNN, 5XY0, 9XY0, EX9E, EXA1).
+ Most instructions turn into one or two x86 instructions that work directly on the chip8_machine in memory.
+ The bulky ones (00E0, DXYN, FX33, FX55, FX65) call back into the interpreter's handler for that one instruction.
+ A few (CXNN, FX0A, FX18 and anything we don't recognise) are never translated at all. Blocks stop just before them
+ and the JIT hands that instruction to the interpreter.
+
+ While native code runs these registers are reserved:
+	rbx		the chip8_machine
+	r12		the cycle budget. Every block subtracts its length on entry and bails out to the JIT if there isn't enough left.
+	r13		the table of translated blocks (jit->blocks), used to jump straight to the target of 00EE and BNNN
+	r14		where to store the remaining budget on exit
+
+ Block chaining
+ When a block ends with a jump to a known address (1NNN, 2NNN, either side of a skip, or just falling into the next block)
+ its exit is a `jmp` to a small stub that returns to the JIT with the address of that `jmp`. Once the target block has been
+ translated, the JIT patches the `jmp` to go straight to it, so hot loops run entirely in native code until the budget runs out.
+ The exception is a jump to an idle loop (see chip8_machine_skipIdle()), which is left coming back here, so the loop can be
+ skipped instead of run.
+
+ Self-modifying code
+ jit->codeMap marks every byte of memory that has been translated. chip8_store() in Chip8.c checks it on every store, and if
+ a program writes over translated code the whole translation cache is thrown away (which also throws away every chained jump into it).
+ If that happens in the middle of a block, the block returns to the JIT straight after the store.
+
+ Timers
+ The 60Hz timers count down after a fixed number of instructions (see chip8_machine_setClockRate()), so the budget handed
+ to native code never goes past the next tick. The tick then happens between exactly the same two instructions it would
+ on the interpreter. A block that doesn't fit in what's left before the tick is interpreted one instruction at a time.
+*/
+
+#if CHIP8_JIT_AVAILABLE
+
+#include <sys/mman.h>
+
+#define CHIP8_JIT_CODE_SIZE			(4 * 1024 * 1024)	// size of the buffer native code is written into
+#define CHIP8_JIT_MAX_BLOCK			64					// the longest block we'll translate, in Chip8 instructions
+#define CHIP8_JIT_MAX_BLOCK_BYTES	8192				// more native code than the longest block could ever need
+
+#define CHIP8_JIT_BAIL				((void *)1)			// returned by native code when the current instruction must be interpreted
+
+
+typedef void *(*chip8_jit_entry)(chip8_machine *m, void *code, long *budget, void **blocks);
+
+struct chip8_jit {
+
+	chip8_machine	*machine;
+
+	unsigned char	*code;					// executable buffer
+	size_t			used;					// bytes of the buffer in use
+	size_t			reserved;				// bytes at the start of the buffer that survive a flush (the entry trampoline)
+	size_t			exitStub;				// offset of the common exit path
+	chip8_jit_entry	enter;					// the entry trampoline
+
+	void			*blocks[2048];			// native code for the block starting at each even address (NULL if not translated)
+	unsigned short	blockLength[2048];		// number of instructions in each block
+	unsigned char	noBlock[2048];			// set when the instruction at that address always goes to the interpreter
+	unsigned char	codeMap[4096];			// set for every byte of memory that has been translated
+
+	unsigned int	quirks;					// the CHIP8_QUIRK_ flags the code is being translated for (setting new quirks flushes it)
+
+	bool			flushPending;			// translated code was written to, flush before running anything else
+	unsigned long	generation;				// bumped on every flush, so stale chain sites are never patched
+
+	bool			stopOnDraw;				// leave native code straight after an instruction that draws
+	bool			drew;					// ... and this says that's why we left
+
+	bool			validate;
+	chip8_machine	*shadow;				// in validate mode, the interpreter's copy of the machine
+
+	chip8_jit_stats	stats;
+};
+
+
+// x86-64 registers (only the ones we use)
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3 };
+
+// x86-64 condition codes for jcc (the low nibble of 0x0F 0x8?)
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_GE = 0xD };
+
+// Byte offsets of the machine's registers from rbx
+#define OFF_V(r)		((int32_t)(offsetof(chip8_machine, V) + (r)))
+#define OFF_I			((int32_t)offsetof(chip8_machine, I))
+#define OFF_PC			((int32_t)offsetof(chip8_machine, pc))
+#define OFF_SP			((int32_t)offsetof(chip8_machine, sp))
+#define OFF_STACK		((int32_t)offsetof(chip8_machine, stack))
+#define OFF_KEYS		((int32_t)offsetof(chip8_machine, keys))
+#define OFF_DT			((int32_t)offsetof(chip8_machine, delay_timer))
+
+
+
+// Code emission
+
+static inline void emit8(chip8_jit *jit, uint8_t b) {
+	jit->code[jit->used++] = b;
+}
+
+static inline void emit16(chip8_jit *jit, uint16_t v) {
+	memcpy(&jit->code[jit->used], &v, 2);
+	jit->used += 2;
+}
+
+static inline void emit32(chip8_jit *jit, uint32_t v) {
+	memcpy(&jit->code[jit->used], &v, 4);
+	jit->used += 4;
+}
+
+static inline void emit64(chip8_jit *jit, uint64_t v) {
+	memcpy(&jit->code[jit->used], &v, 8);
+	jit->used += 8;
+}
+
+static void emitBytes(chip8_jit *jit, const uint8_t *bytes, size_t count) {
+	memcpy(&jit->code[jit->used], bytes, count);
+	jit->used += count;
+}
+
+// ModRM + disp32 for [rbx + disp]
+static inline void emitMem(chip8_jit *jit, int reg, int32_t disp) {
+	emit8(jit, 0x80 | (reg << 3) | RBX);
+	emit32(jit, (uint32_t)disp);
+}
+
+// <op> reg8/reg32, [rbx + disp]  (or [rbx + disp], reg8 depending on op)
+static inline void emitOpMem(chip8_jit *jit, uint8_t op, int reg, int32_t disp) {
+	emit8(jit, op);
+	emitMem(jit, reg, disp);
+}
+
+static inline void emitMovzxByte(chip8_jit *jit, int reg, int32_t disp) {	// movzx reg32, byte [rbx + disp]
+	emit8(jit, 0x0F);
+	emitOpMem(jit, 0xB6, reg, disp);
+}
+
+static inline void emitMovzxWord(chip8_jit *jit, int reg, int32_t disp) {	// movzx reg32, word [rbx + disp]
+	emit8(jit, 0x0F);
+	emitOpMem(jit, 0xB7, reg, disp);
+}
+
+static inline void emitStoreWordImm(chip8_jit *jit, int32_t disp, uint16_t value) {	// mov word [rbx + disp], imm16
+	emit8(jit, 0x66);
+	emitOpMem(jit, 0xC7, 0, disp);
+	emit16(jit, value);
+}
+
+static inline void emitBudget(chip8_jit *jit, uint8_t modrm, uint32_t count) {	// cmp/sub/add r12, imm32
+	emit8(jit, 0x49);
+	emit8(jit, 0x81);
+	emit8(jit, modrm);
+	emit32(jit, count);
+}
+
+#define emitCmpBudget(jit, n)	emitBudget(jit, 0xFC, n)
+#define emitSubBudget(jit, n)	emitBudget(jit, 0xEC, n)
+#define emitAddBudget(jit, n)	emitBudget(jit, 0xC4, n)
+
+// jcc rel32, returns the offset of the rel32 so it can be patched with emitPatchHere()
+static inline size_t emitJcc(chip8_jit *jit, int cc) {
+	emit8(jit, 0x0F);
+	emit8(jit, 0x80 | cc);
+	emit32(jit, 0);
+	return jit->used - 4;
+}
+
+static inline void emitPatchHere(chip8_jit *jit, size_t rel32) {
+	int32_t rel = (int32_t)(jit->used - (rel32 + 4));
+	memcpy(&jit->code[rel32], &rel, 4);
+}
+
+static inline void emitJmpTo(chip8_jit *jit, size_t target) {	// jmp rel32
+	emit8(jit, 0xE9);
+	emit32(jit, (uint32_t)(int32_t)(target - (jit->used + 4)));
+}
+
+// Leave native code with pc already stored. rax tells the JIT what happened.
+static void emitExit(chip8_jit *jit, bool bail) {
+
+	if (bail) {
+		emit8(jit, 0xB8);			// mov eax, 1
+		emit32(jit, 1);
+	}
+	else {
+		emit8(jit, 0x31);			// xor eax, eax
+		emit8(jit, 0xC0);
+	}
+	emitJmpTo(jit, jit->exitStub);
+}
+
+// Leave the block for a known address. If the target can be translated the exit is chainable.
+static void emitExitTo(chip8_jit *jit, uint32_t target) {
+
+	emitStoreWordImm(jit, OFF_PC, (uint16_t)target);
+
+	if (target > 0xFFE || (target & 1)) {
+		emitExit(jit, false);
+		return;
+	}
+
+	// jmp stub (patched later to jump straight to the target block)
+	emit8(jit, 0xE9);
+	size_t site = jit->used;
+	emit32(jit, 0);
+
+	// stub: return the address of the jmp's rel32 so the JIT can patch it
+	emit8(jit, 0x48);
+	emit8(jit, 0xB8);
+	emit64(jit, (uint64_t)(uintptr_t)&jit->code[site]);
+	emitJmpTo(jit, jit->exitStub);
+}
+
+// Leave the block for whatever address is in m->pc. If that block is already translated, jump straight to it.
+static void emitExitDynamic(chip8_jit *jit) {
+
+	static const uint8_t lookup[] = {
+		0x3D, 0xFE, 0x0F, 0x00, 0x00,		// cmp eax, 0xFFE
+	};
+
+	emitMovzxWord(jit, RAX, OFF_PC);
+	emitBytes(jit, lookup, sizeof(lookup));
+	size_t tooHigh = emitJcc(jit, CC_A);
+	emit8(jit, 0xA8);						// test al, 1
+	emit8(jit, 0x01);
+	size_t odd = emitJcc(jit, CC_NE);
+
+	static const uint8_t jump[] = {
+		0x49, 0x8B, 0x44, 0x85, 0x00,		// mov rax, [r13 + rax*4]	(blocks[pc >> 1])
+		0x48, 0x85, 0xC0,					// test rax, rax
+	};
+	emitBytes(jit, jump, sizeof(jump));
+	size_t missing = emitJcc(jit, CC_E);
+	emit8(jit, 0xFF);						// jmp rax
+	emit8(jit, 0xE0);
+
+	emitPatchHere(jit, tooHigh);
+	emitPatchHere(jit, odd);
+	emitPatchHere(jit, missing);
+	emitExit(jit, false);
+}
+
+// Hand the instruction at `pc` back to the interpreter. `remaining` is the number of block instructions from this one onwards.
+static void emitBail(chip8_jit *jit, unsigned short pc, uint32_t remaining) {
+
+	emitAddBudget(jit, remaining);
+	emitStoreWordImm(jit, OFF_PC, pc);
+	emitExit(jit, true);
+}
+
+
+
+// Translation
+
+static inline unsigned short chip8_jit_opcodeAt(chip8_machine *m, unsigned short address) {
+	return (unsigned short)((m->memory[address & 0xFFF] << 8) | m->memory[(address + 1) & 0xFFF]);
+}
+
+typedef enum chip8_jit_kind {
+
+	KIND_INTERPRET,		// never translated, always run by the interpreter
+	KIND_NATIVE,		// translated straight to x86
+	KIND_HELPER,		// translated to a call to the interpreter's handler
+	KIND_BRANCH,		// translated, and ends the block
+
+} chip8_jit_kind;
+
+static chip8_jit_kind chip8_jit_classify(unsigned short opcode) {
+
+	switch (opcode >> 12) {
+		case 0x0:
+			if (opcode == 0x00E0) return KIND_HELPER;
+			if (opcode == 0x00EE) return KIND_BRANCH;
+			return KIND_INTERPRET;
+		case 0x1: case 0x2: case 0x3: case 0x4: case 0xB:
+			return KIND_BRANCH;
+		case 0x5: case 0x9:
+			return (opcode & 0xF) == 0 ? KIND_BRANCH : KIND_INTERPRET;
+		case 0x6: case 0x7: case 0xA:
+			return KIND_NATIVE;
+		case 0x8:
+			switch (opcode & 0xF) {
+				case 0x0: case 0x1: case 0x2: case 0x3: case 0x4: case 0x5: case 0x6: case 0x7: case 0xE:
+					return KIND_NATIVE;
+			}
+			return KIND_INTERPRET;
+		case 0xC:
+			return KIND_INTERPRET;		// CXNN needs the interpreter's random numbers
+		case 0xD:
+			return KIND_HELPER;
+		case 0xE:
+			return ((opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1) ? KIND_BRANCH : KIND_INTERPRET;
+		case 0xF:
+			switch (opcode & 0xFF) {
+				case 0x07: case 0x15: case 0x1E: case 0x29:
+					return KIND_NATIVE;
+				case 0x33: case 0x55: case 0x65:
+					return KIND_HELPER;
+			}
+			return KIND_INTERPRET;		// including FX0A, which waits for a key, and FX18, whose sound observer wants the exact cycle
+	}
+	return KIND_INTERPRET;
+}
+
+// Checks whether the instruction at pc draws to the screen, for chip8_jit_run()'s stopOnDraw.
+static bool chip8_jit_draws(chip8_jit *jit) {
+
+	chip8_machine *m = jit->machine;
+	unsigned short opcode = chip8_jit_opcodeAt(m, m->pc);
+
+	if (jit->stopOnDraw && (opcode == 0x00E0 || (opcode & 0xF000) == 0xD000)) {
+		jit->drew = true;
+	}
+	return jit->drew;
+}
+
+// Runs one instruction through the interpreter from native code.
+// Returns non-zero if native code has to stop, because the translation cache needs flushing or the caller wanted to stop after a draw.
+static int chip8_jit_helper(chip8_machine *m) {
+
+	chip8_jit *jit = m->jit;
+	bool drew = chip8_jit_draws(jit);
+
+	chip8_machine_execute(m);
+	return jit->flushPending || drew;
+}
+
+static void chip8_jit_emitHelper(chip8_jit *jit, unsigned short pc, uint32_t remainingAfter) {
+
+	static const uint8_t call[] = {
+		0x48, 0x89, 0xDF,					// mov rdi, rbx
+		0x48, 0xB8,							// mov rax, imm64
+	};
+	static const uint8_t check[] = {
+		0xFF, 0xD0,							// call rax
+		0x85, 0xC0,							// test eax, eax
+	};
+
+	emitStoreWordImm(jit, OFF_PC, pc);
+	emitBytes(jit, call, sizeof(call));
+	emit64(jit, (uint64_t)(uintptr_t)chip8_jit_helper);
+	emitBytes(jit, check, sizeof(check));
+	size_t carryOn = emitJcc(jit, CC_E);
+
+	// the store hit translated code (or we were asked to stop after drawing), give back the budget for the rest of the block and leave (the handler already moved pc on)
+	emitAddBudget(jit, remainingAfter);
+	emitExit(jit, false);
+
+	emitPatchHere(jit, carryOn);
+}
+
+// VF = 0 after 8XY1, 8XY2 and 8XY3, but only with CHIP8_QUIRK_VF_RESET
+static void chip8_jit_emitVFReset(chip8_jit *jit) {
+
+	if (jit->quirks & CHIP8_QUIRK_VF_RESET) {
+		emitOpMem(jit, 0xC6, 0, OFF_V(0xF));		// mov byte [VF], 0
+		emit8(jit, 0);
+	}
+}
+
+static void chip8_jit_emitNative(chip8_jit *jit, unsigned short opcode) {
+
+	int X = (opcode >> 8) & 0xF;
+	int Y = (opcode >> 4) & 0xF;
+	int S = (jit->quirks & CHIP8_QUIRK_SHIFT_VY) ? Y : X;		// the register 8XY6 and 8XYE shift
+	uint8_t NN = opcode & 0xFF;
+	uint16_t NNN = opcode & 0xFFF;
+
+	switch (opcode >> 12) {
+		case 0x6:										// VX = NN
+			emitOpMem(jit, 0xC6, 0, OFF_V(X));			// mov byte [VX], NN
+			emit8(jit, NN);
+			return;
+		case 0x7:										// VX += NN
+			emitOpMem(jit, 0x80, 0, OFF_V(X));			// add byte [VX], NN
+			emit8(jit, NN);
+			return;
+		case 0xA:										// I = NNN
+			emitStoreWordImm(jit, OFF_I, NNN);
+			return;
+		case 0x8:
+			switch (opcode & 0xF) {
+				case 0x0:								// VX = VY
+					emitOpMem(jit, 0x8A, RAX, OFF_V(Y));	// mov al, [VY]
+					emitOpMem(jit, 0x88, RAX, OFF_V(X));	// mov [VX], al
+					return;
+				case 0x1:								// VX |= VY
+					emitOpMem(jit, 0x8A, RAX, OFF_V(Y));
+					emitOpMem(jit, 0x08, RAX, OFF_V(X));	// or [VX], al
+					chip8_jit_emitVFReset(jit);
+					return;
+				case 0x2:								// VX &= VY
+					emitOpMem(jit, 0x8A, RAX, OFF_V(Y));
+					emitOpMem(jit, 0x20, RAX, OFF_V(X));	// and [VX], al
+					chip8_jit_emitVFReset(jit);
+					return;
+				case 0x3:								// VX ^= VY
+					emitOpMem(jit, 0x8A, RAX, OFF_V(Y));
+					emitOpMem(jit, 0x30, RAX, OFF_V(X));	// xor [VX], al
+					chip8_jit_emitVFReset(jit);
+					return;
+				case 0x4:								// VF = carry, then VX += VY (in that order, same as the interpreter)
+					emitMovzxByte(jit, RAX, OFF_V(X));
+					emitMovzxByte(jit, RCX, OFF_V(Y));
+					emit8(jit, 0x00); emit8(jit, 0xC8);			// add al, cl
+					emit8(jit, 0x0F); emit8(jit, 0x92); emit8(jit, 0xC2);	// setc dl
+					emitOpMem(jit, 0x88, RDX, OFF_V(0xF));		// mov [VF], dl
+					emitOpMem(jit, 0x8A, RAX, OFF_V(X));		// mov al, [VX]
+					emitOpMem(jit, 0x02, RAX, OFF_V(Y));		// add al, [VY]
+					emitOpMem(jit, 0x88, RAX, OFF_V(X));		// mov [VX], al
+					return;
+				case 0x5:								// VF = !borrow, then VX -= VY
+					emitOpMem(jit, 0x8A, RAX, OFF_V(X));		// mov al, [VX]
+					emitOpMem(jit, 0x3A, RAX, OFF_V(Y));		// cmp al, [VY]
+					emit8(jit, 0x0F); emit8(jit, 0x93); emit8(jit, 0xC2);	// setnc dl
+					emitOpMem(jit, 0x88, RDX, OFF_V(0xF));
+					emitOpMem(jit, 0x8A, RAX, OFF_V(X));
+					emitOpMem(jit, 0x2A, RAX, OFF_V(Y));		// sub al, [VY]
+					emitOpMem(jit, 0x88, RAX, OFF_V(X));
+					return;
+				case 0x6:								// VF = VS & 1, then VX = VS >> 1 (VS is VX, or VY with CHIP8_QUIRK_SHIFT_VY)
+					emitOpMem(jit, 0x8A, RAX, OFF_V(S));
+					emit8(jit, 0x24); emit8(jit, 0x01);			// and al, 1
+					emitOpMem(jit, 0x88, RAX, OFF_V(0xF));
+					if (S != X) {
+						emitOpMem(jit, 0x8A, RAX, OFF_V(S));	// mov al, [VS]	(after VF, in case VS is VF)
+						emitOpMem(jit, 0x88, RAX, OFF_V(X));	// mov [VX], al
+					}
+					emitOpMem(jit, 0xD0, 5, OFF_V(X));			// shr byte [VX], 1
+					return;
+				case 0x7:								// VF = !borrow, then VX = VY - VX
+					emitOpMem(jit, 0x8A, RAX, OFF_V(Y));		// mov al, [VY]
+					emitOpMem(jit, 0x3A, RAX, OFF_V(X));		// cmp al, [VX]
+					emit8(jit, 0x0F); emit8(jit, 0x93); emit8(jit, 0xC2);	// setnc dl
+					emitOpMem(jit, 0x88, RDX, OFF_V(0xF));
+					emitOpMem(jit, 0x8A, RAX, OFF_V(Y));
+					emitOpMem(jit, 0x2A, RAX, OFF_V(X));		// sub al, [VX]
+					emitOpMem(jit, 0x88, RAX, OFF_V(X));
+					return;
+				case 0xE:								// VF = VS >> 7, then VX = VS << 1
+					emitOpMem(jit, 0x8A, RAX, OFF_V(S));
+					emit8(jit, 0xC0); emit8(jit, 0xE8); emit8(jit, 0x07);	// shr al, 7
+					emitOpMem(jit, 0x88, RAX, OFF_V(0xF));
+					if (S != X) {
+						emitOpMem(jit, 0x8A, RAX, OFF_V(S));
+						emitOpMem(jit, 0x88, RAX, OFF_V(X));
+					}
+					emitOpMem(jit, 0xD0, 4, OFF_V(X));			// shl byte [VX], 1
+					return;
+			}
+			break;
+		case 0xF:
+			switch (opcode & 0xFF) {
+				case 0x07:								// VX = delay timer
+					emitOpMem(jit, 0x8A, RAX, OFF_DT);
+					emitOpMem(jit, 0x88, RAX, OFF_V(X));
+					return;
+				case 0x15:								// delay timer = VX
+					emitOpMem(jit, 0x8A, RAX, OFF_V(X));
+					emitOpMem(jit, 0x88, RAX, OFF_DT);
+					return;
+				case 0x1E:								// I += VX
+					emitMovzxByte(jit, RAX, OFF_V(X));
+					emit8(jit, 0x66);
+					emitOpMem(jit, 0x01, RAX, OFF_I);			// add [I], ax
+					return;
+				case 0x29:								// I = VX * 5
+					emitMovzxByte(jit, RAX, OFF_V(X));
+					emit8(jit, 0x8D); emit8(jit, 0x04); emit8(jit, 0x80);	// lea eax, [rax + rax*4]
+					emit8(jit, 0x66);
+					emitOpMem(jit, 0x89, RAX, OFF_I);			// mov [I], ax
+					return;
+			}
+			break;
+	}
+}
+
+static void chip8_jit_emitBranch(chip8_jit *jit, unsigned short opcode, unsigned short pc, uint32_t remaining) {
+
+	int X = (opcode >> 8) & 0xF;
+	int Y = (opcode >> 4) & 0xF;
+	uint8_t NN = opcode & 0xFF;
+	uint16_t NNN = opcode & 0xFFF;
+	size_t noSkip;
+
+	switch (opcode >> 12) {
+		case 0x0: {										// 00EE return
+			emitMovzxWord(jit, RAX, OFF_SP);
+			emit8(jit, 0x85); emit8(jit, 0xC0);			// test eax, eax
+			size_t ok = emitJcc(jit, CC_NE);
+			emitBail(jit, pc, remaining);				// stack underflow, let the interpreter complain about it
+			emitPatchHere(jit, ok);
+			emit8(jit, 0xFF); emit8(jit, 0xC8);			// dec eax
+			emit8(jit, 0x66);
+			emitOpMem(jit, 0x89, RAX, OFF_SP);			// mov [sp], ax
+			emit8(jit, 0x0F); emit8(jit, 0xB7); emit8(jit, 0x8C); emit8(jit, 0x43);	// movzx ecx, word [rbx + rax*2 + stack]
+			emit32(jit, (uint32_t)OFF_STACK);
+			emit8(jit, 0x66);
+			emitOpMem(jit, 0x89, RCX, OFF_PC);			// mov [pc], cx
+			emitExitDynamic(jit);
+			return;
+		}
+		case 0x1:										// jump
+			emitExitTo(jit, NNN);
+			return;
+		case 0x2: {										// call
+			emitMovzxWord(jit, RAX, OFF_SP);
+			emit8(jit, 0x83); emit8(jit, 0xF8); emit8(jit, 14);	// cmp eax, 14
+			size_t ok = emitJcc(jit, CC_BE);
+			emitBail(jit, pc, remaining);				// stack overflow
+			emitPatchHere(jit, ok);
+			emit8(jit, 0x66); emit8(jit, 0xC7); emit8(jit, 0x84); emit8(jit, 0x43);	// mov word [rbx + rax*2 + stack], pc + 2
+			emit32(jit, (uint32_t)OFF_STACK);
+			emit16(jit, (uint16_t)(pc + 2));
+			emit8(jit, 0x66);
+			emitOpMem(jit, 0x83, 0, OFF_SP);			// add word [sp], 1
+			emit8(jit, 1);
+			emitExitTo(jit, NNN);
+			return;
+		}
+		case 0xB:										// jump to NNN + V0 (or VX, with CHIP8_QUIRK_JUMP_VX)
+			emitMovzxByte(jit, RAX, OFF_V((jit->quirks & CHIP8_QUIRK_JUMP_VX) ? X : 0));
+			emit8(jit, 0x05);							// add eax, NNN
+			emit32(jit, NNN);
+			emit8(jit, 0x66);
+			emitOpMem(jit, 0x89, RAX, OFF_PC);
+			emitExitDynamic(jit);
+			return;
+		case 0x3:										// skip if VX == NN
+			emitOpMem(jit, 0x80, 7, OFF_V(X));			// cmp byte [VX], NN
+			emit8(jit, NN);
+			noSkip = emitJcc(jit, CC_NE);
+			break;
+		case 0x4:										// skip if VX != NN
+			emitOpMem(jit, 0x80, 7, OFF_V(X));
+			emit8(jit, NN);
+			noSkip = emitJcc(jit, CC_E);
+			break;
+		case 0x5:										// skip if VX == VY
+			emitOpMem(jit, 0x8A, RAX, OFF_V(X));
+			emitOpMem(jit, 0x3A, RAX, OFF_V(Y));
+			noSkip = emitJcc(jit, CC_NE);
+			break;
+		case 0x9:										// skip if VX != VY
+			emitOpMem(jit, 0x8A, RAX, OFF_V(X));
+			emitOpMem(jit, 0x3A, RAX, OFF_V(Y));
+			noSkip = emitJcc(jit, CC_E);
+			break;
+		case 0xE: {										// skip if key VX is (EX9E) or isn't (EXA1) pressed
+			emitMovzxByte(jit, RCX, OFF_V(X));
+			emit8(jit, 0x83); emit8(jit, 0xE1); emit8(jit, 0x0F);	// and ecx, 15
+			emitMovzxWord(jit, RAX, OFF_KEYS);
+			emit8(jit, 0x0F); emit8(jit, 0xA3); emit8(jit, 0xC8);	// bt eax, ecx (the key's bit goes in the carry flag)
+			noSkip = emitJcc(jit, (NN == 0x9E) ? CC_AE : CC_B);
+			break;
+		}
+		default:
+			return;
+	}
+
+	// the skips
+	emitExitTo(jit, pc + 4u);
+	emitPatchHere(jit, noSkip);
+	emitExitTo(jit, pc + 2u);
+}
+
+static void chip8_jit_flush(chip8_jit *jit) {
+
+	memset(jit->blocks, 0, sizeof(jit->blocks));
+	memset(jit->blockLength, 0, sizeof(jit->blockLength));
+	memset(jit->noBlock, 0, sizeof(jit->noBlock));
+	memset(jit->codeMap, 0, sizeof(jit->codeMap));
+	jit->used = jit->reserved;
+	jit->flushPending = false;
+	jit->generation++;
+	jit->stats.flushes++;
+}
+
+static void *chip8_jit_compile(chip8_jit *jit, unsigned short start) {
+
+	chip8_machine *m = jit->machine;
+
+	// find the end of the block
+	unsigned short count = 0;
+	unsigned short address = start;
+	bool branched = false;
+
+	while (count < CHIP8_JIT_MAX_BLOCK && address <= 0xFFE) {
+		chip8_jit_kind kind = chip8_jit_classify(chip8_jit_opcodeAt(m, address));
+		if (kind == KIND_INTERPRET) {
+			break;
+		}
+		count++;
+		address += 2;
+		if (kind == KIND_BRANCH) {
+			branched = true;
+			break;
+		}
+	}
+
+	// whatever we decide here depends on these bytes, so watch them for writes
+	unsigned short end = (count == 0) ? start + 2 : address;
+	for (unsigned short a = start; a < end; a++) {
+		jit->codeMap[a] = 1;
+	}
+
+	if (count == 0) {
+		jit->noBlock[start >> 1] = 1;
+		return NULL;
+	}
+
+	if (jit->used + CHIP8_JIT_MAX_BLOCK_BYTES > CHIP8_JIT_CODE_SIZE) {
+		chip8_jit_flush(jit);
+		for (unsigned short a = start; a < end; a++) {
+			jit->codeMap[a] = 1;
+		}
+	}
+
+	void *entry = &jit->code[jit->used];
+	jit->quirks = chip8_machine_quirkFlags((chip8_quirks)m->quirks);
+
+	// make sure there's enough budget to run the whole block, otherwise give up and let the JIT sort it out
+	emitCmpBudget(jit, count);
+	size_t enough = emitJcc(jit, CC_GE);
+	emitExit(jit, false);
+	emitPatchHere(jit, enough);
+	emitSubBudget(jit, count);
+
+	for (unsigned short i = 0; i < count; i++) {
+		unsigned short pc = start + i * 2;
+		unsigned short opcode = chip8_jit_opcodeAt(m, pc);
+
+		switch (chip8_jit_classify(opcode)) {
+			case KIND_NATIVE:
+				chip8_jit_emitNative(jit, opcode);
+				break;
+			case KIND_HELPER:
+				chip8_jit_emitHelper(jit, pc, count - i - 1u);
+				break;
+			case KIND_BRANCH:
+				chip8_jit_emitBranch(jit, opcode, pc, count - i);
+				break;
+			case KIND_INTERPRET:
+				break;
+		}
+	}
+
+	// the block ran into an instruction we don't translate (or got too long), carry on at the next address
+	if (!branched) {
+		emitExitTo(jit, address);
+	}
+
+	jit->blocks[start >> 1] = entry;
+	jit->blockLength[start >> 1] = count;
+	jit->stats.blocksCompiled++;
+
+	return entry;
+}
+
+// Returns the native code for the block starting at pc (translating it if needed), or NULL if pc has to be interpreted.
+static void *chip8_jit_lookup(chip8_jit *jit, unsigned short pc) {
+
+	if (pc > 0xFFE || (pc & 1)) {
+		return NULL;
+	}
+	if (jit->blocks[pc >> 1] != NULL) {
+		return jit->blocks[pc >> 1];
+	}
+	if (jit->noBlock[pc >> 1]) {
+		return NULL;
+	}
+	return chip8_jit_compile(jit, pc);
+}
+
+static void chip8_jit_emitTrampoline(chip8_jit *jit) {
+
+	static const uint8_t enter[] = {
+		0x53,					// push rbx
+		0x41, 0x54,				// push r12
+		0x41, 0x55,				// push r13
+		0x41, 0x56,				// push r14
+		0x41, 0x57,				// push r15		(also keeps the stack 16 byte aligned for the helper calls)
+		0x48, 0x89, 0xFB,		// mov rbx, rdi		machine
+		0x4C, 0x8B, 0x22,		// mov r12, [rdx]	budget
+		0x49, 0x89, 0xD6,		// mov r14, rdx		&budget
+		0x49, 0x89, 0xCD,		// mov r13, rcx		blocks
+		0xFF, 0xE6,				// jmp rsi			code
+	};
+	static const uint8_t leave[] = {
+		0x4D, 0x89, 0x26,		// mov [r14], r12
+		0x41, 0x5F,				// pop r15
+		0x41, 0x5E,				// pop r14
+		0x41, 0x5D,				// pop r13
+		0x41, 0x5C,				// pop r12
+		0x5B,					// pop rbx
+		0xC3,					// ret
+	};
+
+	jit->enter = (chip8_jit_entry)(void *)&jit->code[jit->used];
+	emitBytes(jit, enter, sizeof(enter));
+	jit->exitStub = jit->used;
+	emitBytes(jit, leave, sizeof(leave));
+	jit->reserved = jit->used;
+}
+
+
+
+// Validation
+
+static void chip8_jit_beginValidation(chip8_jit *jit) {
+
+	memcpy(jit->shadow, jit->machine, sizeof(chip8_machine));
+	jit->shadow->jit = NULL;
+	jit->shadow->jitCodeMap = NULL;
+}
+
+static bool chip8_jit_matches(const chip8_machine *a, const chip8_machine *b) {
+
+	return	memcmp(a->V, b->V, sizeof(a->V)) == 0 &&
+			a->I == b->I &&
+			a->pc == b->pc &&
+			a->sp == b->sp &&
+			memcmp(a->stack, b->stack, sizeof(a->stack)) == 0 &&
+			a->delay_timer == b->delay_timer &&
+			a->sound_timer == b->sound_timer &&
+			a->needsDisplay == b->needsDisplay &&
+			memcmp(a->memory, b->memory, sizeof(a->memory)) == 0 &&
+			memcmp(a->gfx, b->gfx, sizeof(a->gfx)) == 0;
+}
+
+static void chip8_jit_endValidation(chip8_jit *jit, unsigned short startPC, unsigned long cycles) {
+
+	chip8_machine *m = jit->machine;
+	chip8_machine *shadow = jit->shadow;
+
+	for (unsigned long i = 0; i < cycles; i++) {
+		chip8_machine_execute(shadow);
+	}
+
+	if (!chip8_jit_matches(m, shadow)) {
+		printf("JIT: native code starting at 0x%03X diverged from the interpreter within %lu instructions\n", startPC, cycles);
+		jit->stats.validationFailures++;
+
+		// trust the interpreter, and start over from scratch
+		chip8_jit *keepJIT = m->jit;
+		unsigned char *keepCodeMap = m->jitCodeMap;
+		memcpy(m, shadow, sizeof(chip8_machine));
+		m->jit = keepJIT;
+		m->jitCodeMap = keepCodeMap;
+		jit->flushPending = true;
+	}
+}
+
+
+
+// JIT API
+
+chip8_jit *chip8_jit_create(chip8_machine *m, bool validate) {
+
+	chip8_jit *jit = calloc(1, sizeof(chip8_jit));
+	if (jit == NULL) {
+		return NULL;
+	}
+
+	int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_JIT
+	flags |= MAP_JIT;
+#endif
+	void *code = mmap(NULL, CHIP8_JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, flags, -1, 0);
+	if (code == MAP_FAILED) {
+		free(jit);
+		return NULL;
+	}
+
+	if (validate) {
+		jit->shadow = calloc(1, sizeof(chip8_machine));
+		if (jit->shadow == NULL) {
+			munmap(code, CHIP8_JIT_CODE_SIZE);
+			free(jit);
+			return NULL;
+		}
+	}
+
+	jit->machine = m;
+	jit->code = code;
+	jit->validate = validate;
+	chip8_jit_emitTrampoline(jit);
+
+	m->jitCodeMap = jit->codeMap;
+
+	return jit;
+}
+
+void chip8_jit_destroy(chip8_jit *jit) {
+
+	if (jit == NULL) {
+		return;
+	}
+
+	if (jit->machine->jit == jit) {
+		jit->machine->jitCodeMap = NULL;
+	}
+	munmap(jit->code, CHIP8_JIT_CODE_SIZE);
+	free(jit->shadow);
+	free(jit);
+}
+
+void chip8_jit_invalidate(chip8_jit *jit) {
+
+	jit->flushPending = true;
+}
+
+static void chip8_jit_interpretOne(chip8_jit *jit) {
+
+	chip8_jit_draws(jit);
+	chip8_machine_execute(jit->machine);
+	chip8_machine_advance(jit->machine, 1);
+	jit->stats.interpretedCycles++;
+}
+
+unsigned long chip8_jit_run(chip8_machine *m, unsigned long cycles, bool *drew) {
+
+	chip8_jit *jit = m->jit;
+	unsigned long executed = 0;
+
+	jit->stopOnDraw = (drew != NULL);
+	jit->drew = false;
+
+	while (executed < cycles && !jit->drew) {
+
+		if (jit->flushPending) {
+			chip8_jit_flush(jit);
+		}
+
+		// don't bother running idle loops (see chip8_machine_skipIdle())
+		executed += chip8_machine_skipIdle(m, cycles - executed);
+
+		// stop at the next timer tick
+		unsigned long slice = cycles - executed;
+		unsigned long long untilTick = m->nextTimerTick - m->cycles;
+		if (slice > untilTick) {
+			slice = (unsigned long)untilTick;
+		}
+
+		unsigned short pc = m->pc;
+		void *code = chip8_jit_lookup(jit, pc);
+		if (code == NULL || jit->blockLength[pc >> 1] > slice) {
+			chip8_jit_interpretOne(jit);
+			executed++;
+			continue;
+		}
+
+		if (jit->validate) {
+			chip8_jit_beginValidation(jit);
+		}
+
+		long budget = (long)slice;
+		unsigned long generation = jit->generation;
+		void *site = jit->enter(m, code, &budget, jit->blocks);
+		unsigned long ran = slice - (unsigned long)budget;
+
+		executed += ran;
+		jit->stats.nativeCycles += ran;
+
+		if (jit->validate) {
+			chip8_jit_endValidation(jit, pc, ran);
+		}
+
+		chip8_machine_advance(m, ran);
+
+		if (site == CHIP8_JIT_BAIL) {
+			// native code stopped in front of an instruction it can't handle (a stack overflow, for example)
+			if (executed < cycles && !jit->drew) {
+				chip8_jit_interpretOne(jit);
+				executed++;
+			}
+		}
+		else if (site != NULL && !jit->flushPending && !jit->drew && !chip8_machine_idleLoopAt(m, m->pc)) {
+			// chain the block we just left to the one it jumped to, so next time we don't come back out here. But not into an idle
+			// loop: chained, it would spin natively until the budget ran out, and chip8_machine_skipIdle() would never see it
+			void *target = chip8_jit_lookup(jit, m->pc);
+			if (target != NULL && jit->generation == generation) {
+				int32_t rel = (int32_t)((unsigned char *)target - ((unsigned char *)site + 4));
+				memcpy(site, &rel, 4);
+			}
+		}
+	}
+
+	if (drew != NULL) {
+		*drew = jit->drew;
+	}
+	return executed;
+}
+
+chip8_jit_stats chip8_jit_getStats(chip8_jit *jit) {
+
+	return jit->stats;
+}
+
+#else
+
+// No JIT on this platform. chip8_machine_setEngine() will report that, and machines will stay on the interpreter.
+
+chip8_jit *chip8_jit_create(chip8_machine *m, bool validate) {
+	(void)m;
+	(void)validate;
+	return NULL;
+}
+
+void chip8_jit_destroy(chip8_jit *jit) {
+	(void)jit;
+}
+
+unsigned long chip8_jit_run(chip8_machine *m, unsigned long cycles, bool *drew) {
+	(void)m;
+	(void)cycles;
+	(void)drew;
+	return 0;
+}
+
+void chip8_jit_invalidate(chip8_jit *jit) {
+	(void)jit;
+}
+
+chip8_jit_stats chip8_jit_getStats(chip8_jit *jit) {
+	(void)jit;
+	chip8_jit_stats stats = { 0 };
+	return stats;
+}
+
+#endif
@@ -0,0 +1,53 @@
+//
+//  Chip8JIT.h
+//  Chip8
+//
+//  Translates Chip8 code into native x86-64 code.
+//  You don't normally call these directly, pick CHIP8_ENGINE_JIT with chip8_machine_setEngine() instead.
+//
+
+#ifndef __Chip8__Chip8JIT__
+#define __Chip8__Chip8JIT__
+
+#include "Chip8.h"
+
+
+// The JIT emits x86-64 code for the System V calling convention (macOS, Linux, BSD).
+// Everywhere else chip8_jit_create() returns NULL and machines stay on the interpreter.
+#if defined(__x86_64__) && !defined(_WIN32)
+	#define CHIP8_JIT_AVAILABLE	1
+#else
+	#define CHIP8_JIT_AVAILABLE	0
+#endif
+
+
+typedef struct chip8_jit chip8_jit;
+
+
+// Creates a JIT for the machine. When validate is true every native run is replayed on a shadow machine through the interpreter and the two are compared.
+chip8_jit *chip8_jit_create(chip8_machine *machine, bool validate);
+void chip8_jit_destroy(chip8_jit *jit);
+
+// Executes up to `cycles` instructions and returns the number executed.
+// If drew isn't NULL it returns early, straight after the first instruction that draws to the screen, and sets *drew.
+unsigned long chip8_jit_run(chip8_machine *machine, unsigned long cycles, bool *drew);
+
+// Throws away every translated block. Called when translated code is written to.
+void chip8_jit_invalidate(chip8_jit *jit);
+
+
+// Statistics
+typedef struct chip8_jit_stats {
+
+	unsigned long	blocksCompiled;			// blocks translated since the JIT was created
+	unsigned long	flushes;				// times the whole translation cache was thrown away
+	unsigned long	nativeCycles;			// instructions executed as native code
+	unsigned long	interpretedCycles;		// instructions the JIT handed back to the interpreter
+	unsigned long	validationFailures;		// native runs that didn't match the interpreter (validate mode only)
+
+} chip8_jit_stats;
+
+chip8_jit_stats chip8_jit_getStats(chip8_jit *jit);
+
+
+#endif /* defined(__Chip8__Chip8JIT__) */
@@ -0,0 +1,1406 @@
+//
+//  Chip8Lockstep.c
+//  Chip8
+//
+//  Runs many copies of one machine in lockstep, several at a time in SIMD lanes.
+//
+
+#include "Chip8Lockstep.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+#endif
+
+/*
+ Structure of arrays
+
+ A chip8_machine keeps all of one machine's registers together. Here it's the other way round: the lanes are split into
+ blocks of CHIP8_LOCKSTEP_WIDTH, and each block keeps register VX of all its lanes together in one vector, and the same for
+ I, pc, sp, the stack, the timers, the random number generators and the keys. When every lane in a block is at the same
+ address, one instruction is decoded once and runs in all of the lanes with a handful of vector instructions: 7XNN is one
+ vector add, 3XNN a compare and an add to pc, and so on.
+
+ Divergence
+ Copies of the same ROM only stay together while they're given the same inputs. With different keys and random numbers
+ they soon end up at different addresses, and then each step the lanes still waiting to run are grouped by pc: the first
+ one's pc picks a group, everyone at that address runs with a mask that leaves the other lanes alone, and then the next
+ group goes, until every lane has run exactly one instruction. So nothing is ever wrong, it just takes more turns. The
+ common case (every lane at the same address) is checked for first and takes one turn.
+
+ Lanes at the same address are no use to each other in different blocks, so every few runs, if sorting the lanes by pc
+ would leave the blocks with a good deal fewer groups between them, they're sorted and packed into blocks in that order.
+ Lanes move between slots (and blocks) when that happens, so slotLane says which lane is in each slot. Their machines stay
+ where they are.
+
+ A group costs about as much as a whole block does, so a block whose turns have only a lane or two each is slower than the
+ interpreter. Its lanes go off and run on their own machines instead (see Running), until they get to an idle loop or to
+ enough other lanes to run with again.
+
+ Memory
+ Memory, the screen and sprites are different in every lane, and have nothing SIMD about them, so each lane has a machine
+ of its own that holds its memory and screen, and the instructions that use them (00E0, DXYN, FX33, FX55, FX65) run a lane
+ at a time, as do the stack and FX0A. Instructions are decoded from the memory the lanes started with (image), which is
+ shared. A lane that stores to memory marks the word it wrote in divergent (the machines do the same, through their
+ storeMap), and instructions from a divergent word are read from each lane's own memory, with lanes whose instruction
+ doesn't match the group's left to a later turn.
+
+ Timers
+ Every lane has run the same number of instructions, so the timers count down on the same step in every lane. There's
+ one cycle count and one timer schedule (worked out the same way as the interpreter's) for all of them. That also means
+ the lanes waiting in an idle loop can be moved straight to the end of it together (see Idle loops).
+
+ Each block runs all of its steps before the next block starts, so its lanes' memory stays in the cache.
+ The vectors are GCC and Clang vector extensions, which compile to SSE, AVX or NEON, or to plain loops on anything else.
+*/
+
+#define W	CHIP8_LOCKSTEP_WIDTH
+
+typedef uint8_t		chip8_u8v	__attribute__((vector_size(W)));
+typedef int8_t		chip8_s8v	__attribute__((vector_size(W)));
+typedef uint16_t	chip8_u16v	__attribute__((vector_size(W * 2)));
+typedef int16_t		chip8_s16v	__attribute__((vector_size(W * 2)));
+typedef uint32_t	chip8_u32v	__attribute__((vector_size(W * 4)));
+typedef int32_t		chip8_s32v	__attribute__((vector_size(W * 4)));
+
+#define MemAddr(addr)	((addr) & 0x0FFF)
+
+#define CHIP8_LOCKSTEP_GRACE_TURNS	8	// a block gets this many turns in a segment before it can give up on the vectors (see Running)
+#define CHIP8_LOCKSTEP_MIN_LANES	4	// ... and then gives up if its turns have had fewer lanes than this each, on average
+#define CHIP8_LOCKSTEP_BEHIND		16	// the most runs a lane on its own falls behind by before it catches up
+#define CHIP8_LOCKSTEP_REGROUP_RUNS	4	// runs between looks at whether to regroup (see Regrouping)
+
+// takes a where mask is set, b where it isn't
+#define SELECT(mask, a, b)	(((a) & (mask)) | ((b) & ~(mask)))
+
+
+// One block of lanes. Lane n of the block is element n of every vector.
+typedef struct chip8_lanes {
+
+	chip8_u8v	V[16];
+	chip8_u16v	I;
+	chip8_u16v	pc;
+	chip8_u16v	sp;
+	chip8_u16v	stack[16];
+	chip8_u8v	delay_timer;
+	chip8_u8v	sound_timer;
+	chip8_u32v	rngState;
+	chip8_u16v	keys;			// bit n set while key n is down
+	chip8_u8v	caughtUp;		// for a lane on its own, how many of the past runs it has run (see Running)
+	chip8_u8v	patience;		// ... and how many it can fall behind by before it next catches up to see if it can come back
+
+} chip8_lanes;
+
+// One lane's registers, out of its block, for running it on its own.
+typedef struct chip8_lane {
+
+	unsigned char	V[16];
+	uint16_t		I;
+	uint16_t		pc;
+	uint16_t		sp;
+	uint16_t		stack[16];
+	uint8_t			delay_timer;
+	uint8_t			sound_timer;
+	uint32_t		rngState;
+	uint16_t		keys;
+	uint8_t			caughtUp;
+	uint8_t			patience;
+
+} chip8_lane;
+
+// The timer schedule every lane shares (see chip8_scheduleTimerTick() in Chip8.c).
+typedef struct chip8_lockstep_clock {
+
+	unsigned int		clockRate;
+	unsigned long long	cycles;
+	unsigned long long	nextTimerTick;
+	unsigned long long	timerBase;
+	unsigned long long	timerTicks;
+
+} chip8_lockstep_clock;
+
+struct chip8_lockstep {
+
+	size_t					laneCount;
+	size_t					blockCount;
+	chip8_lanes				*blocks;
+	chip8_lanes				*spareBlocks;		// the lanes are sorted into here, then it swaps with blocks
+	size_t					*slotLane;			// the lane in each slot (slot n is lane n % W of block n / W)
+	size_t					*laneSlot;			// ... and the other way round
+	chip8_machine			**machines;			// one per lane, which holds its memory and screen, and runs it when it's on its own
+	uint32_t				*alone;				// for each block, the lanes running on their own, whose registers are in their machines
+	uint32_t				*spareAlone;		// ... and for spareBlocks
+
+	unsigned short			*sortKeys;			// scratch space for sorting the lanes, one of each per lane
+	size_t					*sortOrder;
+	size_t					*sortScratch;
+	size_t					regroupedFrom;		// how many groups there were before the last run's regroup, 0 if it didn't
+	unsigned int			regroupBackoff;		// how many runs to leave it before trying again when a regroup doesn't last
+	unsigned int			regroupWait;		// ... and how many there are left of those
+	unsigned int			regroupCountdown;	// runs until the next look at whether to regroup
+
+	chip8_lockstep_clock	pastClocks[CHIP8_LOCKSTEP_BEHIND];	// the clock at the start of each run since the lanes on their own last caught up
+	unsigned long			pastCycles[CHIP8_LOCKSTEP_BEHIND];	// ... and how many cycles each one was
+	size_t					pastRuns;
+	chip8_u16v				*pastKeys;			// every block's keys in each of those runs, CHIP8_LOCKSTEP_BEHIND to a block
+
+	unsigned int			quirks;				// the CHIP8_QUIRK_ flags
+	chip8_quirks			profile;
+	chip8_lockstep_clock	clock;
+
+	chip8_machine			*prototype;			// a copy of the machine the lanes started as, for chip8_lockstep_resetLane()
+	unsigned char			image[4096];		// the memory every lane started with, which instructions are decoded from
+	unsigned char			divergent[2048];	// set for every word of memory some lane has stored to
+
+	chip8_lockstep_stats	stats;
+};
+
+
+static void chip8_lockstep_setLane(chip8_lockstep *ls, size_t lane, const chip8_machine *m);
+static void chip8_lockstep_catchUpLane(chip8_lockstep *ls, size_t lane);
+
+// The vectors are aligned to their own size, which is more than malloc() promises. This is posix_memalign() rather than
+// aligned_alloc(), which the Mac only has from 10.15 on.
+static chip8_lanes *chip8_lockstep_allocBlocks(size_t count) {
+
+	void *blocks = NULL;
+	if (posix_memalign(&blocks, _Alignof(chip8_lanes), count * sizeof(chip8_lanes)) != 0) {
+		return NULL;
+	}
+	return blocks;
+}
+
+
+
+// Lockstep API
+
+chip8_lockstep *chip8_lockstep_create(const chip8_machine *prototype, size_t lanes) {
+
+	if (lanes == 0) {
+		return NULL;
+	}
+
+	chip8_lockstep *ls = calloc(1, sizeof(chip8_lockstep));
+	if (ls == NULL) {
+		return NULL;
+	}
+	ls->laneCount = lanes;
+	ls->blockCount = (lanes + W - 1) / W;
+
+	size_t slots = ls->blockCount * W;
+	ls->blocks = chip8_lockstep_allocBlocks(ls->blockCount);
+	ls->spareBlocks = chip8_lockstep_allocBlocks(ls->blockCount);
+	ls->slotLane = malloc(slots * sizeof(size_t));
+	ls->laneSlot = malloc(slots * sizeof(size_t));
+	ls->machines = calloc(lanes, sizeof(chip8_machine *));
+	ls->alone = calloc(ls->blockCount, sizeof(uint32_t));
+	ls->spareAlone = calloc(ls->blockCount, sizeof(uint32_t));
+	ls->sortKeys = malloc(lanes * sizeof(unsigned short));
+	ls->sortOrder = malloc(lanes * sizeof(size_t));
+	ls->sortScratch = malloc(lanes * sizeof(size_t));
+	if (posix_memalign((void **)&ls->pastKeys, _Alignof(chip8_u16v), ls->blockCount * CHIP8_LOCKSTEP_BEHIND * sizeof(chip8_u16v)) != 0) {
+		ls->pastKeys = NULL;
+	}
+	ls->prototype = chip8_machine_clone(prototype);
+	if (ls->blocks == NULL || ls->spareBlocks == NULL || ls->slotLane == NULL || ls->laneSlot == NULL || ls->machines == NULL ||
+		ls->alone == NULL || ls->spareAlone == NULL || ls->sortKeys == NULL || ls->sortOrder == NULL || ls->sortScratch == NULL ||
+		ls->pastKeys == NULL || ls->prototype == NULL) {
+		chip8_lockstep_destroy(ls);
+		return NULL;
+	}
+	for (size_t lane = 0; lane < lanes; lane++) {
+		ls->machines[lane] = chip8_machine_clone(prototype);
+		if (ls->machines[lane] == NULL) {
+			chip8_lockstep_destroy(ls);
+			return NULL;
+		}
+		ls->machines[lane]->storeMap = ls->divergent;
+	}
+
+	// lanes past the end of the last block never run (or move), but they get the same state so they're never anything odd
+	memset(ls->blocks, 0, ls->blockCount * sizeof(chip8_lanes));
+	for (size_t lane = 0; lane < slots; lane++) {
+		ls->slotLane[lane] = lane;
+		ls->laneSlot[lane] = lane;
+		chip8_lockstep_setLane(ls, lane, prototype);
+	}
+
+	memcpy(ls->image, prototype->memory, sizeof(ls->image));
+	ls->profile = (chip8_quirks)prototype->quirks;
+	ls->quirks = chip8_machine_quirkFlags(ls->profile);
+	ls->clock = (chip8_lockstep_clock){ prototype->clockRate, prototype->cycles, prototype->nextTimerTick, prototype->timerBase, prototype->timerTicks };
+	return ls;
+}
+
+void chip8_lockstep_destroy(chip8_lockstep *ls) {
+
+	if (ls == NULL) {
+		return;
+	}
+	free(ls->blocks);
+	free(ls->spareBlocks);
+	free(ls->slotLane);
+	free(ls->laneSlot);
+	if (ls->machines != NULL) {
+		for (size_t lane = 0; lane < ls->laneCount; lane++) {
+			chip8_machine_destroy(ls->machines[lane]);
+		}
+	}
+	free(ls->machines);
+	free(ls->alone);
+	free(ls->spareAlone);
+	free(ls->sortKeys);
+	free(ls->sortOrder);
+	free(ls->sortScratch);
+	free(ls->pastKeys);
+	chip8_machine_destroy(ls->prototype);
+	free(ls);
+}
+
+size_t chip8_lockstep_laneCount(const chip8_lockstep *ls) {
+
+	return ls->laneCount;
+}
+
+unsigned long long chip8_lockstep_cycles(const chip8_lockstep *ls) {
+
+	return ls->clock.cycles;
+}
+
+chip8_lockstep_stats chip8_lockstep_getStats(const chip8_lockstep *ls) {
+
+	return ls->stats;
+}
+
+
+
+// Lanes
+
+// Takes the registers of the lane in slot l of the block out, and puts them back.
+static inline void chip8_lockstep_loadLane(const chip8_lanes *b, int l, chip8_lane *r) {
+
+	for (int i = 0; i < 16; i++) {
+		r->V[i] = b->V[i][l];
+		r->stack[i] = b->stack[i][l];
+	}
+	r->I = b->I[l];
+	r->pc = b->pc[l];
+	r->sp = b->sp[l];
+	r->delay_timer = b->delay_timer[l];
+	r->sound_timer = b->sound_timer[l];
+	r->rngState = b->rngState[l];
+	r->keys = b->keys[l];
+	r->caughtUp = b->caughtUp[l];
+	r->patience = b->patience[l];
+}
+
+static inline void chip8_lockstep_storeLane(chip8_lanes *b, int l, const chip8_lane *r) {
+
+	for (int i = 0; i < 16; i++) {
+		b->V[i][l] = r->V[i];
+		b->stack[i][l] = r->stack[i];
+	}
+	b->I[l] = r->I;
+	b->pc[l] = r->pc;
+	b->sp[l] = r->sp;
+	b->delay_timer[l] = r->delay_timer;
+	b->sound_timer[l] = r->sound_timer;
+	b->rngState[l] = r->rngState;
+	b->keys[l] = r->keys;
+	b->caughtUp[l] = r->caughtUp;
+	b->patience[l] = r->patience;
+}
+
+// Moves the registers of the lane in slot l of the block into its machine, when it goes off to run on its own, and back.
+// The keys stay in the block (see chip8_lockstep_runAlone()).
+static void chip8_lockstep_toMachine(const chip8_lanes *b, int l, chip8_machine *m) {
+
+	for (int i = 0; i < 16; i++) {
+		m->V[i] = b->V[i][l];
+		m->stack[i] = b->stack[i][l];
+	}
+	m->I = b->I[l];
+	m->pc = b->pc[l];
+	m->sp = b->sp[l];
+	m->delay_timer = b->delay_timer[l];
+	m->sound_timer = b->sound_timer[l];
+	m->rngState = b->rngState[l];
+}
+
+static void chip8_lockstep_fromMachine(chip8_lanes *b, int l, const chip8_machine *m) {
+
+	for (int i = 0; i < 16; i++) {
+		b->V[i][l] = m->V[i];
+		b->stack[i][l] = m->stack[i];
+	}
+	b->I[l] = m->I;
+	b->pc[l] = m->pc;
+	b->sp[l] = m->sp;
+	b->delay_timer[l] = m->delay_timer;
+	b->sound_timer[l] = m->sound_timer;
+	b->rngState[l] = m->rngState;
+}
+
+// Brings the lane in a slot back into its block, if it was running on its own.
+static void chip8_lockstep_bringBack(chip8_lockstep *ls, size_t slot) {
+
+	size_t block = slot / W;
+	uint32_t bit = (uint32_t)1 << (slot % W);
+	if (ls->alone[block] & bit) {
+		chip8_lockstep_fromMachine(&ls->blocks[block], slot % W, ls->machines[ls->slotLane[slot]]);
+		ls->alone[block] &= ~bit;
+	}
+}
+
+// Sets one lane's registers, memory and screen from a machine (the timer schedule is shared, so that's left alone).
+static void chip8_lockstep_setLane(chip8_lockstep *ls, size_t lane, const chip8_machine *m) {
+
+	chip8_lane r = {
+		.I				= m->I,
+		.pc				= m->pc,
+		.sp				= m->sp,
+		.delay_timer	= m->delay_timer,
+		.sound_timer	= m->sound_timer,
+		.rngState		= m->rngState,
+		.keys			= m->keys,
+	};
+	memcpy(r.V, m->V, sizeof(r.V));
+	memcpy(r.stack, m->stack, sizeof(r.stack));
+	size_t slot = ls->laneSlot[lane];
+	chip8_lockstep_storeLane(&ls->blocks[slot / W], slot % W, &r);
+	ls->alone[slot / W] &= ~((uint32_t)1 << (slot % W));
+
+	if (lane < ls->laneCount && ls->machines[lane] != m) {
+		chip8_machine_fork(m, ls->machines[lane]);
+	}
+}
+
+void chip8_lockstep_resetLane(chip8_lockstep *ls, size_t lane) {
+
+	if (lane < ls->laneCount) {
+		chip8_lockstep_setLane(ls, lane, ls->prototype);
+	}
+}
+
+void chip8_lockstep_setKeys(chip8_lockstep *ls, size_t lane, uint16_t keys) {
+
+	if (lane < ls->laneCount) {
+		size_t slot = ls->laneSlot[lane];
+		ls->blocks[slot / W].keys[slot % W] = keys;
+	}
+}
+
+uint16_t chip8_lockstep_keys(const chip8_lockstep *ls, size_t lane) {
+
+	if (lane >= ls->laneCount) {
+		return 0;
+	}
+	size_t slot = ls->laneSlot[lane];
+	return ls->blocks[slot / W].keys[slot % W];
+}
+
+void chip8_lockstep_seed(chip8_lockstep *ls, size_t lane, unsigned int seed) {
+
+	// the same as chip8_machine_seed(), which can't start xorshift at 0 either
+	if (lane < ls->laneCount) {
+		size_t slot = ls->laneSlot[lane];
+		chip8_lockstep_catchUpLane(ls, lane);
+		chip8_lockstep_bringBack(ls, slot);
+		ls->blocks[slot / W].rngState[slot % W] = (seed != 0) ? seed : 0x6D2B79F5u;
+	}
+}
+
+const uint64_t *chip8_lockstep_screen(chip8_lockstep *ls, size_t lane) {
+
+	if (lane >= ls->laneCount) {
+		return NULL;
+	}
+	chip8_lockstep_catchUpLane(ls, lane);
+	return ls->machines[lane]->gfx;
+}
+
+void chip8_lockstep_copyLane(chip8_lockstep *ls, size_t lane, chip8_machine *m) {
+
+	if (lane >= ls->laneCount) {
+		return;
+	}
+	chip8_lockstep_catchUpLane(ls, lane);
+	size_t slot = ls->laneSlot[lane];
+	chip8_lane r;
+	chip8_lockstep_loadLane(&ls->blocks[slot / W], slot % W, &r);
+	if (ls->alone[slot / W] & ((uint32_t)1 << (slot % W))) {
+		// its registers are in its machine (all but the keys)
+		const chip8_machine *own = ls->machines[lane];
+		memcpy(r.V, own->V, sizeof(r.V));
+		memcpy(r.stack, own->stack, sizeof(r.stack));
+		r.I = own->I;
+		r.pc = own->pc;
+		r.sp = own->sp;
+		r.delay_timer = own->delay_timer;
+		r.sound_timer = own->sound_timer;
+		r.rngState = own->rngState;
+	}
+
+	chip8_machine_setQuirks(m, ls->profile);
+	memcpy(m->memory, ls->machines[lane]->memory, sizeof(m->memory));
+	memcpy(m->gfx, ls->machines[lane]->gfx, sizeof(m->gfx));
+	memcpy(m->V, r.V, sizeof(r.V));
+	memcpy(m->stack, r.stack, sizeof(r.stack));
+	m->keys = r.keys;
+	m->I = r.I;
+	m->pc = r.pc;
+	m->sp = r.sp;
+	m->delay_timer = r.delay_timer;
+	m->sound_timer = r.sound_timer;
+	m->rngState = r.rngState;
+
+	m->clockRate = ls->clock.clockRate;
+	m->cycles = ls->clock.cycles;
+	m->nextTimerTick = ls->clock.nextTimerTick;
+	m->timerBase = ls->clock.timerBase;
+	m->timerTicks = ls->clock.timerTicks;
+
+	// the machine's memory was written behind its back
+	chip8_machine_invalidate(m, 0, 4096);
+	m->needsDisplay = true;
+}
+
+
+
+// Masks
+// A vector mask has every bit of a lane set or clear (which is what vector compares give). A bit mask has bit n set for lane n.
+// These are macros rather than functions because without AVX, passing a 32 byte vector to a function isn't the same on
+// every compiler.
+
+#define chip8_lanes_narrow(mask)	((chip8_u8v)__builtin_convertvector((chip8_s16v)(mask), chip8_s8v))
+#define chip8_lanes_widen(mask)		((chip8_u16v)__builtin_convertvector((chip8_s8v)(mask), chip8_s16v))
+#define chip8_lanes_bits(mask)		chip8_lanes_bits8(chip8_lanes_narrow(mask))
+
+// The vector mask of the 16 bit lanes that are 0. Without AVX, compilers compare 32 byte vectors a lane at a time (though they
+// split arithmetic into two 16 byte halves), so this is arithmetic: x | -x has its top bit set unless x is 0.
+#define chip8_lanes_zero16(x)		((chip8_u16v)((((x) | -(x)) >> 15) - 1))
+
+// Bit n set for every lane whose pc is `address`.
+#define chip8_lanes_at(b, address)	chip8_lanes_bits(chip8_lanes_zero16((b)->pc ^ (unsigned short)(address)))
+
+static inline uint32_t chip8_lanes_bits8(chip8_u8v mask) {
+
+#if defined(__SSE2__)
+	return (uint32_t)_mm_movemask_epi8((__m128i)mask);
+#else
+	uint32_t bits = 0;
+	for (int l = 0; l < W; l++) {
+		bits |= (uint32_t)(mask[l] & 1) << l;
+	}
+	return bits;
+#endif
+}
+
+_Static_assert(CHIP8_LOCKSTEP_WIDTH == 16, "the lanes of a block are the bits of a uint16_t, and chip8_lockstep_group() has a bit for each of 16 of them");
+
+// The masks for one group of lanes, in the lane sizes nearly every instruction needs.
+typedef struct chip8_group {
+
+	chip8_u8v	m8;
+	chip8_u16v	m16;
+	uint32_t	bits;
+
+} chip8_group;
+
+
+
+// Lane at a time instructions
+// These are the interpreter's handlers (see Chip8.c) for a single lane, lane l of the block, working on its registers where
+// they are. lane is the lane's number, which says whose memory and screen are whose.
+
+// the lane's machine has to forget what it decoded from there, just as if it had made the store itself
+static inline void chip8_lane_store(chip8_lockstep *ls, size_t lane, unsigned short address, unsigned char value) {
+
+	address = MemAddr(address);
+	ls->machines[lane]->memory[address] = value;
+	ls->divergent[address >> 1] = 1;
+	chip8_machine_invalidate(ls->machines[lane], address, 1);
+}
+
+static void chip8_lane_00E0(chip8_lockstep *ls, chip8_lanes *b, int l, size_t lane) {
+
+	memset(ls->machines[lane]->gfx, 0, sizeof(ls->machines[lane]->gfx));
+	b->pc[l] += 2;
+}
+
+static void chip8_lane_00EE(chip8_lanes *b, int l) {
+
+	if (b->sp[l] <= 0) {
+		printf("WARNING: Stack Underflow\n");
+		return;
+	}
+	b->sp[l]--;
+	b->pc[l] = b->stack[b->sp[l]][l];
+}
+
+static void chip8_lane_2NNN(chip8_lanes *b, int l, unsigned short nnn) {
+
+	if (b->sp[l] + 1 > 15) {
+		printf("WARNING: Stack Overflow\n");
+		return;
+	}
+	b->stack[b->sp[l]][l] = b->pc[l] + 2;
+	b->sp[l]++;
+	b->pc[l] = nnn;
+}
+
+static void chip8_lane_DXYN(chip8_lockstep *ls, chip8_lanes *b, int l, size_t lane, unsigned char X, unsigned char Y, unsigned char height) {
+
+	const unsigned char *memory = ls->machines[lane]->memory;
+	uint64_t *gfx = ls->machines[lane]->gfx;
+	unsigned char x = b->V[X][l] % 64;
+	unsigned char y = b->V[Y][l] % 32;
+	unsigned short I = b->I[l];
+	bool clip = (ls->quirks & CHIP8_QUIRK_CLIP) != 0;
+	uint64_t collision = 0;
+
+	if (clip && y + height > 32) {
+		height = 32 - y;
+	}
+	for (unsigned char yLine = 0; yLine < height; yLine++) {
+		// sprites nobody has written over are the same in every lane, and the image is more likely to be in the cache
+		unsigned short address = MemAddr(I + yLine);
+		uint64_t bits = (uint64_t)(ls->divergent[address >> 1] ? memory : ls->image)[address] << 56;
+		uint64_t sprite = (bits >> x) | (clip ? 0 : bits << ((64 - x) & 63));
+		uint64_t *row = &gfx[(y + yLine) % 32];
+		collision |= *row & sprite;
+		*row ^= sprite;
+	}
+
+	b->V[0xF][l] = (collision != 0);
+	b->pc[l] += 2;
+}
+
+static void chip8_lane_FX0A(chip8_lanes *b, int l, unsigned char X) {
+
+	// the highest key that's down, like the interpreter's
+	uint16_t keys = b->keys[l];
+	if (keys != 0) {
+		b->V[X][l] = (unsigned char)(31 - __builtin_clz(keys));
+		b->pc[l] += 2;
+	}
+}
+
+static void chip8_lane_FX33(chip8_lockstep *ls, chip8_lanes *b, int l, size_t lane, unsigned char X) {
+
+	unsigned char value = b->V[X][l];
+	unsigned short I = b->I[l];
+	chip8_lane_store(ls, lane, I,		value / 100);
+	chip8_lane_store(ls, lane, I + 1,	(value / 10) % 10);
+	chip8_lane_store(ls, lane, I + 2,	value % 10);
+	b->pc[l] += 2;
+}
+
+static void chip8_lane_memoryQuirk(chip8_lockstep *ls, chip8_lanes *b, int l, unsigned char X) {
+
+	if (ls->quirks & CHIP8_QUIRK_MEMORY_I) {
+		b->I[l] += X + 1;
+	}
+	else if (ls->quirks & CHIP8_QUIRK_MEMORY_I_SHORT) {
+		b->I[l] += X;
+	}
+}
+
+static void chip8_lane_FX55(chip8_lockstep *ls, chip8_lanes *b, int l, size_t lane, unsigned char X) {
+
+	for (unsigned char i = 0; i <= X; i++) {
+		chip8_lane_store(ls, lane, b->I[l] + i, b->V[i][l]);
+	}
+	chip8_lane_memoryQuirk(ls, b, l, X);
+	b->pc[l] += 2;
+}
+
+static void chip8_lane_FX65(chip8_lockstep *ls, chip8_lanes *b, int l, size_t lane, unsigned char X) {
+
+	for (unsigned char i = 0; i <= X; i++) {
+		b->V[i][l] = ls->machines[lane]->memory[MemAddr(b->I[l] + i)];
+	}
+	chip8_lane_memoryQuirk(ls, b, l, X);
+	b->pc[l] += 2;
+}
+
+// Runs one of the lane at a time instructions in every lane of the group.
+#define CHIP8_EACH_LANE(group, statement) \
+	for (uint32_t bits = (group)->bits; bits != 0; bits &= bits - 1) { \
+		int l = __builtin_ctz(bits); \
+		size_t lane = ls->slotLane[first + l]; \
+		(void)lane; \
+		statement; \
+	}
+
+
+
+// Execution
+
+// Runs the instruction `opcode` in every lane of the group. Everything that isn't lane at a time is a few vector operations,
+// each of which leaves the lanes outside the group as they were.
+static void chip8_lockstep_execute(chip8_lockstep *ls, chip8_lanes *b, size_t first, const chip8_group *g, unsigned short opcode) {
+
+	const unsigned char X = (opcode >> 8) & 0xF;
+	const unsigned char Y = (opcode >> 4) & 0xF;
+	const unsigned char N = opcode & 0xF;
+	const unsigned char NN = opcode & 0xFF;
+	const unsigned short NNN = opcode & 0xFFF;
+	const unsigned int quirks = ls->quirks;
+
+	const chip8_u8v m8 = g->m8;
+	const chip8_u16v m16 = g->m16;
+	chip8_u8v *V = b->V;
+	chip8_u8v *VF = &b->V[0xF];
+
+	// the pc of every lane in the group moves on by 2, or 4 where `skip` is set
+	#define NEXT()			b->pc += m16 & 2
+	#define SKIP_IF(skip)	b->pc += m16 & (2 + (chip8_lanes_widen(skip) & 2))
+
+	switch (opcode >> 12) {
+
+		case 0x0:
+			if (opcode == 0x00E0) {
+				CHIP8_EACH_LANE(g, chip8_lane_00E0(ls, b, l, lane));
+			}
+			else if (opcode == 0x00EE) {
+				CHIP8_EACH_LANE(g, chip8_lane_00EE(b, l));
+			}
+			else {
+				goto unknown;
+			}
+			return;
+
+		case 0x1:
+			b->pc = SELECT(m16, (chip8_u16v){ 0 } + NNN, b->pc);
+			return;
+
+		case 0x2:
+			CHIP8_EACH_LANE(g, chip8_lane_2NNN(b, l, NNN));
+			return;
+
+		case 0x3:
+			SKIP_IF((chip8_u8v)(V[X] == NN));
+			return;
+
+		case 0x4:
+			SKIP_IF((chip8_u8v)(V[X] != NN));
+			return;
+
+		case 0x5:
+			if (N != 0) {
+				goto unknown;
+			}
+			SKIP_IF((chip8_u8v)(V[X] == V[Y]));
+			return;
+
+		case 0x6:
+			V[X] = SELECT(m8, (chip8_u8v){ 0 } + NN, V[X]);
+			NEXT();
+			return;
+
+		case 0x7:
+			V[X] += m8 & NN;
+			NEXT();
+			return;
+
+		case 0x8: {
+			// in the same order as the interpreter's handlers, which matters when X or Y is F
+			chip8_u8v value;
+			switch (N) {
+				case 0x0:
+					V[X] = SELECT(m8, V[Y], V[X]);
+					break;
+				case 0x1:
+				case 0x2:
+				case 0x3:
+					value = (N == 0x1) ? (V[X] | V[Y]) : (N == 0x2) ? (V[X] & V[Y]) : (V[X] ^ V[Y]);
+					V[X] = SELECT(m8, value, V[X]);
+					if (quirks & CHIP8_QUIRK_VF_RESET) {
+						*VF &= ~m8;
+					}
+					break;
+				case 0x4:
+					*VF = SELECT(m8, (chip8_u8v)(V[Y] > 255 - V[X]) & 1, *VF);
+					V[X] = SELECT(m8, V[X] + V[Y], V[X]);
+					break;
+				case 0x5:
+					*VF = SELECT(m8, (chip8_u8v)(V[Y] <= V[X]) & 1, *VF);
+					V[X] = SELECT(m8, V[X] - V[Y], V[X]);
+					break;
+				case 0x6: {
+					unsigned char S = (quirks & CHIP8_QUIRK_SHIFT_VY) ? Y : X;
+					*VF = SELECT(m8, V[S] & 1, *VF);
+					V[X] = SELECT(m8, V[S] >> 1, V[X]);
+					break;
+				}
+				case 0x7:
+					*VF = SELECT(m8, (chip8_u8v)(V[X] <= V[Y]) & 1, *VF);
+					V[X] = SELECT(m8, V[Y] - V[X], V[X]);
+					break;
+				case 0xE: {
+					unsigned char S = (quirks & CHIP8_QUIRK_SHIFT_VY) ? Y : X;
+					*VF = SELECT(m8, V[S] >> 7, *VF);
+					V[X] = SELECT(m8, V[S] << 1, V[X]);
+					break;
+				}
+				default:
+					goto unknown;
+			}
+			NEXT();
+			return;
+		}
+
+		case 0x9:
+			if (N != 0) {
+				goto unknown;
+			}
+			SKIP_IF((chip8_u8v)(V[X] != V[Y]));
+			return;
+
+		case 0xA:
+			b->I = SELECT(m16, (chip8_u16v){ 0 } + NNN, b->I);
+			NEXT();
+			return;
+
+		case 0xB: {
+			chip8_u16v offset = __builtin_convertvector(V[(quirks & CHIP8_QUIRK_JUMP_VX) ? X : 0], chip8_u16v);
+			b->pc = SELECT(m16, NNN + offset, b->pc);
+			return;
+		}
+
+		case 0xC: {
+			// every lane's xorshift at once (see chip8_random() in Chip8.c)
+			chip8_u32v s = b->rngState;
+			s ^= s << 13;
+			s ^= s >> 17;
+			s ^= s << 5;
+			chip8_u32v m32 = (chip8_u32v)__builtin_convertvector((chip8_s16v)m16, chip8_s32v);
+			b->rngState = SELECT(m32, s, b->rngState);
+			chip8_u8v randomBytes = __builtin_convertvector((s * 0x9E3779BBu) >> 24, chip8_u8v);
+			V[X] = SELECT(m8, randomBytes & NN, V[X]);
+			NEXT();
+			return;
+		}
+
+		case 0xD:
+			CHIP8_EACH_LANE(g, chip8_lane_DXYN(ls, b, l, lane, X, Y, N));
+			return;
+
+		case 0xE: {
+			chip8_u16v down = (b->keys >> __builtin_convertvector(V[X] & 0xF, chip8_u16v)) & 1;
+			if (NN == 0x9E) {
+				b->pc += m16 & (2 + (down << 1));
+			}
+			else if (NN == 0xA1) {
+				b->pc += m16 & (4 - (down << 1));
+			}
+			else {
+				goto unknown;
+			}
+			return;
+		}
+
+		case 0xF:
+			switch (NN) {
+				case 0x07:
+					V[X] = SELECT(m8, b->delay_timer, V[X]);
+					break;
+				case 0x0A:
+					CHIP8_EACH_LANE(g, chip8_lane_FX0A(b, l, X));
+					return;
+				case 0x15:
+					b->delay_timer = SELECT(m8, V[X], b->delay_timer);
+					break;
+				case 0x18:
+					b->sound_timer = SELECT(m8, V[X], b->sound_timer);
+					break;
+				case 0x1E:
+					b->I += m16 & __builtin_convertvector(V[X], chip8_u16v);
+					break;
+				case 0x29:
+					b->I = SELECT(m16, __builtin_convertvector(V[X], chip8_u16v) * 5, b->I);
+					break;
+				case 0x33:
+					CHIP8_EACH_LANE(g, chip8_lane_FX33(ls, b, l, lane, X));
+					return;
+				case 0x55:
+					CHIP8_EACH_LANE(g, chip8_lane_FX55(ls, b, l, lane, X));
+					return;
+				case 0x65:
+					CHIP8_EACH_LANE(g, chip8_lane_FX65(ls, b, l, lane, X));
+					return;
+				default:
+					goto unknown;
+			}
+			NEXT();
+			return;
+	}
+
+unknown:
+	// like the interpreter, complain and stay put
+	CHIP8_EACH_LANE(g, printf("Unknown opcode: 0x%X at PC: %d\n", opcode, b->pc[l]));
+
+	#undef NEXT
+	#undef SKIP_IF
+}
+
+static inline chip8_group chip8_lockstep_group(uint32_t bits) {
+
+	static const chip8_u16v laneBits = { 1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7,
+										 1 << 8, 1 << 9, 1 << 10, 1 << 11, 1 << 12, 1 << 13, 1 << 14, 1 << 15 };
+	chip8_group g;
+	g.m16 = ~chip8_lanes_zero16(((chip8_u16v){ 0 } + (uint16_t)bits) & laneBits);
+	g.m8 = chip8_lanes_narrow(g.m16);
+	g.bits = bits;
+	return g;
+}
+
+static inline unsigned short chip8_lockstep_opcodeAt(const unsigned char *memory, unsigned short address) {
+
+	return (unsigned short)(memory[MemAddr(address)] << 8 | memory[MemAddr(address + 1)]);
+}
+
+
+// The number of different addresses the block's lanes are at, counting no further than `limit`.
+static inline int chip8_lockstep_addresses(const chip8_lanes *b, uint32_t live, int limit) {
+
+	int addresses = 0;
+	for (uint32_t waiting = live; waiting != 0 && addresses < limit; addresses++) {
+		waiting &= ~chip8_lanes_at(b, b->pc[__builtin_ctz(waiting)]);
+	}
+	return addresses;
+}
+
+
+
+// Timers
+
+// Schedules the next tick, once the timers have counted down (see chip8_scheduleTimerTick() in Chip8.c).
+static inline void chip8_lockstep_scheduleTick(chip8_lockstep_clock *clock) {
+
+	clock->timerTicks++;
+	clock->nextTimerTick = clock->timerBase + ((clock->timerTicks + 1) * clock->clockRate + 59) / 60;
+}
+
+// The timers count down in the lanes of the mask at once. The others ran on their own machines, which counted theirs down.
+static inline void chip8_lockstep_timerTick(chip8_lanes *b, chip8_u8v mask, chip8_lockstep_clock *clock) {
+
+	b->delay_timer -= (chip8_u8v)(b->delay_timer != 0) & mask & 1;
+	b->sound_timer -= (chip8_u8v)(b->sound_timer != 0) & mask & 1;
+	chip8_lockstep_scheduleTick(clock);
+}
+
+
+
+// Idle loops
+// The interpreter fast-forwards through delay timer loops and FX0A (see Idle Loops in Chip8.c). Lanes do better than that:
+// the timers never count down in the middle of a segment (see Running), so a lane anywhere in a delay loop its delay timer
+// keeps it in, or at an FX0A with no keys down, is going to stay there for the whole segment. It sits the segment out, and
+// is moved straight to where it would have ended up.
+
+// If the FX07 at pc starts a delay loop (FX07, then 3XNN or 4XNN, then a jump back to the FX07), returns the 3XNN or 4XNN.
+// Otherwise returns 0.
+static unsigned short chip8_lockstep_delayLoopTest(const chip8_lockstep *ls, unsigned short pc, unsigned char X) {
+
+	if ((pc & 1) || pc > 0xFFA || ls->divergent[pc >> 1] || ls->divergent[(pc >> 1) + 1] || ls->divergent[(pc >> 1) + 2]) {
+		return 0;
+	}
+	unsigned short test = chip8_lockstep_opcodeAt(ls->image, pc + 2);
+	unsigned short jump = chip8_lockstep_opcodeAt(ls->image, pc + 4);
+	if (jump != (0x1000 | pc) || ((test >> 8) & 0xF) != X || ((test >> 12) != 0x3 && (test >> 12) != 0x4)) {
+		return 0;
+	}
+	return test;
+}
+
+// If pc is an FX0A, returns it. If it's one of the three instructions of a delay loop, returns the loop's 3XNN or 4XNN, with
+// the address of its FX07 in *loop. Otherwise returns 0.
+static unsigned short chip8_lockstep_idleAt(const chip8_lockstep *ls, unsigned short pc, unsigned short *loop) {
+
+	if ((pc & 1) || pc > 0xFFE || ls->divergent[pc >> 1]) {
+		return 0;
+	}
+	unsigned short opcode = chip8_lockstep_opcodeAt(ls->image, pc);
+	if ((opcode & 0xF0FF) == 0xF00A) {
+		return opcode;
+	}
+	*loop = ((opcode & 0xF0FF) == 0xF007) ? pc : ((opcode >> 12) == 0x1) ? pc - 4 : pc - 2;
+	if (*loop > 0xFFA || (chip8_lockstep_opcodeAt(ls->image, *loop) & 0xF0FF) != 0xF007) {
+		return 0;
+	}
+	return chip8_lockstep_delayLoopTest(ls, *loop, ls->image[*loop] & 0xF);
+}
+
+// Moves the lanes at pc (`lanes`) that would idle there for all `steps` of the segment to where they'd end up, and returns them.
+static uint32_t chip8_lockstep_park(chip8_lockstep *ls, chip8_lanes *b, uint32_t lanes, unsigned short pc, unsigned long steps) {
+
+	unsigned short loop;
+	unsigned short test = chip8_lockstep_idleAt(ls, pc, &loop);
+	if (test == 0) {
+		return 0;
+	}
+	if ((test & 0xF0FF) == 0xF00A) {
+		return lanes & chip8_lanes_bits(chip8_lanes_zero16(b->keys));
+	}
+
+	// the lanes the test sends round again, with their delay timer in VX (and before that, at the test, with what's in VX now)
+	unsigned char X = (test >> 8) & 0xF;
+	unsigned char NN = test & 0xFF;
+	unsigned long phase = (pc - loop) / 2;
+	chip8_u8v stays = (test >> 12) == 0x3 ? (chip8_u8v)(b->delay_timer != NN) : (chip8_u8v)(b->delay_timer == NN);
+	if (phase == 1) {
+		stays &= (test >> 12) == 0x3 ? (chip8_u8v)(b->V[X] != NN) : (chip8_u8v)(b->V[X] == NN);
+	}
+	uint32_t parked = chip8_lanes_bits8(stays) & lanes;
+	if (parked == 0) {
+		return 0;
+	}
+
+	chip8_group g = chip8_lockstep_group(parked);
+	b->pc = SELECT(g.m16, (chip8_u16v){ 0 } + (unsigned short)(loop + 2 * ((phase + steps) % 3)), b->pc);
+	if (phase == 0 || phase + steps > 3) {
+		// it got to the FX07 at least once
+		b->V[X] = SELECT(g.m8, b->delay_timer, b->V[X]);
+	}
+	return parked;
+}
+
+
+
+// Regrouping
+
+// Moves everything in slot `from` of one block to slot `to` of another.
+static void chip8_lockstep_moveSlot(chip8_lanes *toBlock, int to, const chip8_lanes *fromBlock, int from) {
+
+	chip8_lane r;
+	chip8_lockstep_loadLane(fromBlock, from, &r);
+	chip8_lockstep_storeLane(toBlock, to, &r);
+}
+
+// Sorts the lanes by pc, and packs them into the blocks in that order if that leaves a good deal fewer groups to run. Lanes
+// running on their own are sorted after all the rest. Sorting isn't free, and it takes lanes a while to drift apart, so this
+// only looks every CHIP8_LOCKSTEP_REGROUP_RUNS runs.
+static void chip8_lockstep_regroup(chip8_lockstep *ls) {
+
+	size_t lanes = ls->laneCount;
+	if (ls->blockCount < 2 || ls->regroupCountdown-- > 0) {
+		return;
+	}
+	ls->regroupCountdown = CHIP8_LOCKSTEP_REGROUP_RUNS - 1;
+
+	// how many groups the lanes in the vectors are split into now
+	size_t groups = 0;
+	for (size_t block = 0; block < ls->blockCount; block++) {
+		size_t first = block * W;
+		size_t live = (lanes - first < W) ? lanes - first : W;
+		groups += chip8_lockstep_addresses(&ls->blocks[block], (((uint32_t)1 << live) - 1) & ~ls->alone[block], W);
+	}
+
+	// a regroup that's undone by the next look (lanes that don't wait for anything drift apart again straight away) was wasted,
+	// so the next one waits twice as long, and one that lasts puts it back
+	if (ls->regroupedFrom != 0) {
+		if (groups * 4 > ls->regroupedFrom * 3) {
+			ls->regroupBackoff = (ls->regroupBackoff == 0) ? 1 : (ls->regroupBackoff < 64) ? ls->regroupBackoff * 2 : 64;
+		} else {
+			ls->regroupBackoff = 0;
+		}
+		ls->regroupWait = ls->regroupBackoff;
+		ls->regroupedFrom = 0;
+	}
+	if (ls->regroupWait > 0) {
+		ls->regroupWait--;
+		return;
+	}
+	if (groups <= ls->blockCount) {
+		return;
+	}
+
+	// a radix sort of the slots by address (with lanes on their own past the last one), 7 bits at a time
+	unsigned short *keys = ls->sortKeys;
+	size_t *order = ls->sortOrder;
+	size_t *scratch = ls->sortScratch;
+	for (size_t slot = 0; slot < lanes; slot++) {
+		bool alone = (ls->alone[slot / W] >> (slot % W)) & 1;
+		keys[slot] = (alone ? 0x1000 : 0) | MemAddr(ls->blocks[slot / W].pc[slot % W]);
+		scratch[slot] = slot;
+	}
+	for (int shift = 0; shift < 14; shift += 7) {
+		size_t counts[128] = { 0 };
+		for (size_t i = 0; i < lanes; i++) {
+			counts[(keys[scratch[i]] >> shift) & 127]++;
+		}
+		size_t position = 0;
+		for (int digit = 0; digit < 128; digit++) {
+			size_t count = counts[digit];
+			counts[digit] = position;
+			position += count;
+		}
+		for (size_t i = 0; i < lanes; i++) {
+			order[counts[(keys[scratch[i]] >> shift) & 127]++] = scratch[i];
+		}
+		size_t *sorted = order;
+		order = scratch;
+		scratch = sorted;
+	}
+	order = scratch;
+
+	// ... and how many they'd be split into sorted
+	size_t sortedGroups = 0;
+	for (size_t i = 0; i < lanes && keys[order[i]] < 0x1000; i++) {
+		sortedGroups += (i % W == 0 || keys[order[i]] != keys[order[i - 1]]);
+	}
+	// moving every lane costs about as much as running it for a step, which only pays if it saves a fair number of groups
+	if (sortedGroups * 4 > groups * 3) {
+		return;
+	}
+
+	// lanes already in the block they're sorted into stay in their slots, so only the ones that change blocks move (the sort
+	// keeps lanes in the order of their slots, and a block that was sorted last time mostly still is), and lanes past the end
+	// stay where they are
+	size_t *target = (order == ls->sortOrder) ? ls->sortScratch : ls->sortOrder;
+	uint32_t *taken = ls->spareAlone;
+	memset(taken, 0, ls->blockCount * sizeof(uint32_t));
+	if (lanes % W != 0) {
+		taken[lanes / W] = ~(((uint32_t)1 << (lanes % W)) - 1);
+	}
+	for (size_t i = 0; i < lanes; i++) {
+		size_t from = order[i];
+		if (from / W == i / W) {
+			target[from] = from;
+			taken[i / W] |= (uint32_t)1 << (from % W);
+		}
+	}
+	for (size_t i = 0; i < lanes; i++) {
+		size_t from = order[i];
+		if (from / W != i / W) {
+			int to = __builtin_ctz(~taken[i / W]);
+			target[from] = (i / W) * W + (size_t)to;
+			taken[i / W] |= (uint32_t)1 << to;
+		}
+	}
+
+	// the runs lanes on their own are behind by are kept by slot, so the ones that move catch up first
+	for (size_t from = 0; from < lanes; from++) {
+		if (target[from] != from) {
+			chip8_lockstep_catchUpLane(ls, ls->slotLane[from]);
+		}
+	}
+
+	size_t *slotLane = order;
+	memcpy(ls->spareBlocks, ls->blocks, ls->blockCount * sizeof(chip8_lanes));
+	memset(ls->spareAlone, 0, ls->blockCount * sizeof(uint32_t));
+	for (size_t from = 0; from < lanes; from++) {
+		size_t to = target[from];
+		if (to != from) {
+			chip8_lockstep_moveSlot(&ls->spareBlocks[to / W], to % W, &ls->blocks[from / W], from % W);
+		}
+		slotLane[to] = ls->slotLane[from];
+		ls->spareAlone[to / W] |= ((ls->alone[from / W] >> (from % W)) & 1) << (to % W);
+	}
+	for (size_t slot = 0; slot < lanes; slot++) {
+		ls->slotLane[slot] = slotLane[slot];
+		ls->laneSlot[slotLane[slot]] = slot;
+	}
+
+	chip8_lanes *blocks = ls->blocks;
+	ls->blocks = ls->spareBlocks;
+	ls->spareBlocks = blocks;
+	uint32_t *alone = ls->alone;
+	ls->alone = ls->spareAlone;
+	ls->spareAlone = alone;
+	ls->regroupedFrom = groups;
+	ls->stats.regroups++;
+}
+
+
+
+// Running
+// Lanes only have to agree on the cycle count when the timers count down, and at the end of the run. So a block runs in
+// segments that end at the next timer tick, and within a segment every lane has its own count of the steps it has left. The
+// lanes at the lowest address go first, which lets lanes that have fallen behind on the same path catch up with the ones
+// ahead, and run together from there. A lane with no steps left waits for the end of the segment.
+//
+// A block that's had more than CHIP8_LOCKSTEP_GRACE_TURNS turns in a segment, with fewer than CHIP8_LOCKSTEP_MIN_LANES lanes
+// a turn between them, is too split up for the vectors to pay. Its lanes go off and run to the end of the run on their own
+// machines, on the interpreter with its decode cache, superinstructions and idle loops.
+//
+// From then on they don't run a run at a time. Switching from one machine to the next every 60th of a second costs the
+// interpreter a good deal (the branch predictor has learned the other machine's path, not this one's), so the clock and
+// every block's keys are noted down at the start of each run instead, and a lane on its own catches up on the runs it's
+// missed (runs with the same keys in one go) when its patience runs out, when anything looks at it, or when there are
+// CHIP8_LOCKSTEP_BEHIND of them. Then, if it's got to an idle loop, or to enough lanes at the same address to make a
+// group, it comes back to its block. If not, its patience doubles, up to CHIP8_LOCKSTEP_BEHIND runs.
+
+#define CHIP8_LOCKSTEP_SEGMENT	0x7FFF	// the most steps in a segment, which is as many as fit in the 16 bit counts of steps left
+
+// Runs the lane in slot l of the block, which is on its own, on its machine for `cycles` steps from the clock.
+static void chip8_lockstep_runAlone(chip8_lockstep *ls, chip8_lanes *b, int l, size_t lane, uint16_t keys, unsigned long cycles,
+									const chip8_lockstep_clock *clock) {
+
+	chip8_machine *m = ls->machines[lane];
+	m->keys = keys;
+	m->clockRate = clock->clockRate;
+	m->cycles = clock->cycles;
+	m->nextTimerTick = clock->nextTimerTick;
+	m->timerBase = clock->timerBase;
+	m->timerTicks = clock->timerTicks;
+
+	chip8_machine_run(m, cycles);
+	b->pc[l] = m->pc;
+}
+
+// Runs a lane that's on its own through the runs it's behind by.
+static void chip8_lockstep_catchUpLane(chip8_lockstep *ls, size_t lane) {
+
+	size_t slot = ls->laneSlot[lane];
+	size_t block = slot / W;
+	int l = slot % W;
+	if (!(ls->alone[block] & ((uint32_t)1 << l))) {
+		return;
+	}
+	chip8_lanes *b = &ls->blocks[block];
+	const chip8_u16v *pastKeys = &ls->pastKeys[block * CHIP8_LOCKSTEP_BEHIND];
+	for (size_t run = b->caughtUp[l], next; run < ls->pastRuns; run = next) {
+		// runs with the same keys go in one, which comes to the same thing without stopping and starting the machine in between
+		unsigned long cycles = ls->pastCycles[run];
+		for (next = run + 1; next < ls->pastRuns && pastKeys[next][l] == pastKeys[run][l]; next++) {
+			cycles += ls->pastCycles[next];
+		}
+		chip8_lockstep_runAlone(ls, b, l, lane, pastKeys[run][l], cycles, &ls->pastClocks[run]);
+	}
+	b->caughtUp[l] = (uint8_t)ls->pastRuns;
+}
+
+// The lowest address any of the lanes is at.
+static inline unsigned short chip8_lockstep_lowestPC(const chip8_lanes *b, uint32_t lanes) {
+
+#if defined(__SSE2__)
+	// SSE2 only compares signed 16 bit numbers, so the top bit is flipped going in and out (and the other lanes are at 0xFFFF)
+	chip8_u16v pc = SELECT(chip8_lockstep_group(lanes).m16, b->pc, (chip8_u16v){ 0 } + 0xFFFF) ^ 0x8000;
+	__m128i halves[sizeof(pc) / 16];
+	memcpy(halves, &pc, sizeof(pc));
+	__m128i lowest = halves[0];
+	for (size_t i = 1; i < sizeof(pc) / 16; i++) {
+		lowest = _mm_min_epi16(lowest, halves[i]);
+	}
+	lowest = _mm_min_epi16(lowest, _mm_shuffle_epi32(lowest, _MM_SHUFFLE(1, 0, 3, 2)));
+	lowest = _mm_min_epi16(lowest, _mm_shuffle_epi32(lowest, _MM_SHUFFLE(2, 3, 0, 1)));
+	lowest = _mm_min_epi16(lowest, _mm_shufflelo_epi16(lowest, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (unsigned short)(_mm_extract_epi16(lowest, 0) ^ 0x8000);
+#else
+	unsigned short lowest = 0xFFFF;
+	for (; lanes != 0; lanes &= lanes - 1) {
+		unsigned short pc = b->pc[__builtin_ctz(lanes)];
+		lowest = (pc < lowest) ? pc : lowest;
+	}
+	return lowest;
+#endif
+}
+
+// How many lanes there are. __builtin_popcount() is a call into the runtime library unless the target has an instruction for it.
+static inline int chip8_lockstep_count(uint32_t lanes) {
+
+	lanes = lanes - ((lanes >> 1) & 0x5555);
+	lanes = (lanes & 0x3333) + ((lanes >> 2) & 0x3333);
+	lanes = (lanes + (lanes >> 4)) & 0x0F0F;
+	return (int)((lanes + (lanes >> 8)) & 0x1F);
+}
+
+// Whether there are at least `count` lanes (up to 4).
+static inline bool chip8_lockstep_atLeast(uint32_t lanes, int count) {
+
+	for (int i = 1; i < count; i++) {
+		lanes &= lanes - 1;
+	}
+	return lanes != 0;
+}
+
+// Runs one segment of `steps` steps, from the clock, in the lanes of the block in `live`, and updates *alone.
+static void chip8_lockstep_runSegment(chip8_lockstep *ls, chip8_lanes *b, size_t first, uint32_t live, uint32_t *alone,
+									  unsigned long steps, unsigned long rest, const chip8_lockstep_clock *clock, chip8_lockstep_stats *stats) {
+
+	// lanes that would only go round an idle loop sit it out
+	uint32_t active = live & ~*alone;
+	for (uint32_t waiting = active; waiting != 0; ) {
+		unsigned short pc = b->pc[__builtin_ctz(waiting)];
+		uint32_t group = chip8_lanes_at(b, pc) & waiting;
+		waiting &= ~group;
+		uint32_t parked = chip8_lockstep_park(ls, b, group, pc, steps);
+		active &= ~parked;
+		stats->idleInstructions += (unsigned long long)chip8_lockstep_count(parked) * steps;
+	}
+
+	chip8_u16v left = (chip8_u16v){ 0 } + (uint16_t)steps;
+	uint32_t vectors = active;
+	unsigned long turns = 0;
+	unsigned long ran = 0;
+	while (active != 0) {
+
+		// the usual case is every lane at the same instruction, which is then the lowest too
+		unsigned short pc = b->pc[__builtin_ctz(active)];
+		uint32_t group = chip8_lanes_at(b, pc) & active;
+		if (group != active) {
+			pc = chip8_lockstep_lowestPC(b, active);
+			group = chip8_lanes_at(b, pc) & active;
+		}
+		turns++;
+		ran += chip8_lockstep_count(group);
+		if (turns > CHIP8_LOCKSTEP_GRACE_TURNS && ran < turns * CHIP8_LOCKSTEP_MIN_LANES) {
+			// too few lanes a turn for the vectors to pay, so each goes off on its own
+			for (uint32_t bits = active; bits != 0; bits &= bits - 1) {
+				int l = __builtin_ctz(bits);
+				chip8_lockstep_clock laneClock = *clock;
+				laneClock.cycles += steps - left[l];
+				size_t lane = ls->slotLane[first + l];
+				chip8_lockstep_toMachine(b, l, ls->machines[lane]);
+				chip8_lockstep_runAlone(ls, b, l, lane, b->keys[l], left[l] + rest, &laneClock);
+				b->caughtUp[l] = (uint8_t)ls->pastRuns;
+				b->patience[l] = 0;
+				stats->laneInstructions += left[l] + rest;
+			}
+			*alone |= active;
+			break;
+		}
+
+		unsigned short opcode;
+		if (ls->divergent[MemAddr(pc) >> 1] | ls->divergent[MemAddr(pc + 1) >> 1]) {
+			// somebody has written over this instruction, so only the lanes that agree with the first of them go
+			int leader = __builtin_ctz(group);
+			opcode = chip8_lockstep_opcodeAt(ls->machines[ls->slotLane[first + leader]]->memory, pc);
+			for (uint32_t bits = group; bits != 0; bits &= bits - 1) {
+				int l = __builtin_ctz(bits);
+				if (chip8_lockstep_opcodeAt(ls->machines[ls->slotLane[first + l]]->memory, pc) != opcode) {
+					group &= ~((uint32_t)1 << l);
+				}
+			}
+			stats->divergentCode++;
+		}
+		else {
+			opcode = chip8_lockstep_opcodeAt(ls->image, pc);
+		}
+
+		chip8_group g = chip8_lockstep_group(group);
+		chip8_lockstep_execute(ls, b, first, &g, opcode);
+		stats->groups++;
+
+		left -= g.m16 & 1;
+		active &= ~chip8_lanes_bits(chip8_lanes_zero16(left));
+	}
+
+	// the instructions the vectors ran, counted up once rather than a group at a time
+	for (; vectors != 0; vectors &= vectors - 1) {
+		stats->groupLanes += steps - left[__builtin_ctz(vectors)];
+	}
+}
+
+// Runs one block of lanes for `cycles` steps. The clock is the block's own copy of the timer schedule.
+static void chip8_lockstep_runBlock(chip8_lockstep *ls, size_t block, unsigned long cycles, chip8_lockstep_clock *clock) {
+
+	chip8_lanes *b = &ls->blocks[block];
+	size_t first = block * W;
+	size_t lanes = (ls->laneCount - first < W) ? ls->laneCount - first : W;
+	uint32_t live = ((uint32_t)1 << lanes) - 1;
+	chip8_lockstep_stats stats = { 0 };
+
+	stats.instructions = (unsigned long long)cycles * lanes;
+	while (cycles > 0) {
+		unsigned long long untilTick = clock->nextTimerTick - clock->cycles;
+		unsigned long steps = (cycles < untilTick) ? cycles : (unsigned long)untilTick;
+		steps = (steps < CHIP8_LOCKSTEP_SEGMENT) ? steps : CHIP8_LOCKSTEP_SEGMENT;
+
+		chip8_lockstep_runSegment(ls, b, first, live, &ls->alone[block], steps, cycles - steps, clock, &stats);
+		stats.segments++;
+
+		// the lanes on their own machines have counted their own timers down
+		clock->cycles += steps;
+		cycles -= steps;
+		chip8_u8v ticks = ~chip8_lockstep_group(ls->alone[block]).m8;
+		while (clock->cycles >= clock->nextTimerTick) {
+			chip8_lockstep_timerTick(b, ticks, clock);
+		}
+	}
+
+	ls->stats.instructions += stats.instructions;
+	ls->stats.idleInstructions += stats.idleInstructions;
+	ls->stats.laneInstructions += stats.laneInstructions;
+	ls->stats.segments += stats.segments;
+	ls->stats.groups += stats.groups;
+	ls->stats.groupLanes += stats.groupLanes;
+	ls->stats.divergentCode += stats.divergentCode;
+}
+
+// Catches up the lanes on their own in a block that have run out of patience (or all of them), and brings them back if they've
+// got to an idle loop, or to enough others to run with.
+static void chip8_lockstep_comeBack(chip8_lockstep *ls, size_t block, bool all) {
+
+	chip8_lanes *b = &ls->blocks[block];
+	size_t first = block * W;
+	size_t lanes = (ls->laneCount - first < W) ? ls->laneCount - first : W;
+	uint32_t live = ((uint32_t)1 << lanes) - 1;
+	uint32_t due = ls->alone[block];
+	if (!all) {
+		due &= chip8_lanes_bits8((chip8_u8v)((chip8_u8v){ 0 } + (uint8_t)ls->pastRuns - b->caughtUp >= b->patience));
+	}
+	for (; due != 0; due &= due - 1) {
+		int l = __builtin_ctz(due);
+		size_t lane = ls->slotLane[first + l];
+		chip8_lockstep_catchUpLane(ls, lane);
+		unsigned short loop;
+		if (chip8_lockstep_idleAt(ls, b->pc[l], &loop) != 0 ||
+			chip8_lockstep_atLeast(chip8_lanes_at(b, b->pc[l]) & live, CHIP8_LOCKSTEP_MIN_LANES)) {
+			chip8_lockstep_fromMachine(b, l, ls->machines[lane]);
+			ls->alone[block] &= ~((uint32_t)1 << l);
+		}
+		else {
+			b->patience[l] = (b->patience[l] == 0) ? 1 : (b->patience[l] * 2 < CHIP8_LOCKSTEP_BEHIND) ? b->patience[l] * 2 : CHIP8_LOCKSTEP_BEHIND;
+		}
+	}
+}
+
+void chip8_lockstep_run(chip8_lockstep *ls, unsigned long cycles) {
+
+	bool all = ls->pastRuns == CHIP8_LOCKSTEP_BEHIND;
+	for (size_t block = 0; block < ls->blockCount; block++) {
+		chip8_lockstep_comeBack(ls, block, all);
+		if (all) {
+			ls->blocks[block].caughtUp = (chip8_u8v){ 0 };
+		}
+	}
+	if (all) {
+		ls->pastRuns = 0;
+	}
+	chip8_lockstep_regroup(ls);
+
+	// the lanes on their own don't run now, they're only told what they'll have to run when they catch up
+	size_t run = ls->pastRuns++;
+	ls->pastClocks[run] = ls->clock;
+	ls->pastCycles[run] = cycles;
+	for (size_t block = 0; block < ls->blockCount; block++) {
+		ls->pastKeys[block * CHIP8_LOCKSTEP_BEHIND + run] = ls->blocks[block].keys;
+		ls->stats.laneInstructions += (unsigned long long)chip8_lockstep_count(ls->alone[block]) * cycles;
+	}
+
+	// every block starts from the same point on the same schedule, so they all end up in the same place
+	chip8_lockstep_clock clock = ls->clock;
+	for (size_t block = 0; block < ls->blockCount; block++) {
+		clock = ls->clock;
+		chip8_lockstep_runBlock(ls, block, cycles, &clock);
+	}
+	ls->clock = clock;
+}
+
+unsigned long chip8_lockstep_runFrame(chip8_lockstep *ls) {
+
+	unsigned long cycles = (unsigned long)(ls->clock.nextTimerTick - ls->clock.cycles);
+	chip8_lockstep_run(ls, cycles);
+	return cycles;
+}
+
+void chip8_lockstep_catchUp(chip8_lockstep *ls) {
+
+	for (size_t lane = 0; lane < ls->laneCount; lane++) {
+		chip8_lockstep_catchUpLane(ls, lane);
+	}
+}
@@ -0,0 +1,69 @@
+//
+//  Chip8Lockstep.h
+//  Chip8
+//
+//  Runs many copies of one machine in lockstep, several at a time in SIMD lanes.
+//
+
+#ifndef __Chip8__Chip8Lockstep__
+#define __Chip8__Chip8Lockstep__
+
+#include "Chip8.h"
+
+
+#define CHIP8_LOCKSTEP_WIDTH	16		// lanes that run side by side in one set of vector registers
+
+
+typedef struct chip8_lockstep chip8_lockstep;
+
+// Makes `lanes` copies of the machine, all at the same point (the way chip8_machine_fork() would). They're meant for running
+// the same ROM with different inputs, like training an agent on thousands of games of PONG at once.
+// Returns NULL if there isn't the memory.
+chip8_lockstep *chip8_lockstep_create(const chip8_machine *prototype, size_t lanes);
+void chip8_lockstep_destroy(chip8_lockstep *lockstep);
+
+size_t chip8_lockstep_laneCount(const chip8_lockstep *lockstep);
+
+// Every lane runs `cycles` instructions. All of the lanes share one cycle count, so the 60Hz timers count down on the same
+// instruction in every lane, just as they would if each lane were a machine of its own running the same number of cycles.
+void chip8_lockstep_run(chip8_lockstep *lockstep, unsigned long cycles);
+unsigned long chip8_lockstep_runFrame(chip8_lockstep *lockstep);	// runs to the end of the 60Hz frame, returns the cycles each lane ran
+void chip8_lockstep_catchUp(chip8_lockstep *lockstep);		// catches up every lane that's behind (see Lanes), to time all the work a set of runs did
+
+unsigned long long chip8_lockstep_cycles(const chip8_lockstep *lockstep);
+
+// Lanes
+// Lanes don't have the machine's superinstructions, sound or key observers, or needsDisplay, but otherwise run exactly like
+// the interpreter, quirks and all. Copy one out to a machine to look at the rest of it.
+// A lane running on its own (see laneInstructions) can be a few runs behind the rest; it catches up whenever it's looked at
+// (its screen, a copy or a seed), so that's never seen.
+void chip8_lockstep_resetLane(chip8_lockstep *lockstep, size_t lane);		// back to the way the prototype was (only the cycle count carries on)
+void chip8_lockstep_setKeys(chip8_lockstep *lockstep, size_t lane, uint16_t keys);	// bit n set while key n is held down
+uint16_t chip8_lockstep_keys(const chip8_lockstep *lockstep, size_t lane);
+void chip8_lockstep_seed(chip8_lockstep *lockstep, size_t lane, unsigned int seed);	// like chip8_machine_seed()
+const uint64_t *chip8_lockstep_screen(chip8_lockstep *lockstep, size_t lane);	// 32 rows, the same as chip8_machine.gfx
+
+// Copies the lane into the machine, which carries on from there exactly as the lane would (with the quirks and clock rate the lanes run with).
+void chip8_lockstep_copyLane(chip8_lockstep *lockstep, size_t lane, chip8_machine *machine);
+
+
+// Statistics
+// Lanes at different addresses can't run together, so each address takes a turn. `groups` counts the turns. Lanes split up
+// into too many of them run on their own instead, which laneInstructions counts.
+typedef struct chip8_lockstep_stats {
+
+	unsigned long long	instructions;		// instructions run, counting every lane
+	unsigned long long	idleInstructions;	// ... of which were fast-forwarded, because the lane was waiting in an idle loop
+	unsigned long long	laneInstructions;	// ... or run by a lane on its own, because its block had split into too many groups
+	unsigned long long	segments;			// times a block ran to the next timer tick (or the end of the run)
+	unsigned long long	groups;				// times a group of lanes at the same address ran an instruction together
+	unsigned long long	groupLanes;			// lanes in those groups, added up
+	unsigned long long	divergentCode;		// groups that had to check their lanes still had the same instruction, because some lane wrote over it
+	unsigned long long	regroups;			// times the lanes were sorted by address and packed into blocks again
+
+} chip8_lockstep_stats;
+
+chip8_lockstep_stats chip8_lockstep_getStats(const chip8_lockstep *lockstep);
+
+
+#endif /* defined(__Chip8__Chip8Lockstep__) */
@@ -0,0 +1,426 @@
+//
+//  Chip8Pacer.c
+//  Chip8
+//
+//  Runs a machine at real speed on a thread of its own, a 60Hz frame at a time.
+//
+
+#include "Chip8Pacer.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__APPLE__)
+	#include <mach/mach_time.h>
+	#include <pthread/qos.h>
+#endif
+
+/*
+ How pacing works
+
+ The core never looks at the clock (see chip8_machine_setClockRate()), so it's up to us to run a frame's worth of instructions
+ every 60th of a second. Rather than a timer, which fires whenever the run loop gets round to it, the pacer works out when
+ each frame is due from when it started: frame n is due at start + n / 60 seconds. It sleeps until then, runs the frame, and
+ moves on to the next. Because each deadline comes from the start rather than from when the last frame finished, being
+ woken late doesn't make the next frame late as well, and the game runs at exactly the right speed on average.
+
+ Sleeping is only good to within a few tens of microseconds (much worse on a busy machine), so the pacer sleeps until just
+ before the deadline and spins for the rest.
+
+ If it falls behind (a slow frame, or the computer was asleep) the next frames are already due, so they run back to back until
+ it has caught up. After CHIP8_PACER_MAX_CATCH_UP frames it gives up on the rest, counts them as dropped, and starts again from now.
+
+ Between frames, the pacer runs any work that other threads sent it with chip8_pacer_perform(), which is how they get at the
+ machine without a lock.
+*/
+
+#define CHIP8_PACER_FRAME		(1000000000ull / 60)	// nanoseconds in a 60Hz frame
+#define CHIP8_PACER_SPIN		250000ull				// how long before a deadline we stop sleeping and spin instead
+
+
+typedef struct chip8_pacer_job {
+
+	chip8_pacer_work		work;
+	void					*context;
+	bool					wait;			// the sender is waiting for `done` (and the job is on its stack)
+	bool					done;
+	struct chip8_pacer_job	*next;
+
+} chip8_pacer_job;
+
+struct chip8_pacer {
+
+	chip8_machine			*machine;
+	chip8_pacer_callbacks	callbacks;
+	void					*context;
+	pthread_t				thread;
+
+	pthread_mutex_t			lock;			// protects everything below
+	pthread_cond_t			wake;			// signalled to wake the pacer's thread while it's paused
+	pthread_cond_t			changed;		// signalled when the thread parks, or finishes a job somebody is waiting for
+
+	chip8_pacer_job			*jobs;			// in the order they were sent
+	chip8_pacer_job			*lastJob;
+
+	bool					paused;			// asked to pause
+	bool					parked;			// ... and has
+	bool					quit;
+	bool					turbo;
+	bool					restart;		// start pacing again from now (after a pause, or changing to and from turbo)
+
+	uint64_t				deadline;		// when the next frame is due
+	uint64_t				nextPresent;	// when turbo mode next presents a frame
+	uint64_t				mark;			// the time up to which we've counted as running
+
+	chip8_pacer_stats		stats;
+	double					jitterTotal;
+	double					jitterSquares;
+};
+
+
+
+// Clock
+// Deadlines are in chip8_now()'s nanoseconds, which is CLOCK_MONOTONIC for clock_nanosleep() (and mach_absolute_time()'s
+// clock on the Mac, which mach_wait_until() waits on).
+
+static void chip8_pacer_sleepUntil(uint64_t deadline) {
+
+	uint64_t now = chip8_now();
+	if (deadline > now + CHIP8_PACER_SPIN) {
+		uint64_t wake = deadline - CHIP8_PACER_SPIN;
+#if defined(__APPLE__)
+		// there's no clock_nanosleep() here, but mach_wait_until() is just as good with the time converted to Mach ticks
+		static mach_timebase_info_data_t timebase;
+		if (timebase.denom == 0) {
+			mach_timebase_info(&timebase);
+		}
+		mach_wait_until(mach_absolute_time() + (wake - now) * timebase.denom / timebase.numer);
+#else
+		struct timespec until = { (time_t)(wake / 1000000000u), (long)(wake % 1000000000u) };
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+		}
+#endif
+	}
+
+	while (chip8_now() < deadline) {
+		sched_yield();
+	}
+}
+
+
+
+// Pacer thread
+
+// Runs the queued jobs. Called, and returns, with the lock held.
+static void chip8_pacer_runJobs(chip8_pacer *p) {
+
+	while (p->jobs != NULL) {
+		chip8_pacer_job *job = p->jobs;
+		p->jobs = job->next;
+		if (p->jobs == NULL) {
+			p->lastJob = NULL;
+		}
+
+		pthread_mutex_unlock(&p->lock);
+		job->work(job->context, p->machine);
+		pthread_mutex_lock(&p->lock);
+
+		if (job->wait) {
+			job->done = true;
+			pthread_cond_broadcast(&p->changed);
+		}
+		else {
+			free(job);
+		}
+	}
+}
+
+// Running time since the mark that hasn't been counted yet. A frame lasts until the next one is due, so that 60 frames take
+// exactly a second rather than a second less a frame. Called with the lock held.
+static uint64_t chip8_pacer_uncounted(const chip8_pacer *p) {
+
+	return (p->deadline > p->mark) ? p->deadline - p->mark : 0;
+}
+
+// Counts a frame that started at `start`. Called with the lock held.
+static void chip8_pacer_count(chip8_pacer *p, uint64_t start, unsigned long long cycles, bool present, bool paced) {
+
+	chip8_pacer_stats *s = &p->stats;
+
+	s->frames++;
+	s->presented += present;
+	s->cycles += cycles;
+	if (start > p->mark) {
+		s->running += start - p->mark;
+		p->mark = start;
+	}
+	s->targetRate = p->machine->clockRate;
+
+	if (paced) {
+		uint64_t late = (start > p->deadline) ? start - p->deadline : 0;
+		s->jitterSamples++;
+		p->jitterTotal += late;
+		p->jitterSquares += (double)late * late;
+		if (late > s->jitterMax) {
+			s->jitterMax = late;
+		}
+	}
+}
+
+static void *chip8_pacer_main(void *context) {
+
+	chip8_pacer *p = context;
+
+#if defined(__APPLE__)
+	// the same as the main thread, so the frames keep coming when the Mac is busy
+	pthread_set_qos_class_self_np(QOS_CLASS_USER_INTERACTIVE, 0);
+#endif
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		chip8_pacer_runJobs(p);
+		if (p->quit) {
+			break;
+		}
+
+		if (p->paused) {
+			if (!p->parked) {
+				p->stats.running += chip8_pacer_uncounted(p);
+				p->mark = p->deadline;
+				p->parked = true;
+				pthread_cond_broadcast(&p->changed);
+			}
+			pthread_cond_wait(&p->wake, &p->lock);
+			continue;
+		}
+
+		if (p->restart) {
+			uint64_t now = chip8_now();
+			p->deadline = now;
+			p->nextPresent = now;
+			p->mark = now;
+			p->restart = false;
+		}
+		bool turbo = p->turbo;
+		uint64_t deadline = p->deadline;
+
+		// wait for the frame to be due, and then look again, in case we were paused or sent some work in the meantime
+		if (!turbo && chip8_now() < deadline) {
+			pthread_mutex_unlock(&p->lock);
+			chip8_pacer_sleepUntil(deadline);
+			pthread_mutex_lock(&p->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		uint64_t start = chip8_now();
+		unsigned long long cycles = p->machine->cycles;
+		if (p->callbacks.runFrame != NULL) {
+			p->callbacks.runFrame(p->context, p->machine);
+		}
+		else {
+			chip8_machine_runFrame(p->machine);
+		}
+		cycles = (p->machine->cycles > cycles) ? p->machine->cycles - cycles : 0;	// rewinding goes backwards
+
+		// turbo mode shows one frame every 60th of a second, whichever frame that happens to be
+		bool present = true;
+		if (turbo) {
+			present = (start >= p->nextPresent);
+			if (present) {
+				p->nextPresent = (start - p->nextPresent < CHIP8_PACER_FRAME) ? p->nextPresent + CHIP8_PACER_FRAME : start + CHIP8_PACER_FRAME;
+			}
+		}
+		if (p->callbacks.frameDone != NULL) {
+			p->callbacks.frameDone(p->context, p->machine, present);
+		}
+		uint64_t end = chip8_now();
+
+		pthread_mutex_lock(&p->lock);
+		chip8_pacer_count(p, start, cycles, present, !turbo);
+
+		if (turbo) {
+			p->deadline = end;
+		}
+		else {
+			p->deadline += CHIP8_PACER_FRAME;
+			if (end > p->deadline + CHIP8_PACER_MAX_CATCH_UP * CHIP8_PACER_FRAME) {
+				p->stats.dropped += (end - p->deadline) / CHIP8_PACER_FRAME;
+				p->deadline = end;
+			}
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+
+
+// Pacer API
+
+chip8_pacer *chip8_pacer_create(chip8_machine *machine, const chip8_pacer_callbacks *callbacks, void *context) {
+
+	chip8_pacer *p = calloc(1, sizeof(chip8_pacer));
+	if (p == NULL) {
+		return NULL;
+	}
+
+	p->machine = machine;
+	if (callbacks != NULL) {
+		p->callbacks = *callbacks;
+	}
+	p->context = context;
+	p->paused = true;
+	p->restart = true;
+	p->stats.targetRate = machine->clockRate;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+	pthread_cond_init(&p->changed, NULL);
+
+	if (pthread_create(&p->thread, NULL, chip8_pacer_main, p) != 0) {
+		pthread_cond_destroy(&p->changed);
+		pthread_cond_destroy(&p->wake);
+		pthread_mutex_destroy(&p->lock);
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+void chip8_pacer_destroy(chip8_pacer *p) {
+
+	if (p == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->quit = true;
+	pthread_cond_signal(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+
+	// the thread runs the jobs it already had before it quits, so there's nothing left to free
+	pthread_cond_destroy(&p->changed);
+	pthread_cond_destroy(&p->wake);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+}
+
+void chip8_pacer_resume(chip8_pacer *p) {
+
+	pthread_mutex_lock(&p->lock);
+	if (p->paused) {
+		p->paused = false;
+		p->parked = false;
+		p->restart = true;
+		pthread_cond_signal(&p->wake);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+void chip8_pacer_pause(chip8_pacer *p) {
+
+	pthread_mutex_lock(&p->lock);
+	p->paused = true;
+
+	// from a callback on the pacer's own thread, the pacer stops once the callback returns (and waiting would never end)
+	while (!p->parked && !pthread_equal(pthread_self(), p->thread)) {
+		pthread_cond_wait(&p->changed, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+bool chip8_pacer_perform(chip8_pacer *p, chip8_pacer_work work, void *context, bool wait) {
+
+	// from the pacer's own thread (a callback, say) we're already between frames, and waiting would never end
+	if (pthread_equal(pthread_self(), p->thread)) {
+		work(context, p->machine);
+		return true;
+	}
+
+	chip8_pacer_job waitingJob;
+	chip8_pacer_job *job = wait ? &waitingJob : malloc(sizeof(chip8_pacer_job));
+	if (job == NULL) {
+		return false;
+	}
+	*job = (chip8_pacer_job){ work, context, wait, false, NULL };
+
+	pthread_mutex_lock(&p->lock);
+	if (p->lastJob != NULL) {
+		p->lastJob->next = job;
+	}
+	else {
+		p->jobs = job;
+	}
+	p->lastJob = job;
+	pthread_cond_signal(&p->wake);
+
+	while (wait && !job->done) {
+		pthread_cond_wait(&p->changed, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return true;
+}
+
+static void chip8_pacer_applyClockRate(void *context, chip8_machine *machine) {
+
+	chip8_machine_setClockRate(machine, (unsigned int)(uintptr_t)context);
+}
+
+void chip8_pacer_setClockRate(chip8_pacer *p, unsigned int instructionsPerSecond) {
+
+	chip8_pacer_perform(p, chip8_pacer_applyClockRate, (void *)(uintptr_t)instructionsPerSecond, true);
+}
+
+void chip8_pacer_setTurbo(chip8_pacer *p, bool turbo) {
+
+	pthread_mutex_lock(&p->lock);
+	if (p->turbo != turbo) {
+		p->turbo = turbo;
+		p->restart = true;
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+
+// Statistics
+
+chip8_pacer_stats chip8_pacer_getStats(chip8_pacer *p) {
+
+	pthread_mutex_lock(&p->lock);
+	chip8_pacer_stats stats = p->stats;
+	if (!p->parked) {
+		stats.running += chip8_pacer_uncounted(p);
+	}
+	if (stats.jitterSamples > 0) {
+		stats.jitterMean = p->jitterTotal / stats.jitterSamples;
+		double variance = p->jitterSquares / stats.jitterSamples - stats.jitterMean * stats.jitterMean;
+		stats.jitterStdDev = (variance > 0) ? sqrt(variance) : 0;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	if (stats.running > 0) {
+		stats.measuredRate = stats.cycles * 1e9 / stats.running;
+		stats.measuredFPS = stats.frames * 1e9 / stats.running;
+	}
+	return stats;
+}
+
+void chip8_pacer_resetStats(chip8_pacer *p) {
+
+	pthread_mutex_lock(&p->lock);
+	unsigned int targetRate = p->stats.targetRate;
+	memset(&p->stats, 0, sizeof(p->stats));
+	p->stats.targetRate = targetRate;
+	p->jitterTotal = 0;
+	p->jitterSquares = 0;
+	p->mark = chip8_now();
+	pthread_mutex_unlock(&p->lock);
+}
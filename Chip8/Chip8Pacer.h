@@ -0,0 +1,83 @@
+//
+//  Chip8Pacer.h
+//  Chip8
+//
+//  Runs a machine at real speed on a thread of its own, a 60Hz frame at a time.
+//
+
+#ifndef __Chip8__Chip8Pacer__
+#define __Chip8__Chip8Pacer__
+
+#include "Chip8.h"
+
+
+#define CHIP8_PACER_MAX_CATCH_UP	15	// frames the pacer will run back to back to catch up before it gives up on them (a quarter of a second)
+
+
+typedef struct chip8_pacer chip8_pacer;
+
+// Called on the pacer's thread.
+typedef struct chip8_pacer_callbacks {
+
+	// Runs one 60Hz frame. NULL means chip8_machine_runFrame(), but a frontend might want to do something else, like step back a frame while rewinding.
+	void (*runFrame)(void *context, chip8_machine *machine);
+
+	// Called after every frame. `present` is false for the frames turbo mode skips, which there's no point showing.
+	void (*frameDone)(void *context, chip8_machine *machine, bool present);
+
+} chip8_pacer_callbacks;
+
+// Work for the pacer's thread (see chip8_pacer_perform()).
+typedef void (*chip8_pacer_work)(void *context, chip8_machine *machine);
+
+
+// Starts the pacer's thread, paused. From then on the machine belongs to that thread, so only touch it with chip8_pacer_perform().
+// `callbacks` is copied. Returns NULL if the thread can't be started.
+chip8_pacer *chip8_pacer_create(chip8_machine *machine, const chip8_pacer_callbacks *callbacks, void *context);
+void chip8_pacer_destroy(chip8_pacer *pacer);		// stops the thread and waits for it. The machine is yours again
+
+void chip8_pacer_resume(chip8_pacer *pacer);		// not from the pacer's own thread (from a callback, say)
+
+// Returns once the machine has stopped, between two frames. Called from a callback, it returns straight away, and the pacer
+// stops as soon as the frame is done.
+void chip8_pacer_pause(chip8_pacer *pacer);
+
+// Runs `work` on the pacer's thread between two frames (or straight away, if it's paused), in the order it was sent.
+// With `wait` it returns once the work is done, otherwise straight away. Returns false if there's no memory to queue it.
+bool chip8_pacer_perform(chip8_pacer *pacer, chip8_pacer_work work, void *context, bool wait);
+
+// The machine's clock rate (see chip8_machine_setClockRate()), which is how many instructions a second of real time runs.
+void chip8_pacer_setClockRate(chip8_pacer *pacer, unsigned int instructionsPerSecond);
+
+// In turbo mode the pacer doesn't wait for anything: it runs frames back to back as fast as it can, and only presents
+// 60 of them a second.
+void chip8_pacer_setTurbo(chip8_pacer *pacer, bool turbo);
+
+
+// Statistics
+// Times are in nanoseconds. Only time spent running counts, not time spent paused.
+typedef struct chip8_pacer_stats {
+
+	unsigned int		targetRate;		// instructions per second we're aiming for (the machine's clock rate)
+	double				measuredRate;	// instructions per second we actually ran
+	double				measuredFPS;	// ... and frames per second
+
+	unsigned long long	frames;			// frames run
+	unsigned long long	presented;		// frames presented (all of them, outside turbo mode)
+	unsigned long long	dropped;		// frames given up on because we fell more than CHIP8_PACER_MAX_CATCH_UP behind
+	unsigned long long	cycles;			// instructions run
+	uint64_t			running;		// time spent running
+
+	// How late each frame started compared to when it should have, outside turbo mode.
+	unsigned long long	jitterSamples;
+	double				jitterMean;
+	double				jitterStdDev;
+	uint64_t			jitterMax;
+
+} chip8_pacer_stats;
+
+chip8_pacer_stats chip8_pacer_getStats(chip8_pacer *pacer);
+void chip8_pacer_resetStats(chip8_pacer *pacer);
+
+
+#endif /* defined(__Chip8__Chip8Pacer__) */
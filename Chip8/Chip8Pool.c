@@ -0,0 +1,207 @@
+//
+//  Chip8Pool.c
+//  Chip8
+//
+//  Runs many independent Chip8 machines across all of the cores in the box.
+//
+
+#include "Chip8Pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+/*
+ Each machine is completely independent of every other machine, so there is nothing to synchronize while they run.
+ A batch of work is just an array of machines (or, for chip8_pool_each(), of anything else indexed from 0). Threads hand out machines to themselves by bumping a shared atomic index,
+ which keeps every core busy even when some machines are slower than others (a ROM stuck in a tight loop vs one that draws a lot).
+ Machines are handed out a few at a time so threads aren't fighting over the index cache line on every machine.
+ 
+ The worker threads are created once and then sleep on a condition variable between batches,
+ so running many short batches doesn't pay for thread creation each time.
+*/
+
+#define CHIP8_POOL_CHUNK	4	// number of machines a thread claims at a time
+
+
+struct chip8_pool {
+	
+	pthread_t		*threads;
+	unsigned int	threadCount;		// number of worker threads (not counting the thread calling chip8_pool_run())
+	
+	pthread_mutex_t	lock;
+	pthread_cond_t	workReady;			// signalled when a new batch is posted (or the pool is shutting down)
+	pthread_cond_t	workDone;			// signalled when the last worker finishes a batch
+	
+	// the current batch
+	size_t			count;
+	chip8_pool_task	task;
+	void			*context;
+	unsigned long	generation;			// bumped for every batch so workers can tell a new batch from a spurious wakeup
+	unsigned int	busyWorkers;		// workers that haven't finished the current batch yet
+	bool			shutdown;
+	
+	atomic_size_t	next;				// index of the next unclaimed machine
+};
+
+
+static void chip8_pool_work(chip8_pool *pool) {
+	
+	size_t count = pool->count;
+	chip8_pool_task task = pool->task;
+	void *context = pool->context;
+	
+	for (;;) {
+		size_t start = atomic_fetch_add_explicit(&pool->next, CHIP8_POOL_CHUNK, memory_order_relaxed);
+		if (start >= count) {
+			return;
+		}
+		
+		size_t end = start + CHIP8_POOL_CHUNK;
+		if (end > count) {
+			end = count;
+		}
+		
+		for (size_t i = start; i < end; i++) {
+			task(context, i);
+		}
+	}
+}
+
+static void *chip8_pool_worker(void *arg) {
+	
+	chip8_pool *pool = arg;
+	unsigned long seen = 0;
+	
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->shutdown && pool->generation == seen) {
+			pthread_cond_wait(&pool->workReady, &pool->lock);
+		}
+		if (pool->shutdown) {
+			break;
+		}
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+		
+		chip8_pool_work(pool);
+		
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busyWorkers == 0) {
+			pthread_cond_signal(&pool->workDone);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	
+	return NULL;
+}
+
+chip8_pool *chip8_pool_create(unsigned int threadCount) {
+	
+	if (threadCount == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threadCount = cores > 0 ? (unsigned int)cores : 1;
+	}
+	
+	chip8_pool *pool = calloc(1, sizeof(chip8_pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->workReady, NULL);
+	pthread_cond_init(&pool->workDone, NULL);
+	atomic_init(&pool->next, 0);
+	
+	// the thread calling chip8_pool_each() does its share of the work, so we only need threadCount - 1 workers.
+	pool->threads = calloc(threadCount, sizeof(pthread_t));
+	if (pool->threads == NULL) {
+		chip8_pool_destroy(pool);
+		return NULL;
+	}
+	for (unsigned int i = 0; i < threadCount - 1; i++) {
+		if (pthread_create(&pool->threads[i], NULL, chip8_pool_worker, pool) != 0) {
+			// stops (and joins) the ones that did start
+			chip8_pool_destroy(pool);
+			return NULL;
+		}
+		pool->threadCount++;
+	}
+	
+	return pool;
+}
+
+void chip8_pool_destroy(chip8_pool *pool) {
+	
+	if (pool == NULL) {
+		return;
+	}
+	
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->workReady);
+	pthread_mutex_unlock(&pool->lock);
+	
+	for (unsigned int i = 0; i < pool->threadCount; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	
+	pthread_cond_destroy(&pool->workDone);
+	pthread_cond_destroy(&pool->workReady);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+unsigned int chip8_pool_threadCount(chip8_pool *pool) {
+	return pool->threadCount + 1;
+}
+
+typedef struct chip8_pool_runBatch {
+	chip8_machine	**machines;
+	unsigned long	cycles;
+} chip8_pool_runBatch;
+
+static void chip8_pool_runMachine(void *context, size_t index) {
+	
+	chip8_pool_runBatch *batch = context;
+	chip8_machine_run(batch->machines[index], batch->cycles);
+}
+
+void chip8_pool_run(chip8_pool *pool, chip8_machine **machines, size_t count, unsigned long cycles) {
+	
+	if (cycles == 0) {
+		return;
+	}
+	
+	chip8_pool_runBatch batch = { machines, cycles };
+	chip8_pool_each(pool, count, chip8_pool_runMachine, &batch);
+}
+
+void chip8_pool_each(chip8_pool *pool, size_t count, chip8_pool_task task, void *context) {
+	
+	if (count == 0) {
+		return;
+	}
+	
+	// post the batch
+	pthread_mutex_lock(&pool->lock);
+	pool->count			= count;
+	pool->task			= task;
+	pool->context		= context;
+	pool->busyWorkers	= pool->threadCount;
+	atomic_store_explicit(&pool->next, 0, memory_order_relaxed);
+	pool->generation++;
+	pthread_cond_broadcast(&pool->workReady);
+	pthread_mutex_unlock(&pool->lock);
+	
+	// pitch in
+	chip8_pool_work(pool);
+	
+	// wait for the stragglers
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busyWorkers > 0) {
+		pthread_cond_wait(&pool->workDone, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,34 @@
+//
+//  Chip8Pool.h
+//  Chip8
+//
+//  Runs many independent Chip8 machines across all of the cores in the box.
+//
+
+#ifndef __Chip8__Chip8Pool__
+#define __Chip8__Chip8Pool__
+
+#include "Chip8.h"
+
+
+typedef struct chip8_pool chip8_pool;
+
+
+// Creates a pool of worker threads. Pass 0 for threadCount to get one thread per online core.
+// Returns NULL if there isn't the memory or any of the threads can't be started.
+chip8_pool *chip8_pool_create(unsigned int threadCount);
+void chip8_pool_destroy(chip8_pool *pool);
+
+unsigned int chip8_pool_threadCount(chip8_pool *pool);
+
+// Steps every machine in the array `cycles` times, spreading the machines over the pool's threads.
+// Blocks until every machine has finished. The calling thread joins in with the work.
+void chip8_pool_run(chip8_pool *pool, chip8_machine **machines, size_t count, unsigned long cycles);
+
+// Any other work that splits up the same way: calls task(context, index) once for every index from 0 to count - 1, on
+// whichever of the pool's threads gets there first. Blocks until they've all returned, like chip8_pool_run().
+typedef void (*chip8_pool_task)(void *context, size_t index);
+void chip8_pool_each(chip8_pool *pool, size_t count, chip8_pool_task task, void *context);
+
+
+#endif /* defined(__Chip8__Chip8Pool__) */
@@ -0,0 +1,437 @@
+//
+//  Chip8Profile.c
+//  Chip8
+//
+//  Finds out where a ROM spends its cycles: which addresses, which kinds of instruction, which subroutines and which loops.
+//
+
+#include "Chip8Profile.h"
+
+#include <limits.h>
+#include <string.h>
+
+
+/*
+ How it works
+
+ machine->profileCountdown counts down the instructions to the next sample, and when it runs out chip8_profile_sample() is
+ called with the instruction that's about to run. Normally chip8_machine_run() stops the engine right there to take it, so
+ the engine runs just as it would without a profile in between. A core built with CHIP8_PROFILE=1 counts down in the
+ interpreter instead, on every instruction, which is what exact mode wants (see Chip8.h). Everything else is worked out
+ from the machine right then:
+
+	- the address (pc) and kind of instruction (the chip8_op) give the flat profile
+	- the return addresses on the Chip8 stack give the call stack. Each one points just past a 2NNN, and that 2NNN's NNN is the
+	  subroutine the frame belongs to. So nothing has to be tracked on every call and return, which keeps sampling cheap.
+	- a 2NNN being sampled counts as a call from the current subroutine to NNN
+	- a 1NNN that jumps backwards is the bottom of a loop that starts at NNN
+
+ In exact mode (a period of 1) every instruction is a sample, so all the counts are exact. Otherwise each sample stands for
+ about `period` instructions, and the counts are estimates.
+*/
+
+#define CHIP8_PROFILE_OPS		64		// more than there are chip8_ops
+#define CHIP8_PROFILE_DEPTH		17		// 0x200 plus up to 16 subroutines
+#define CHIP8_PROFILE_STACKS	4096	// different call stacks we can tell apart (a power of two)
+#define CHIP8_PROFILE_CALLS		1024	// different caller -> callee pairs we can tell apart (a power of two)
+#define CHIP8_PROFILE_UNKNOWN	0xFFFF	// a frame whose 2NNN has since been written over
+
+
+typedef struct chip8_profile_stack {
+
+	unsigned long long	cycles;		// 0 for an empty slot
+	unsigned char		depth;
+	unsigned short		frames[CHIP8_PROFILE_DEPTH];
+
+} chip8_profile_stack;
+
+typedef struct chip8_profile_call {
+
+	unsigned long long	count;		// 0 for an empty slot
+	unsigned short		caller;
+	unsigned short		callee;
+
+} chip8_profile_call;
+
+struct chip8_profile {
+
+	unsigned int		period;
+	uint32_t			rng;				// spaces the samples out
+
+	unsigned char		callOp;				// the chip8_ops for 2NNN, 1NNN and FX07
+	unsigned char		jumpOp;
+	unsigned char		delayOp;
+
+	unsigned long long	cycles;
+	unsigned long long	samples;
+
+	unsigned long long	addressCycles[4096];
+	unsigned char		addressOp[4096];	// the chip8_op last seen at each address
+	unsigned long long	opCycles[CHIP8_PROFILE_OPS];
+
+	unsigned long long	selfCycles[4096];	// by subroutine address: cycles spent in the subroutine itself
+	unsigned long long	totalCycles[4096];	// ... and including everything it called
+	unsigned long long	calls[4096];		// ... and the times it was called
+
+	unsigned long long	loopJumps[4096];	// backward jumps to each address
+	unsigned short		loopEnd[4096];		// ... and the furthest address one came from
+
+	chip8_profile_call	callPairs[CHIP8_PROFILE_CALLS];
+	unsigned long long	lostCalls;			// calls between pairs that didn't fit
+
+	chip8_profile_stack	stacks[CHIP8_PROFILE_STACKS];
+	unsigned long long	lostCycles;			// cycles in stacks that didn't fit
+};
+
+
+
+// Profile API
+
+chip8_profile *chip8_profile_create(unsigned int period) {
+
+	chip8_profile *p = malloc(sizeof(chip8_profile));
+	if (p != NULL) {
+		p->period = (period != 0) ? period : CHIP8_PROFILE_EXACT;
+		chip8_profile_clear(p);
+	}
+	return p;
+}
+
+void chip8_profile_destroy(chip8_profile *p) {
+
+	free(p);
+}
+
+// the chip8_op numbers are private to the interpreter, so we look the ones we care about up by name
+static unsigned char chip8_profile_findOp(const char *name) {
+
+	for (unsigned char op = 0; op < CHIP8_PROFILE_OPS; op++) {
+		const char *opName = chip8_machine_opName(op);
+		if (opName != NULL && strcmp(opName, name) == 0) {
+			return op;
+		}
+	}
+	return UCHAR_MAX;
+}
+
+void chip8_profile_clear(chip8_profile *p) {
+
+	unsigned int period = p->period;
+	memset(p, 0, sizeof(chip8_profile));
+	p->period = period;
+	p->rng = 0x9E3779B9;
+
+	p->callOp = chip8_profile_findOp("2NNN");
+	p->jumpOp = chip8_profile_findOp("1NNN");
+	p->delayOp = chip8_profile_findOp("FX07");
+}
+
+unsigned long long chip8_profile_cycles(const chip8_profile *p) {
+
+	return p->cycles;
+}
+
+
+
+// Collecting
+
+// instructions until the next sample: `period` on average, but spaced out randomly
+static unsigned long long chip8_profile_nextGap(chip8_profile *p) {
+
+	if (p->period == CHIP8_PROFILE_EXACT) {
+		return 1;
+	}
+
+	p->rng ^= p->rng << 13;
+	p->rng ^= p->rng >> 17;
+	p->rng ^= p->rng << 5;
+	return 1 + p->rng % (2ull * p->period - 1);
+}
+
+static inline unsigned short chip8_profile_opcodeAt(const chip8_machine *m, unsigned short address) {
+
+	return (unsigned short)(m->memory[address & 0xFFF] << 8 | m->memory[(address + 1) & 0xFFF]);
+}
+
+// Fills in the subroutines we're in, outermost first, and returns how many there are.
+static int chip8_profile_callStack(const chip8_machine *m, unsigned short *frames) {
+
+	int depth = 0;
+	frames[depth++] = 0x200;
+
+	for (int i = 0; i < m->sp && i < 16; i++) {
+		unsigned short opcode = chip8_profile_opcodeAt(m, m->stack[i] - 2);
+		frames[depth++] = ((opcode & 0xF000) == 0x2000) ? (opcode & 0x0FFF) : CHIP8_PROFILE_UNKNOWN;
+	}
+	return depth;
+}
+
+static void chip8_profile_addStack(chip8_profile *p, const unsigned short *frames, int depth, unsigned long long cycles) {
+
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < depth; i++) {
+		hash = (hash ^ frames[i]) * 16777619u;
+	}
+
+	// open addressing. Most programs only ever have a few dozen different stacks
+	for (int probe = 0; probe < CHIP8_PROFILE_STACKS; probe++) {
+		chip8_profile_stack *stack = &p->stacks[(hash + probe) & (CHIP8_PROFILE_STACKS - 1)];
+
+		if (stack->cycles == 0) {
+			stack->depth = (unsigned char)depth;
+			memcpy(stack->frames, frames, depth * sizeof(unsigned short));
+		}
+		else if (stack->depth != depth || memcmp(stack->frames, frames, depth * sizeof(unsigned short)) != 0) {
+			continue;
+		}
+		stack->cycles += cycles;
+		return;
+	}
+	p->lostCycles += cycles;
+}
+
+static void chip8_profile_addCall(chip8_profile *p, unsigned short caller, unsigned short callee, unsigned long long count) {
+
+	uint32_t hash = ((uint32_t)caller * 4099u) ^ callee;
+
+	for (int probe = 0; probe < CHIP8_PROFILE_CALLS; probe++) {
+		chip8_profile_call *call = &p->callPairs[(hash + probe) & (CHIP8_PROFILE_CALLS - 1)];
+
+		if (call->count == 0) {
+			call->caller = caller;
+			call->callee = callee;
+		}
+		else if (call->caller != caller || call->callee != callee) {
+			continue;
+		}
+		call->count += count;
+		return;
+	}
+	p->lostCalls += count;
+}
+
+// Counts `cycles` spent on the instruction at pc, which ran (or would have run) `count` times.
+static void chip8_profile_record(chip8_profile *p, const chip8_machine *m, unsigned char op, unsigned long long cycles, unsigned long long count) {
+
+	unsigned short pc = m->pc & 0xFFF;
+
+	p->cycles += cycles;
+	p->addressCycles[pc] += cycles;
+	p->addressOp[pc] = op;
+	if (op < CHIP8_PROFILE_OPS) {
+		p->opCycles[op] += cycles;
+	}
+
+	unsigned short frames[CHIP8_PROFILE_DEPTH];
+	int depth = chip8_profile_callStack(m, frames);
+	chip8_profile_addStack(p, frames, depth, cycles);
+
+	unsigned short current = frames[depth - 1];
+	if (current != CHIP8_PROFILE_UNKNOWN) {
+		p->selfCycles[current] += cycles;
+	}
+	for (int i = 0; i < depth; i++) {
+		// a recursive subroutine only counts once towards its own total
+		bool outermost = frames[i] != CHIP8_PROFILE_UNKNOWN;
+		for (int j = 0; j < i && outermost; j++) {
+			outermost = frames[j] != frames[i];
+		}
+		if (outermost) {
+			p->totalCycles[frames[i]] += cycles;
+		}
+	}
+
+	unsigned short opcode = chip8_profile_opcodeAt(m, pc);
+
+	if (op == p->callOp) {
+		unsigned short callee = opcode & 0x0FFF;
+		p->calls[callee] += count;
+		chip8_profile_addCall(p, current, callee, count);
+	}
+	else if (op == p->jumpOp && (opcode & 0x0FFF) <= pc) {
+		unsigned short start = opcode & 0x0FFF;
+		p->loopJumps[start] += count;
+		if (pc > p->loopEnd[start]) {
+			p->loopEnd[start] = pc;
+		}
+	}
+}
+
+bool chip8_profile_attach(chip8_profile *p, chip8_machine *m) {
+
+	m->profile = p;
+	m->profileCountdown = (p != NULL) ? chip8_profile_nextGap(p) : ULLONG_MAX;
+	return true;
+}
+
+void chip8_profile_sample(chip8_machine *m, unsigned char op) {
+
+	chip8_profile *p = m->profile;
+	if (p == NULL) {
+		m->profileCountdown = ULLONG_MAX;
+		return;
+	}
+
+	p->samples++;
+	chip8_profile_record(p, m, op, p->period, p->period);
+	m->profileCountdown = chip8_profile_nextGap(p);
+}
+
+void chip8_profile_skipped(chip8_machine *m, unsigned char op, unsigned long cycles) {
+
+	chip8_profile *p = m->profile;
+	if (p == NULL) {
+		return;
+	}
+
+	chip8_profile_record(p, m, op, cycles, cycles);
+
+	// a delay loop is three instructions, FX07 and a skip and a jump back (see chip8_skipIdle())
+	unsigned short pc = m->pc & 0xFFF;
+	if (op == p->delayOp) {
+		p->loopJumps[pc] += cycles / 3;
+		if (pc + 4 > p->loopEnd[pc]) {
+			p->loopEnd[pc] = pc + 4;
+		}
+	}
+}
+
+
+
+// Reports
+
+typedef struct chip8_profile_entry {
+
+	unsigned long long	cycles;
+	unsigned int		key;
+
+} chip8_profile_entry;
+
+static int chip8_profile_compareEntries(const void *a, const void *b) {
+
+	const chip8_profile_entry *x = a;
+	const chip8_profile_entry *y = b;
+
+	if (x->cycles != y->cycles) {
+		return (x->cycles > y->cycles) ? -1 : 1;
+	}
+	return (x->key > y->key) - (x->key < y->key);
+}
+
+// Fills in the non-zero values, biggest first, and returns how many there were.
+static size_t chip8_profile_sort(const unsigned long long *values, size_t count, chip8_profile_entry *entries) {
+
+	size_t used = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (values[i] != 0) {
+			entries[used++] = (chip8_profile_entry){ values[i], (unsigned int)i };
+		}
+	}
+	qsort(entries, used, sizeof(chip8_profile_entry), chip8_profile_compareEntries);
+	return used;
+}
+
+static double chip8_profile_percent(const chip8_profile *p, unsigned long long cycles) {
+
+	return (p->cycles != 0) ? 100.0 * cycles / p->cycles : 0;
+}
+
+void chip8_profile_printFlat(const chip8_profile *p, FILE *file, unsigned int limit) {
+
+	chip8_profile_entry *entries = malloc(4096 * sizeof(chip8_profile_entry));
+	unsigned long long *loopCycles = calloc(4096, sizeof(unsigned long long));
+	if (entries == NULL || loopCycles == NULL) {
+		free(entries);
+		free(loopCycles);
+		return;
+	}
+	size_t count;
+
+	if (p->period == CHIP8_PROFILE_EXACT) {
+		fprintf(file, "Profile: %llu cycles, every instruction counted\n", p->cycles);
+	}
+	else {
+		fprintf(file, "Profile: about %llu cycles, from %llu samples (one every %u instructions on average)\n", p->cycles, p->samples, p->period);
+	}
+
+	fprintf(file, "\nAddress      cycles        %%  instruction\n");
+	count = chip8_profile_sort(p->addressCycles, 4096, entries);
+	for (size_t i = 0; i < count && i < limit; i++) {
+		const char *name = chip8_machine_opName(p->addressOp[entries[i].key]);
+		fprintf(file, "  0x%03X  %12llu  %6.2f%%  %s\n", entries[i].key, entries[i].cycles, chip8_profile_percent(p, entries[i].cycles), name ? name : "?");
+	}
+
+	fprintf(file, "\nInstruction  cycles        %%\n");
+	count = chip8_profile_sort(p->opCycles, CHIP8_PROFILE_OPS, entries);
+	for (size_t i = 0; i < count && i < limit; i++) {
+		const char *name = chip8_machine_opName((unsigned char)entries[i].key);
+		fprintf(file, "  %-7s  %12llu  %6.2f%%\n", name ? name : "?", entries[i].cycles, chip8_profile_percent(p, entries[i].cycles));
+	}
+
+	fprintf(file, "\nSubroutine   total        %%          self        %%         calls\n");
+	count = chip8_profile_sort(p->totalCycles, 4096, entries);
+	for (size_t i = 0; i < count && i < limit; i++) {
+		unsigned int address = entries[i].key;
+		fprintf(file, "  0x%03X  %12llu  %6.2f%%  %12llu  %6.2f%%  %12llu\n", address,
+				p->totalCycles[address], chip8_profile_percent(p, p->totalCycles[address]),
+				p->selfCycles[address], chip8_profile_percent(p, p->selfCycles[address]), p->calls[address]);
+	}
+
+	fprintf(file, "\nCall                 count\n");
+	unsigned long long callCounts[CHIP8_PROFILE_CALLS];
+	for (int i = 0; i < CHIP8_PROFILE_CALLS; i++) {
+		callCounts[i] = p->callPairs[i].count;
+	}
+	count = chip8_profile_sort(callCounts, CHIP8_PROFILE_CALLS, entries);
+	for (size_t i = 0; i < count && i < limit; i++) {
+		const chip8_profile_call *call = &p->callPairs[entries[i].key];
+		fprintf(file, "  0x%03X -> 0x%03X  %12llu\n", call->caller, call->callee, call->count);
+	}
+
+	// a loop's cycles are everything between its start and the jump back to it
+	fprintf(file, "\nLoop               cycles        %%    iterations\n");
+	for (int start = 0; start < 4096; start++) {
+		if (p->loopJumps[start] != 0) {
+			for (int address = start; address <= p->loopEnd[start] + 1 && address < 4096; address++) {
+				loopCycles[start] += p->addressCycles[address];
+			}
+		}
+	}
+	count = chip8_profile_sort(loopCycles, 4096, entries);
+	for (size_t i = 0; i < count && i < limit; i++) {
+		unsigned int start = entries[i].key;
+		fprintf(file, "  0x%03X-0x%03X  %12llu  %6.2f%%  %12llu\n", start, p->loopEnd[start],
+				entries[i].cycles, chip8_profile_percent(p, entries[i].cycles), p->loopJumps[start]);
+	}
+
+	if (p->lostCycles != 0 || p->lostCalls != 0) {
+		fprintf(file, "\n(%llu cycles and %llu calls didn't fit in the profile's tables)\n", p->lostCycles, p->lostCalls);
+	}
+
+	free(entries);
+	free(loopCycles);
+}
+
+void chip8_profile_printStacks(const chip8_profile *p, FILE *file) {
+
+	for (int i = 0; i < CHIP8_PROFILE_STACKS; i++) {
+		const chip8_profile_stack *stack = &p->stacks[i];
+		if (stack->cycles == 0) {
+			continue;
+		}
+
+		for (int frame = 0; frame < stack->depth; frame++) {
+			if (stack->frames[frame] == CHIP8_PROFILE_UNKNOWN) {
+				fprintf(file, "%sunknown", (frame > 0) ? ";" : "");
+			}
+			else {
+				fprintf(file, "%s0x%03X", (frame > 0) ? ";" : "", stack->frames[frame]);
+			}
+		}
+		fprintf(file, " %llu\n", stack->cycles);
+	}
+
+	if (p->lostCycles != 0) {
+		fprintf(file, "0x200;other %llu\n", p->lostCycles);
+	}
+}
@@ -0,0 +1,51 @@
+//
+//  Chip8Profile.h
+//  Chip8
+//
+//  Finds out where a ROM spends its cycles: which addresses, which kinds of instruction, which subroutines and which loops.
+//
+
+#ifndef __Chip8__Chip8Profile__
+#define __Chip8__Chip8Profile__
+
+#include "Chip8.h"
+
+
+#define CHIP8_PROFILE_EXACT		1		// a period that counts every single instruction
+
+
+typedef struct chip8_profile chip8_profile;
+
+
+// Creates an empty profile. With a period of CHIP8_PROFILE_EXACT every instruction is counted. Otherwise one instruction in
+// roughly every `period` is sampled (the gaps are random, so loops can't line up with them) and counted as `period` cycles.
+// A period in the thousands costs next to nothing, so it can be left running all the time. Exact mode stops the engine on
+// every instruction, which is slow unless the core was built with CHIP8_PROFILE=1 (see Chip8.h).
+chip8_profile *chip8_profile_create(unsigned int period);
+void chip8_profile_destroy(chip8_profile *profile);
+
+// Throws away everything collected so far.
+void chip8_profile_clear(chip8_profile *profile);
+
+// Starts collecting samples from the machine into the profile (or stops, if profile is NULL).
+// Several machines can feed the same profile, as long as they all run on the same thread. Always returns true.
+bool chip8_profile_attach(chip8_profile *profile, chip8_machine *machine);
+
+// The number of cycles the profile has seen (an estimate when sampling).
+unsigned long long chip8_profile_cycles(const chip8_profile *profile);
+
+// Prints the hottest `limit` addresses, instruction kinds, subroutines, calls and loops.
+void chip8_profile_printFlat(const chip8_profile *profile, FILE *file, unsigned int limit);
+
+// Prints every call stack that was seen with its cycle count, one per line in the "folded" format that flamegraph.pl,
+// speedscope and friends read. Each frame is the address of a subroutine, and the outermost one is always 0x200.
+void chip8_profile_printStacks(const chip8_profile *profile, FILE *file);
+
+
+// Core hooks
+// The core calls these, nothing else needs to.
+void chip8_profile_sample(chip8_machine *machine, unsigned char op);	// when machine->profileCountdown runs out, op is the chip8_op at pc
+void chip8_profile_skipped(chip8_machine *machine, unsigned char op, unsigned long cycles);		// when an idle loop at pc is fast-forwarded
+
+
+#endif /* defined(__Chip8__Chip8Profile__) */
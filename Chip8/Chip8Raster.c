@@ -0,0 +1,392 @@
+//
+//  Chip8Raster.c
+//  Chip8
+//
+//  Turns the 1 bit screen into pixels a frontend can upload in one go (or save to an image file).
+//
+
+#include "Chip8Raster.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ How the screen becomes pixels
+
+ Each row of the screen is a uint64_t, leftmost pixel in the top bit. A row is turned into 64 pixels as many at a time as fit
+ in a vector: their bits are broadcast into every lane, ANDed with a different bit in each lane, and compared with that bit,
+ which leaves a mask that's all ones in the lanes whose pixel is on. The mask picks the on colour or the off colour for all
+ of them at once. That's a handful of vector instructions for every few pixels, rather than a test and a branch for each one.
+
+ With persistence, every pixel has a brightness instead. Each frame, pixels that are on go to full brightness and the rest
+ are multiplied by the persistence, 8 pixels at a time. RGBA colours then come from a table of 256 colours running from the
+ off colour to the on colour, worked out once when the raster is created.
+
+ Scaling repeats each pixel across the row, and then copies the whole row down, which memcpy does about as fast as memory
+ allows. So a big scale costs hardly more than writing the bytes.
+
+ The vectors are GCC and Clang vector extensions, like Chip8Lockstep.c's, which compile to SSE or NEON, or plain loops. They're
+ 16 bytes, the width both of those have: compilers split up wider ones, but not always well (GCC turns a 32 byte compare
+ into one compare per lane on a machine without AVX).
+*/
+
+typedef uint8_t		chip8_u8x8		__attribute__((vector_size(8)));
+typedef uint8_t		chip8_u8x16		__attribute__((vector_size(16)));
+typedef uint16_t	chip8_u16x8		__attribute__((vector_size(16)));
+typedef uint32_t	chip8_u32x4		__attribute__((vector_size(16)));
+
+// a bit for each lane, from the leftmost pixel down
+static const chip8_u8x16 chip8_bits8 = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01, 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+static const chip8_u16x8 chip8_bits16 = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+static const chip8_u32x4 chip8_bits32 = { 0x8, 0x4, 0x2, 0x1 };
+
+
+struct chip8_raster {
+
+	chip8_raster_config	config;
+	uint32_t			colors[256];		// the RGBA colour for every brightness, as it goes in memory
+	uint16_t			keep;				// persistence, in 256ths (0 for none)
+	uint8_t				brightness[32][64];	// every pixel's brightness, with persistence
+	bool				fading;
+};
+
+
+chip8_raster *chip8_raster_create(const chip8_raster_config *config) {
+
+	chip8_raster *r = calloc(1, sizeof(chip8_raster));
+	if (r == NULL) {
+		return NULL;
+	}
+
+	if (config != NULL) {
+		r->config = *config;
+	}
+	else {
+		r->config.format = CHIP8_RASTER_RGBA;
+		r->config.off = (chip8_color){ 0, 0, 0, 255 };
+		r->config.on = (chip8_color){ 255, 255, 255, 255 };
+	}
+	if (r->config.scale == 0) {
+		r->config.scale = 1;
+	}
+
+	// brightness 0 is the off colour, 255 the on colour, and everything in between a blend of the two
+	const uint8_t *off = &r->config.off.r;
+	const uint8_t *on = &r->config.on.r;
+	for (int level = 0; level < 256; level++) {
+		uint8_t color[4];
+		for (int channel = 0; channel < 4; channel++) {
+			color[channel] = (uint8_t)((off[channel] * (255 - level) + on[channel] * level + 127) / 255);
+		}
+		memcpy(&r->colors[level], color, 4);
+	}
+
+	double persistence = r->config.persistence;
+	if (persistence > 0) {
+		r->keep = (persistence >= 1) ? 255 : (uint16_t)(persistence * 256);
+	}
+
+	return r;
+}
+
+void chip8_raster_destroy(chip8_raster *r) {
+
+	free(r);
+}
+
+unsigned int chip8_raster_width(const chip8_raster *r) {
+
+	return 64 * r->config.scale;
+}
+
+unsigned int chip8_raster_height(const chip8_raster *r) {
+
+	return 32 * r->config.scale;
+}
+
+size_t chip8_raster_bytesPerRow(const chip8_raster *r) {
+
+	return (size_t)chip8_raster_width(r) * ((r->config.format == CHIP8_RASTER_RGBA) ? 4 : 1);
+}
+
+bool chip8_raster_fading(const chip8_raster *r) {
+
+	return r->fading;
+}
+
+
+
+// Drawing
+
+// The 64 pixels of a row, straight from its bits.
+static void chip8_raster_expandRow(const chip8_raster *r, uint64_t row, void *line) {
+
+	if (r->config.format == CHIP8_RASTER_RGBA) {
+		chip8_u32x4 on = (chip8_u32x4){ 0 } + r->colors[255];
+		chip8_u32x4 off = (chip8_u32x4){ 0 } + r->colors[0];
+		for (int nibble = 0; nibble < 16; nibble++) {
+			uint32_t bits = (uint32_t)(row >> (60 - nibble * 4)) & 0xF;
+			chip8_u32x4 lit = (chip8_u32x4)((bits & chip8_bits32) == chip8_bits32);
+			chip8_u32x4 pixels = (on & lit) | (off & ~lit);
+			memcpy((uint32_t *)line + nibble * 4, &pixels, sizeof(pixels));
+		}
+	}
+	else {
+		for (int half = 0; half < 4; half++) {
+			uint8_t left = (uint8_t)(row >> (56 - half * 16));
+			uint8_t right = (uint8_t)(row >> (48 - half * 16));
+			chip8_u8x16 bits = { left, left, left, left, left, left, left, left, right, right, right, right, right, right, right, right };
+			chip8_u8x16 pixels = (chip8_u8x16)((bits & chip8_bits8) == chip8_bits8);		// 0xFF where the pixel is on
+			memcpy((uint8_t *)line + half * 16, &pixels, sizeof(pixels));
+		}
+	}
+}
+
+// Brings the row's brightness up to date for a new frame, and ORs the brightness left in pixels that are off into *glow.
+static void chip8_raster_fadeRow(chip8_raster *r, int y, uint64_t row, chip8_u16x8 *glow) {
+
+	for (int byte = 0; byte < 8; byte++) {
+		uint16_t bits = (uint8_t)(row >> (56 - byte * 8));
+		chip8_u16x8 lit = (chip8_u16x8)((bits & chip8_bits16) == chip8_bits16);
+
+		chip8_u8x8 old;
+		memcpy(&old, &r->brightness[y][byte * 8], sizeof(old));
+		chip8_u16x8 faded = (__builtin_convertvector(old, chip8_u16x8) * r->keep) >> 8;
+
+		chip8_u8x8 now = __builtin_convertvector((lit & 255) | (faded & ~lit), chip8_u8x8);
+		memcpy(&r->brightness[y][byte * 8], &now, sizeof(now));
+		*glow |= faded & ~lit;
+	}
+}
+
+// Writes one row of pixels `scale` times as wide, into the first of its `scale` rows.
+static void chip8_raster_widenRow(const chip8_raster *r, const void *line, unsigned char *out) {
+
+	unsigned int scale = r->config.scale;
+	if (r->config.format == CHIP8_RASTER_RGBA) {
+		const uint32_t *pixels = line;
+		for (int x = 0; x < 64; x++) {
+			for (unsigned int i = 0; i < scale; i++) {
+				memcpy(out + (x * scale + i) * 4, &pixels[x], 4);
+			}
+		}
+	}
+	else {
+		const uint8_t *pixels = line;
+		for (int x = 0; x < 64; x++) {
+			memset(out + x * scale, pixels[x], scale);
+		}
+	}
+}
+
+void chip8_raster_draw(chip8_raster *r, const uint64_t gfx[32], void *pixels, size_t stride) {
+
+	unsigned int scale = r->config.scale;
+	size_t bytesPerRow = chip8_raster_bytesPerRow(r);
+	chip8_u16x8 glow = { 0 };
+
+	for (int y = 0; y < 32; y++) {
+
+		// at scale 1 the row goes straight where it belongs, and otherwise it's widened from here
+		unsigned char *out = (unsigned char *)pixels + (size_t)y * scale * stride;
+		uint32_t buffer[64];
+		void *line = (scale == 1) ? (void *)out : buffer;
+
+		if (r->keep == 0) {
+			chip8_raster_expandRow(r, gfx[y], line);
+		}
+		else {
+			chip8_raster_fadeRow(r, y, gfx[y], &glow);
+			if (r->config.format == CHIP8_RASTER_RGBA) {
+				for (int x = 0; x < 64; x++) {
+					memcpy((uint32_t *)line + x, &r->colors[r->brightness[y][x]], 4);
+				}
+			}
+			else {
+				memcpy(line, r->brightness[y], 64);
+			}
+		}
+
+		if (scale == 1) {
+			continue;
+		}
+		chip8_raster_widenRow(r, line, out);
+		for (unsigned int i = 1; i < scale; i++) {
+			memcpy(out + i * stride, out, bytesPerRow);
+		}
+	}
+
+	r->fading = false;
+	for (int i = 0; i < 8; i++) {
+		r->fading |= (glow[i] != 0);
+	}
+}
+
+
+
+// Image files
+
+bool chip8_raster_writePPM(const char *path, const void *rgba, unsigned int width, unsigned int height, size_t stride) {
+
+	FILE *file = fopen(path, "wb");
+	unsigned char *rgb = malloc((size_t)width * 3);
+	if (file == NULL || rgb == NULL) {
+		if (file != NULL) {
+			fclose(file);
+		}
+		free(rgb);
+		return false;
+	}
+
+	bool ok = fprintf(file, "P6\n%u %u\n255\n", width, height) > 0;
+	for (unsigned int y = 0; y < height && ok; y++) {
+		const unsigned char *row = (const unsigned char *)rgba + y * stride;
+		for (unsigned int x = 0; x < width; x++) {
+			memcpy(&rgb[x * 3], &row[x * 4], 3);
+		}
+		ok = fwrite(rgb, 3, width, file) == width;
+	}
+
+	free(rgb);
+	return (fclose(file) == 0) && ok;
+}
+
+/*
+ PNG
+
+ A PNG is a list of chunks, each with a CRC. The pixels go in IDAT chunks, as a zlib stream of the rows (each with a filter
+ type byte in front, 0 for none). zlib streams don't have to be compressed: deflate has "stored" blocks of up to 65535 bytes
+ that are just copied, so all we need is their headers, a zlib header and an Adler-32 checksum at the end. The files come out
+ about as big as the pixels, which is fine for screenshots of a 64x32 screen.
+*/
+
+typedef struct chip8_png {
+
+	FILE		*file;
+	uint32_t	crc;
+	uint32_t	crcTable[256];
+	bool		ok;
+
+} chip8_png;
+
+static void chip8_png_write(chip8_png *png, const void *bytes, size_t count) {
+
+	const unsigned char *b = bytes;
+	for (size_t i = 0; i < count; i++) {
+		png->crc = png->crcTable[(png->crc ^ b[i]) & 0xFF] ^ (png->crc >> 8);
+	}
+	png->ok &= fwrite(bytes, 1, count, png->file) == count;
+}
+
+static void chip8_png_writeUInt(chip8_png *png, uint32_t value) {
+
+	unsigned char bytes[4] = { value >> 24, value >> 16, value >> 8, value };
+	chip8_png_write(png, bytes, 4);
+}
+
+static void chip8_png_beginChunk(chip8_png *png, const char *type, uint32_t length) {
+
+	chip8_png_writeUInt(png, length);		// the length isn't part of the CRC, so it's reset afterwards
+	png->crc = 0xFFFFFFFFu;
+	chip8_png_write(png, type, 4);
+}
+
+static void chip8_png_endChunk(chip8_png *png) {
+
+	chip8_png_writeUInt(png, png->crc ^ 0xFFFFFFFFu);
+}
+
+bool chip8_raster_writePNG(const char *path, const void *rgba, unsigned int width, unsigned int height, size_t stride) {
+
+	// the rows as zlib will see them
+	size_t rowBytes = 1 + (size_t)width * 4;
+	size_t size = rowBytes * height;
+	unsigned char *raw = malloc(size);
+	if (raw == NULL) {
+		return false;
+	}
+	uint32_t a = 1, b = 0;
+	for (unsigned int y = 0; y < height; y++) {
+		unsigned char *row = raw + y * rowBytes;
+		row[0] = 0;
+		memcpy(row + 1, (const unsigned char *)rgba + y * stride, rowBytes - 1);
+		for (size_t i = 0; i < rowBytes; i++) {
+			a = (a + row[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+	}
+
+	chip8_png png = { .file = fopen(path, "wb"), .ok = true };
+	if (png.file == NULL) {
+		free(raw);
+		return false;
+	}
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		}
+		png.crcTable[n] = c;
+	}
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	chip8_png_write(&png, signature, sizeof(signature));
+
+	chip8_png_beginChunk(&png, "IHDR", 13);
+	chip8_png_writeUInt(&png, width);
+	chip8_png_writeUInt(&png, height);
+	static const unsigned char format[5] = { 8, 6, 0, 0, 0 };		// 8 bits a channel, RGBA, deflate, no filtering, not interlaced
+	chip8_png_write(&png, format, sizeof(format));
+	chip8_png_endChunk(&png);
+
+	size_t blocks = (size + 65534) / 65535;
+	chip8_png_beginChunk(&png, "IDAT", (uint32_t)(2 + size + blocks * 5 + 4));
+	static const unsigned char zlibHeader[2] = { 0x78, 0x01 };
+	chip8_png_write(&png, zlibHeader, sizeof(zlibHeader));
+	for (size_t offset = 0; offset < size; offset += 65535) {
+		size_t length = (size - offset < 65535) ? size - offset : 65535;
+		unsigned char header[5] = { (offset + length == size) ? 1 : 0, length, length >> 8, ~length, ~length >> 8 };
+		chip8_png_write(&png, header, sizeof(header));
+		chip8_png_write(&png, raw + offset, length);
+	}
+	chip8_png_writeUInt(&png, (b << 16) | a);
+	chip8_png_endChunk(&png);
+
+	chip8_png_beginChunk(&png, "IEND", 0);
+	chip8_png_endChunk(&png);
+
+	free(raw);
+	return (fclose(png.file) == 0) && png.ok;
+}
+
+bool chip8_raster_saveScreen(const uint64_t gfx[32], unsigned int scale, const char *path) {
+
+	chip8_raster_config config = {
+		.format	= CHIP8_RASTER_RGBA,
+		.scale	= (scale != 0) ? scale : CHIP8_RASTER_DEFAULT_SCALE,
+		.off	= { 0, 0, 0, 255 },
+		.on		= { 255, 255, 255, 255 },
+	};
+	chip8_raster *raster = chip8_raster_create(&config);
+	size_t stride = (raster != NULL) ? chip8_raster_bytesPerRow(raster) : 0;
+	void *pixels = malloc(stride * (raster != NULL ? chip8_raster_height(raster) : 0));
+	if (raster == NULL || pixels == NULL) {
+		chip8_raster_destroy(raster);
+		free(pixels);
+		return false;
+	}
+
+	chip8_raster_draw(raster, gfx, pixels, stride);
+
+	size_t length = strlen(path);
+	bool png = (length >= 4 && strcasecmp(path + length - 4, ".png") == 0);
+	unsigned int width = chip8_raster_width(raster);
+	unsigned int height = chip8_raster_height(raster);
+	bool ok = png ? chip8_raster_writePNG(path, pixels, width, height, stride) : chip8_raster_writePPM(path, pixels, width, height, stride);
+
+	free(pixels);
+	chip8_raster_destroy(raster);
+	return ok;
+}
@@ -0,0 +1,72 @@
+//
+//  Chip8Raster.h
+//  Chip8
+//
+//  Turns the 1 bit screen into pixels a frontend can upload in one go (or save to an image file).
+//
+
+#ifndef __Chip8__Chip8Raster__
+#define __Chip8__Chip8Raster__
+
+#include "Chip8.h"
+
+
+#define CHIP8_RASTER_DEFAULT_SCALE		8		// for image files, when nobody says otherwise (512x256)
+
+
+typedef struct chip8_raster chip8_raster;
+
+typedef enum chip8_raster_format {
+
+	CHIP8_RASTER_RGBA,			// 4 bytes a pixel: red, green, blue and alpha, in the colours of the palette
+	CHIP8_RASTER_INDEXED,		// 1 byte a pixel: 0 for off and 255 for on (in between while a pixel fades), for a palette of your own or a grayscale texture
+
+} chip8_raster_format;
+
+typedef struct chip8_color {
+
+	uint8_t		r, g, b, a;
+
+} chip8_color;
+
+typedef struct chip8_raster_config {
+
+	chip8_raster_format	format;
+	unsigned int		scale;			// every Chip8 pixel becomes scale x scale pixels (0 means 1)
+	chip8_color			off;			// the palette, for CHIP8_RASTER_RGBA
+	chip8_color			on;
+
+	// Phosphor: how much of a pixel's brightness is left one frame after it goes off, from 0 (it goes straight out) up to 1 (it
+	// takes a long time). Chip8 games flicker, because they erase sprites to move them, and a bit of persistence smooths that
+	// over, like the screens they were written for.
+	double				persistence;
+
+} chip8_raster_config;
+
+// `config` is copied. Pass NULL for white on black RGBA at scale 1, with no persistence. Returns NULL if there isn't the memory.
+chip8_raster *chip8_raster_create(const chip8_raster_config *config);
+void chip8_raster_destroy(chip8_raster *raster);
+
+unsigned int chip8_raster_width(const chip8_raster *raster);		// in pixels: 64 * scale
+unsigned int chip8_raster_height(const chip8_raster *raster);		// 32 * scale
+size_t chip8_raster_bytesPerRow(const chip8_raster *raster);		// the smallest stride chip8_raster_draw() can take
+
+// Draws the screen (32 rows, like chip8_machine.gfx or chip8_frame.gfx) into `pixels`, which the caller owns, top row first
+// with `stride` bytes from one row to the next. Call it once per frame: each call fades the phosphor by a frame.
+void chip8_raster_draw(chip8_raster *raster, const uint64_t gfx[32], void *pixels, size_t stride);
+
+// True while pixels are still fading, so the next chip8_raster_draw() will look different even if the screen doesn't change.
+bool chip8_raster_fading(const chip8_raster *raster);
+
+
+// Image files
+// For looking at the screen from a headless run. `rgba` is 4 bytes a pixel, like CHIP8_RASTER_RGBA. They return false if the
+// file can't be written.
+bool chip8_raster_writePPM(const char *path, const void *rgba, unsigned int width, unsigned int height, size_t stride);	// binary PPM, which has no alpha
+bool chip8_raster_writePNG(const char *path, const void *rgba, unsigned int width, unsigned int height, size_t stride);	// uncompressed, so it needs no zlib
+
+// Writes the screen as white on black at `scale` (0 for CHIP8_RASTER_DEFAULT_SCALE). A PNG if the path ends in .png, otherwise a PPM.
+bool chip8_raster_saveScreen(const uint64_t gfx[32], unsigned int scale, const char *path);
+
+
+#endif /* defined(__Chip8__Chip8Raster__) */
@@ -0,0 +1,330 @@
+//
+//  Chip8Recording.c
+//  Chip8
+//
+//  Records the input to a machine so the session can be played back exactly, as fast as the machine can go.
+//
+
+#include "Chip8Recording.h"
+
+#include <string.h>
+
+
+/*
+ Why this works
+
+ Given the same ROM, clock rate, quirks and random seed, a machine always does exactly the same thing, however it's stepped: the timers
+ count emulated cycles rather than wall clock time, and CXNN uses the machine's own random number generator. The only thing left
+ that comes from outside is the keypad. So a recording is just the starting conditions plus every key event, stamped with the
+ cycle it happened on. Playback runs the machine up to each event, presses (or releases) the key, and carries on.
+*/
+
+#define CHIP8_RECORDING_MAGIC	"C8RC"
+
+
+typedef struct chip8_key_event {
+
+	unsigned long long	cycle;		// the machine's cycle count when the key changed
+	unsigned char		key;		// 0x0-0xF
+	bool				down;
+
+} chip8_key_event;
+
+struct chip8_recording {
+
+	unsigned int		clockRate;
+	unsigned int		seed;
+	chip8_quirks		quirks;
+	uint64_t			romHash;
+	unsigned long long	startCycle;
+	unsigned long long	endCycle;
+
+	chip8_key_event		*events;
+	size_t				count;
+	size_t				capacity;
+
+	chip8_machine		*machine;	// the machine being recorded, if any
+};
+
+static const char chip8_keyNames[] = "0123456789ABCDEF";
+
+
+// A 64-bit FNV-1a hash of the program memory, so playback can tell it's been given the wrong ROM
+static uint64_t chip8_recording_hashROM(const chip8_machine *m) {
+
+	uint64_t hash = 14695981039346656037ull;
+	for (int i = 0x200; i < 4096; i++) {
+		hash = (hash ^ m->memory[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+static void chip8_recording_observeKey(void *context, chip8_machine *m, unsigned char k, bool down) {
+
+	chip8_recording *r = context;
+
+	// the machine only calls us with keys it recognises
+	int index = chip8_keyIndex(k);
+
+	// key repeat sends lots of downs in a row, only the first one changes anything
+	if (((m->keys >> index) & 1) == down) {
+		return;
+	}
+
+	if (r->count == r->capacity) {
+		size_t capacity = (r->capacity != 0) ? r->capacity * 2 : 256;
+		chip8_key_event *events = realloc(r->events, capacity * sizeof(chip8_key_event));
+		if (events == NULL) {
+			printf("Out of memory recording key events\n");
+			return;
+		}
+		r->events = events;
+		r->capacity = capacity;
+	}
+
+	chip8_key_event *event = &r->events[r->count++];
+	event->cycle = m->cycles;
+	event->key = (unsigned char)index;
+	event->down = down;
+}
+
+
+
+// Recording API
+
+chip8_recording *chip8_recording_create() {
+
+	return calloc(1, sizeof(chip8_recording));
+}
+
+void chip8_recording_destroy(chip8_recording *r) {
+
+	if (r == NULL) {
+		return;
+	}
+	if (r->machine != NULL) {
+		chip8_machine_setKeyObserver(r->machine, NULL, NULL);
+	}
+	free(r->events);
+	free(r);
+}
+
+void chip8_recording_begin(chip8_recording *r, chip8_machine *m) {
+
+	if (r->machine != NULL) {
+		chip8_machine_setKeyObserver(r->machine, NULL, NULL);
+	}
+
+	r->clockRate = m->clockRate;
+	r->seed = m->rngState;
+	r->quirks = m->quirks;
+	r->romHash = chip8_recording_hashROM(m);
+	r->startCycle = m->cycles;
+	r->endCycle = m->cycles;
+	r->count = 0;
+
+	r->machine = m;
+	chip8_machine_setKeyObserver(m, chip8_recording_observeKey, r);
+}
+
+void chip8_recording_end(chip8_recording *r, chip8_machine *m) {
+
+	r->endCycle = m->cycles;
+
+	if (r->machine == m) {
+		chip8_machine_setKeyObserver(m, NULL, NULL);
+		r->machine = NULL;
+	}
+}
+
+void chip8_recording_truncate(chip8_recording *r, unsigned long long cycle) {
+
+	while (r->count > 0 && r->events[r->count - 1].cycle >= cycle) {
+		r->count--;
+	}
+	if (r->endCycle > cycle) {
+		r->endCycle = cycle;
+	}
+}
+
+unsigned long long chip8_recording_length(const chip8_recording *r) {
+
+	unsigned long long end = (r->machine != NULL) ? r->machine->cycles : r->endCycle;
+	return end - r->startCycle;
+}
+
+
+
+// Playback
+
+bool chip8_recording_replay(const chip8_recording *r, chip8_machine *m) {
+
+	if (chip8_recording_hashROM(m) != r->romHash || m->cycles != r->startCycle) {
+		printf("This recording needs a machine that has just loaded the ROM it was made with\n");
+		return false;
+	}
+
+	chip8_machine_setClockRate(m, r->clockRate);
+	chip8_machine_setQuirks(m, r->quirks);
+	chip8_machine_seed(m, r->seed);
+
+	// run up to each event in one go, then apply it
+	for (size_t i = 0; i < r->count; i++) {
+		const chip8_key_event *event = &r->events[i];
+
+		chip8_machine_run(m, (unsigned long)(event->cycle - m->cycles));
+		if (event->down) {
+			chip8_machine_keydown(m, chip8_keyNames[event->key]);
+		}
+		else {
+			chip8_machine_keyup(m, chip8_keyNames[event->key]);
+		}
+	}
+
+	unsigned long long end = (r->machine != NULL) ? r->machine->cycles : r->endCycle;
+	chip8_machine_run(m, (unsigned long)(end - m->cycles));
+	return true;
+}
+
+
+
+// Files
+
+static void chip8_recording_putUInt(FILE *file, uint64_t value, int count) {
+	for (int i = 0; i < count; i++) {
+		fputc((int)((value >> (i * 8)) & 0xFF), file);
+	}
+}
+
+static void chip8_recording_putVarint(FILE *file, uint64_t value) {
+	while (value >= 0x80) {
+		fputc((int)((value & 0x7F) | 0x80), file);
+		value >>= 7;
+	}
+	fputc((int)value, file);
+}
+
+static bool chip8_recording_getUInt(FILE *file, uint64_t *value, int count) {
+	*value = 0;
+	for (int i = 0; i < count; i++) {
+		int byte = fgetc(file);
+		if (byte == EOF) {
+			return false;
+		}
+		*value |= (uint64_t)byte << (i * 8);
+	}
+	return true;
+}
+
+static bool chip8_recording_getVarint(FILE *file, uint64_t *value) {
+	*value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int byte = fgetc(file);
+		if (byte == EOF) {
+			return false;
+		}
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool chip8_recording_save(const chip8_recording *r, const char *path) {
+
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		printf("Failed to open recording %s\n", path);
+		return false;
+	}
+
+	unsigned long long end = (r->machine != NULL) ? r->machine->cycles : r->endCycle;
+
+	fwrite(CHIP8_RECORDING_MAGIC, 1, 4, file);
+	chip8_recording_putUInt(file, CHIP8_RECORDING_VERSION, 4);
+	chip8_recording_putUInt(file, r->clockRate, 4);
+	chip8_recording_putUInt(file, r->seed, 4);
+	chip8_recording_putUInt(file, r->quirks, 1);
+	chip8_recording_putUInt(file, r->romHash, 8);
+	chip8_recording_putUInt(file, r->startCycle, 8);
+	chip8_recording_putUInt(file, end, 8);
+	chip8_recording_putUInt(file, r->count, 4);
+
+	unsigned long long cycle = r->startCycle;
+	for (size_t i = 0; i < r->count; i++) {
+		chip8_recording_putVarint(file, r->events[i].cycle - cycle);
+		fputc(r->events[i].key | (r->events[i].down ? 0x80 : 0), file);
+		cycle = r->events[i].cycle;
+	}
+
+	bool failed = ferror(file);
+	failed |= (fclose(file) != 0);
+	if (failed) {
+		printf("Failed to write recording %s\n", path);
+		return false;
+	}
+	return true;
+}
+
+chip8_recording *chip8_recording_load(const char *path) {
+
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		printf("Failed to open recording %s\n", path);
+		return NULL;
+	}
+
+	chip8_recording *r = chip8_recording_create();
+	char magic[4];
+	uint64_t version = 0, clockRate, seed, quirks, startCycle, endCycle, count;
+	bool ok = (r != NULL) &&
+			  fread(magic, 1, 4, file) == 4 && memcmp(magic, CHIP8_RECORDING_MAGIC, 4) == 0 &&
+			  chip8_recording_getUInt(file, &version, 4) && version == CHIP8_RECORDING_VERSION &&
+			  chip8_recording_getUInt(file, &clockRate, 4) && clockRate != 0 &&
+			  chip8_recording_getUInt(file, &seed, 4) &&
+			  chip8_recording_getUInt(file, &quirks, 1) && quirks < CHIP8_QUIRKS_COUNT &&
+			  chip8_recording_getUInt(file, &r->romHash, 8) &&
+			  chip8_recording_getUInt(file, &startCycle, 8) &&
+			  chip8_recording_getUInt(file, &endCycle, 8) &&
+			  chip8_recording_getUInt(file, &count, 4);
+
+	if (ok && count > 0) {
+		r->events = malloc(count * sizeof(chip8_key_event));
+		r->capacity = count;
+		ok = (r->events != NULL);
+	}
+
+	unsigned long long cycle = ok ? startCycle : 0;
+	for (uint64_t i = 0; ok && i < count; i++) {
+		uint64_t delta;
+		int byte;
+		ok = chip8_recording_getVarint(file, &delta) && (byte = fgetc(file)) != EOF;
+		if (ok) {
+			cycle += delta;
+			r->events[i].cycle = cycle;
+			r->events[i].key = byte & 0x0F;
+			r->events[i].down = (byte & 0x80) != 0;
+			r->count++;
+		}
+	}
+	fclose(file);
+
+	if (!ok && version > 0 && version < CHIP8_RECORDING_VERSION) {
+		printf("%s was recorded by an older version of the emulator, which it can't be played back on\n", path);
+		chip8_recording_destroy(r);
+		return NULL;
+	}
+	if (!ok || cycle > endCycle) {
+		printf("%s isn't a Chip8 recording (or it's damaged)\n", path);
+		chip8_recording_destroy(r);
+		return NULL;
+	}
+
+	r->clockRate = (unsigned int)clockRate;
+	r->seed = (unsigned int)seed;
+	r->quirks = (chip8_quirks)quirks;
+	r->startCycle = startCycle;
+	r->endCycle = endCycle;
+	return r;
+}
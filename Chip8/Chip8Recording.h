@@ -0,0 +1,50 @@
+//
+//  Chip8Recording.h
+//  Chip8
+//
+//  Records the input to a machine so the session can be played back exactly, as fast as the machine can go.
+//
+
+#ifndef __Chip8__Chip8Recording__
+#define __Chip8__Chip8Recording__
+
+#include "Chip8.h"
+
+
+// Recording format
+// "C8RC", a 32-bit version number, the clock rate, the random seed, a hash of the ROM and the cycle the session started and ended on,
+// followed by the number of key events and the events themselves. Each event is the number of cycles since the one before it
+// (a LEB128 varint) and one byte holding the key (low nibble) and whether it went down (top bit). Everything is little-endian.
+// Version 2 added the quirks profile (one byte, after the seed). Version 3 has the same layout, but the seed is for the xorshift
+// generator CXNN uses now, so older recordings can't be played back the way they happened and aren't loaded.
+#define CHIP8_RECORDING_VERSION	3
+
+
+typedef struct chip8_recording chip8_recording;
+
+
+chip8_recording *chip8_recording_create();
+void chip8_recording_destroy(chip8_recording *recording);
+
+// Starts recording a machine, throwing away anything recorded before. Call it straight after loading the ROM, because playback
+// starts from a freshly loaded ROM. This takes over the machine's key observer.
+void chip8_recording_begin(chip8_recording *recording, chip8_machine *machine);
+
+// Stops recording, and notes the cycle the session ended on.
+void chip8_recording_end(chip8_recording *recording, chip8_machine *machine);
+
+// Throws away every event from `cycle` on, for when the machine has been rewound to that cycle.
+void chip8_recording_truncate(chip8_recording *recording, unsigned long long cycle);
+
+// The number of cycles the session lasted (so far, if it's still being recorded).
+unsigned long long chip8_recording_length(const chip8_recording *recording);
+
+bool chip8_recording_save(const chip8_recording *recording, const char *path);
+chip8_recording *chip8_recording_load(const char *path);		// returns NULL if the file isn't a recording we understand
+
+// Plays the whole session back on a machine that has just loaded the same ROM, without any pacing.
+// Returns false (without running anything) if the machine isn't running the ROM the recording was made with.
+bool chip8_recording_replay(const chip8_recording *recording, chip8_machine *machine);
+
+
+#endif /* defined(__Chip8__Chip8Recording__) */
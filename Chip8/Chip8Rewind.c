@@ -0,0 +1,419 @@
+//
+//  Chip8Rewind.c
+//  Chip8
+//
+//  Keeps a history of machine states, one per frame, so you can go back to any of them.
+//
+
+#include "Chip8Rewind.h"
+#include "Chip8Snapshot.h"
+
+#include <string.h>
+
+
+/*
+ How frames are stored
+
+ Each frame is a snapshot (see Chip8Snapshot.h), but most frames only change a handful of bytes, so storing whole snapshots
+ would be a waste. Instead every keyframeInterval frames we store a keyframe, and every frame in between stores the snapshot
+ XORed with its keyframe. That's almost all zeros, so both kinds are run-length encoded as a list of
+ (number of zero bytes, number of literal bytes, the literal bytes) with the counts as LEB128 varints.
+
+ A frame only ever depends on its own keyframe (not the frame before it), so seeking to any frame means decoding at most two
+ records, however much history there is.
+
+ The encoded frames go into one ring of bytes, in order, with an index entry per frame pointing into it. When the ring (or the
+ index) is full we throw away the oldest keyframe along with every frame that depends on it.
+*/
+
+// A delta is typically 12 to 30 bytes, so the index entries are kept as small as they'll go or they'd cost more than the frames.
+typedef struct chip8_rewind_frame {
+
+	uint32_t		offset;				// where the encoded frame starts in the data ring (which is never bigger than 4GB)
+	uint16_t		length;				// encoded bytes (at most a little over twice a snapshot)
+	uint16_t		sinceKeyframe;		// how many frames back its keyframe is (0 for a keyframe)
+
+} chip8_rewind_frame;
+
+struct chip8_rewind {
+
+	size_t				memoryBudget;
+	size_t				memoryAllocated;
+	unsigned int		keyframeInterval;
+	size_t				snapshotSize;
+
+	unsigned char		*data;				// the data ring
+	size_t				dataSize;
+	size_t				dataHead;			// where the next frame goes
+	size_t				dataUsed;
+
+	chip8_rewind_frame	*frames;			// the index, frame n is at frames[n % frameCapacity]
+	size_t				frameCapacity;
+	unsigned long long	oldest;				// number of the oldest frame held
+	size_t				count;				// frames held
+	size_t				keyframes;
+
+	unsigned char		*keyframe;			// a decoded keyframe ...
+	unsigned long long	keyframeNumber;		// ... and which one it is
+	bool				keyframeValid;
+
+	unsigned char		*snapshot;			// scratch space for one snapshot
+	unsigned char		*encoded;			// scratch space for one encoded frame (at worst a little over twice a snapshot)
+};
+
+// The budget is split between the index and the data ring as if every frame were this big. Frames average 30 to 80 bytes
+// once their keyframe's share is counted, so the data ring runs out first and the index stays nearly full.
+#define CHIP8_REWIND_MIN_FRAME		24
+
+
+// Encoding
+
+static size_t chip8_rewind_putVarint(unsigned char *out, size_t value) {
+
+	size_t used = 0;
+	while (value >= 0x80) {
+		out[used++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	out[used++] = (unsigned char)value;
+	return used;
+}
+
+static size_t chip8_rewind_getVarint(const unsigned char *in, size_t *used) {
+
+	size_t value = 0;
+	int shift = 0;
+	unsigned char byte;
+	do {
+		byte = in[(*used)++];
+		value |= (size_t)(byte & 0x7F) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	return value;
+}
+
+static inline bool chip8_rewind_sameWord(const unsigned char *state, const unsigned char *base, size_t pos) {
+
+	uint64_t a, b = 0;
+	memcpy(&a, &state[pos], 8);
+	if (base != NULL) {
+		memcpy(&b, &base[pos], 8);
+	}
+	return a == b;
+}
+
+// Encodes state XOR base (or just state if base is NULL) into out, and returns the encoded length.
+static size_t chip8_rewind_encode(const unsigned char *state, const unsigned char *base, size_t size, unsigned char *out) {
+
+	#define DIFF(i)	(state[i] ^ (base != NULL ? base[i] : 0))
+
+	size_t used = 0;
+	size_t pos = 0;
+
+	while (pos < size) {
+
+		// most of it is zeros, so skip those 8 bytes at a time where we can
+		size_t zeroStart = pos;
+		while (pos + 8 <= size && chip8_rewind_sameWord(state, base, pos)) {
+			pos += 8;
+		}
+		while (pos < size && DIFF(pos) == 0) {
+			pos++;
+		}
+
+		// a literal run carries on through single zeros, it's cheaper than starting a new run
+		size_t literalStart = pos;
+		while (pos < size && (DIFF(pos) != 0 || (pos + 1 < size && DIFF(pos + 1) != 0))) {
+			pos++;
+		}
+
+		used += chip8_rewind_putVarint(&out[used], literalStart - zeroStart);
+		used += chip8_rewind_putVarint(&out[used], pos - literalStart);
+		for (size_t i = literalStart; i < pos; i++) {
+			out[used++] = DIFF(i);
+		}
+	}
+	return used;
+
+	#undef DIFF
+}
+
+// XORs an encoded frame into out.
+static void chip8_rewind_decode(const unsigned char *in, size_t length, unsigned char *out) {
+
+	size_t used = 0;
+	size_t pos = 0;
+
+	while (used < length) {
+		pos += chip8_rewind_getVarint(in, &used);
+		size_t literals = chip8_rewind_getVarint(in, &used);
+		for (size_t i = 0; i < literals; i++) {
+			out[pos++] ^= in[used++];
+		}
+	}
+}
+
+
+// The Data Ring
+
+static inline chip8_rewind_frame *chip8_rewind_frameAt(chip8_rewind *r, unsigned long long frame) {
+	return &r->frames[frame % r->frameCapacity];
+}
+
+static void chip8_rewind_write(chip8_rewind *r, const unsigned char *bytes, size_t length) {
+
+	size_t first = r->dataSize - r->dataHead;
+	if (first > length) {
+		first = length;
+	}
+	memcpy(&r->data[r->dataHead], bytes, first);
+	memcpy(r->data, bytes + first, length - first);
+
+	r->dataHead = (r->dataHead + length) % r->dataSize;
+	r->dataUsed += length;
+}
+
+// Decodes frame `frame` into out (on top of whatever is there already).
+static void chip8_rewind_read(chip8_rewind *r, unsigned long long frame, unsigned char *out) {
+
+	chip8_rewind_frame *f = chip8_rewind_frameAt(r, frame);
+
+	// copy it out of the ring first so the decoder doesn't have to care about wrapping
+	size_t first = r->dataSize - f->offset;
+	if (first > f->length) {
+		first = f->length;
+	}
+	memcpy(r->encoded, &r->data[f->offset], first);
+	memcpy(r->encoded + first, r->data, f->length - first);
+
+	chip8_rewind_decode(r->encoded, f->length, out);
+}
+
+// Makes r->keyframe hold keyframe `frame`.
+static void chip8_rewind_loadKeyframe(chip8_rewind *r, unsigned long long frame) {
+
+	if (r->keyframeValid && r->keyframeNumber == frame) {
+		return;
+	}
+
+	memset(r->keyframe, 0, r->snapshotSize);
+	chip8_rewind_read(r, frame, r->keyframe);
+	r->keyframeNumber = frame;
+	r->keyframeValid = true;
+}
+
+// Throws away the oldest keyframe and every frame that depends on it.
+static void chip8_rewind_dropOldest(chip8_rewind *r) {
+
+	do {
+		chip8_rewind_frame *f = chip8_rewind_frameAt(r, r->oldest);
+		if (f->sinceKeyframe == 0) {
+			r->keyframes--;
+		}
+		r->dataUsed -= f->length;
+		r->oldest++;
+		r->count--;
+	} while (r->count > 0 && chip8_rewind_frameAt(r, r->oldest)->sinceKeyframe != 0);
+}
+
+
+
+// Rewind API
+
+chip8_rewind *chip8_rewind_create(size_t memoryBudget, unsigned int keyframeInterval) {
+
+	size_t snapshotSize = chip8_snapshot_size();
+	size_t encodedSize = snapshotSize * 2 + 16;
+	size_t fixed = sizeof(chip8_rewind) + snapshotSize * 2 + encodedSize;
+
+	if (memoryBudget <= fixed) {
+		return NULL;
+	}
+
+	// split what's left between the index and the data ring
+	size_t remaining = memoryBudget - fixed;
+	size_t frameCapacity = remaining / (CHIP8_REWIND_MIN_FRAME + sizeof(chip8_rewind_frame));
+	size_t dataSize = remaining - frameCapacity * sizeof(chip8_rewind_frame);
+	if (dataSize > UINT32_MAX) {
+		dataSize = UINT32_MAX;
+	}
+
+	// we need to be able to hold at least one keyframe, however badly it compresses
+	if (frameCapacity < 2 || dataSize < encodedSize) {
+		return NULL;
+	}
+
+	chip8_rewind *r = calloc(1, sizeof(chip8_rewind));
+	if (r == NULL) {
+		return NULL;
+	}
+
+	r->memoryBudget = memoryBudget;
+	r->memoryAllocated = fixed + frameCapacity * sizeof(chip8_rewind_frame) + dataSize;
+	r->keyframeInterval = (keyframeInterval != 0) ? keyframeInterval : CHIP8_REWIND_DEFAULT_KEYFRAMES;
+	if (r->keyframeInterval > UINT16_MAX) {
+		r->keyframeInterval = UINT16_MAX;
+	}
+	r->snapshotSize = snapshotSize;
+	r->dataSize = dataSize;
+	r->frameCapacity = frameCapacity;
+
+	r->data = malloc(dataSize);
+	r->frames = malloc(frameCapacity * sizeof(chip8_rewind_frame));
+	r->keyframe = malloc(snapshotSize);
+	r->snapshot = malloc(snapshotSize);
+	r->encoded = malloc(encodedSize);
+
+	if (r->data == NULL || r->frames == NULL || r->keyframe == NULL || r->snapshot == NULL || r->encoded == NULL) {
+		chip8_rewind_destroy(r);
+		return NULL;
+	}
+	return r;
+}
+
+void chip8_rewind_destroy(chip8_rewind *r) {
+
+	if (r == NULL) {
+		return;
+	}
+	free(r->data);
+	free(r->frames);
+	free(r->keyframe);
+	free(r->snapshot);
+	free(r->encoded);
+	free(r);
+}
+
+void chip8_rewind_clear(chip8_rewind *r) {
+
+	// carry on numbering from where we were, so frame numbers never get reused
+	r->oldest += r->count;
+	r->count = 0;
+	r->keyframes = 0;
+	r->dataHead = 0;
+	r->dataUsed = 0;
+	r->keyframeValid = false;
+}
+
+void chip8_rewind_push(chip8_rewind *r, const chip8_machine *m) {
+
+	unsigned long long frame = r->oldest + r->count;
+	chip8_snapshot_save(m, r->snapshot, r->snapshotSize);
+
+	for (;;) {
+
+		// a keyframe every keyframeInterval frames (or whenever there's nothing to be a delta of)
+		unsigned long long newestKeyframe = 0;
+		bool keyframe = (r->count == 0);
+		if (!keyframe) {
+			unsigned long long newest = frame - 1;
+			newestKeyframe = newest - chip8_rewind_frameAt(r, newest)->sinceKeyframe;
+			keyframe = (frame - newestKeyframe >= r->keyframeInterval);
+		}
+
+		size_t length;
+		if (keyframe) {
+			length = chip8_rewind_encode(r->snapshot, NULL, r->snapshotSize, r->encoded);
+		}
+		else {
+			chip8_rewind_loadKeyframe(r, newestKeyframe);
+			length = chip8_rewind_encode(r->snapshot, r->keyframe, r->snapshotSize, r->encoded);
+		}
+
+		// make room, oldest first
+		while (r->count > 0 && (r->dataSize - r->dataUsed < length || r->count == r->frameCapacity)) {
+			chip8_rewind_dropOldest(r);
+		}
+
+		// if that threw away our keyframe there was only room for this frame anyway, so it had better be a keyframe
+		if (!keyframe && r->count == 0) {
+			continue;
+		}
+
+		chip8_rewind_frame *f = chip8_rewind_frameAt(r, frame);
+		f->offset = (uint32_t)r->dataHead;
+		f->length = (uint16_t)length;
+		f->sinceKeyframe = keyframe ? 0 : (uint16_t)(frame - newestKeyframe);
+		chip8_rewind_write(r, r->encoded, length);
+		r->count++;
+
+		if (keyframe) {
+			r->keyframes++;
+			memcpy(r->keyframe, r->snapshot, r->snapshotSize);
+			r->keyframeNumber = frame;
+			r->keyframeValid = true;
+		}
+		return;
+	}
+}
+
+unsigned long long chip8_rewind_oldest(chip8_rewind *r) {
+
+	return r->oldest;
+}
+
+unsigned long long chip8_rewind_newest(chip8_rewind *r) {
+
+	return r->oldest + r->count - 1;
+}
+
+bool chip8_rewind_seek(chip8_rewind *r, unsigned long long frame, chip8_machine *m) {
+
+	if (frame < r->oldest || frame - r->oldest >= r->count) {
+		return false;
+	}
+
+	chip8_rewind_frame *f = chip8_rewind_frameAt(r, frame);
+	chip8_rewind_loadKeyframe(r, frame - f->sinceKeyframe);
+
+	memcpy(r->snapshot, r->keyframe, r->snapshotSize);
+	if (f->sinceKeyframe != 0) {
+		chip8_rewind_read(r, frame, r->snapshot);
+	}
+	return chip8_snapshot_load(m, r->snapshot, r->snapshotSize);
+}
+
+void chip8_rewind_truncate(chip8_rewind *r, unsigned long long frame) {
+
+	if (frame < r->oldest) {
+		chip8_rewind_clear(r);
+		return;
+	}
+
+	while (r->count > 0 && r->oldest + r->count - 1 > frame) {
+
+		chip8_rewind_frame *f = chip8_rewind_frameAt(r, r->oldest + r->count - 1);
+		if (f->sinceKeyframe == 0) {
+			r->keyframes--;
+			if (r->keyframeNumber == r->oldest + r->count - 1) {
+				r->keyframeValid = false;
+			}
+		}
+		r->dataUsed -= f->length;
+		r->dataHead = f->offset;
+		r->count--;
+	}
+}
+
+bool chip8_rewind_stepBack(chip8_rewind *r, chip8_machine *m) {
+
+	if (r->count < 2) {
+		return false;
+	}
+
+	unsigned long long frame = chip8_rewind_newest(r) - 1;
+	chip8_rewind_truncate(r, frame);
+	return chip8_rewind_seek(r, frame, m);
+}
+
+chip8_rewind_stats chip8_rewind_getStats(chip8_rewind *r) {
+
+	chip8_rewind_stats stats;
+	stats.memoryBudget = r->memoryBudget;
+	stats.memoryAllocated = r->memoryAllocated;
+	stats.memoryUsed = r->dataUsed + r->count * sizeof(chip8_rewind_frame);
+	stats.frames = r->count;
+	stats.keyframes = r->keyframes;
+	stats.uncompressedSize = r->count * r->snapshotSize;
+	return stats;
+}
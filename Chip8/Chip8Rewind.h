@@ -0,0 +1,64 @@
+//
+//  Chip8Rewind.h
+//  Chip8
+//
+//  Keeps a history of machine states, one per frame, so you can go back to any of them.
+//
+
+#ifndef __Chip8__Chip8Rewind__
+#define __Chip8__Chip8Rewind__
+
+#include "Chip8.h"
+
+
+#define CHIP8_REWIND_DEFAULT_BUDGET		(4 * 1024 * 1024)	// bytes, which is ten minutes or more of play for most games
+#define CHIP8_REWIND_DEFAULT_KEYFRAMES	60					// frames between keyframes
+
+
+typedef struct chip8_rewind chip8_rewind;
+
+
+// Creates a rewind buffer that never uses more than memoryBudget bytes. Once it's full the oldest frames are thrown away.
+// Every keyframeInterval frames a whole snapshot is stored, and the frames in between only store what changed since it.
+// Pass 0 for keyframeInterval to get CHIP8_REWIND_DEFAULT_KEYFRAMES. Returns NULL if the budget is too small to hold anything.
+chip8_rewind *chip8_rewind_create(size_t memoryBudget, unsigned int keyframeInterval);
+void chip8_rewind_destroy(chip8_rewind *rewind);
+
+// Throws away every frame.
+void chip8_rewind_clear(chip8_rewind *rewind);
+
+// Records the machine's state as the newest frame.
+void chip8_rewind_push(chip8_rewind *rewind, const chip8_machine *machine);
+
+// Frames are numbered from 0 in the order they were pushed. These give the oldest and newest frames still held
+// (newest only means something if there's at least one frame, see chip8_rewind_getStats()).
+unsigned long long chip8_rewind_oldest(chip8_rewind *rewind);
+unsigned long long chip8_rewind_newest(chip8_rewind *rewind);
+
+// Restores frame `frame` into the machine. Returns false if that frame isn't held any more.
+bool chip8_rewind_seek(chip8_rewind *rewind, unsigned long long frame, chip8_machine *machine);
+
+// Throws away every frame newer than `frame`, so the next push carries on from there.
+void chip8_rewind_truncate(chip8_rewind *rewind, unsigned long long frame);
+
+// Goes back one frame: throws away the newest frame and restores the one before it into the machine.
+// Returns false (and leaves the machine alone) if there's nothing older to go back to.
+bool chip8_rewind_stepBack(chip8_rewind *rewind, chip8_machine *machine);
+
+
+// Statistics
+typedef struct chip8_rewind_stats {
+
+	size_t	memoryBudget;		// what the buffer was created with
+	size_t	memoryAllocated;	// what it actually allocated (never more than the budget)
+	size_t	memoryUsed;			// how much of that is holding frames right now
+	size_t	frames;				// frames held
+	size_t	keyframes;			// ... of which are keyframes
+	size_t	uncompressedSize;	// what the frames held would take as plain snapshots
+
+} chip8_rewind_stats;
+
+chip8_rewind_stats chip8_rewind_getStats(chip8_rewind *rewind);
+
+
+#endif /* defined(__Chip8__Chip8Rewind__) */
@@ -0,0 +1,233 @@
+//
+//  Chip8Snapshot.c
+//  Chip8
+//
+//  Saves the state of a machine to a compact binary snapshot, and loads it back again.
+//
+
+#include "Chip8Snapshot.h"
+
+#include <string.h>
+
+
+/*
+ Layout (all values little-endian)
+
+	offset	size	field
+	0		4		"C8SN"
+	4		4		version
+	8		4096	memory
+	4104	16		V0-VF
+	4120	2		I
+	4122	2		pc
+	4124	32		stack
+	4156	2		sp
+	4158	1		delay timer
+	4159	1		sound timer
+	4160	256		gfx (32 rows of 8 bytes)
+	4416	16		keys (one byte each, 0 or 1)
+	4432	4		clock rate
+	4436	8		cycles
+	4444	8		next timer tick
+	4452	8		timer base
+	4460	8		timer ticks
+	4468	8		idle cycles
+	4476	4		random number generator state
+	4480	1		quirks profile
+
+ Only the emulated machine is saved. The decode cache, the JIT and the renderer's dirty tracking are rebuilt from it.
+*/
+
+#define CHIP8_SNAPSHOT_MAGIC	"C8SN"
+#define CHIP8_SNAPSHOT_SIZE		4481
+
+
+// Writing
+
+typedef struct chip8_writer {
+	unsigned char	*bytes;
+	size_t			used;
+} chip8_writer;
+
+static void chip8_putBytes(chip8_writer *w, const void *bytes, size_t count) {
+	memcpy(w->bytes + w->used, bytes, count);
+	w->used += count;
+}
+
+static void chip8_putUInt(chip8_writer *w, uint64_t value, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		w->bytes[w->used++] = (unsigned char)(value >> (i * 8));
+	}
+}
+
+size_t chip8_snapshot_size() {
+
+	return CHIP8_SNAPSHOT_SIZE;
+}
+
+size_t chip8_snapshot_save(const chip8_machine *m, void *buffer, size_t size) {
+
+	if (size < CHIP8_SNAPSHOT_SIZE) {
+		return 0;
+	}
+
+	chip8_writer w = { buffer, 0 };
+
+	chip8_putBytes(&w, CHIP8_SNAPSHOT_MAGIC, 4);
+	chip8_putUInt(&w, CHIP8_SNAPSHOT_VERSION, 4);
+
+	chip8_putBytes(&w, m->memory, sizeof(m->memory));
+	chip8_putBytes(&w, m->V, sizeof(m->V));
+	chip8_putUInt(&w, m->I, 2);
+	chip8_putUInt(&w, m->pc, 2);
+	for (int i = 0; i < 16; i++) {
+		chip8_putUInt(&w, m->stack[i], 2);
+	}
+	chip8_putUInt(&w, m->sp, 2);
+	chip8_putUInt(&w, m->delay_timer, 1);
+	chip8_putUInt(&w, m->sound_timer, 1);
+	for (int row = 0; row < 32; row++) {
+		chip8_putUInt(&w, m->gfx[row], 8);
+	}
+	for (int k = 0; k < 16; k++) {
+		chip8_putUInt(&w, (m->keys >> k) & 1, 1);
+	}
+
+	chip8_putUInt(&w, m->clockRate, 4);
+	chip8_putUInt(&w, m->cycles, 8);
+	chip8_putUInt(&w, m->nextTimerTick, 8);
+	chip8_putUInt(&w, m->timerBase, 8);
+	chip8_putUInt(&w, m->timerTicks, 8);
+	chip8_putUInt(&w, m->idleCycles, 8);
+	chip8_putUInt(&w, m->rngState, 4);
+	chip8_putUInt(&w, m->quirks, 1);
+
+	return w.used;
+}
+
+
+// Reading
+
+typedef struct chip8_reader {
+	const unsigned char	*bytes;
+	size_t				used;
+} chip8_reader;
+
+static void chip8_getBytes(chip8_reader *r, void *bytes, size_t count) {
+	memcpy(bytes, r->bytes + r->used, count);
+	r->used += count;
+}
+
+static uint64_t chip8_getUInt(chip8_reader *r, size_t count) {
+	uint64_t value = 0;
+	for (size_t i = 0; i < count; i++) {
+		value |= (uint64_t)r->bytes[r->used++] << (i * 8);
+	}
+	return value;
+}
+
+bool chip8_snapshot_load(chip8_machine *m, const void *buffer, size_t size) {
+
+	if (size < CHIP8_SNAPSHOT_SIZE || memcmp(buffer, CHIP8_SNAPSHOT_MAGIC, 4) != 0) {
+		printf("Not a Chip8 snapshot\n");
+		return false;
+	}
+
+	chip8_reader r = { buffer, 4 };
+
+	uint64_t version = chip8_getUInt(&r, 4);
+	if (version != CHIP8_SNAPSHOT_VERSION) {
+		printf("Can't load version %llu snapshots\n", (unsigned long long)version);
+		return false;
+	}
+
+	// check the fields that could break the machine before touching it, so a bad snapshot can't leave us half loaded
+	chip8_reader check = { buffer, 4156 };
+	uint64_t sp = chip8_getUInt(&check, 2);
+	check.used = 4432;
+	uint64_t clockRate = chip8_getUInt(&check, 4);
+	uint64_t cycles = chip8_getUInt(&check, 8);
+	uint64_t nextTimerTick = chip8_getUInt(&check, 8);
+	check.used = 4476;
+	uint64_t rngState = chip8_getUInt(&check, 4);
+	uint64_t quirks = chip8_getUInt(&check, 1);
+
+	if (sp > 16 || clockRate == 0 || nextTimerTick <= cycles || rngState == 0 || quirks >= CHIP8_QUIRKS_COUNT) {
+		printf("Chip8 snapshot is corrupt\n");
+		return false;
+	}
+
+	chip8_getBytes(&r, m->memory, sizeof(m->memory));
+	chip8_getBytes(&r, m->V, sizeof(m->V));
+	m->I = (unsigned short)chip8_getUInt(&r, 2);
+	m->pc = (unsigned short)chip8_getUInt(&r, 2);
+	for (int i = 0; i < 16; i++) {
+		m->stack[i] = (unsigned short)chip8_getUInt(&r, 2);
+	}
+	m->sp = (unsigned short)chip8_getUInt(&r, 2);
+	m->delay_timer = (unsigned char)chip8_getUInt(&r, 1);
+	m->sound_timer = (unsigned char)chip8_getUInt(&r, 1);
+	for (int row = 0; row < 32; row++) {
+		m->gfx[row] = chip8_getUInt(&r, 8);
+	}
+	m->keys = 0;
+	for (int k = 0; k < 16; k++) {
+		m->keys |= (uint16_t)((chip8_getUInt(&r, 1) != 0) << k);
+	}
+
+	m->clockRate = (unsigned int)chip8_getUInt(&r, 4);
+	m->cycles = chip8_getUInt(&r, 8);
+	m->nextTimerTick = chip8_getUInt(&r, 8);
+	m->timerBase = chip8_getUInt(&r, 8);
+	m->timerTicks = chip8_getUInt(&r, 8);
+	m->idleCycles = chip8_getUInt(&r, 8);
+	m->rngState = (unsigned int)rngState;
+
+	// the quirks decide what translated code the JIT and AOT engines can use, so let chip8_machine_setQuirks() tell them
+	chip8_machine_setQuirks(m, (chip8_quirks)quirks);
+
+	// all of memory just changed under the decode cache
+	chip8_machine_invalidate(m, 0, 4096);
+	m->needsDisplay = true;
+	return true;
+}
+
+
+// Files
+
+bool chip8_snapshot_saveFile(const chip8_machine *m, const char *path) {
+
+	unsigned char buffer[CHIP8_SNAPSHOT_SIZE];
+	size_t size = chip8_snapshot_save(m, buffer, sizeof(buffer));
+
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		printf("Failed to open snapshot %s\n", path);
+		return false;
+	}
+
+	size_t written = fwrite(buffer, 1, size, file);
+	bool failed = (fclose(file) != 0) || written != size;
+
+	if (failed) {
+		printf("Failed to write snapshot %s\n", path);
+		return false;
+	}
+	return true;
+}
+
+bool chip8_snapshot_loadFile(chip8_machine *m, const char *path) {
+
+	unsigned char buffer[CHIP8_SNAPSHOT_SIZE];
+
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		printf("Failed to open snapshot %s\n", path);
+		return false;
+	}
+
+	size_t size = fread(buffer, 1, sizeof(buffer), file);
+	fclose(file);
+
+	return chip8_snapshot_load(m, buffer, size);
+}
@@ -0,0 +1,34 @@
+//
+//  Chip8Snapshot.h
+//  Chip8
+//
+//  Saves the state of a machine to a compact binary snapshot, and loads it back again.
+//
+
+#ifndef __Chip8__Chip8Snapshot__
+#define __Chip8__Chip8Snapshot__
+
+#include "Chip8.h"
+
+
+// Snapshot format
+// A snapshot starts with the 4 bytes "C8SN" and a 32-bit version number, followed by the machine state (see Chip8Snapshot.c).
+// Everything is little-endian, so snapshots can be moved between machines. Bump the version whenever the layout changes.
+#define CHIP8_SNAPSHOT_VERSION	2
+
+
+// The number of bytes chip8_snapshot_save() writes.
+size_t chip8_snapshot_size();
+
+// Writes a snapshot of the machine into buffer. Returns the number of bytes written, or 0 if the buffer is too small.
+size_t chip8_snapshot_save(const chip8_machine *machine, void *buffer, size_t size);
+
+// Restores the machine from a snapshot. Returns false (and leaves the machine alone) if it isn't a snapshot we understand.
+bool chip8_snapshot_load(chip8_machine *machine, const void *buffer, size_t size);
+
+// The same again, for files.
+bool chip8_snapshot_saveFile(const chip8_machine *machine, const char *path);
+bool chip8_snapshot_loadFile(chip8_machine *machine, const char *path);
+
+
+#endif /* defined(__Chip8__Chip8Snapshot__) */
@@ -7,7 +7,24 @@
 //
 
 #import <Cocoa/Cocoa.h>
+#import "Chip8Frames.h"
 
 @interface Chip8View : NSView
 
+@property (assign) BOOL rewinding;			// YES while the rewind key (delete) is held down
+@property (assign) chip8_frames *frames;	// the frames to show, published by the emulation thread
+
+// How long pixels take to fade out, from 0 (straight away) up to 1 (see chip8_raster_config). Set it before the first frame.
+@property (assign) double persistence;
+
+// Told about the keypad keys ('0'-'9' and 'A'-'F') going down and coming back up, with the NSEvent's timestamp. The view never
+// touches the machine itself, because the machine belongs to the emulation thread.
+@property (copy) void (^keyHandler)(unsigned char key, BOOL down, NSTimeInterval timestamp);
+
+// Takes the latest frame from `frames` and repaints the parts of the screen that it changes. Call it on the main thread.
+- (void)showLatestFrame;
+
+// Marks the 8x8 pixel tiles set in `tiles` (see chip8_machine_dirtyTiles()) as needing display.
+- (void)setNeedsDisplayInTiles:(uint32_t)tiles;
+
 @end
@@ -8,35 +8,136 @@
 
 #import "Chip8View.h"
 #import	"Chip8.h"
+#import "Chip8Raster.h"
 
 
-@implementation Chip8View
+@implementation Chip8View {
+	
+	const chip8_frame	*_frame;		// the frame on the screen. It stays put until the next chip8_frames_acquire()
+	unsigned long long	_sequence;		// ... and its sequence number
+	uint64_t			_shown[32];		// what's on the screen
+	
+	// the screen's pixels, which chip8_raster_draw() fills in and drawRect: hands to Core Graphics as one image
+	chip8_raster		*_raster;
+	uint32_t			_pixels[32][64];
+	CGImageRef			_image;
+}
+
+- (void)dealloc {
+	
+	CGImageRelease(_image);
+	chip8_raster_destroy(_raster);
+}
+
+- (void)showLatestFrame {
+	
+	const chip8_frame *frame = chip8_frames_acquire(self.frames);
+	bool fresh = (frame != NULL && frame->sequence != _sequence);
+	bool fading = (_raster != NULL && chip8_raster_fading(_raster));
+	if (!fresh && !fading) {
+		return;
+	}
+	
+	uint32_t dirtyTiles = 0;
+	if (fresh) {
+		_frame = frame;
+		_sequence = frame->sequence;
+		
+		// only repaint the parts of the screen that actually changed since we last showed it
+		dirtyTiles = chip8_dirtyTilesBetween(frame->gfx, _shown);
+		memcpy(_shown, frame->gfx, sizeof(_shown));
+	}
+	
+	if (dirtyTiles == 0 && !fading) {
+		// it looks just like the last one, which is already on the screen
+		chip8_frames_presented(self.frames, frame);
+		return;
+	}
+	
+	[self renderPixels];
+	
+	// pixels that are fading out change every frame, wherever they are
+	if (fading) {
+		[self setNeedsDisplay:YES];
+	}
+	else {
+		[self setNeedsDisplayInTiles:dirtyTiles];
+	}
+}
+
+// Turns _shown into _pixels, and _pixels into _image.
+- (void)renderPixels {
+	
+	if (_raster == NULL) {
+		chip8_raster_config config = {
+			.format			= CHIP8_RASTER_RGBA,
+			.scale			= 1,
+			.off			= { 0, 0, 0, 255 },
+			.on				= { 255, 255, 255, 255 },
+			.persistence	= self.persistence,
+		};
+		_raster = chip8_raster_create(&config);
+		if (_raster == NULL) {
+			return;
+		}
+	}
+	chip8_raster_draw(_raster, _shown, _pixels, sizeof(_pixels[0]));
+	
+	// the bytes go red, green, blue, alpha, and alpha is always 255, so premultiplying changes nothing
+	CGColorSpaceRef colorSpace = CGColorSpaceCreateDeviceRGB();
+	CGContextRef bitmap = CGBitmapContextCreate(_pixels, 64, 32, 8, sizeof(_pixels[0]), colorSpace,
+												kCGImageAlphaPremultipliedLast | kCGBitmapByteOrder32Big);
+	CGImageRelease(_image);
+	_image = (bitmap != NULL) ? CGBitmapContextCreateImage(bitmap) : NULL;
+	CGContextRelease(bitmap);
+	CGColorSpaceRelease(colorSpace);
+}
+
+- (void)setNeedsDisplayInTiles:(uint32_t)tiles {
+	
+	int pixelWidth =  self.bounds.size.width / 64;
+	int pixelHeight = self.bounds.size.height / 32;
+	
+	for (int tile = 0; tile < 32; tile++) {
+		
+		if (tiles & (1u << tile)) {
+			int tileRow = tile / 8;
+			int tileCol = tile % 8;
+			NSRect tileRect = NSMakeRect(tileCol * 8 * pixelWidth,
+										 self.bounds.size.height - (tileRow + 1) * 8 * pixelHeight,
+										 8 * pixelWidth,
+										 8 * pixelHeight);
+			
+			[self setNeedsDisplayInRect:tileRect];
+		}
+	}
+}
 
 - (void)drawRect:(NSRect)dirtyRect {
 	
 	int pixelWidth =  self.bounds.size.width / 64;
 	int pixelHeight = self.bounds.size.height / 32;
 	
+	// only repaint what AppKit asked for, which is usually just the tiles that changed
 	[[NSColor blackColor] setFill];
-	NSRectFill(self.bounds);
+	NSRectFill(dirtyRect);
 	
-	[[NSColor whiteColor] setFill];
+	if (_image == NULL) {
+		[self renderPixels];
+	}
 	
-	for (int row = 0; row < 32; row++) {
-		for (int col = 0; col < 64; col++) {
-			
-			if (gfx[col][row] != 0) {
-				NSRect pixelRect = NSMakeRect(col * pixelWidth,
-											  self.bounds.size.height - pixelHeight - row * pixelHeight,
-											  pixelWidth,
-											  pixelHeight);
-				
-				NSRectFill(pixelRect);
-			}
-		}
+	// the whole screen is one 64x32 image, stretched over the view with every pixel kept square-edged, rather than a rectangle
+	// for every pixel. Core Graphics clips it to the dirty rect
+	if (_image != NULL) {
+		CGContextRef context = [[NSGraphicsContext currentContext] graphicsPort];
+		CGContextSetInterpolationQuality(context, kCGInterpolationNone);
+		CGContextDrawImage(context, CGRectMake(0, self.bounds.size.height - 32 * pixelHeight, 64 * pixelWidth, 32 * pixelHeight), _image);
 	}
 	
-	chip8_setNeedsDisplay(false);
+	// AppKit puts what we've drawn on the screen as soon as we return, so this is as close to presenting the frame as we can see
+	if (_frame != NULL) {
+		chip8_frames_presented(self.frames, _frame);
+	}
 }
 
 - (BOOL)canBecomeKeyView {
@@ -51,122 +152,59 @@
 	return YES;
 }
 
+- (void)key:(unsigned char)key down:(BOOL)down timestamp:(NSTimeInterval)timestamp {
+	
+	if (self.keyHandler != nil) {
+		self.keyHandler(key, down, timestamp);
+	}
+}
+
+// The keypad's 4x4 grid sits on the left of the keyboard, from 1234 down to ZXCV. Returns the keypad key ('0'-'9', 'A'-'F') for
+// a character, or 0 if it isn't one of them.
+static unsigned char chip8_view_keypadKey(unichar character) {
+	
+	static const char keyboard[16] = "1234qwerasdfzxcv";
+	static const char keypad[16]   = "123C456D789EA0BF";
+	
+	for (int i = 0; i < 16; i++) {
+		if (character == (unichar)keyboard[i]) {
+			return (unsigned char)keypad[i];
+		}
+	}
+	return 0;
+}
+
 - (void)keyDown:(NSEvent *)theEvent {
 	
-	NSString *characters;
-	characters = [theEvent characters];
-	unichar character = [characters characterAtIndex: 0];
-	
-	switch (character) {
-		case '1':
-			chip8_keydown('1');
-			break;
-		case '2':
-			chip8_keydown('2');
-			break;
-		case '3':
-			chip8_keydown('3');
-			break;
-		case '4':
-			chip8_keydown('C');
-			break;
-		case 'q':
-			chip8_keydown('4');
-			break;
-		case 'w':
-			chip8_keydown('5');
-			break;
-		case 'e':
-			chip8_keydown('6');
-			break;
-		case 'r':
-			chip8_keydown('D');
-			break;
-		case 'a':
-			chip8_keydown('7');
-			break;
-		case 's':
-			chip8_keydown('8');
-			break;
-		case 'd':
-			chip8_keydown('9');
-			break;
-		case 'f':
-			chip8_keydown('E');
-			break;
-		case 'z':
-			chip8_keydown('A');
-			break;
-		case 'x':
-			chip8_keydown('0');
-			break;
-		case 'c':
-			chip8_keydown('B');
-			break;
-		case 'v':
-			chip8_keydown('F');
-			break;
-		default:
-			NSLog(@"Unrecognized key");
-			break;
+	unichar character = [[theEvent characters] characterAtIndex:0];
+	if (character == NSDeleteCharacter) {
+		self.rewinding = YES;
+		return;
+	}
+	
+	unsigned char key = chip8_view_keypadKey(character);
+	if (key == 0) {
+		NSLog(@"Unrecognized key");
+		return;
+	}
+	
+	// holding a key down sends it again and again, but the machine only needs to hear about it once
+	if (![theEvent isARepeat]) {
+		[self key:key down:YES timestamp:[theEvent timestamp]];
 	}
 }
 
 - (void)keyUp:(NSEvent *)theEvent {
 	
-	NSString *characters;
-	characters = [theEvent characters];
-	unichar character = [characters characterAtIndex: 0];
-	
-	switch (character) {
-		case '1':
-			chip8_keyup('1');
-			break;
-		case '2':
-			chip8_keyup('2');
-			break;
-		case '3':
-			chip8_keyup('3');
-			break;
-		case '4':
-			chip8_keyup('C');
-			break;
-		case 'q':
-			chip8_keyup('4');
-			break;
-		case 'w':
-			chip8_keyup('5');
-			break;
-		case 'e':
-			chip8_keyup('6');
-			break;
-		case 'r':
-			chip8_keyup('D');
-			break;
-		case 'a':
-			chip8_keyup('7');
-			break;
-		case 's':
-			chip8_keyup('8');
-			break;
-		case 'd':
-			chip8_keyup('9');
-			break;
-		case 'f':
-			chip8_keyup('E');
-			break;
-		case 'z':
-			chip8_keyup('A');
-			break;
-		case 'x':
-			chip8_keyup('0');
-			break;
-		case 'c':
-			chip8_keyup('B');
-			break;
-		case 'v':
-			chip8_keyup('F');
-			break;
+	unichar character = [[theEvent characters] characterAtIndex:0];
+	if (character == NSDeleteCharacter) {
+		self.rewinding = NO;
+		return;
+	}
+	
+	unsigned char key = chip8_view_keypadKey(character);
+	if (key != 0) {
+		[self key:key down:NO timestamp:[theEvent timestamp]];
 	}
 }
 
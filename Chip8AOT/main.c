@@ -0,0 +1,544 @@
+//
+//  main.c
+//  Chip8AOT
+//
+//  chip8-aotc: translates Chip8 ROMs into C ahead of time, for running with chip8_machine_setProgram() (see Chip8/Chip8AOT.h).
+//
+//  usage: chip8-aotc [-o FILE] [-q QUIRKS] ROM...
+//
+//  Every ROM becomes a chip8_aot_program called chip8_aot_<NAME> (NAME is the file name, upper cased), and the file ends
+//  with a NULL terminated list of all of them called chip8_aot_programs, for chip8_aot_find().
+//
+//  The code is translated for one quirks profile, the one chip8_machine_loadROM() would pick for the ROM unless -q says
+//  otherwise, and only runs on a machine with the same profile.
+//
+
+#include "Chip8.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define CHIP8_AOTC_MAX_BLOCK	32		// the longest block we'll write, in instructions (a block has to fit before the next timer tick)
+
+
+// How an instruction is translated.
+typedef enum chip8_aotc_kind {
+
+	KIND_INTERPRET,		// never translated (0NNN and anything we don't recognise). Tracing stops here
+	KIND_NATIVE,		// written out as C
+	KIND_HELPER,		// a call to the interpreter's handler, because it's bulky or touches state that is private to the core
+	KIND_DRAW,			// the same, for instructions that draw to the screen
+	KIND_BRANCH,		// written out as C, and ends the block
+
+} chip8_aotc_kind;
+
+// What we know about one ROM.
+typedef struct chip8_aotc_rom {
+
+	char			name[64];
+	unsigned char	memory[4096];
+	unsigned int	size;
+	chip8_quirks	quirks;
+	unsigned int	quirkFlags;			// the CHIP8_QUIRK_ flags in quirks
+
+	bool			reached[4096];		// tracing got to an instruction here
+	bool			entry[4096];		// control can arrive here from somewhere other than the instruction before
+	int				block[4096];		// the block starting here (-1 if none)
+	unsigned int	blockCount;
+
+} chip8_aotc_rom;
+
+
+
+// Tracing
+
+static unsigned short chip8_aotc_opcodeAt(const chip8_aotc_rom *rom, unsigned int address) {
+
+	return (unsigned short)((rom->memory[address & 0xFFF] << 8) | rom->memory[(address + 1) & 0xFFF]);
+}
+
+static chip8_aotc_kind chip8_aotc_classify(unsigned short opcode) {
+
+	switch (opcode >> 12) {
+		case 0x0:
+			if (opcode == 0x00E0) return KIND_DRAW;
+			if (opcode == 0x00EE) return KIND_BRANCH;
+			return KIND_INTERPRET;
+		case 0x1: case 0x2: case 0x3: case 0x4: case 0xB:
+			return KIND_BRANCH;
+		case 0x5: case 0x9:
+			return (opcode & 0xF) == 0 ? KIND_BRANCH : KIND_INTERPRET;
+		case 0x6: case 0x7: case 0xA:
+			return KIND_NATIVE;
+		case 0x8:
+			switch (opcode & 0xF) {
+				case 0x0: case 0x1: case 0x2: case 0x3: case 0x4: case 0x5: case 0x6: case 0x7: case 0xE:
+					return KIND_NATIVE;
+			}
+			return KIND_INTERPRET;
+		case 0xC:
+			return KIND_HELPER;		// CXNN needs the machine's random number generator
+		case 0xD:
+			return KIND_DRAW;
+		case 0xE:
+			return ((opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1) ? KIND_BRANCH : KIND_INTERPRET;
+		case 0xF:
+			switch (opcode & 0xFF) {
+				case 0x07: case 0x0A: case 0x15: case 0x18: case 0x1E: case 0x29: case 0x65:
+					return KIND_NATIVE;
+				case 0x33: case 0x55:
+					return KIND_HELPER;		// stores have to go through chip8_store(), in case they hit code
+			}
+			return KIND_INTERPRET;
+	}
+	return KIND_INTERPRET;
+}
+
+// Can we translate the instruction at this address? It has to be inside the ROM (anything else is RAM, and could be anything by the time it runs).
+static bool chip8_aotc_translatable(const chip8_aotc_rom *rom, unsigned int address) {
+
+	return (address & 1) == 0 && address >= 0x200 && address + 2 <= 0x200 + rom->size &&
+		   chip8_aotc_classify(chip8_aotc_opcodeAt(rom, address)) != KIND_INTERPRET;
+}
+
+typedef struct chip8_aotc_worklist {
+
+	unsigned short	address[4096];
+	unsigned int	count;
+
+} chip8_aotc_worklist;
+
+// Notes that control can get to `address`, and queues it up for tracing if it's new. `entry` says it can get there by a jump rather than by falling through.
+static void chip8_aotc_visit(chip8_aotc_rom *rom, chip8_aotc_worklist *work, unsigned int address, bool entry) {
+
+	if (address >= 4096) {
+		return;
+	}
+
+	if (entry) {
+		rom->entry[address] = true;
+	}
+	if (!rom->reached[address] && chip8_aotc_translatable(rom, address)) {
+		rom->reached[address] = true;
+		work->address[work->count++] = address;
+	}
+}
+
+// Follows every path through the code from 0x200 that doesn't depend on the machine's state.
+static void chip8_aotc_trace(chip8_aotc_rom *rom) {
+
+	static chip8_aotc_worklist work;
+	work.count = 0;
+
+	chip8_aotc_visit(rom, &work, 0x200, true);
+
+	while (work.count > 0) {
+		unsigned int pc = work.address[--work.count];
+		unsigned short opcode = chip8_aotc_opcodeAt(rom, pc);
+		unsigned short nnn = opcode & 0x0FFF;
+
+		switch (opcode >> 12) {
+			case 0x0:
+				if (opcode == 0x00E0) {
+					chip8_aotc_visit(rom, &work, pc + 2, false);
+				}
+				break;		// 00EE goes wherever the stack says
+			case 0x1:
+				chip8_aotc_visit(rom, &work, nnn, true);
+				break;
+			case 0x2:
+				chip8_aotc_visit(rom, &work, nnn, true);
+				chip8_aotc_visit(rom, &work, pc + 2, true);		// where the subroutine returns to
+				break;
+			case 0x3: case 0x4: case 0x5: case 0x9: case 0xE:
+				chip8_aotc_visit(rom, &work, pc + 2, true);
+				chip8_aotc_visit(rom, &work, pc + 4, true);
+				break;
+			case 0xB:
+				break;		// BNNN depends on V0
+			default:
+				chip8_aotc_visit(rom, &work, pc + 2, false);
+				break;
+		}
+	}
+}
+
+// Splits what tracing reached into blocks. A block starts wherever control can arrive other than by falling through,
+// and ends at a branch, just before the next block, or when it gets too long.
+static void chip8_aotc_findBlocks(chip8_aotc_rom *rom) {
+
+	unsigned int length = 0;
+	rom->blockCount = 0;
+
+	for (unsigned int address = 0; address < 4096; address++) {
+		rom->block[address] = -1;
+	}
+
+	for (unsigned int address = 0x200; address < 4096; address += 2) {
+		if (!rom->reached[address]) {
+			length = 0;
+			continue;
+		}
+
+		bool ended = (length == 0) || length == CHIP8_AOTC_MAX_BLOCK ||
+					 chip8_aotc_classify(chip8_aotc_opcodeAt(rom, address - 2)) == KIND_BRANCH;
+		if (ended || rom->entry[address]) {
+			rom->block[address] = (int)rom->blockCount++;
+			length = 0;
+		}
+		length++;
+	}
+}
+
+// The number of instructions in the block starting at address.
+static unsigned int chip8_aotc_blockLength(const chip8_aotc_rom *rom, unsigned int address) {
+
+	unsigned int length = 1;
+	while (chip8_aotc_classify(chip8_aotc_opcodeAt(rom, address)) != KIND_BRANCH && address + 2 < 4096 &&
+		   rom->reached[address + 2] && rom->block[address + 2] < 0) {
+		address += 2;
+		length++;
+	}
+	return length;
+}
+
+
+
+// Writing C
+
+// Continues at `target`: a goto if it's a block, otherwise back out to the engine.
+static void chip8_aotc_writeGoto(FILE *out, const chip8_aotc_rom *rom, unsigned int target) {
+
+	if (target < 4096 && rom->block[target] >= 0) {
+		fprintf(out, "goto at_%03X;", target);
+	}
+	else {
+		fprintf(out, "CHIP8_AOT_EXIT(0x%03X, 0)", target);
+	}
+}
+
+// Writes a skip: `condition` true skips the next instruction.
+static void chip8_aotc_writeSkip(FILE *out, const chip8_aotc_rom *rom, unsigned int pc, const char *condition) {
+
+	fprintf(out, "\tif (%s) { ", condition);
+	chip8_aotc_writeGoto(out, rom, pc + 4);
+	fprintf(out, " }\n\t");
+	chip8_aotc_writeGoto(out, rom, pc + 2);
+	fprintf(out, "\n");
+}
+
+static void chip8_aotc_writeInstruction(FILE *out, const chip8_aotc_rom *rom, unsigned int pc, unsigned int after) {
+
+	unsigned short opcode = chip8_aotc_opcodeAt(rom, pc);
+	unsigned int x = (opcode >> 8) & 0xF;
+	unsigned int y = (opcode >> 4) & 0xF;
+	unsigned int nn = opcode & 0xFF;
+	unsigned int nnn = opcode & 0xFFF;
+	unsigned int s = (rom->quirkFlags & CHIP8_QUIRK_SHIFT_VY) ? y : x;		// the register 8XY6 and 8XYE shift
+	const char *vfReset = (rom->quirkFlags & CHIP8_QUIRK_VF_RESET) ? "\tm->V[15] = 0;\n" : "";
+	char condition[64];
+
+	fprintf(out, "\t// %03X: %04X\n", pc, opcode);
+
+	switch (chip8_aotc_classify(opcode)) {
+		case KIND_HELPER:
+			fprintf(out, "\tCHIP8_AOT_HELPER(0x%03X, %u)\n", pc, after);
+			return;
+		case KIND_DRAW:
+			fprintf(out, "\tCHIP8_AOT_DRAW(0x%03X, %u)\n", pc, after);
+			return;
+		case KIND_INTERPRET:
+			return;
+		default:
+			break;
+	}
+
+	// the rest mirror the interpreter's handlers in Chip8.c, down to the order VF and VX are written in
+	switch (opcode >> 12) {
+		case 0x0:	// 00EE
+			fprintf(out, "\tif (m->sp == 0) CHIP8_AOT_EXIT(0x%03X, 1)\n", pc);
+			fprintf(out, "\tm->sp--;\n\tm->pc = m->stack[m->sp];\n\tgoto dispatch;\n");
+			break;
+		case 0x1:
+			fprintf(out, "\t");
+			chip8_aotc_writeGoto(out, rom, nnn);
+			fprintf(out, "\n");
+			break;
+		case 0x2:
+			fprintf(out, "\tif (m->sp + 1 > 15) CHIP8_AOT_EXIT(0x%03X, 1)\n", pc);
+			fprintf(out, "\tm->stack[m->sp] = 0x%03X;\n\tm->sp++;\n\t", pc + 2);
+			chip8_aotc_writeGoto(out, rom, nnn);
+			fprintf(out, "\n");
+			break;
+		case 0x3:
+			sprintf(condition, "m->V[%u] == 0x%02X", x, nn);
+			chip8_aotc_writeSkip(out, rom, pc, condition);
+			break;
+		case 0x4:
+			sprintf(condition, "m->V[%u] != 0x%02X", x, nn);
+			chip8_aotc_writeSkip(out, rom, pc, condition);
+			break;
+		case 0x5:
+			sprintf(condition, "m->V[%u] == m->V[%u]", x, y);
+			chip8_aotc_writeSkip(out, rom, pc, condition);
+			break;
+		case 0x6:
+			fprintf(out, "\tm->V[%u] = 0x%02X;\n", x, nn);
+			break;
+		case 0x7:
+			fprintf(out, "\tm->V[%u] += 0x%02X;\n", x, nn);
+			break;
+		case 0x8:
+			switch (opcode & 0xF) {
+				case 0x0: fprintf(out, "\tm->V[%u] = m->V[%u];\n", x, y); break;
+				case 0x1: fprintf(out, "\tm->V[%u] |= m->V[%u];\n%s", x, y, vfReset); break;
+				case 0x2: fprintf(out, "\tm->V[%u] &= m->V[%u];\n%s", x, y, vfReset); break;
+				case 0x3: fprintf(out, "\tm->V[%u] ^= m->V[%u];\n%s", x, y, vfReset); break;
+				case 0x4: fprintf(out, "\tm->V[15] = (m->V[%u] > (255 - m->V[%u])) ? 1 : 0;\n\tm->V[%u] += m->V[%u];\n", y, x, x, y); break;
+				case 0x5: fprintf(out, "\tm->V[15] = (m->V[%u] > m->V[%u]) ? 0 : 1;\n\tm->V[%u] -= m->V[%u];\n", y, x, x, y); break;
+				case 0x6: fprintf(out, "\tm->V[15] = m->V[%u] & 0x1;\n\tm->V[%u] = m->V[%u] >> 1;\n", s, x, s); break;
+				case 0x7: fprintf(out, "\tm->V[15] = (m->V[%u] > m->V[%u]) ? 0 : 1;\n\tm->V[%u] = m->V[%u] - m->V[%u];\n", x, y, x, y, x); break;
+				case 0xE: fprintf(out, "\tm->V[15] = m->V[%u] >> 7;\n\tm->V[%u] = m->V[%u] << 1;\n", s, x, s); break;
+			}
+			break;
+		case 0x9:
+			sprintf(condition, "m->V[%u] != m->V[%u]", x, y);
+			chip8_aotc_writeSkip(out, rom, pc, condition);
+			break;
+		case 0xA:
+			fprintf(out, "\tm->I = 0x%03X;\n", nnn);
+			break;
+		case 0xB:
+			fprintf(out, "\tm->pc = 0x%03X + m->V[%u];\n\tgoto dispatch;\n", nnn, (rom->quirkFlags & CHIP8_QUIRK_JUMP_VX) ? x : 0);
+			break;
+		case 0xE:
+			sprintf(condition, "((m->keys >> (m->V[%u] & 0xF)) & 1) %s 0", x, (nn == 0x9E) ? "!=" : "==");
+			chip8_aotc_writeSkip(out, rom, pc, condition);
+			break;
+		case 0xF:
+			switch (nn) {
+				case 0x07: fprintf(out, "\tm->V[%u] = m->delay_timer;\n", x); break;
+				case 0x0A:
+					// with no key down the instruction still takes its cycle, but pc stays put. The engine fast-forwards from there
+					fprintf(out, "\tif (m->keys == 0) CHIP8_AOT_EXIT(0x%03X, %u)\n", pc, after);
+					fprintf(out, "\tm->V[%u] = (unsigned char)(31 - __builtin_clz(m->keys));\n", x);
+					break;
+				case 0x15: fprintf(out, "\tm->delay_timer = m->V[%u];\n", x); break;
+				case 0x18: fprintf(out, "\tCHIP8_AOT_SOUND(%u, %u)\n", x, after); break;
+				case 0x1E: fprintf(out, "\tm->I += m->V[%u];\n", x); break;
+				case 0x29: fprintf(out, "\tm->I = m->V[%u] * 5;\n", x); break;
+				case 0x65:
+					for (unsigned int r = 0; r <= x; r++) {
+						fprintf(out, "\tm->V[%u] = m->memory[(m->I + %u) & 0xFFF];\n", r, r);
+					}
+					if (rom->quirkFlags & CHIP8_QUIRK_MEMORY_I) {
+						fprintf(out, "\tm->I += %u;\n", x + 1);
+					}
+					else if (rom->quirkFlags & CHIP8_QUIRK_MEMORY_I_SHORT) {
+						fprintf(out, "\tm->I += %u;\n", x);
+					}
+					break;
+			}
+			break;
+	}
+}
+
+static const char *chip8_aotc_quirksConstant(chip8_quirks quirks) {
+
+	switch (quirks) {
+		case CHIP8_QUIRKS_VIP:		return "CHIP8_QUIRKS_VIP";
+		case CHIP8_QUIRKS_CHIP48:	return "CHIP8_QUIRKS_CHIP48";
+		case CHIP8_QUIRKS_SCHIP:	return "CHIP8_QUIRKS_SCHIP";
+		default:					return "CHIP8_QUIRKS_CLASSIC";
+	}
+}
+
+static void chip8_aotc_write(FILE *out, const chip8_aotc_rom *rom) {
+
+	const char *name = rom->name;
+
+	fprintf(out, "\n\n// %s (%s quirks)\n\n", name, chip8_machine_quirksName(rom->quirks));
+
+	// the ROM itself, so the engine can tell whether the machine still holds the code that was translated
+	fprintf(out, "static const unsigned char chip8_aot_%s_rom[%u] = {", name, rom->size);
+	for (unsigned int i = 0; i < rom->size; i++) {
+		fprintf(out, "%s0x%02X,", (i % 16 == 0) ? "\n\t" : " ", rom->memory[0x200 + i]);
+	}
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "static const chip8_aot_block chip8_aot_%s_blocks[%u] = {", name, rom->blockCount);
+	unsigned int written = 0;
+	for (unsigned int address = 0x200; address < 4096; address += 2) {
+		if (rom->block[address] >= 0) {
+			fprintf(out, "%s{ 0x%03X, %u },", (written++ % 8 == 0) ? "\n\t" : " ", address, chip8_aotc_blockLength(rom, address));
+		}
+	}
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "static unsigned long chip8_aot_%s_run(chip8_aot_context *c, unsigned long budget) {\n\n", name);
+	fprintf(out, "\tchip8_machine *m = c->machine;\n");
+	fprintf(out, "\tunsigned long left = budget;\n\n");
+
+	fprintf(out, "dispatch: __attribute__((unused));\n\tswitch (m->pc) {\n");
+	for (unsigned int address = 0x200; address < 4096; address += 2) {
+		if (rom->block[address] >= 0) {
+			fprintf(out, "\t\tcase 0x%03X: goto at_%03X;\n", address, address);
+		}
+	}
+	fprintf(out, "\t}\n\treturn budget - left;\n");
+
+	for (unsigned int address = 0x200; address < 4096; address += 2) {
+		if (rom->block[address] < 0) {
+			continue;
+		}
+
+		unsigned int length = chip8_aotc_blockLength(rom, address);
+		fprintf(out, "\nat_%03X:\n", address);
+		fprintf(out, "\tCHIP8_AOT_ENTER(%d, 0x%03X, %u)\n", rom->block[address], address, length);
+
+		unsigned int pc = address;
+		for (unsigned int i = 0; i < length; i++, pc += 2) {
+			chip8_aotc_writeInstruction(out, rom, pc, length - i - 1);
+		}
+
+		// the block ran into another one (or got too long), carry on into it
+		if (chip8_aotc_classify(chip8_aotc_opcodeAt(rom, pc - 2)) != KIND_BRANCH) {
+			fprintf(out, "\t");
+			chip8_aotc_writeGoto(out, rom, pc);
+			fprintf(out, "\n");
+		}
+	}
+	fprintf(out, "}\n\n");
+
+	fprintf(out, "const chip8_aot_program chip8_aot_%s = {\n", name);
+	fprintf(out, "\t\"%s\", chip8_aot_%s_rom, %u, chip8_aot_%s_blocks, %u, %s, chip8_aot_%s_run\n",
+			name, name, rom->size, name, rom->blockCount, chip8_aotc_quirksConstant(rom->quirks), name);
+	fprintf(out, "};\n");
+}
+
+
+
+// Main
+
+static bool chip8_aotc_load(chip8_aotc_rom *rom, const char *path, int quirks) {
+
+	memset(rom, 0, sizeof(*rom));
+
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		return false;
+	}
+	rom->size = (unsigned int)fread(&rom->memory[0x200], 1, 4096 - 0x200, file);
+	bool failed = ferror(file);
+	fclose(file);
+	if (failed || rom->size == 0) {
+		return false;
+	}
+
+	rom->quirks = (quirks >= 0) ? (chip8_quirks)quirks : chip8_machine_quirksForROM(&rom->memory[0x200], rom->size);
+	rom->quirkFlags = chip8_machine_quirkFlags(rom->quirks);
+
+	// the name is the file name without its directory or extension, as a C identifier
+	const char *base = strrchr(path, '/');
+	base = (base != NULL) ? base + 1 : path;
+	size_t length = 0;
+	if (isdigit((unsigned char)base[0])) {
+		rom->name[length++] = '_';
+	}
+	for (const char *c = base; *c != '\0' && *c != '.' && length < sizeof(rom->name) - 1; c++) {
+		rom->name[length++] = isalnum((unsigned char)*c) ? (char)toupper((unsigned char)*c) : '_';
+	}
+	rom->name[length] = '\0';
+	return length > 0;
+}
+
+int main(int argc, char **argv) {
+
+	const char *outPath = NULL;
+	int quirks = -1;
+
+	int option;
+	while ((option = getopt(argc, argv, "o:q:h")) != -1) {
+		switch (option) {
+			case 'o':
+				outPath = optarg;
+				break;
+			case 'q':
+				for (quirks = CHIP8_QUIRKS_COUNT - 1; quirks >= 0; quirks--) {
+					if (strcmp(optarg, chip8_machine_quirksName((chip8_quirks)quirks)) == 0) {
+						break;
+					}
+				}
+				if (quirks < 0) {
+					fprintf(stderr, "Unknown quirks %s\n", optarg);
+					return 2;
+				}
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-o FILE] [-q QUIRKS] ROM...\n", argv[0]);
+				return 2;
+		}
+	}
+	if (optind == argc) {
+		fprintf(stderr, "usage: %s [-o FILE] [-q QUIRKS] ROM...\n", argv[0]);
+		return 2;
+	}
+
+	FILE *out = (outPath != NULL) ? fopen(outPath, "w") : stdout;
+	if (out == NULL) {
+		fprintf(stderr, "Can't write %s\n", outPath);
+		return 1;
+	}
+
+	fprintf(out, "// Translated from Chip8 ROMs by chip8-aotc. Don't edit, translate the ROMs again instead.\n\n");
+	fprintf(out, "#include \"Chip8AOT.h\"\n");
+
+	int romCount = argc - optind;
+	char (*names)[64] = calloc(romCount, sizeof(*names));
+	chip8_aotc_rom *rom = malloc(sizeof(chip8_aotc_rom));
+	int status = 0;
+
+	for (int i = 0; i < romCount; i++) {
+		const char *path = argv[optind + i];
+		if (!chip8_aotc_load(rom, path, quirks)) {
+			fprintf(stderr, "Can't read %s\n", path);
+			status = 1;
+			break;
+		}
+		for (int j = 0; j < i; j++) {
+			if (strcmp(names[j], rom->name) == 0) {
+				fprintf(stderr, "Two ROMs are called %s\n", rom->name);
+				status = 1;
+			}
+		}
+		if (status != 0) {
+			break;
+		}
+		strcpy(names[i], rom->name);
+
+		chip8_aotc_trace(rom);
+		chip8_aotc_findBlocks(rom);
+		chip8_aotc_write(out, rom);
+	}
+
+	if (status == 0) {
+		fprintf(out, "\n\nconst chip8_aot_program * const chip8_aot_programs[] = {\n");
+		for (int i = 0; i < romCount; i++) {
+			fprintf(out, "\t&chip8_aot_%s,\n", names[i]);
+		}
+		fprintf(out, "\tNULL\n};\n");
+	}
+
+	free(rom);
+	free(names);
+	if (out != stdout && fclose(out) != 0) {
+		fprintf(stderr, "Can't write %s\n", outPath);
+		status = 1;
+	}
+	return status;
+}
@@ -0,0 +1,1528 @@
+//
+//  main.c
+//  Chip8CLI
+//
+//  Runs Chip8 ROMs without a window, so the core can be benchmarked and checked on any machine with a C compiler.
+//
+
+#include <dirent.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Chip8.h"
+#include "Chip8AOT.h"
+#include "Chip8Audio.h"
+#include "Chip8Env.h"
+#include "Chip8Frames.h"
+#include "Chip8Input.h"
+#include "Chip8JIT.h"
+#include "Chip8Lockstep.h"
+#include "Chip8Pacer.h"
+#include "Chip8Profile.h"
+#include "Chip8Raster.h"
+#include "Chip8Recording.h"
+#include "Chip8Rewind.h"
+#include "Chip8Snapshot.h"
+
+
+#define CHIP8_CLI_FRAMES			600		// how long to run for when we aren't told (ten seconds of game time)
+#define CHIP8_CLI_BENCH_FRAMES		360000	// per ROM and engine in benchmark mode (an hour and forty minutes of game time)
+#define CHIP8_CLI_BENCH_MONKEY		4		// benchmark mode presses a random key every this many frames, so the games actually play
+#define CHIP8_CLI_BENCH_REPEAT		3		// ... and keeps the fastest of this many runs
+#define CHIP8_CLI_AUDIO_LATENCY		250		// milliseconds. We read the samples after every frame, so nothing gets dropped
+#define CHIP8_CLI_ENV_EPISODE		300		// frames in an episode with -E (five seconds of game time)
+#define CHIP8_CLI_CHECK_FRAMES		3600	// per ROM, quirks profile and engine in check mode (a minute of game time)
+#define CHIP8_CLI_REWIND_STEP_BACK	1000	// -R steps back over half the frames held every this many frames
+
+
+// A key press or release from the -k script, which happens at the start of a frame.
+typedef struct chip8_cli_key {
+
+	unsigned long long	frame;
+	unsigned char		k;
+	bool				down;
+
+} chip8_cli_key;
+
+typedef struct chip8_cli_options {
+
+	unsigned long long	cycles;			// stop after this many instructions (0 for no limit)
+	unsigned long long	frames;			// stop after this many frames (0 for no limit)
+	chip8_engine		engine;
+	unsigned int		clockRate;
+	unsigned int		seed;
+	int					quirks;			// a chip8_quirks, or -1 for the one chip8_machine_loadROM() picks
+
+	chip8_cli_key		*keys;			// the input script, in frame order
+	size_t				keyCount;
+	unsigned int		monkey;			// press a random key every this many frames (0 for never)
+
+	const char			*recordPath;	// save the session to this recording
+	const char			*replayPath;	// play this recording back instead of running the script
+	const char			*benchPath;		// benchmark every ROM in this directory
+	const char			*checkPath;		// check every engine against the interpreter on every ROM in this directory
+	const char			*wavPath;		// write the sound to this WAV file
+	const char			*imagePath;		// save the screen at the end to this PNG or PPM
+
+	size_t				lanes;			// compare this many machines with the same number of lanes in lockstep (0 not to)
+	size_t				envs;			// play this many environments of a chip8_env with random actions (0 not to)
+	size_t				rewindBudget;	// check a chip8_rewind of this many bytes against snapshots of every frame (0 not to)
+
+	unsigned int		profilePeriod;	// profile the run, sampling every this many instructions (0 for no profile)
+	const char			*stacksPath;	// write the profile's call stacks here, for a flame graph
+
+	int					repeat;
+	bool				json;
+	bool				showScreen;
+	bool				realTime;		// run at real speed on a chip8_pacer, like the app does
+	bool				turbo;			// ... in turbo mode
+
+} chip8_cli_options;
+
+typedef struct chip8_cli_result {
+
+	unsigned long long	cycles;
+	unsigned long long	idleCycles;
+	unsigned long long	fusedCycles;
+	unsigned long long	frames;
+	double				seconds;
+	uint64_t			screenHash;
+	chip8_quirks		quirks;
+
+	bool				paced;			// ran on a chip8_pacer, which measured this
+	chip8_pacer_stats	pacing;
+	chip8_input_stats	input;			// ... and had its keys sent from another thread, if it wasn't in turbo mode
+	chip8_frames_stats	presentation;	// ... and handed its frames to this thread, which presented them
+	bool				framesMatch;	// ... and the last frame handed over was the machine's screen at the end
+
+} chip8_cli_result;
+
+// Where a run has got to, so it can be fed its keys a frame at a time.
+typedef struct chip8_cli_session {
+
+	chip8_machine			*machine;
+	const chip8_cli_options	*options;
+	unsigned long long		startCycles;
+	unsigned long long		frames;
+	unsigned int			monkeyState;
+	size_t					nextKey;
+	chip8_pacer				*pacer;			// running the session, if it's running in real time
+	chip8_input				*input;			// the keys come from here rather than straight from the script, if it's set
+	chip8_audio				*audio;			// making the sound, if we're keeping it
+	chip8_wav				*wav;			// ... and where it goes
+	chip8_frames			*buffers;		// where its frames are handed over to be presented, if it's running on a pacer
+	bool					finished;		// for the thread waiting on the pacer (see chip8_cli_checkFinished())
+
+} chip8_cli_session;
+
+static const char *chip8_cli_engineNames[] = { "interpreter", "jit", "validate", "aot" };
+
+// Built with make aot, the ROMs chip8-aotc translated are linked in as well.
+#ifndef CHIP8_CLI_AOT
+	#define CHIP8_CLI_AOT	0
+#endif
+#if CHIP8_CLI_AOT
+extern const chip8_aot_program * const chip8_aot_programs[];
+#endif
+
+
+
+// Helpers
+
+// chip8_now() in seconds.
+static double chip8_cli_now() {
+
+	return chip8_now() / 1e9;
+}
+
+// A 64-bit FNV-1a hash of the screen, leftmost pixels first, so it comes out the same on every platform.
+static uint64_t chip8_cli_screenHash(const chip8_machine *m) {
+
+	uint64_t hash = 14695981039346656037ull;
+	for (int row = 0; row < 32; row++) {
+		for (int shift = 56; shift >= 0; shift -= 8) {
+			hash = (hash ^ ((m->gfx[row] >> shift) & 0xFF)) * 1099511628211ull;
+		}
+	}
+	return hash;
+}
+
+static void chip8_cli_printScreen(const chip8_machine *m) {
+
+	for (int row = 0; row < 32; row++) {
+		char line[65];
+		for (int col = 0; col < 64; col++) {
+			line[col] = chip8_machine_pixel(m, col, row) ? '#' : '.';
+		}
+		line[64] = '\0';
+		printf("%s\n", line);
+	}
+}
+
+static bool chip8_cli_saveScreen(const chip8_machine *m, const char *path) {
+
+	if (!chip8_raster_saveScreen(m->gfx, 0, path)) {
+		fprintf(stderr, "Can't write %s\n", path);
+		return false;
+	}
+	return true;
+}
+
+static bool chip8_cli_parseQuirks(const char *name, int *quirks) {
+
+	for (int i = 0; i < CHIP8_QUIRKS_COUNT; i++) {
+		if (strcmp(name, chip8_machine_quirksName((chip8_quirks)i)) == 0) {
+			*quirks = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool chip8_cli_parseEngine(const char *name, chip8_engine *engine) {
+
+	for (int i = 0; i <= CHIP8_ENGINE_AOT; i++) {
+		if (strcmp(name, chip8_cli_engineNames[i]) == 0) {
+			*engine = (chip8_engine)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Parses a script like "60:+5,75:-5" (press 5 at frame 60, let go at frame 75). Events have to be in frame order.
+static bool chip8_cli_parseScript(const char *script, chip8_cli_options *o) {
+
+	size_t capacity = 1;
+	for (const char *c = script; *c != '\0'; c++) {
+		capacity += (*c == ',');
+	}
+	o->keys = calloc(capacity, sizeof(chip8_cli_key));
+	o->keyCount = 0;
+
+	const char *c = script;
+	while (*c != '\0') {
+		char *end;
+		unsigned long long frame = strtoull(c, &end, 10);
+		if (end == c || end[0] != ':' || (end[1] != '+' && end[1] != '-') || end[2] == '\0') {
+			return false;
+		}
+
+		unsigned char k = (unsigned char)end[2];
+		if (k >= 'a' && k <= 'f') {
+			k -= 'a' - 'A';
+		}
+		if (!((k >= '0' && k <= '9') || (k >= 'A' && k <= 'F'))) {
+			return false;
+		}
+		if (o->keyCount > 0 && frame < o->keys[o->keyCount - 1].frame) {
+			return false;
+		}
+
+		o->keys[o->keyCount++] = (chip8_cli_key){ frame, k, end[1] == '+' };
+
+		c = end + 3;
+		if (*c == ',') {
+			c++;
+		}
+		else if (*c != '\0') {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+
+// Running
+
+// Puts the machine on the engine in the options, or says why it can't.
+static bool chip8_cli_setEngine(chip8_machine *m, const char *romPath, const chip8_cli_options *o) {
+
+	bool available;
+	if (o->engine == CHIP8_ENGINE_AOT) {
+#if CHIP8_CLI_AOT
+		const chip8_aot_program *program = chip8_aot_find(chip8_aot_programs, m);
+		available = (program != NULL) && chip8_machine_setProgram(m, program);
+#else
+		available = false;
+#endif
+	}
+	else {
+		available = chip8_machine_setEngine(m, o->engine);
+	}
+	if (!available) {
+		fprintf(stderr, "The %s engine isn't available here for %s\n", chip8_cli_engineNames[o->engine], romPath);
+	}
+	return available;
+}
+
+static chip8_machine *chip8_cli_load(const char *romPath, const chip8_cli_options *o) {
+
+	chip8_machine *m = chip8_machine_create();
+	if (m == NULL || !chip8_machine_loadROM(m, romPath)) {
+		chip8_machine_destroy(m);
+		return NULL;
+	}
+
+	// before picking the engine, because a program translated ahead of time only runs with the quirks it was translated for
+	if (o->quirks >= 0) {
+		chip8_machine_setQuirks(m, (chip8_quirks)o->quirks);
+	}
+
+	if (!chip8_cli_setEngine(m, romPath, o)) {
+		chip8_machine_destroy(m);
+		return NULL;
+	}
+	chip8_machine_setClockRate(m, o->clockRate);
+	chip8_machine_seed(m, o->seed);
+	return m;
+}
+
+static chip8_cli_session chip8_cli_beginSession(chip8_machine *m, const chip8_cli_options *o) {
+
+	return (chip8_cli_session){
+		.machine		= m,
+		.options		= o,
+		.startCycles	= m->cycles,
+		.monkeyState	= o->seed,
+	};
+}
+
+static bool chip8_cli_finished(const chip8_cli_session *s) {
+
+	const chip8_cli_options *o = s->options;
+	unsigned long long ran = s->machine->cycles - s->startCycles;
+	return (o->cycles != 0 && ran >= o->cycles) || (o->frames != 0 && s->frames >= o->frames);
+}
+
+typedef void (*chip8_cli_press)(void *context, unsigned char k, bool down);
+
+// Calls press() for each of the scripted and random key presses at the start of the session's frame.
+static void chip8_cli_frameKeys(chip8_cli_session *s, chip8_cli_press press, void *context) {
+
+	const chip8_cli_options *o = s->options;
+
+	while (s->nextKey < o->keyCount && o->keys[s->nextKey].frame <= s->frames) {
+		const chip8_cli_key *key = &o->keys[s->nextKey++];
+		press(context, key->k, key->down);
+	}
+
+	if (o->monkey != 0 && s->frames % o->monkey == 0) {
+		s->monkeyState = s->monkeyState * 1664525u + 1013904223u;
+		unsigned char k = "0123456789ABCDEF"[(s->monkeyState >> 8) & 0xF];
+		press(context, k, (s->monkeyState & 0x10000) != 0);
+	}
+}
+
+static void chip8_cli_pressMachine(void *context, unsigned char k, bool down) {
+
+	if (down) {
+		chip8_machine_keydown(context, k);
+	}
+	else {
+		chip8_machine_keyup(context, k);
+	}
+}
+
+// Feeds in the key presses for the start of the frame, and runs it.
+static void chip8_cli_runFrame(chip8_cli_session *s) {
+
+	chip8_machine *m = s->machine;
+	const chip8_cli_options *o = s->options;
+
+	if (s->input != NULL) {
+		chip8_input_apply(s->input, m);
+	}
+	else {
+		chip8_cli_frameKeys(s, chip8_cli_pressMachine, m);
+	}
+
+	unsigned long long ran = m->cycles - s->startCycles;
+	unsigned long budget = ULONG_MAX;
+	if (o->cycles != 0 && o->cycles - ran < ULONG_MAX) {
+		budget = (unsigned long)(o->cycles - ran);
+	}
+	if (chip8_machine_runUntil(m, budget, CHIP8_RUN_UNTIL_FRAME, NULL) == CHIP8_STOP_FRAME) {
+		s->frames++;
+	}
+
+	if (s->audio != NULL) {
+		chip8_audio_update(s->audio, m);
+		chip8_audio_readToWAV(s->audio, s->wav);
+	}
+}
+
+static void chip8_cli_finishResult(chip8_cli_result *result, const chip8_cli_session *s, unsigned long long startIdle, unsigned long long startFused) {
+
+	chip8_machine *m = s->machine;
+	result->frames = s->frames;
+	result->cycles = m->cycles - s->startCycles;
+	result->idleCycles = m->idleCycles - startIdle;
+	result->fusedCycles = m->fusedCycles - startFused;
+	result->screenHash = chip8_cli_screenHash(m);
+	result->quirks = (chip8_quirks)m->quirks;
+}
+
+// Runs a frame at a time (like a frontend would), as fast as possible.
+static chip8_cli_result chip8_cli_run(chip8_machine *m, const chip8_cli_options *o, chip8_audio *audio, chip8_wav *wav) {
+
+	chip8_cli_result result = { 0 };
+	unsigned long long startIdle = m->idleCycles;
+	unsigned long long startFused = m->fusedCycles;
+	chip8_cli_session session = chip8_cli_beginSession(m, o);
+	session.audio = audio;
+	session.wav = wav;
+
+	double start = chip8_cli_now();
+	while (!chip8_cli_finished(&session)) {
+		chip8_cli_runFrame(&session);
+	}
+	result.seconds = chip8_cli_now() - start;
+
+	chip8_cli_finishResult(&result, &session, startIdle, startFused);
+	return result;
+}
+
+static void chip8_cli_pacedFrame(void *context, chip8_machine *machine) {
+
+	(void)machine;		// the session's
+	chip8_cli_session *session = context;
+	chip8_cli_runFrame(session);
+
+	// stop before the next frame, so there's nothing extra in the timings
+	if (chip8_cli_finished(session)) {
+		chip8_pacer_pause(session->pacer);
+	}
+}
+
+// Publishes the frames the pacer presents, like the app does, and the last one, so the end of the run can be checked.
+static void chip8_cli_pacedFrameDone(void *context, chip8_machine *machine, bool present) {
+
+	chip8_cli_session *session = context;
+	if (present || chip8_cli_finished(session)) {
+		chip8_frames_publish(session->buffers, machine);
+	}
+}
+
+// Presents the latest frame published, the way a render thread would. The CLI has no screen to draw it on, so that's all.
+static void chip8_cli_present(chip8_frames *frames) {
+
+	chip8_frames_presented(frames, chip8_frames_acquire(frames));
+}
+
+// Run on the pacer's thread, which the session belongs to while it's running.
+static void chip8_cli_checkFinished(void *context, chip8_machine *machine) {
+
+	(void)machine;
+	chip8_cli_session *session = context;
+	session->finished = chip8_cli_finished(session);
+}
+
+static void chip8_cli_pressInput(void *context, unsigned char k, bool down) {
+
+	chip8_input_push(context, k, down, chip8_now());
+}
+
+// Pushes the key presses for every frame that's due by now, `elapsed` seconds after the pacer started.
+static void chip8_cli_feedInput(chip8_cli_session *feeder, chip8_input *input, double elapsed) {
+
+	while (feeder->frames <= elapsed * 60) {
+		chip8_cli_frameKeys(feeder, chip8_cli_pressInput, input);
+		feeder->frames++;
+	}
+}
+
+// Runs at real speed on a pacer, the way the app does, to see how well it keeps time. Outside turbo mode the keys come from
+// this thread, at the time their frame is due, the way a player's would, so we can see how long they take to reach the machine.
+// That means a key can land a frame later than the script says. The frames come back to this thread too, through a
+// chip8_frames, as they would to the app's renderer.
+static chip8_cli_result chip8_cli_runPaced(chip8_machine *m, const chip8_cli_options *o, chip8_audio *audio, chip8_wav *wav) {
+
+	chip8_cli_result result = { 0 };
+	unsigned long long startIdle = m->idleCycles;
+	unsigned long long startFused = m->fusedCycles;
+	chip8_cli_session session = chip8_cli_beginSession(m, o);
+	session.audio = audio;
+	session.wav = wav;
+
+	chip8_frames *frames = chip8_frames_create();
+	if (frames == NULL) {
+		fprintf(stderr, "Can't make the frame buffers\n");
+		exit(1);
+	}
+	session.buffers = frames;
+
+	chip8_pacer_callbacks callbacks = { chip8_cli_pacedFrame, chip8_cli_pacedFrameDone };
+	chip8_pacer *pacer = chip8_pacer_create(m, &callbacks, &session);
+	if (pacer == NULL) {
+		fprintf(stderr, "Can't start the pacer\n");
+		exit(1);
+	}
+	chip8_pacer_setTurbo(pacer, o->turbo);
+	session.pacer = pacer;
+
+	chip8_input *input = NULL;
+	chip8_cli_session feeder = { .options = o, .monkeyState = o->seed };
+	if (!o->turbo) {
+		input = chip8_input_create();
+		if (input == NULL) {
+			fprintf(stderr, "Can't make the input queue\n");
+			exit(1);
+		}
+		session.input = input;
+	}
+
+	double start = chip8_cli_now();
+	if (input != NULL) {
+		chip8_cli_feedInput(&feeder, input, 0);
+	}
+	chip8_pacer_resume(pacer);
+	for (;;) {
+		if (input != NULL) {
+			chip8_cli_feedInput(&feeder, input, chip8_cli_now() - start);
+		}
+		chip8_cli_present(frames);
+		chip8_pacer_perform(pacer, chip8_cli_checkFinished, &session, true);
+		if (session.finished) {
+			break;
+		}
+		usleep(1000);
+	}
+	chip8_pacer_pause(pacer);
+	result.seconds = chip8_cli_now() - start;
+
+	// every frame published was either presented or skipped for a newer one, and the last is the screen the run ended on
+	chip8_cli_present(frames);
+	const chip8_frame *last = chip8_frames_acquire(frames);
+	result.presentation = chip8_frames_getStats(frames);
+	result.framesMatch = last != NULL && last->cycles == m->cycles && memcmp(last->gfx, m->gfx, sizeof(last->gfx)) == 0 &&
+						 result.presentation.presented + result.presentation.skipped == result.presentation.published;
+
+	result.paced = true;
+	result.pacing = chip8_pacer_getStats(pacer);
+	chip8_pacer_destroy(pacer);
+	if (input != NULL) {
+		result.input = chip8_input_getStats(input);		// the machine is ours again, so this is the emulation thread now
+		chip8_input_destroy(input);
+	}
+	chip8_frames_destroy(frames);
+
+	chip8_cli_finishResult(&result, &session, startIdle, startFused);
+	return result;
+}
+
+static void chip8_cli_report(const char *rom, const chip8_cli_options *o, const chip8_cli_result *r) {
+
+	double seconds = (r->seconds > 0) ? r->seconds : 1e-9;
+	double ips = r->cycles / seconds;
+	double fps = r->frames / seconds;
+
+	const chip8_pacer_stats *p = &r->pacing;
+	const chip8_frames_stats *f = &r->presentation;
+
+	if (o->json) {
+		printf("{\"rom\":\"%s\",\"engine\":\"%s\",\"dispatch\":\"%s\",\"quirks\":\"%s\",\"clock_rate\":%u,\"cycles\":%llu,\"idle_cycles\":%llu,\"fused_cycles\":%llu,"
+			   "\"frames\":%llu,\"seconds\":%.6f,\"ips\":%.0f,\"fps\":%.0f,\"screen_hash\":\"%016llx\"",
+			   rom, chip8_cli_engineNames[o->engine], chip8_machine_dispatchName(), chip8_machine_quirksName(r->quirks), o->clockRate, r->cycles, r->idleCycles, r->fusedCycles, r->frames,
+			   r->seconds, ips, fps, (unsigned long long)r->screenHash);
+		if (r->paced) {
+			printf(",\"turbo\":%s,\"target_ips\":%u,\"measured_ips\":%.0f,\"measured_fps\":%.2f,\"presented\":%llu,\"dropped\":%llu,"
+				   "\"jitter_mean_us\":%.1f,\"jitter_stddev_us\":%.1f,\"jitter_max_us\":%.1f",
+				   o->turbo ? "true" : "false", p->targetRate, p->measuredRate, p->measuredFPS, p->presented, p->dropped,
+				   p->jitterMean / 1e3, p->jitterStdDev / 1e3, p->jitterMax / 1e3);
+			printf(",\"frames_published\":%llu,\"frames_presented\":%llu,\"frames_skipped\":%llu,\"present_latency_mean_us\":%.1f,\"present_latency_max_us\":%.1f,\"frames_match\":%s",
+				   f->published, f->presented, f->skipped, chip8_latency_mean(&f->latency) / 1e3, f->latency.max / 1e3,
+				   r->framesMatch ? "true" : "false");
+		}
+		if (r->input.applied > 0) {
+			printf(",\"keys_applied\":%llu,\"keys_deferred\":%llu,\"key_latency_mean_us\":%.1f,\"key_latency_max_us\":%.1f",
+				   r->input.applied, r->input.deferred, chip8_latency_mean(&r->input.latency) / 1e3, r->input.latency.max / 1e3);
+		}
+		printf("}\n");
+	}
+	else {
+		printf("ROM:     %s\n", rom);
+		printf("Engine:  %s\n", chip8_cli_engineNames[o->engine]);
+		printf("Quirks:  %s\n", chip8_machine_quirksName(r->quirks));
+		printf("Cycles:  %llu (%llu skipped as idle, %llu run as superinstructions)\n", r->cycles, r->idleCycles, r->fusedCycles);
+		printf("Frames:  %llu\n", r->frames);
+		printf("Time:    %.6fs\n", r->seconds);
+		printf("Speed:   %.1f MIPS, %.0f frames/s (%.0fx real time)\n", ips / 1e6, fps, fps / 60.0);
+		printf("Screen:  %016llx\n", (unsigned long long)r->screenHash);
+		if (r->paced) {
+			printf("Pacing:  %.0f instructions/s for %u (%.1f%%), %.2f frames/s, %llu presented, %llu dropped%s\n",
+				   p->measuredRate, p->targetRate, p->targetRate ? p->measuredRate * 100.0 / p->targetRate : 0.0, p->measuredFPS,
+				   p->presented, p->dropped, o->turbo ? " (turbo)" : "");
+			if (p->jitterSamples > 0) {
+				printf("Jitter:  %.1fus mean, %.1fus standard deviation, %.1fus worst\n", p->jitterMean / 1e3, p->jitterStdDev / 1e3, p->jitterMax / 1e3);
+			}
+			printf("Present: %llu frames published, %llu presented, %llu skipped. They took %.2fms to present on average (%.2fms worst)%s\n",
+				   f->published, f->presented, f->skipped, chip8_latency_mean(&f->latency) / 1e6, f->latency.max / 1e6,
+				   r->framesMatch ? "" : ", and the last one wasn't the screen the run ended on");
+		}
+		if (r->input.applied > 0) {
+			printf("Keys:    %llu pressed or released, %llu held over a frame. They reached the machine %.2fms after they were sent on average (%.2fms worst)\n",
+				   r->input.applied, r->input.deferred, chip8_latency_mean(&r->input.latency) / 1e6, r->input.latency.max / 1e6);
+		}
+	}
+}
+
+static int chip8_cli_runROM(const char *romPath, const chip8_cli_options *o) {
+
+	chip8_machine *m = chip8_cli_load(romPath, o);
+	if (m == NULL) {
+		return 1;
+	}
+
+	chip8_recording *recording = NULL;
+	if (o->recordPath != NULL) {
+		recording = chip8_recording_create();
+		chip8_recording_begin(recording, m);
+	}
+
+	chip8_profile *profile = NULL;
+	if (o->profilePeriod != 0) {
+		profile = chip8_profile_create(o->profilePeriod);
+		if (!chip8_profile_attach(profile, m)) {
+			chip8_profile_destroy(profile);
+			chip8_recording_destroy(recording);
+			chip8_machine_destroy(m);
+			return 1;
+		}
+	}
+
+	chip8_audio *audio = NULL;
+	chip8_wav *wav = NULL;
+	if (o->wavPath != NULL) {
+		audio = chip8_audio_create(0, CHIP8_CLI_AUDIO_LATENCY);
+		wav = chip8_wav_open(o->wavPath, chip8_audio_sampleRate(audio));
+		if (wav == NULL) {
+			fprintf(stderr, "Can't write %s\n", o->wavPath);
+			chip8_audio_destroy(audio);
+			chip8_profile_destroy(profile);
+			chip8_recording_destroy(recording);
+			chip8_machine_destroy(m);
+			return 1;
+		}
+		chip8_audio_attach(audio, m);
+		chip8_audio_update(audio, m);
+	}
+
+	chip8_cli_result result = o->realTime ? chip8_cli_runPaced(m, o, audio, wav) : chip8_cli_run(m, o, audio, wav);
+	chip8_cli_report(romPath, o, &result);
+	if (o->showScreen) {
+		chip8_cli_printScreen(m);
+	}
+
+	bool saved = true;
+	if (o->imagePath != NULL) {
+		saved &= chip8_cli_saveScreen(m, o->imagePath);
+	}
+	if (audio != NULL) {
+		chip8_audio_stats stats = chip8_audio_getStats(audio);
+		chip8_audio_attach(NULL, m);
+		saved &= chip8_wav_close(wav);
+		if (!o->json) {
+			printf("Sound:   %.2fs written to %s (the buzzer went on or off %llu times)\n",
+				   (double)stats.read / chip8_audio_sampleRate(audio), o->wavPath, stats.edges);
+		}
+		chip8_audio_destroy(audio);
+	}
+
+	if (recording != NULL) {
+		chip8_recording_end(recording, m);
+		saved &= chip8_recording_save(recording, o->recordPath);
+		chip8_recording_destroy(recording);
+	}
+
+	if (profile != NULL) {
+		chip8_profile_attach(NULL, m);
+		printf("\n");
+		chip8_profile_printFlat(profile, stdout, 20);
+
+		if (o->stacksPath != NULL) {
+			FILE *file = fopen(o->stacksPath, "w");
+			if (file != NULL) {
+				chip8_profile_printStacks(profile, file);
+				saved &= (fclose(file) == 0);
+			}
+			else {
+				fprintf(stderr, "Can't write %s\n", o->stacksPath);
+				saved = false;
+			}
+		}
+		chip8_profile_destroy(profile);
+	}
+
+	chip8_machine_destroy(m);
+	return (saved && (!result.paced || result.framesMatch)) ? 0 : 1;
+}
+
+static int chip8_cli_replay(const char *romPath, const chip8_cli_options *o) {
+
+	chip8_recording *recording = chip8_recording_load(o->replayPath);
+	chip8_machine *m = (recording != NULL) ? chip8_cli_load(romPath, o) : NULL;
+	if (m == NULL) {
+		chip8_recording_destroy(recording);
+		return 1;
+	}
+
+	double start = chip8_cli_now();
+	bool replayed = chip8_recording_replay(recording, m);
+	double seconds = chip8_cli_now() - start;
+
+	if (replayed) {
+		// the recording sets its own clock rate, and the timers have counted down once a frame since then
+		chip8_cli_options replayOptions = *o;
+		replayOptions.clockRate = m->clockRate;
+		chip8_cli_result result = {
+			.cycles			= m->cycles,
+			.idleCycles		= m->idleCycles,
+			.fusedCycles	= m->fusedCycles,
+			.frames			= m->timerTicks,
+			.seconds		= seconds,
+			.screenHash		= chip8_cli_screenHash(m),
+			.quirks			= (chip8_quirks)m->quirks,
+		};
+		chip8_cli_report(romPath, &replayOptions, &result);
+		if (o->showScreen) {
+			chip8_cli_printScreen(m);
+		}
+		if (o->imagePath != NULL) {
+			replayed = chip8_cli_saveScreen(m, o->imagePath);
+		}
+	}
+
+	chip8_recording_destroy(recording);
+	chip8_machine_destroy(m);
+	return replayed ? 0 : 1;
+}
+
+
+
+// Benchmark
+
+static int chip8_cli_compareNames(const void *a, const void *b) {
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+// The paths of the files in the directory, sorted by name, or NULL if it can't be opened. Free each path, then the list.
+static void chip8_cli_freeROMs(char **roms, size_t count) {
+
+	for (size_t i = 0; i < count; i++) {
+		free(roms[i]);
+	}
+	free(roms);
+}
+
+static char **chip8_cli_listROMs(const char *directory, size_t *count) {
+
+	DIR *dir = opendir(directory);
+	if (dir == NULL) {
+		fprintf(stderr, "Can't open %s\n", directory);
+		return NULL;
+	}
+
+	char **roms = malloc(sizeof(char *));
+	size_t romCount = 0;
+	bool ok = (roms != NULL);
+	struct dirent *entry;
+	while (ok && (entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		size_t length = strlen(directory) + strlen(entry->d_name) + 2;
+		char *path = malloc(length);
+		if (path == NULL) {
+			ok = false;
+			break;
+		}
+		snprintf(path, length, "%s/%s", directory, entry->d_name);
+
+		struct stat info;
+		if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+			free(path);
+			continue;
+		}
+		char **grown = realloc(roms, (romCount + 1) * sizeof(char *));
+		if (grown == NULL) {
+			free(path);
+			ok = false;
+			break;
+		}
+		roms = grown;
+		roms[romCount++] = path;
+	}
+	closedir(dir);
+
+	if (!ok) {
+		fprintf(stderr, "Not enough memory to list %s\n", directory);
+		if (roms != NULL) {
+			chip8_cli_freeROMs(roms, romCount);
+		}
+		return NULL;
+	}
+	qsort(roms, romCount, sizeof(char *), chip8_cli_compareNames);
+
+	*count = romCount;
+	return roms;
+}
+
+// Runs every ROM in the directory on every engine, and prints one line of JSON for each.
+static int chip8_cli_bench(const chip8_cli_options *o) {
+
+	size_t romCount;
+	char **roms = chip8_cli_listROMs(o->benchPath, &romCount);
+	if (roms == NULL) {
+		return 1;
+	}
+
+	int status = 0;
+	for (size_t i = 0; i < romCount; i++) {
+		for (chip8_engine engine = CHIP8_ENGINE_INTERPRETER; engine <= CHIP8_ENGINE_AOT; engine++) {
+			if (engine == CHIP8_ENGINE_JIT_VALIDATE || (engine == CHIP8_ENGINE_AOT && !CHIP8_CLI_AOT)) {
+				continue;
+			}
+			chip8_cli_options runOptions = *o;
+			runOptions.engine = engine;
+			runOptions.json = true;
+
+			// every repeat does exactly the same thing, so keep the fastest
+			chip8_cli_result best = { 0 };
+			bool ran = false;
+			for (int repeat = 0; repeat < o->repeat; repeat++) {
+				chip8_machine *m = chip8_cli_load(roms[i], &runOptions);
+				if (m == NULL) {
+					break;
+				}
+				chip8_cli_result result = chip8_cli_run(m, &runOptions, NULL, NULL);
+				chip8_machine_destroy(m);
+
+				if (!ran || result.seconds < best.seconds) {
+					best = result;
+				}
+				ran = true;
+			}
+
+			if (ran) {
+				chip8_cli_report(roms[i], &runOptions, &best);
+			}
+			else if (engine == CHIP8_ENGINE_INTERPRETER) {
+				status = 1;		// the interpreter is always there, so the ROM itself is the problem
+			}
+		}
+		free(roms[i]);
+	}
+	free(roms);
+	return status;
+}
+
+
+
+// Lockstep
+// Runs the ROM on o->lanes machines one after another, then on as many lanes of a chip8_lockstep, to see how much faster
+// running them side by side is. Lane n gets the same keys and random numbers as machine n (the monkey and the seed are
+// offset by n, so they don't all play the same game), and has to end up exactly the same.
+
+typedef struct chip8_cli_lanePress {
+
+	chip8_lockstep	*lockstep;
+	size_t			lane;
+
+} chip8_cli_lanePress;
+
+static void chip8_cli_pressLane(void *context, unsigned char k, bool down) {
+
+	chip8_cli_lanePress *press = context;
+	int index = chip8_keyIndex(k);
+	uint16_t keys = chip8_lockstep_keys(press->lockstep, press->lane);
+	keys = down ? (keys | (1 << index)) : (keys & ~(1 << index));
+	chip8_lockstep_setKeys(press->lockstep, press->lane, keys);
+}
+
+// Everything a lane has, which is everything but the bookkeeping.
+static bool chip8_cli_sameMachine(const chip8_machine *a, const chip8_machine *b) {
+
+	return memcmp(a->memory, b->memory, sizeof(a->memory)) == 0 && memcmp(a->V, b->V, sizeof(a->V)) == 0 &&
+		   a->I == b->I && a->pc == b->pc && a->sp == b->sp && memcmp(a->stack, b->stack, sizeof(a->stack)) == 0 &&
+		   a->delay_timer == b->delay_timer && a->sound_timer == b->sound_timer && a->rngState == b->rngState &&
+		   memcmp(a->gfx, b->gfx, sizeof(a->gfx)) == 0 && a->keys == b->keys && a->cycles == b->cycles;
+}
+
+static int chip8_cli_runLockstep(const char *romPath, const chip8_cli_options *o) {
+
+	chip8_machine *prototype = chip8_cli_load(romPath, o);
+	if (prototype == NULL) {
+		return 1;
+	}
+	size_t lanes = o->lanes;
+	chip8_machine **machines = calloc(lanes, sizeof(chip8_machine *));
+	chip8_cli_session *sessions = calloc(lanes, sizeof(chip8_cli_session));
+	chip8_lockstep *lockstep = chip8_lockstep_create(prototype, lanes);
+	chip8_machine *check = chip8_machine_create();
+	if (machines == NULL || sessions == NULL || lockstep == NULL || check == NULL) {
+		fprintf(stderr, "Not enough memory for %zu lanes\n", lanes);
+		exit(1);
+	}
+
+	for (size_t lane = 0; lane < lanes; lane++) {
+		machines[lane] = chip8_machine_clone(prototype);
+		if (machines[lane] == NULL || !chip8_cli_setEngine(machines[lane], romPath, o)) {
+			exit(1);
+		}
+		chip8_machine_seed(machines[lane], o->seed + (unsigned int)lane);
+		chip8_lockstep_seed(lockstep, lane, o->seed + (unsigned int)lane);
+	}
+
+	// the machines, each one all the way through before the next, which is kindest to the cache
+	double start = chip8_cli_now();
+	for (size_t lane = 0; lane < lanes; lane++) {
+		chip8_cli_session *session = &sessions[lane];
+		*session = chip8_cli_beginSession(machines[lane], o);
+		session->monkeyState = o->seed + (unsigned int)lane;
+		while (session->frames < o->frames) {
+			chip8_cli_runFrame(session);
+		}
+	}
+	double scalarSeconds = chip8_cli_now() - start;
+
+	// the lanes, a frame at a time so the keys can go in between
+	for (size_t lane = 0; lane < lanes; lane++) {
+		sessions[lane] = (chip8_cli_session){ .options = o, .monkeyState = o->seed + (unsigned int)lane };
+	}
+	unsigned long long startCycles = chip8_lockstep_cycles(lockstep);
+	start = chip8_cli_now();
+	for (unsigned long long frame = 0; frame < o->frames; frame++) {
+		for (size_t lane = 0; lane < lanes; lane++) {
+			chip8_cli_lanePress press = { lockstep, lane };
+			chip8_cli_frameKeys(&sessions[lane], chip8_cli_pressLane, &press);
+			sessions[lane].frames++;
+		}
+		chip8_lockstep_runFrame(lockstep);
+	}
+	chip8_lockstep_catchUp(lockstep);
+	double lockstepSeconds = chip8_cli_now() - start;
+	unsigned long long cycles = chip8_lockstep_cycles(lockstep) - startCycles;
+
+	size_t mismatches = 0;
+	size_t firstMismatch = 0;
+	for (size_t lane = 0; lane < lanes; lane++) {
+		chip8_lockstep_copyLane(lockstep, lane, check);
+		if (!chip8_cli_sameMachine(check, machines[lane]) && mismatches++ == 0) {
+			firstMismatch = lane;
+		}
+	}
+
+	chip8_lockstep_stats stats = chip8_lockstep_getStats(lockstep);
+	double scalarIPS = cycles * lanes / (scalarSeconds > 0 ? scalarSeconds : 1e-9);
+	double lockstepIPS = cycles * lanes / (lockstepSeconds > 0 ? lockstepSeconds : 1e-9);
+	double idleShare = stats.instructions ? (double)stats.idleInstructions / stats.instructions : 0;
+	double lanesPerGroup = stats.groups ? (double)stats.groupLanes / stats.groups : 0;
+	double laneShare = stats.instructions ? (double)stats.laneInstructions / stats.instructions : 0;
+
+	if (o->json) {
+		printf("{\"rom\":\"%s\",\"engine\":\"%s\",\"quirks\":\"%s\",\"clock_rate\":%u,\"lanes\":%zu,\"frames\":%llu,\"cycles\":%llu,"
+			   "\"scalar_seconds\":%.6f,\"scalar_ips\":%.0f,\"lockstep_seconds\":%.6f,\"lockstep_ips\":%.0f,\"speedup\":%.3f,"
+			   "\"idle\":%.3f,\"lanes_per_group\":%.3f,\"divergent_code\":%llu,\"lane_at_a_time\":%.3f,\"regroups\":%llu,"
+			   "\"mismatches\":%zu}\n",
+			   romPath, chip8_cli_engineNames[o->engine], chip8_machine_quirksName((chip8_quirks)prototype->quirks), o->clockRate, lanes,
+			   o->frames, cycles, scalarSeconds, scalarIPS, lockstepSeconds, lockstepIPS, lockstepIPS / scalarIPS,
+			   idleShare, lanesPerGroup, stats.divergentCode, laneShare, stats.regroups, mismatches);
+	}
+	else {
+		printf("ROM:      %s\n", romPath);
+		printf("Quirks:   %s\n", chip8_machine_quirksName((chip8_quirks)prototype->quirks));
+		printf("Lanes:    %zu, in %zu blocks of %d\n", lanes, (lanes + CHIP8_LOCKSTEP_WIDTH - 1) / CHIP8_LOCKSTEP_WIDTH, CHIP8_LOCKSTEP_WIDTH);
+		printf("Cycles:   %llu each, over %llu frames\n", cycles, o->frames);
+		printf("Machines: %.6fs on the %s, %.1f MIPS (%.2f MIPS each)\n", scalarSeconds, chip8_cli_engineNames[o->engine],
+			   scalarIPS / 1e6, scalarIPS / 1e6 / lanes);
+		printf("Lockstep: %.6fs, %.1f MIPS (%.2f MIPS a lane), %.2fx the machines\n", lockstepSeconds,
+			   lockstepIPS / 1e6, lockstepIPS / 1e6 / lanes, lockstepIPS / scalarIPS);
+		printf("Groups:   %.1f lanes each (%llu had to check for code some lane wrote over)\n", lanesPerGroup, stats.divergentCode);
+		printf("Idle:     %.1f%% of the instructions were fast-forwarded through idle loops\n", idleShare * 100);
+		printf("Apart:    %.1f%% of the instructions ran a lane at a time, and the lanes were sorted into new blocks %llu times\n",
+			   laneShare * 100, stats.regroups);
+		if (mismatches == 0) {
+			printf("Check:    every lane matches its machine\n");
+		}
+		else {
+			printf("Check:    %zu lanes don't match their machines, the first is lane %zu\n", mismatches, firstMismatch);
+		}
+	}
+
+	// lockstep only pays when the lanes stay together, so say so when it didn't (on stderr, to keep the JSON clean). Only a
+	// mismatch fails the run: a short run's timings are too noisy to fail on
+	if (lockstepIPS < scalarIPS) {
+		fprintf(stderr, "Warning: %s ran slower in %zu lockstep lanes than on %zu machines (%.2fx)\n", romPath, lanes, lanes, lockstepIPS / scalarIPS);
+	}
+	if (o->showScreen) {
+		chip8_lockstep_copyLane(lockstep, 0, check);
+		chip8_cli_printScreen(check);
+	}
+
+	for (size_t lane = 0; lane < lanes; lane++) {
+		chip8_machine_destroy(machines[lane]);
+	}
+	free(machines);
+	free(sessions);
+	chip8_machine_destroy(check);
+	chip8_lockstep_destroy(lockstep);
+	chip8_machine_destroy(prototype);
+	return (mismatches == 0) ? 0 : 1;
+}
+
+
+
+// Rewind
+// Runs the ROM, pushing every frame into a chip8_rewind of o->rewindBudget bytes and saving a snapshot of it as well. After
+// each push it seeks to a random frame the buffer still holds, and a few times along the way it steps back over half of them
+// and plays on from there, the way the app does, which has to replace the frames it stepped back over. At the end it steps
+// back as far as it can go. Every frame the buffer gives back has to be exactly its snapshot, and frames it doesn't hold
+// have to be refused.
+
+typedef struct chip8_cli_rewindCheck {
+
+	chip8_rewind		*rewind;
+	unsigned char		*snapshots;		// one for every frame pushed, frame n at n * size
+	unsigned char		*scratch;
+	size_t				size;
+	unsigned long long	checked;
+	unsigned long long	mismatches;
+	unsigned long long	firstMismatch;
+
+} chip8_cli_rewindCheck;
+
+static void chip8_cli_pushFrame(chip8_cli_rewindCheck *c, const chip8_machine *m) {
+
+	chip8_rewind_push(c->rewind, m);
+	chip8_snapshot_save(m, &c->snapshots[chip8_rewind_newest(c->rewind) * c->size], c->size);
+}
+
+// Compares the machine the rewind buffer restored with the snapshot of the frame it's meant to be.
+static void chip8_cli_checkRestored(chip8_cli_rewindCheck *c, const chip8_machine *m, unsigned long long frame, bool restored) {
+
+	chip8_snapshot_save(m, c->scratch, c->size);
+	if ((!restored || memcmp(c->scratch, &c->snapshots[frame * c->size], c->size) != 0) && c->mismatches++ == 0) {
+		c->firstMismatch = frame;
+	}
+	c->checked++;
+}
+
+// Steps back until the newest frame is `frame`, checking each one on the way.
+static void chip8_cli_stepBack(chip8_cli_rewindCheck *c, chip8_machine *m, unsigned long long frame) {
+
+	while (chip8_rewind_newest(c->rewind) > frame) {
+		bool restored = chip8_rewind_stepBack(c->rewind, m);
+		chip8_cli_checkRestored(c, m, chip8_rewind_newest(c->rewind), restored);
+	}
+}
+
+static int chip8_cli_checkRewind(const char *romPath, const chip8_cli_options *o) {
+
+	chip8_machine *m = chip8_cli_load(romPath, o);
+	if (m == NULL) {
+		return 1;
+	}
+	chip8_cli_rewindCheck c = {
+		.rewind	= chip8_rewind_create(o->rewindBudget, 0),
+		.size	= chip8_snapshot_size(),
+	};
+	if (c.rewind == NULL) {
+		fprintf(stderr, "Can't make a rewind buffer of %zu bytes\n", o->rewindBudget);
+		exit(1);
+	}
+	c.snapshots = malloc(o->frames * c.size);
+	c.scratch = malloc(c.size);
+	if (c.snapshots == NULL || c.scratch == NULL) {
+		fprintf(stderr, "Not enough memory to keep %llu snapshots\n", o->frames);
+		exit(1);
+	}
+
+	// the seeks restore into their own machine, so the session carries on as if they hadn't happened
+	chip8_machine *restored = chip8_machine_clone(m);
+	if (restored == NULL) {
+		exit(1);
+	}
+	unsigned int random = o->seed;
+	bool refuses = true;
+
+	chip8_cli_session session = chip8_cli_beginSession(m, o);
+	double start = chip8_cli_now();
+	while (session.frames < o->frames) {
+		chip8_cli_runFrame(&session);
+		chip8_cli_pushFrame(&c, m);
+
+		unsigned long long oldest = chip8_rewind_oldest(c.rewind);
+		unsigned long long newest = chip8_rewind_newest(c.rewind);
+		random = random * 1664525u + 1013904223u;
+		unsigned long long frame = oldest + random % (newest - oldest + 1);
+		chip8_cli_checkRestored(&c, restored, frame, chip8_rewind_seek(c.rewind, frame, restored));
+		refuses = refuses && !chip8_rewind_seek(c.rewind, newest + 1, restored) &&
+				  (oldest == 0 || !chip8_rewind_seek(c.rewind, oldest - 1, restored));
+
+		if (session.frames % CHIP8_CLI_REWIND_STEP_BACK == 0 && session.frames < o->frames) {
+			chip8_cli_stepBack(&c, m, newest - (newest - oldest) / 2);
+		}
+	}
+	double seconds = chip8_cli_now() - start;
+	chip8_rewind_stats stats = chip8_rewind_getStats(c.rewind);
+	unsigned long long oldest = chip8_rewind_oldest(c.rewind);
+	unsigned long long newest = chip8_rewind_newest(c.rewind);
+
+	chip8_cli_stepBack(&c, m, oldest);
+
+	bool ok = (c.mismatches == 0 && refuses);
+	if (o->json) {
+		printf("{\"rom\":\"%s\",\"engine\":\"%s\",\"quirks\":\"%s\",\"frames\":%llu,\"seconds\":%.6f,\"memory_budget\":%zu,"
+			   "\"memory_allocated\":%zu,\"memory_used\":%zu,\"frames_held\":%zu,\"keyframes\":%zu,\"uncompressed_size\":%zu,"
+			   "\"checked\":%llu,\"mismatches\":%llu,\"refuses_missing\":%s}\n",
+			   romPath, chip8_cli_engineNames[o->engine], chip8_machine_quirksName((chip8_quirks)m->quirks), o->frames, seconds,
+			   stats.memoryBudget, stats.memoryAllocated, stats.memoryUsed, stats.frames, stats.keyframes, stats.uncompressedSize,
+			   c.checked, c.mismatches, refuses ? "true" : "false");
+	}
+	else {
+		printf("ROM:     %s\n", romPath);
+		printf("Quirks:  %s\n", chip8_machine_quirksName((chip8_quirks)m->quirks));
+		printf("Pushed:  %llu frames in %.6fs, with running, seeking and checking them\n", o->frames, seconds);
+		printf("Held:    frames %llu to %llu, %zu of them keyframes\n", oldest, newest, stats.keyframes);
+		printf("Memory:  %zu bytes used of %zu allocated (budget %zu), for %zu bytes of snapshots\n",
+			   stats.memoryUsed, stats.memoryAllocated, stats.memoryBudget, stats.uncompressedSize);
+		if (c.mismatches != 0) {
+			printf("Check:   %llu of %llu frames restored don't match their snapshots, the first is frame %llu\n",
+				   c.mismatches, c.checked, c.firstMismatch);
+		}
+		else if (!refuses) {
+			printf("Check:   it restored a frame it doesn't hold\n");
+		}
+		else {
+			printf("Check:   all %llu frames restored match their snapshots\n", c.checked);
+		}
+	}
+
+	free(c.scratch);
+	free(c.snapshots);
+	chip8_rewind_destroy(c.rewind);
+	chip8_machine_destroy(restored);
+	chip8_machine_destroy(m);
+	return ok ? 0 : 1;
+}
+
+
+
+// Check
+// Every engine is meant to end up exactly where the interpreter would, cycle for cycle. This runs every ROM in a directory on
+// the interpreter and then on every other engine, under every quirks profile, pressing the same random keys, and compares
+// the machines they end up with. The validate engine also has to get through without the JIT ever diverging from its shadow
+// interpreter. Lockstep lanes are checked against their machines by -L, and the rewind buffer by -R.
+
+// Returns false (and says why) if the engine didn't end up where the interpreter did.
+static bool chip8_cli_checkEngine(const char *romPath, const chip8_cli_options *o, const chip8_machine *reference, const char **outcome) {
+
+	chip8_machine *m = chip8_machine_create();
+	if (m == NULL || !chip8_machine_loadROM(m, romPath)) {
+		chip8_machine_destroy(m);
+		*outcome = "can't load";
+		return false;
+	}
+	chip8_machine_setQuirks(m, (chip8_quirks)o->quirks);
+
+	// engines that aren't built in (or translated for these quirks) are skipped rather than failed
+	bool available;
+	if (o->engine == CHIP8_ENGINE_AOT) {
+#if CHIP8_CLI_AOT
+		const chip8_aot_program *program = chip8_aot_find(chip8_aot_programs, m);
+		available = (program != NULL) && chip8_machine_setProgram(m, program);
+#else
+		available = false;
+#endif
+	}
+	else {
+		available = chip8_machine_setEngine(m, o->engine);
+	}
+	if (!available) {
+		chip8_machine_destroy(m);
+		*outcome = "skipped";
+		return true;
+	}
+	chip8_machine_setClockRate(m, o->clockRate);
+	chip8_machine_seed(m, o->seed);
+
+	chip8_cli_run(m, o, NULL, NULL);
+
+	bool ok = true;
+	*outcome = "ok";
+#if CHIP8_JIT_AVAILABLE
+	if (o->engine == CHIP8_ENGINE_JIT_VALIDATE && chip8_jit_getStats(m->jit).validationFailures != 0) {
+		ok = false;
+		*outcome = "DIVERGED";
+	}
+#endif
+	if (!chip8_cli_sameMachine(m, reference) || m->timerTicks != reference->timerTicks) {
+		ok = false;
+		*outcome = "DIFFERS";
+	}
+	chip8_machine_destroy(m);
+	return ok;
+}
+
+static int chip8_cli_check(const chip8_cli_options *o) {
+
+	size_t romCount;
+	char **roms = chip8_cli_listROMs(o->checkPath, &romCount);
+	if (roms == NULL) {
+		return 1;
+	}
+
+	int status = 0;
+	for (size_t i = 0; i < romCount; i++) {
+		int first = (o->quirks >= 0) ? o->quirks : 0;
+		int last = (o->quirks >= 0) ? o->quirks : CHIP8_QUIRKS_COUNT - 1;
+		for (int quirks = first; quirks <= last; quirks++) {
+
+			chip8_cli_options checkOptions = *o;
+			checkOptions.quirks = quirks;
+			checkOptions.engine = CHIP8_ENGINE_INTERPRETER;
+
+			chip8_machine *reference = chip8_cli_load(roms[i], &checkOptions);
+			if (reference == NULL) {
+				status = 1;
+				break;
+			}
+			chip8_cli_result result = chip8_cli_run(reference, &checkOptions, NULL, NULL);
+			printf("%s (%s): %llu cycles, screen %016llx:", roms[i], chip8_machine_quirksName((chip8_quirks)quirks),
+				   result.cycles, (unsigned long long)result.screenHash);
+
+			for (chip8_engine engine = CHIP8_ENGINE_JIT; engine <= CHIP8_ENGINE_AOT; engine++) {
+				checkOptions.engine = engine;
+				const char *outcome;
+				if (!chip8_cli_checkEngine(roms[i], &checkOptions, reference, &outcome)) {
+					status = 1;
+				}
+				printf(" %s %s%s", chip8_cli_engineNames[engine], outcome, (engine < CHIP8_ENGINE_AOT) ? "," : "\n");
+			}
+			chip8_machine_destroy(reference);
+		}
+		free(roms[i]);
+	}
+	free(roms);
+
+	printf("%s\n", (status == 0) ? "Every engine matches the interpreter" : "Some engines don't match the interpreter");
+	return status;
+}
+
+
+
+// Environments
+// Plays the ROM in o->envs environments of a chip8_env, the way an agent learning to play it would, except that the actions
+// are random: each step, every environment holds down one key (or none). It's for seeing how many frames a second a batch
+// of environments can feed an agent. The hash covers every environment's last observation, and doesn't depend on how many
+// threads there are.
+
+static int chip8_cli_runEnvs(const char *romPath, const chip8_cli_options *o) {
+
+	chip8_machine *prototype = chip8_cli_load(romPath, o);
+	if (prototype == NULL) {
+		return 1;
+	}
+
+	chip8_env_config config = {
+		.count			= o->envs,
+		.frameSkip		= CHIP8_ENV_DEFAULT_FRAME_SKIP,
+		.maxFrames		= CHIP8_CLI_ENV_EPISODE,
+		.observation	= CHIP8_ENV_OBSERVE_ROWS,
+		.engine			= o->engine,
+		.seed			= o->seed,
+	};
+#if CHIP8_CLI_AOT
+	if (o->engine == CHIP8_ENGINE_AOT) {
+		config.program = chip8_aot_find(chip8_aot_programs, prototype);		// chip8_cli_load() has checked there is one
+	}
+#endif
+	chip8_env *env = chip8_env_create(prototype, &config, NULL, NULL);
+	uint16_t *actions = calloc(o->envs, sizeof(uint16_t));
+	unsigned char *observations = malloc(o->envs * (env != NULL ? chip8_env_observationSize(env) : 0));
+	if (env == NULL || actions == NULL || observations == NULL) {
+		fprintf(stderr, "Can't make %zu environments\n", o->envs);
+		exit(1);
+	}
+
+	unsigned int random = o->seed;
+	unsigned long long steps = (o->frames + config.frameSkip - 1) / config.frameSkip;
+	chip8_env_reset(env, observations);
+	double start = chip8_cli_now();
+	for (unsigned long long step = 0; step < steps; step++) {
+		for (size_t i = 0; i < o->envs; i++) {
+			random = random * 1664525u + 1013904223u;
+			unsigned int k = (random >> 8) % 17;
+			actions[i] = (k < 16) ? (uint16_t)(1 << k) : 0;
+		}
+		chip8_env_step(env, actions, observations, NULL, NULL);
+	}
+	double seconds = chip8_cli_now() - start;
+
+	uint64_t hash = 14695981039346656037ull;
+	size_t size = o->envs * chip8_env_observationSize(env);
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ observations[i]) * 1099511628211ull;
+	}
+
+	chip8_env_stats stats = chip8_env_getStats(env);
+	double framesPerSecond = stats.frames / (seconds > 0 ? seconds : 1e-9);
+	if (o->json) {
+		printf("{\"rom\":\"%s\",\"engine\":\"%s\",\"quirks\":\"%s\",\"clock_rate\":%u,\"envs\":%zu,\"threads\":%u,\"frame_skip\":%u,"
+			   "\"steps\":%llu,\"frames\":%llu,\"episodes\":%llu,\"seconds\":%.6f,\"frames_per_second\":%.0f,\"observation_hash\":\"%016llx\"}\n",
+			   romPath, chip8_cli_engineNames[o->engine], chip8_machine_quirksName((chip8_quirks)prototype->quirks), o->clockRate, o->envs,
+			   stats.threads, config.frameSkip, stats.steps, stats.frames, stats.episodes, seconds, framesPerSecond, (unsigned long long)hash);
+	}
+	else {
+		printf("ROM:          %s\n", romPath);
+		printf("Quirks:       %s\n", chip8_machine_quirksName((chip8_quirks)prototype->quirks));
+		printf("Environments: %zu on %u threads, %s\n", o->envs, stats.threads, chip8_cli_engineNames[o->engine]);
+		printf("Steps:        %llu of %u frames, %llu frames in all (%llu episodes of %d frames finished)\n",
+			   stats.steps, config.frameSkip, stats.frames, stats.episodes, CHIP8_CLI_ENV_EPISODE);
+		printf("Time:         %.6fs, %.0f frames a second (%.0f steps)\n", seconds, framesPerSecond, framesPerSecond / config.frameSkip);
+		printf("Observations: %016llx\n", (unsigned long long)hash);
+	}
+	if (o->showScreen) {
+		chip8_cli_printScreen(chip8_env_machine(env, 0));
+	}
+	bool saved = (o->imagePath == NULL) || chip8_cli_saveScreen(chip8_env_machine(env, 0), o->imagePath);
+
+	free(observations);
+	free(actions);
+	chip8_env_destroy(env);
+	chip8_machine_destroy(prototype);
+	return saved ? 0 : 1;
+}
+
+
+
+// Main
+
+static void chip8_cli_usage(const char *name) {
+
+	fprintf(stderr,
+			"usage: %s [options] ROM\n"
+			"       %s -b DIRECTORY [options]\n"
+			"       %s -C DIRECTORY [options]\n"
+			"\n"
+			"  -c CYCLES     stop after this many instructions\n"
+			"  -f FRAMES     stop after this many 60Hz frames (default %d, or no limit with -c)\n"
+			"  -e ENGINE     interpreter, jit, validate or aot (default interpreter). aot needs a build from make aot\n"
+			"  -r RATE       instructions per second (default %d)\n"
+			"  -q QUIRKS     classic, vip, chip48 or schip (default: whatever suits the ROM)\n"
+			"  -s SEED       random number seed (default 0)\n"
+			"  -k SCRIPT     key presses, like 60:+5,75:-5 (press 5 at frame 60, let go at frame 75)\n"
+			"  -m FRAMES     press or release a random key every FRAMES frames\n"
+			"  -o FILE       save the session as a recording\n"
+			"  -p FILE       play back a recording of ROM instead, as fast as possible\n"
+			"  -P PERIOD     profile the run, sampling one instruction in PERIOD (1 counts them all, fastest in a make profile build)\n"
+			"  -F FILE       with -P, write the call stacks to FILE for a flame graph\n"
+			"  -w FILE       write the sound to FILE as a WAV\n"
+			"  -t            run in real time, paced like the app, and report how well it kept time\n"
+			"  -T            run in turbo mode on the pacer, presenting 60 frames a second of real time\n"
+			"  -L LANES      run LANES machines, then LANES lanes in lockstep, and compare them (speed and results)\n"
+			"  -E ENVS       play ENVS environments at once with random keys, on every core, and report the frames a second\n"
+			"  -R BYTES      push every frame into a rewind buffer of BYTES bytes, then seek around it and step back, checking\n"
+			"                every frame it restores against a snapshot. Exits with 1 if one doesn't match\n"
+			"  -d            print the screen at the end\n"
+			"  -i FILE       save the screen at the end as an image: a PNG if FILE ends in .png, otherwise a PPM\n"
+			"  -j            print the results as JSON\n"
+			"  -b DIRECTORY  benchmark every ROM in DIRECTORY on every engine, printing a line of JSON for each\n"
+			"  -n REPEAT     benchmark runs per ROM and engine, keeping the fastest (default %d)\n"
+			"  -C DIRECTORY  check every engine ends up exactly where the interpreter does on every ROM in DIRECTORY, under every\n"
+			"                quirks profile (or the one -q picks). Exits with 1 if any of them doesn't\n",
+			name, name, name, CHIP8_CLI_FRAMES, CHIP8_DEFAULT_CLOCK_RATE, CHIP8_CLI_BENCH_REPEAT);
+}
+
+int main(int argc, char **argv) {
+
+	chip8_cli_options o = { 0 };
+	o.engine = CHIP8_ENGINE_INTERPRETER;
+	o.clockRate = CHIP8_DEFAULT_CLOCK_RATE;
+	o.quirks = -1;
+	o.repeat = CHIP8_CLI_BENCH_REPEAT;
+	bool framesGiven = false;
+	bool monkeyGiven = false;
+
+	int option;
+	while ((option = getopt(argc, argv, "c:f:e:r:q:s:k:m:o:p:P:F:w:tTL:E:R:di:jb:n:C:h")) != -1) {
+		switch (option) {
+			case 'c':
+				o.cycles = strtoull(optarg, NULL, 10);
+				break;
+
+			case 'f':
+				o.frames = strtoull(optarg, NULL, 10);
+				framesGiven = true;
+				break;
+
+			case 'e':
+				if (!chip8_cli_parseEngine(optarg, &o.engine)) {
+					fprintf(stderr, "Unknown engine %s\n", optarg);
+					return 2;
+				}
+				break;
+
+			case 'r':
+				o.clockRate = (unsigned int)strtoul(optarg, NULL, 10);
+				if (o.clockRate == 0) {
+					fprintf(stderr, "The clock rate has to be at least 1\n");
+					return 2;
+				}
+				break;
+
+			case 'q':
+				if (!chip8_cli_parseQuirks(optarg, &o.quirks)) {
+					fprintf(stderr, "Unknown quirks %s\n", optarg);
+					return 2;
+				}
+				break;
+
+			case 's':
+				o.seed = (unsigned int)strtoul(optarg, NULL, 0);
+				break;
+
+			case 'k':
+				if (!chip8_cli_parseScript(optarg, &o)) {
+					fprintf(stderr, "Can't read the key script %s\n", optarg);
+					return 2;
+				}
+				break;
+
+			case 'm':
+				o.monkey = (unsigned int)strtoul(optarg, NULL, 10);
+				monkeyGiven = true;
+				break;
+
+			case 'o':
+				o.recordPath = optarg;
+				break;
+
+			case 'p':
+				o.replayPath = optarg;
+				break;
+
+			case 'P':
+				o.profilePeriod = (unsigned int)strtoul(optarg, NULL, 10);
+				break;
+
+			case 'F':
+				o.stacksPath = optarg;
+				break;
+
+			case 'w':
+				o.wavPath = optarg;
+				break;
+
+			case 't':
+				o.realTime = true;
+				break;
+
+			case 'T':
+				o.realTime = true;
+				o.turbo = true;
+				break;
+
+			case 'L':
+				o.lanes = strtoull(optarg, NULL, 10);
+				break;
+
+			case 'E':
+				o.envs = strtoull(optarg, NULL, 10);
+				break;
+
+			case 'R':
+				o.rewindBudget = strtoull(optarg, NULL, 10);
+				break;
+
+			case 'd':
+				o.showScreen = true;
+				break;
+
+			case 'i':
+				o.imagePath = optarg;
+				break;
+
+			case 'j':
+				o.json = true;
+				break;
+
+			case 'b':
+				o.benchPath = optarg;
+				break;
+
+			case 'n':
+				o.repeat = atoi(optarg);
+				break;
+
+			case 'C':
+				o.checkPath = optarg;
+				break;
+
+			default:
+				chip8_cli_usage(argv[0]);
+				return 2;
+		}
+	}
+
+	if (!framesGiven && o.cycles == 0) {
+		o.frames = (o.benchPath != NULL) ? CHIP8_CLI_BENCH_FRAMES : (o.checkPath != NULL) ? CHIP8_CLI_CHECK_FRAMES : CHIP8_CLI_FRAMES;
+	}
+
+	if (o.benchPath != NULL) {
+		if (!monkeyGiven) {
+			o.monkey = CHIP8_CLI_BENCH_MONKEY;
+		}
+		if (o.repeat < 1) {
+			o.repeat = 1;
+		}
+		return chip8_cli_bench(&o);
+	}
+
+	if (o.checkPath != NULL) {
+		if (!monkeyGiven) {
+			o.monkey = CHIP8_CLI_BENCH_MONKEY;
+		}
+		return chip8_cli_check(&o);
+	}
+
+	if (optind != argc - 1) {
+		chip8_cli_usage(argv[0]);
+		return 2;
+	}
+
+	if (o.lanes != 0 && o.frames == 0) {
+		fprintf(stderr, "-L runs whole frames, so use -f rather than -c\n");
+		return 2;
+	}
+	if (o.envs != 0 && o.frames == 0) {
+		fprintf(stderr, "-E runs whole frames, so use -f rather than -c\n");
+		return 2;
+	}
+	if (o.rewindBudget != 0 && o.frames == 0) {
+		fprintf(stderr, "-R runs whole frames, so use -f rather than -c\n");
+		return 2;
+	}
+
+	const char *romPath = argv[optind];
+	int status;
+	if (o.lanes != 0) {
+		status = chip8_cli_runLockstep(romPath, &o);
+	}
+	else if (o.envs != 0) {
+		status = chip8_cli_runEnvs(romPath, &o);
+	}
+	else if (o.rewindBudget != 0) {
+		status = chip8_cli_checkRewind(romPath, &o);
+	}
+	else {
+		status = (o.replayPath != NULL) ? chip8_cli_replay(romPath, &o) : chip8_cli_runROM(romPath, &o);
+	}
+	free(o.keys);
+	return status;
+}